@@ -4,6 +4,8 @@ import os
 import sys
 import shutil
 import commands
+import hashlib
+import struct
 
 ORG_DIR = os.getcwd()
 ROOT_DIR = os.path.abspath(os.path.dirname(__file__))
@@ -12,6 +14,8 @@ LINUX_IMAGE_NAME = "linux.bin.gz"
 LINUX_IMAGE_FILE = os.path.join(IMAGES_DIR, LINUX_IMAGE_NAME)
 ROMFS_IMAGE_NAME = "romfs.img.gz"
 ROMFS_IMAGE_FILE = os.path.join(IMAGES_DIR, ROMFS_IMAGE_NAME)
+LINUX_INSTALLED_PATH = "/dev/flash/kernel"
+ROMFS_INSTALLED_PATH = "/dev/flash/userland"
 RANDOM_ID = os.urandom(16).encode('hex')
 WORK_BASE_DIR = os.path.join(ROOT_DIR, RANDOM_ID)
 FW_DIR_NAME = "fw"
@@ -22,7 +26,19 @@ UPDATE_SCRIPT_NAME = "fw_upgrade.sh"
 UPDATE_SCRIPT_FILE = os.path.join(SCRIPT_DIR, UPDATE_SCRIPT_NAME)
 CHECK_SCRIPT_NAME = "check_result.sh"
 CHECK_SCRIPT_FILE = os.path.join(SCRIPT_DIR, CHECK_SCRIPT_NAME)
+SIGNED_MANIFEST_NAME = "package.manifest"
+SIGNED_MANIFEST_MAGIC = "FWPKG-MANIFEST 1"
+SIGNATURE_NAME = "package.manifest.sig"
 CONF_NAME = "firmware.conf"
+MANIFEST_NAME = "manifest.sha256"
+DELTA_SUFFIX = ".delta"
+DELTA_MAGIC = "FWDELTA1"
+DELTA_BLOCK_SIZE = 32
+DELTA_MAX_OP_SIZE = 0x40000000
+DELTA_OP_END = 0
+DELTA_OP_COPY = 1
+DELTA_OP_ADD = 2
+DELTA_OP_DATA = 3
 
 parser = optparse.OptionParser()
 parser.add_option("--version",
@@ -33,12 +49,25 @@ parser.add_option("--prefix",
     action="store",
     dest="prefix",
     help="file name prefix")
+parser.add_option("--base",
+    action="store",
+    dest="base",
+    help="directory of the images of the package running on the devices, as they were shipped; images are shipped as deltas against them")
+parser.add_option("--sign-key",
+    action="store",
+    dest="sign_key",
+    help="path to RSA private key (PEM) to sign the package with")
 (options, args) = parser.parse_args()
 
 if not options.version:
   print 'version is required'
   parser.print_help()
   sys.exit()
+if options.base:
+  options.base = os.path.abspath(os.path.expanduser(os.path.expandvars(options.base)))
+  if not os.path.isdir(options.base):
+    print options.base + ' is not a directory'
+    sys.exit()
 
 def exit():
   if os.path.isdir(WORK_BASE_DIR):
@@ -53,22 +82,117 @@ def error_exit(msg, help=False):
     parser.print_help()
   exit()
 
-def process_image_file(image_prefix, image_name, src_path):
+def read_file(path):
+  f = open(path, 'rb')
+  data = f.read()
+  f.close()
+  return data
+
+def delta_ops(op, src_off, data):
+  # splits an operation so that its length fits in 32 bits
+  ops = ""
+  pos = 0
+  while pos < len(data):
+    n = min(len(data) - pos, DELTA_MAX_OP_SIZE)
+    if op == DELTA_OP_DATA:
+      ops = ops + struct.pack(">BI", op, n)
+    else:
+      ops = ops + struct.pack(">BQI", op, src_off + pos, n)
+    if op != DELTA_OP_COPY:
+      ops = ops + data[pos:pos + n]
+    pos = pos + n
+  return ops
+
+def delta_literal(src, dst, src_off):
+  # bytes between two matches are sent as differences to the source that
+  # follows the previous match when they mostly equal it (bsdiff style)
+  if len(dst) == 0:
+    return ""
+  base = src[src_off:src_off + len(dst)]
+  if len(base) == len(dst):
+    same = sum(1 for a, b in zip(base, dst) if a == b)
+    if same * 2 >= len(dst):
+      diff = bytearray(len(dst))
+      for i in xrange(len(dst)):
+        diff[i] = (ord(dst[i]) - ord(base[i])) & 0xFF
+      return delta_ops(DELTA_OP_ADD, src_off, str(diff))
+  return delta_ops(DELTA_OP_DATA, 0, dst)
+
+def make_delta(src, dst, installed_path):
+  index = {}
+  for off in xrange(0, len(src) - DELTA_BLOCK_SIZE + 1, DELTA_BLOCK_SIZE):
+    index.setdefault(src[off:off + DELTA_BLOCK_SIZE], off)
+  body = []
+  literal_start = 0
+  src_next = 0
+  i = 0
+  while i + DELTA_BLOCK_SIZE <= len(dst):
+    off = index.get(dst[i:i + DELTA_BLOCK_SIZE])
+    if off is None:
+      i = i + 1
+      continue
+    start, src_start = i, off
+    while start > literal_start and src_start > 0 and dst[start - 1] == src[src_start - 1]:
+      start, src_start = start - 1, src_start - 1
+    end, src_end = i + DELTA_BLOCK_SIZE, off + DELTA_BLOCK_SIZE
+    while end + 4096 <= len(dst) and dst[end:end + 4096] == src[src_end:src_end + 4096]:
+      end, src_end = end + 4096, src_end + 4096
+    while end < len(dst) and src_end < len(src) and dst[end] == src[src_end]:
+      end, src_end = end + 1, src_end + 1
+    body.append(delta_literal(src, dst[literal_start:start], src_next))
+    body.append(delta_ops(DELTA_OP_COPY, src_start, src[src_start:src_end]))
+    literal_start, src_next, i = end, src_end, end
+  body.append(delta_literal(src, dst[literal_start:], src_next))
+  body.append(struct.pack(">B", DELTA_OP_END))
+  header = struct.pack(">8sQQ32s32sH", DELTA_MAGIC, len(src), len(dst),
+    hashlib.sha256(src).digest(), hashlib.sha256(dst).digest(), len(installed_path))
+  return header + installed_path + "".join(body)
+
+manifest = []
+
+def add_manifest_entry(name):
+  manifest.append(hashlib.sha256(read_file(os.path.join(FW_WORK_DIR, name))).hexdigest() + "  " + name + "\n")
+
+def process_image_file(image_prefix, image_name, src_path, installed_path):
   dest_name = image_prefix + NAME_SEPARATOR + image_name
   dest_path = os.path.join(FW_WORK_DIR, dest_name) 
   shutil.copy2(src_path, dest_path)
+  # the image as it is after a delta has been applied on the device
+  add_manifest_entry(dest_name)
   status, result = commands.getstatusoutput("md5sum " + dest_name)
   if status != 0:
     error_exit("failed to 'md5sum'")
   f = open(dest_path + ".md5", 'w')
   f.write(result)
   f.close()
+  base_path = None
+  if options.base:
+    base_path = os.path.join(options.base, image_name)
+  if base_path is not None and os.path.isfile(base_path):
+    src = read_file(base_path)
+    dst = read_file(dest_path)
+    delta = make_delta(src, dst, installed_path)
+    print image_name + ": source sha256=" + hashlib.sha256(src).hexdigest() + \
+      ", target sha256=" + hashlib.sha256(dst).hexdigest()
+    if len(delta) < len(dst):
+      f = open(dest_path + DELTA_SUFFIX, 'wb')
+      f.write(delta)
+      f.close()
+      os.remove(dest_path)
+      print image_name + ": delta of " + str(len(delta)) + " bytes (image " + str(len(dst)) + " bytes)"
+    else:
+      print image_name + ": delta is not smaller than the image, the image is shipped"
   return "\"${PREFIX}${VERSION}" + NAME_SEPARATOR + image_name + "\""
 
 if not os.path.isfile(UPDATE_SCRIPT_FILE):
   error_exit(UPDATE_SCRIPT_FILE + " was not found")
 if not os.path.isfile(CHECK_SCRIPT_FILE):
   error_exit(CHECK_SCRIPT_FILE + " was not found")
+sign_key_path = None
+if options.sign_key:
+  sign_key_path = os.path.abspath(os.path.expanduser(os.path.expandvars(options.sign_key)))
+  if not os.path.isfile(sign_key_path):
+    error_exit(sign_key_path + " was not found")
 
 linux_img_exists = False
 romfs_img_exists = False
@@ -99,11 +223,11 @@ conf_str = conf_str + "VERSION=\"" + options.version + "\"\n"
 image_prefix = image_prefix + options.version
 # kernel image
 if linux_img_exists:
-  value = process_image_file(image_prefix, LINUX_IMAGE_NAME, LINUX_IMAGE_FILE)
+  value = process_image_file(image_prefix, LINUX_IMAGE_NAME, LINUX_IMAGE_FILE, LINUX_INSTALLED_PATH)
   conf_str = conf_str + "KERNEL=" + value + "\n"
 # userland image
 if romfs_img_exists:
-  value = process_image_file(image_prefix, ROMFS_IMAGE_NAME, ROMFS_IMAGE_FILE)
+  value = process_image_file(image_prefix, ROMFS_IMAGE_NAME, ROMFS_IMAGE_FILE, ROMFS_INSTALLED_PATH)
   conf_str = conf_str + "USERLAND=" + value + "\n"
 
 # create conf file
@@ -111,11 +235,42 @@ f = open(os.path.join(FW_WORK_DIR, CONF_NAME), "w")
 f.write(conf_str)
 f.close()
 
+# create manifest
+add_manifest_entry(UPDATE_SCRIPT_NAME)
+add_manifest_entry(CHECK_SCRIPT_NAME)
+add_manifest_entry(CONF_NAME)
+f = open(os.path.join(FW_WORK_DIR, MANIFEST_NAME), "w")
+f.write("".join(manifest))
+f.close()
+
+# sign, the devices having the public key refuse entries which are not in the signed manifest
+names = sorted(os.listdir(FW_WORK_DIR))
+if sign_key_path:
+  signed_manifest_str = SIGNED_MANIFEST_MAGIC + "\n"
+  for name in names:
+    f = open(os.path.join(FW_WORK_DIR, name), "rb")
+    data = f.read()
+    f.close()
+    signed_manifest_str = signed_manifest_str + hashlib.sha256(data).hexdigest() + " " + \
+      str(len(data)) + " " + FW_DIR_NAME + "/" + name + "\n"
+  f = open(os.path.join(FW_WORK_DIR, SIGNED_MANIFEST_NAME), "wb")
+  f.write(signed_manifest_str)
+  f.close()
+  status, result = commands.getstatusoutput("openssl dgst -sha256 -sign " + sign_key_path + \
+    " -out " + os.path.join(FW_WORK_DIR, SIGNATURE_NAME) + " " + os.path.join(FW_WORK_DIR, SIGNED_MANIFEST_NAME))
+  if status != 0:
+    error_exit("failed to sign package: " + result)
+  # the manifest and its signature have to come first in the archive
+  names = [SIGNED_MANIFEST_NAME, SIGNATURE_NAME] + names
+else:
+  print "Warning: package is not signed, devices having a public key will refuse it."
+
 # archive
 zip_name = image_prefix + NAME_SEPARATOR + RANDOM_ID + ".zip"
 zip_file = os.path.join(ROOT_DIR, zip_name)
 os.chdir(WORK_BASE_DIR)
-status, result = commands.getstatusoutput("zip " + zip_file + " ./fw/*")
+status, result = commands.getstatusoutput("zip -D " + zip_file + " " + \
+  " ".join(["./" + FW_DIR_NAME + "/" + name for name in names]))
 if status != 0:
   error_exit("failed to archive package")
 print "firmware package '" + zip_name + "' has been created."
@@ -4,6 +4,7 @@ import os
 import sys
 import shutil
 import commands
+import hashlib
 
 ORG_DIR = os.getcwd()
 ROOT_DIR = os.path.abspath(os.path.dirname(__file__))
@@ -17,7 +18,11 @@ UPDATE_SCRIPT_NAME = "fw_upgrade.sh"
 UPDATE_SCRIPT_FILE = os.path.join(SCRIPT_DIR, UPDATE_SCRIPT_NAME)
 CHECK_SCRIPT_NAME = "check_result.sh"
 CHECK_SCRIPT_FILE = os.path.join(SCRIPT_DIR, CHECK_SCRIPT_NAME)
+SIGNED_MANIFEST_NAME = "package.manifest"
+SIGNED_MANIFEST_MAGIC = "FWPKG-MANIFEST 1"
+SIGNATURE_NAME = "package.manifest.sig"
 CONF_NAME = "package.conf"
+MANIFEST_NAME = "manifest.sha256"
 
 parser = optparse.OptionParser()
 parser.add_option("--version",
@@ -29,13 +34,17 @@ parser.add_option("--prefix",
     dest="prefix",
     help="file name prefix")
 parser.add_option("--package",
-    action="store",
-    dest="debpackage",
-    help="path to debian package file of servicesync-raspberrypi")
+    action="append",
+    dest="debpackages",
+    help="path to debian package file of servicesync-raspberrypi, can be given more than once")
 parser.add_option("--upgrade-disabled",
     action="store_true",
     dest="upgrade_disabled",
     help="disable to execute 'apt-get upgrade'")
+parser.add_option("--sign-key",
+    action="store",
+    dest="sign_key",
+    help="path to RSA private key (PEM) to sign the package with")
 (options, args) = parser.parse_args()
 
 if not options.version:
@@ -56,29 +65,35 @@ def error_exit(msg, help=False):
     parser.print_help()
   exit()
 
-debpackage_path = None
-if options.debpackage is not None:
-  debpackage_path = os.path.expandvars(options.debpackage)
+debpackage_paths = []
+for debpackage in options.debpackages or []:
+  debpackage_path = os.path.expandvars(debpackage)
   debpackage_path = os.path.expanduser(debpackage_path)
   debpackage_path = os.path.abspath(debpackage_path)
   if not os.path.isfile(debpackage_path):
     error_exit(debpackage_path + " was not found.")
     sys.exit()
+  debpackage_paths.append(debpackage_path)
 
 if not os.path.isfile(UPDATE_SCRIPT_FILE):
   error_exit(UPDATE_SCRIPT_FILE + " was not found")
 if not os.path.isfile(CHECK_SCRIPT_FILE):
   error_exit(CHECK_SCRIPT_FILE + " was not found")
+sign_key_path = None
+if options.sign_key:
+  sign_key_path = os.path.abspath(os.path.expanduser(os.path.expandvars(options.sign_key)))
+  if not os.path.isfile(sign_key_path):
+    error_exit(sign_key_path + " was not found")
 
 os.makedirs(FW_WORK_DIR)
 os.chdir(FW_WORK_DIR)
 
 shutil.copy2(UPDATE_SCRIPT_FILE, os.path.join(FW_WORK_DIR, UPDATE_SCRIPT_NAME))
 shutil.copy2(CHECK_SCRIPT_FILE, os.path.join(FW_WORK_DIR, CHECK_SCRIPT_NAME))
-debpackage_name = None
-if debpackage_path is not None:
-  debpackage_name = os.path.basename(debpackage_path)
-  shutil.copy2(debpackage_path, os.path.join(FW_WORK_DIR, debpackage_name))
+debpackage_names = []
+for debpackage_path in debpackage_paths:
+  debpackage_names.append(os.path.basename(debpackage_path))
+  shutil.copy2(debpackage_path, os.path.join(FW_WORK_DIR, debpackage_names[-1]))
 
 package_prefix = ""
 # prefix
@@ -91,19 +106,52 @@ package_prefix = package_prefix + options.version
 conf_str = ""
 if options.upgrade_disabled:
   conf_str = conf_str + "UPGRADE_DISABLED=1\n"
-if debpackage_name is not None:
-  conf_str = conf_str + "SSGW_DEBPKG=" + debpackage_name + "\n"
+if len(debpackage_names) > 0:
+  conf_str = conf_str + "SSGW_DEBPKG=\"" + " ".join(debpackage_names) + "\"\n"
 
 if len(conf_str) > 0: 
   f = open(os.path.join(FW_WORK_DIR, CONF_NAME), "w")
   f.write(conf_str)
   f.close()
 
+# create manifest, the files are verified on the device before the update
+manifest_str = ""
+for name in sorted(os.listdir(FW_WORK_DIR)):
+  f = open(os.path.join(FW_WORK_DIR, name), "rb")
+  manifest_str = manifest_str + hashlib.sha256(f.read()).hexdigest() + "  " + name + "\n"
+  f.close()
+f = open(os.path.join(FW_WORK_DIR, MANIFEST_NAME), "w")
+f.write(manifest_str)
+f.close()
+
+# sign, the devices having the public key refuse entries which are not in the signed manifest
+names = sorted(os.listdir(FW_WORK_DIR))
+if sign_key_path:
+  signed_manifest_str = SIGNED_MANIFEST_MAGIC + "\n"
+  for name in names:
+    f = open(os.path.join(FW_WORK_DIR, name), "rb")
+    data = f.read()
+    f.close()
+    signed_manifest_str = signed_manifest_str + hashlib.sha256(data).hexdigest() + " " + \
+      str(len(data)) + " " + FW_DIR_NAME + "/" + name + "\n"
+  f = open(os.path.join(FW_WORK_DIR, SIGNED_MANIFEST_NAME), "wb")
+  f.write(signed_manifest_str)
+  f.close()
+  status, result = commands.getstatusoutput("openssl dgst -sha256 -sign " + sign_key_path + \
+    " -out " + os.path.join(FW_WORK_DIR, SIGNATURE_NAME) + " " + os.path.join(FW_WORK_DIR, SIGNED_MANIFEST_NAME))
+  if status != 0:
+    error_exit("failed to sign package: " + result)
+  # the manifest and its signature have to come first in the archive
+  names = [SIGNED_MANIFEST_NAME, SIGNATURE_NAME] + names
+else:
+  print "Warning: package is not signed, devices having a public key will refuse it."
+
 # archive
 zip_name = package_prefix + NAME_SEPARATOR + RANDOM_ID + ".zip"
 zip_file = os.path.join(ROOT_DIR, zip_name)
 os.chdir(WORK_BASE_DIR)
-status, result = commands.getstatusoutput("zip " + zip_file + " ./fw/*")
+status, result = commands.getstatusoutput("zip -D " + zip_file + " " + \
+  " ".join(["./" + FW_DIR_NAME + "/" + name for name in names]))
 if status != 0:
   error_exit("failed to archive package")
 print "firmware package '" + zip_name + "' has been created."
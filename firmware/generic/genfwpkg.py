@@ -4,6 +4,7 @@ import os
 import sys
 import shutil
 import commands
+import hashlib
 
 ORG_DIR = os.getcwd()
 ROOT_DIR = os.path.abspath(os.path.dirname(__file__))
@@ -17,6 +18,9 @@ UPDATE_SCRIPT_NAME = "fw_upgrade.sh"
 UPDATE_SCRIPT_FILE = os.path.join(SCRIPT_DIR, UPDATE_SCRIPT_NAME)
 CHECK_SCRIPT_NAME = "check_result.sh"
 CHECK_SCRIPT_FILE = os.path.join(SCRIPT_DIR, CHECK_SCRIPT_NAME)
+SIGNED_MANIFEST_NAME = "package.manifest"
+SIGNED_MANIFEST_MAGIC = "FWPKG-MANIFEST 1"
+SIGNATURE_NAME = "package.manifest.sig"
 
 parser = optparse.OptionParser()
 parser.add_option("--version",
@@ -27,6 +31,10 @@ parser.add_option("--prefix",
     action="store",
     dest="prefix",
     help="file name prefix")
+parser.add_option("--sign-key",
+    action="store",
+    dest="sign_key",
+    help="path to RSA private key (PEM) to sign the package with")
 (options, args) = parser.parse_args()
 
 if not options.version:
@@ -51,6 +59,11 @@ if not os.path.isfile(UPDATE_SCRIPT_FILE):
   error_exit(UPDATE_SCRIPT_FILE + " was not found")
 if not os.path.isfile(CHECK_SCRIPT_FILE):
   error_exit(CHECK_SCRIPT_FILE + " was not found")
+sign_key_path = None
+if options.sign_key:
+  sign_key_path = os.path.abspath(os.path.expanduser(os.path.expandvars(options.sign_key)))
+  if not os.path.isfile(sign_key_path):
+    error_exit(sign_key_path + " was not found")
 
 os.makedirs(FW_WORK_DIR)
 os.chdir(FW_WORK_DIR)
@@ -65,11 +78,34 @@ if options.prefix:
 # version
 package_prefix = package_prefix + options.version
 
+# sign, the devices having the public key refuse entries which are not in the signed manifest
+names = sorted(os.listdir(FW_WORK_DIR))
+if sign_key_path:
+  signed_manifest_str = SIGNED_MANIFEST_MAGIC + "\n"
+  for name in names:
+    f = open(os.path.join(FW_WORK_DIR, name), "rb")
+    data = f.read()
+    f.close()
+    signed_manifest_str = signed_manifest_str + hashlib.sha256(data).hexdigest() + " " + \
+      str(len(data)) + " " + FW_DIR_NAME + "/" + name + "\n"
+  f = open(os.path.join(FW_WORK_DIR, SIGNED_MANIFEST_NAME), "wb")
+  f.write(signed_manifest_str)
+  f.close()
+  status, result = commands.getstatusoutput("openssl dgst -sha256 -sign " + sign_key_path + \
+    " -out " + os.path.join(FW_WORK_DIR, SIGNATURE_NAME) + " " + os.path.join(FW_WORK_DIR, SIGNED_MANIFEST_NAME))
+  if status != 0:
+    error_exit("failed to sign package: " + result)
+  # the manifest and its signature have to come first in the archive
+  names = [SIGNED_MANIFEST_NAME, SIGNATURE_NAME] + names
+else:
+  print "Warning: package is not signed, devices having a public key will refuse it."
+
 # archive
 zip_name = package_prefix + NAME_SEPARATOR + RANDOM_ID + ".zip"
 zip_file = os.path.join(ROOT_DIR, zip_name)
 os.chdir(WORK_BASE_DIR)
-status, result = commands.getstatusoutput("zip " + zip_file + " ./fw/*")
+status, result = commands.getstatusoutput("zip -D " + zip_file + " " + \
+  " ".join(["./" + FW_DIR_NAME + "/" + name for name in names]))
 if status != 0:
   error_exit("failed to archive package")
 print "firmware package '" + zip_name + "' has been created."
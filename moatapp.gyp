@@ -1,6 +1,7 @@
 {
   'variables': {
     'sseutils_root': './moat-c-utils',
+    'hash_bench_openssl%': 0,
   },
   'includes': [
     'common.gypi',
@@ -14,9 +15,26 @@
       'sources': [
         '<@(sseutils_src)',
         'src/<(package_name).c',
+        'src/firmware/delta_patch.c',
         'src/firmware/download_info_model.c',
+        'src/firmware/fast_hash.c',
+        'src/firmware/firmware_conf.c',
         'src/firmware/firmware_package.c',
         'src/firmware/firmware_updater.c',
+        'src/firmware/kernel_hash.c',
+        'src/firmware/manifest_verifier.c',
+        'src/firmware/mirror_list.c',
+        'src/firmware/package_cache.c',
+        'src/firmware/package_downloader.c',
+        'src/firmware/package_segment.c',
+        'src/firmware/rate_limiter.c',
+        'src/firmware/rsa_public_key.c',
+        'src/firmware/signed_manifest.c',
+        'src/firmware/slot_installer.c',
+        'src/firmware/update_journal.c',
+        'src/firmware/update_queue.c',
+        'src/firmware/worker_process.c',
+        'src/firmware/zip_stream.c',
        ],
       'product_prefix': '',
       'type': 'shared_library',
@@ -25,10 +43,30 @@
         '<(sseutils_include)',
       ],
       'libraries': [
+        '-lz',
       ],
       'dependencies': [
       ],
     },
 
+    # hash throughput benchmark, built with "make hashbench" only
+    {
+      'target_name': 'hash_bench',
+      'type': 'executable',
+      'suppress_wildcard': 1,
+      'sources': [
+        '<@(sseutils_src)',
+        'src/firmware/fast_hash.c',
+        'src/firmware/kernel_hash.c',
+        'test/hash_bench.c',
+       ],
+      'conditions': [
+        [ 'hash_bench_openssl==1', {
+          'defines': [ 'HASH_BENCH_WITH_OPENSSL' ],
+          'libraries': [ '-lcrypto' ],
+        }],
+      ],
+    },
+
   ],
 }
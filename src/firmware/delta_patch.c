@@ -0,0 +1,548 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <servicesync/moat.h>
+#include "delta_patch.h"
+
+#define TAG "DeltaPatch"
+
+#define TRACE_ENTER() MOAT_LOG_TRACE(TAG, "== enter =>");
+#define TRACE_LEAVE() MOAT_LOG_TRACE(TAG, "<= leave ==");
+#define LOG_ERROR(format, ...)  MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...)  MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+
+#define DELTA_PATCH_MAGIC  "FWDELTA1"
+#define DELTA_PATCH_MAGIC_LEN  (8)
+/* magic, source size, target size, source digest, target digest, path length */
+#define DELTA_PATCH_HEADER_SIZE  (DELTA_PATCH_MAGIC_LEN + 8 + 8 + SHA256_MD_BYTES + SHA256_MD_BYTES + 2)
+#define DELTA_PATCH_MAX_PATH_LEN  (1024)
+#define DELTA_PATCH_BUFFER_SIZE  (64 * 1024)
+
+#define DELTA_OP_END  (0)
+#define DELTA_OP_COPY  (1)
+#define DELTA_OP_ADD  (2)
+#define DELTA_OP_DATA  (3)
+
+enum DeltaPatchState_ {
+  DELTA_PATCH_STATE_HEADER,
+  DELTA_PATCH_STATE_SOURCE_PATH,
+  DELTA_PATCH_STATE_OP,
+  DELTA_PATCH_STATE_COPY_ARGS,
+  DELTA_PATCH_STATE_ADD_ARGS,
+  DELTA_PATCH_STATE_DATA_ARGS,
+  DELTA_PATCH_STATE_ADD,
+  DELTA_PATCH_STATE_DATA,
+  DELTA_PATCH_STATE_COMPLETED,
+  DELTA_PATCH_STATE_ERROR,
+  DELTA_PATCH_STATEs
+};
+
+/* DeltaPatch private */
+
+static sse_uint32
+DeltaPatch_Get32(const sse_byte *p)
+{
+  return ((sse_uint32)p[0] << 24) | ((sse_uint32)p[1] << 16) | ((sse_uint32)p[2] << 8) | (sse_uint32)p[3];
+}
+
+static sse_uint64
+DeltaPatch_Get64(const sse_byte *p)
+{
+  return ((sse_uint64)DeltaPatch_Get32(p) << 32) | (sse_uint64)DeltaPatch_Get32(p + 4);
+}
+
+static void
+TDeltaPatch_Expect(TDeltaPatch *self, sse_int in_state, sse_uint in_need)
+{
+  self->fState = in_state;
+  self->fHeaderLen = 0;
+  self->fHeaderNeed = in_need;
+}
+
+static void
+TDeltaPatch_Close(TDeltaPatch *self, sse_bool in_remove)
+{
+  if (self->fSourceFd >= 0) {
+    close(self->fSourceFd);
+    self->fSourceFd = -1;
+  }
+  if (self->fTargetFd >= 0) {
+    close(self->fTargetFd);
+    self->fTargetFd = -1;
+    if (in_remove) {
+      unlink(self->fTargetPath);
+    }
+  }
+}
+
+/*
+ * Hashes the first in_size bytes of the candidate. A partition of an
+ * installed image may be larger than the image, the rest is ignored.
+ */
+static sse_bool
+TDeltaPatch_VerifySource(TDeltaPatch *self, int in_fd)
+{
+  FastHashSha256Context context;
+  sse_byte digest[SHA256_MD_BYTES];
+  sse_uint64 remaining = self->fSourceSize;
+  ssize_t n;
+
+  FastHash_Sha256Init(&context);
+  while (remaining > 0) {
+    n = read(in_fd, self->fBuffer, (sse_size)SSE_MIN(remaining, (sse_uint64)DELTA_PATCH_BUFFER_SIZE));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return sse_false;
+    }
+    FastHash_Sha256Update(&context, self->fBuffer, (sse_size)n);
+    remaining -= (sse_uint64)n;
+  }
+  FastHash_Sha256Final(&context, digest);
+  return (sse_memcmp(digest, self->fSourceDigest, SHA256_MD_BYTES) == 0) ? sse_true : sse_false;
+}
+
+static sse_int
+TDeltaPatch_OpenSource(TDeltaPatch *self, sse_char *in_path)
+{
+  int fd;
+
+  fd = open(in_path, O_RDONLY);
+  if (fd < 0) {
+    LOG_DEBUG("failed to open(%s). err=[%s]", in_path, strerror(errno));
+    return SSE_E_NOENT;
+  }
+  if (!TDeltaPatch_VerifySource(self, fd)) {
+    LOG_INFO("[%s] does not match the source of the patch.", in_path);
+    close(fd);
+    return SSE_E_NOENT;
+  }
+  LOG_INFO("patch source: [%s]", in_path);
+  self->fSourceFd = fd;
+  return SSE_E_OK;
+}
+
+static sse_int
+TDeltaPatch_FindSource(TDeltaPatch *self, sse_char *in_installed_path)
+{
+  sse_char *path;
+  sse_char *p;
+  sse_int len;
+  sse_int i;
+  sse_int err;
+
+  if (self->fBaseDirPath != NULL) {
+    len = sse_strlen(self->fBaseDirPath) + 1 + SHA256_MD_BYTES * 2;
+    path = sse_malloc(len + 1);
+    if (path == NULL) {
+      LOG_ERROR("failed to sse_malloc().");
+      return SSE_E_NOMEM;
+    }
+    p = path + snprintf(path, len + 1, "%s/", self->fBaseDirPath);
+    for (i = 0; i < SHA256_MD_BYTES; i++) {
+      p += snprintf(p, 3, "%02x", self->fSourceDigest[i]);
+    }
+    err = TDeltaPatch_OpenSource(self, path);
+    sse_free(path);
+    if (err == SSE_E_OK) {
+      return SSE_E_OK;
+    }
+  }
+  if (in_installed_path[0] != '\0' && TDeltaPatch_OpenSource(self, in_installed_path) == SSE_E_OK) {
+    return SSE_E_OK;
+  }
+  LOG_ERROR("source of the patch was not found.");
+  return SSE_E_NOENT;
+}
+
+static sse_int
+TDeltaPatch_Output(TDeltaPatch *self, sse_byte *in_data, sse_size in_len)
+{
+  ssize_t n;
+
+  if (in_len > self->fTargetSize - self->fWritten) {
+    LOG_ERROR("patch overruns the target. size=%llu", self->fTargetSize);
+    return SSE_E_INVAL;
+  }
+  FastHash_Sha256Update(&self->fDigestContext, in_data, in_len);
+  self->fWritten += in_len;
+  while (in_len > 0) {
+    n = write(self->fTargetFd, in_data, in_len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_ERROR("failed to write(%s). err=[%s]", self->fTargetPath, strerror(errno));
+      return SSE_E_GENERIC;
+    }
+    in_data += n;
+    in_len -= (sse_size)n;
+  }
+  return SSE_E_OK;
+}
+
+static sse_int
+TDeltaPatch_ReadSource(TDeltaPatch *self, sse_size in_len)
+{
+  sse_size done = 0;
+  ssize_t n;
+
+  if (self->fSourceOffset > self->fSourceSize || in_len > self->fSourceSize - self->fSourceOffset) {
+    LOG_ERROR("patch reads beyond the source. offset=%llu, len=%zu", self->fSourceOffset, in_len);
+    return SSE_E_INVAL;
+  }
+  while (done < in_len) {
+    n = pread(self->fSourceFd, self->fBuffer + done, in_len - done, (off_t)(self->fSourceOffset + done));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      LOG_ERROR("failed to pread() the source. err=[%s]", (n < 0) ? strerror(errno) : "EOF");
+      return SSE_E_GENERIC;
+    }
+    done += (sse_size)n;
+  }
+  self->fSourceOffset += in_len;
+  return SSE_E_OK;
+}
+
+static sse_int
+TDeltaPatch_Copy(TDeltaPatch *self)
+{
+  sse_size len;
+  sse_int err;
+
+  while (self->fRemaining > 0) {
+    len = SSE_MIN((sse_size)self->fRemaining, (sse_size)DELTA_PATCH_BUFFER_SIZE);
+    err = TDeltaPatch_ReadSource(self, len);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+    err = TDeltaPatch_Output(self, self->fBuffer, len);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+    self->fRemaining -= (sse_uint32)len;
+  }
+  return SSE_E_OK;
+}
+
+static sse_int
+TDeltaPatch_WriteAdd(TDeltaPatch *self, sse_byte *in_data, sse_size in_len, sse_size *out_consumed)
+{
+  sse_size len;
+  sse_size i;
+  sse_int err;
+
+  len = SSE_MIN(SSE_MIN(in_len, (sse_size)self->fRemaining), (sse_size)DELTA_PATCH_BUFFER_SIZE);
+  err = TDeltaPatch_ReadSource(self, len);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  for (i = 0; i < len; i++) {
+    self->fBuffer[i] += in_data[i];
+  }
+  err = TDeltaPatch_Output(self, self->fBuffer, len);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  self->fRemaining -= (sse_uint32)len;
+  *out_consumed = len;
+  return SSE_E_OK;
+}
+
+static sse_int
+TDeltaPatch_Finish(TDeltaPatch *self)
+{
+  sse_byte digest[SHA256_MD_BYTES];
+
+  if (self->fWritten != self->fTargetSize) {
+    LOG_ERROR("target is short. size=%llu, expected=%llu", self->fWritten, self->fTargetSize);
+    return SSE_E_INVAL;
+  }
+  FastHash_Sha256Final(&self->fDigestContext, digest);
+  if (sse_memcmp(digest, self->fTargetDigest, SHA256_MD_BYTES) != 0) {
+    LOG_ERROR("SHA-256 digest of the target mismatched. path=[%s]", self->fTargetPath);
+    return SSE_E_INVAL;
+  }
+  if (close(self->fTargetFd) != 0) {
+    LOG_ERROR("failed to close(%s). err=[%s]", self->fTargetPath, strerror(errno));
+    self->fTargetFd = -1;
+    unlink(self->fTargetPath);
+    return SSE_E_GENERIC;
+  }
+  self->fTargetFd = -1;
+  TDeltaPatch_Close(self, sse_false);
+  LOG_INFO("[%s] has been patched. size=%llu", self->fTargetPath, self->fWritten);
+  self->fState = DELTA_PATCH_STATE_COMPLETED;
+  return SSE_E_OK;
+}
+
+static sse_int
+TDeltaPatch_HandleHeader(TDeltaPatch *self)
+{
+  sse_byte *h = self->fHeader;
+  sse_uint path_len;
+  sse_int err;
+
+  switch (self->fState) {
+  case DELTA_PATCH_STATE_HEADER:
+    if (sse_memcmp(h, DELTA_PATCH_MAGIC, DELTA_PATCH_MAGIC_LEN) != 0) {
+      LOG_ERROR("not a delta patch.");
+      return SSE_E_INVAL;
+    }
+    self->fSourceSize = DeltaPatch_Get64(h + 8);
+    self->fTargetSize = DeltaPatch_Get64(h + 16);
+    sse_memcpy(self->fSourceDigest, h + 24, SHA256_MD_BYTES);
+    sse_memcpy(self->fTargetDigest, h + 24 + SHA256_MD_BYTES, SHA256_MD_BYTES);
+    path_len = ((sse_uint)h[DELTA_PATCH_HEADER_SIZE - 2] << 8) | h[DELTA_PATCH_HEADER_SIZE - 1];
+    if (self->fTargetSize > self->fMaxTargetSize) {
+      LOG_ERROR("target is too large. size=%llu", self->fTargetSize);
+      return SSE_E_INVAL;
+    }
+    if (path_len > DELTA_PATCH_MAX_PATH_LEN) {
+      LOG_ERROR("source path is too long. len=%u", path_len);
+      return SSE_E_INVAL;
+    }
+    TDeltaPatch_Expect(self, DELTA_PATCH_STATE_SOURCE_PATH, path_len);
+    if (path_len > 0) {
+      return SSE_E_OK;
+    }
+    /* fall through */
+  case DELTA_PATCH_STATE_SOURCE_PATH:
+    h[self->fHeaderLen] = '\0';
+    err = TDeltaPatch_FindSource(self, (sse_char *)h);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+    self->fTargetFd = open(self->fTargetPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (self->fTargetFd < 0) {
+      LOG_ERROR("failed to open(%s). err=[%s]", self->fTargetPath, strerror(errno));
+      return SSE_E_ACCES;
+    }
+    FastHash_Sha256Init(&self->fDigestContext);
+    TDeltaPatch_Expect(self, DELTA_PATCH_STATE_OP, 1);
+    return SSE_E_OK;
+  case DELTA_PATCH_STATE_OP:
+    switch (h[0]) {
+    case DELTA_OP_END:
+      return TDeltaPatch_Finish(self);
+    case DELTA_OP_COPY:
+      TDeltaPatch_Expect(self, DELTA_PATCH_STATE_COPY_ARGS, 12);
+      return SSE_E_OK;
+    case DELTA_OP_ADD:
+      TDeltaPatch_Expect(self, DELTA_PATCH_STATE_ADD_ARGS, 12);
+      return SSE_E_OK;
+    case DELTA_OP_DATA:
+      TDeltaPatch_Expect(self, DELTA_PATCH_STATE_DATA_ARGS, 4);
+      return SSE_E_OK;
+    default:
+      LOG_ERROR("unknown operation. op=%u", h[0]);
+      return SSE_E_INVAL;
+    }
+  case DELTA_PATCH_STATE_COPY_ARGS:
+    self->fSourceOffset = DeltaPatch_Get64(h);
+    self->fRemaining = DeltaPatch_Get32(h + 8);
+    err = TDeltaPatch_Copy(self);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+    TDeltaPatch_Expect(self, DELTA_PATCH_STATE_OP, 1);
+    return SSE_E_OK;
+  case DELTA_PATCH_STATE_ADD_ARGS:
+    self->fSourceOffset = DeltaPatch_Get64(h);
+    self->fRemaining = DeltaPatch_Get32(h + 8);
+    TDeltaPatch_Expect(self, (self->fRemaining > 0) ? DELTA_PATCH_STATE_ADD : DELTA_PATCH_STATE_OP, (self->fRemaining > 0) ? 0 : 1);
+    return SSE_E_OK;
+  case DELTA_PATCH_STATE_DATA_ARGS:
+    self->fRemaining = DeltaPatch_Get32(h);
+    TDeltaPatch_Expect(self, (self->fRemaining > 0) ? DELTA_PATCH_STATE_DATA : DELTA_PATCH_STATE_OP, (self->fRemaining > 0) ? 0 : 1);
+    return SSE_E_OK;
+  default:
+    return SSE_E_INVAL;
+  }
+}
+
+/* DeltaPatch public */
+
+sse_int
+TDeltaPatch_Write(TDeltaPatch *self, sse_byte *in_data, sse_size in_len)
+{
+  sse_size n;
+  sse_int err = SSE_E_OK;
+
+  while (in_len > 0) {
+    switch (self->fState) {
+    case DELTA_PATCH_STATE_ERROR:
+      return SSE_E_INVAL;
+    case DELTA_PATCH_STATE_COMPLETED:
+      LOG_ERROR("garbage after the end of the patch.");
+      err = SSE_E_INVAL;
+      n = 0;
+      break;
+    case DELTA_PATCH_STATE_ADD:
+      err = TDeltaPatch_WriteAdd(self, in_data, in_len, &n);
+      if (err == SSE_E_OK && self->fRemaining == 0) {
+        TDeltaPatch_Expect(self, DELTA_PATCH_STATE_OP, 1);
+      }
+      break;
+    case DELTA_PATCH_STATE_DATA:
+      n = SSE_MIN(in_len, (sse_size)self->fRemaining);
+      err = TDeltaPatch_Output(self, in_data, n);
+      self->fRemaining -= (sse_uint32)n;
+      if (err == SSE_E_OK && self->fRemaining == 0) {
+        TDeltaPatch_Expect(self, DELTA_PATCH_STATE_OP, 1);
+      }
+      break;
+    default:
+      n = SSE_MIN(in_len, (sse_size)(self->fHeaderNeed - self->fHeaderLen));
+      sse_memcpy(self->fHeader + self->fHeaderLen, in_data, n);
+      self->fHeaderLen += n;
+      if (self->fHeaderLen == self->fHeaderNeed) {
+        err = TDeltaPatch_HandleHeader(self);
+      }
+      break;
+    }
+    if (err != SSE_E_OK) {
+      LOG_ERROR("failed to apply patch. err=%s", sse_get_error_string(err));
+      TDeltaPatch_Close(self, sse_true);
+      self->fState = DELTA_PATCH_STATE_ERROR;
+      return err;
+    }
+    in_data += n;
+    in_len -= n;
+  }
+  return SSE_E_OK;
+}
+
+sse_bool
+TDeltaPatch_IsCompleted(TDeltaPatch *self)
+{
+  return (self->fState == DELTA_PATCH_STATE_COMPLETED) ? sse_true : sse_false;
+}
+
+void
+TDeltaPatch_SetMaxTargetSize(TDeltaPatch *self, sse_uint64 in_max_size)
+{
+  self->fMaxTargetSize = in_max_size;
+}
+
+sse_int
+TDeltaPatch_ApplyFile(TDeltaPatch *self, sse_char *in_patch_path)
+{
+  sse_byte *buffer = NULL;
+  ssize_t n;
+  sse_int err = SSE_E_OK;
+  int fd;
+
+  TRACE_ENTER();
+  fd = open(in_patch_path, O_RDONLY);
+  if (fd < 0) {
+    LOG_ERROR("failed to open(%s). err=[%s]", in_patch_path, strerror(errno));
+    return SSE_E_NOENT;
+  }
+  buffer = sse_malloc(DELTA_PATCH_BUFFER_SIZE);
+  if (buffer == NULL) {
+    LOG_ERROR("failed to sse_malloc().");
+    close(fd);
+    return SSE_E_NOMEM;
+  }
+  while (err == SSE_E_OK) {
+    n = read(fd, buffer, DELTA_PATCH_BUFFER_SIZE);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      LOG_ERROR("failed to read(%s). err=[%s]", in_patch_path, strerror(errno));
+      err = SSE_E_GENERIC;
+      break;
+    }
+    if (n == 0) {
+      break;
+    }
+    err = TDeltaPatch_Write(self, buffer, (sse_size)n);
+  }
+  if (err == SSE_E_OK && !TDeltaPatch_IsCompleted(self)) {
+    LOG_ERROR("patch [%s] is truncated.", in_patch_path);
+    TDeltaPatch_Close(self, sse_true);
+    self->fState = DELTA_PATCH_STATE_ERROR;
+    err = SSE_E_INVAL;
+  }
+  sse_free(buffer);
+  close(fd);
+  TRACE_LEAVE();
+  return err;
+}
+
+TDeltaPatch *
+DeltaPatch_New(sse_char *in_target_path, sse_char *in_base_dir_path)
+{
+  TDeltaPatch *patch;
+
+  TRACE_ENTER();
+  patch = sse_zeroalloc(sizeof(TDeltaPatch));
+  if (patch == NULL) {
+    LOG_ERROR("failed to sse_zeroalloc().");
+    return NULL;
+  }
+  patch->fSourceFd = -1;
+  patch->fTargetFd = -1;
+  patch->fMaxTargetSize = (sse_uint64)-1;
+  patch->fTargetPath = sse_strdup(in_target_path);
+  patch->fBaseDirPath = (in_base_dir_path != NULL) ? sse_strdup(in_base_dir_path) : NULL;
+  patch->fHeader = sse_malloc(SSE_MAX(DELTA_PATCH_HEADER_SIZE, DELTA_PATCH_MAX_PATH_LEN + 1));
+  patch->fBuffer = sse_malloc(DELTA_PATCH_BUFFER_SIZE);
+  if (patch->fTargetPath == NULL || (in_base_dir_path != NULL && patch->fBaseDirPath == NULL) ||
+      patch->fHeader == NULL || patch->fBuffer == NULL) {
+    LOG_ERROR("failed to allocate patch.");
+    TDeltaPatch_Delete(patch);
+    return NULL;
+  }
+  TDeltaPatch_Expect(patch, DELTA_PATCH_STATE_HEADER, DELTA_PATCH_HEADER_SIZE);
+  TRACE_LEAVE();
+  return patch;
+}
+
+void
+TDeltaPatch_Delete(TDeltaPatch *self)
+{
+  TRACE_ENTER();
+  TDeltaPatch_Close(self, (self->fState != DELTA_PATCH_STATE_COMPLETED) ? sse_true : sse_false);
+  if (self->fBuffer != NULL) {
+    sse_free(self->fBuffer);
+  }
+  if (self->fHeader != NULL) {
+    sse_free(self->fHeader);
+  }
+  if (self->fBaseDirPath != NULL) {
+    sse_free(self->fBaseDirPath);
+  }
+  if (self->fTargetPath != NULL) {
+    sse_free(self->fTargetPath);
+  }
+  sse_free(self);
+  TRACE_LEAVE();
+}
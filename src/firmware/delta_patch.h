@@ -0,0 +1,69 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#ifndef __DELTA_PATCH__
+#define __DELTA_PATCH__
+
+#include <sseutils.h>
+#include "fast_hash.h"
+
+SSE_BEGIN_C_DECLS
+
+#define DELTA_PATCH_FILE_SUFFIX  ".delta"
+
+typedef struct TDeltaPatch_ TDeltaPatch;
+
+/*
+ * Push decoder for delta patches made by genfwpkg.py --base. A patch
+ * rebuilds a target image from a source image with COPY (bytes of the
+ * source), ADD (bytes of the source plus a difference) and DATA (new bytes)
+ * operations, all written in order with a fixed size buffer.
+ * The source is looked up by its SHA-256 digest in the base directory first
+ * and at the path of the installed image recorded in the patch then, and is
+ * verified before it is used. The target is hashed while it is written and
+ * is removed unless it matches the digest in the patch.
+ */
+struct TDeltaPatch_ {
+  sse_char *fTargetPath;
+  sse_char *fBaseDirPath;
+  sse_int fState;
+  sse_byte *fHeader;
+  sse_uint fHeaderLen;
+  sse_uint fHeaderNeed;
+  sse_uint64 fSourceSize;
+  sse_uint64 fTargetSize;
+  sse_uint64 fMaxTargetSize;
+  sse_byte fSourceDigest[SHA256_MD_BYTES];
+  sse_byte fTargetDigest[SHA256_MD_BYTES];
+  int fSourceFd;
+  int fTargetFd;
+  sse_uint64 fSourceOffset;
+  sse_uint32 fRemaining;
+  sse_uint64 fWritten;
+  FastHashSha256Context fDigestContext;
+  sse_byte *fBuffer;
+};
+
+TDeltaPatch * DeltaPatch_New(sse_char *in_target_path, sse_char *in_base_dir_path);
+void TDeltaPatch_Delete(TDeltaPatch *self);
+sse_int TDeltaPatch_Write(TDeltaPatch *self, sse_byte *in_data, sse_size in_len);
+sse_bool TDeltaPatch_IsCompleted(TDeltaPatch *self);
+void TDeltaPatch_SetMaxTargetSize(TDeltaPatch *self, sse_uint64 in_max_size);
+sse_int TDeltaPatch_ApplyFile(TDeltaPatch *self, sse_char *in_patch_path);
+
+SSE_END_C_DECLS
+
+#endif /* __DELTA_PATCH__ */
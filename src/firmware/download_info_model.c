@@ -26,12 +26,16 @@
 #define LOG_INFO(format, ...) MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
 #define LOG_DEBUG(format, ...)  MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
 
+/* a notification without result for this long is considered lost */
+#define DOWNLOAD_INFO_MODEL_PENDING_EXPIRY_MSEC  (10 * 60 * 1000)
+#define DOWNLOAD_INFO_MODEL_PROGRESS_MIN_GAP_MSEC  (1000)
+#define DOWNLOAD_INFO_MODEL_PROGRESS_STEPS  (20)
+
 /* DownloadInfoModel private */
 
 static sse_int
-DownloadInfoModel_OnDownloadAndUpdate(Moat in_moat, sse_char *in_uid, sse_char *in_key, MoatValue *in_data, sse_pointer in_model_context)
+DownloadInfoModel_RunCommand(TDownloadInfoModel *model, sse_int in_command, sse_char *in_key)
 {
-  TDownloadInfoModel *model= (TDownloadInfoModel *)in_model_context;
   sse_int err;
 
   TRACE_ENTER();
@@ -39,17 +43,56 @@ DownloadInfoModel_OnDownloadAndUpdate(Moat in_moat, sse_char *in_uid, sse_char *
     LOG_ERROR("async key is nil.");
     return SSE_E_INVAL;
   }
-  if (model->fCurrentInfo == NULL || model->fCommandCallback == NULL) {
+  /* "apply" takes the DownloadInfo of the staged package */
+  if ((model->fCurrentInfo == NULL && in_command != DOWNLOAD_INFO_MODEL_COMMAND_APPLY) || model->fCommandCallback == NULL) {
     LOG_ERROR("invalid model state");
     return SSE_E_INVAL;
   }
-  err = (*model->fCommandCallback)(model, in_key, model->fCommandUserData);
+  err = (*model->fCommandCallback)(model, in_command, in_key, model->fCommandUserData);
   if (err != SSE_E_OK) {
     LOG_ERROR("failed to CommandCallback:%s", sse_get_error_string(err));
     return err;
   }
   TRACE_LEAVE();
-	return SSE_E_OK;
+  return SSE_E_OK;
+}
+
+static sse_int
+DownloadInfoModel_OnDownloadAndUpdate(Moat in_moat, sse_char *in_uid, sse_char *in_key, MoatValue *in_data, sse_pointer in_model_context)
+{
+  return DownloadInfoModel_RunCommand((TDownloadInfoModel *)in_model_context, DOWNLOAD_INFO_MODEL_COMMAND_DOWNLOAD_AND_UPDATE, in_key);
+}
+
+static sse_int
+DownloadInfoModel_OnDownload(Moat in_moat, sse_char *in_uid, sse_char *in_key, MoatValue *in_data, sse_pointer in_model_context)
+{
+  return DownloadInfoModel_RunCommand((TDownloadInfoModel *)in_model_context, DOWNLOAD_INFO_MODEL_COMMAND_DOWNLOAD, in_key);
+}
+
+static sse_int
+DownloadInfoModel_OnApply(Moat in_moat, sse_char *in_uid, sse_char *in_key, MoatValue *in_data, sse_pointer in_model_context)
+{
+  return DownloadInfoModel_RunCommand((TDownloadInfoModel *)in_model_context, DOWNLOAD_INFO_MODEL_COMMAND_APPLY, in_key);
+}
+
+static sse_int
+DownloadInfoModel_StartCommand(Moat in_moat, sse_char *in_uid, sse_char *in_key, MoatValue *in_data, sse_pointer in_model_context, MoatCommandProc in_proc)
+{
+  TDownloadInfoModel *model = (TDownloadInfoModel *)in_model_context;
+  sse_int err;
+
+  TRACE_ENTER();
+  if (model->fCommandCallback == NULL) {
+    LOG_ERROR("Command Callback is nil.");
+    return SSE_E_INVAL;
+  }
+  err = moat_start_async_command(in_moat, in_uid, in_key, in_data, in_proc, in_model_context);
+  if (err) {
+    LOG_ERROR("failed to moat_start_async_command(). err=%s", sse_get_error_string(err));
+    return err;
+  }
+  TRACE_LEAVE();
+  return SSE_E_INPROGRESS;
 }
 
 static sse_int
@@ -89,10 +132,76 @@ error_exit:
   return err;
 }
 
+static void
+TDownloadInfoModel_RemovePending(TDownloadInfoModel *self, sse_uint in_index)
+{
+  self->fPendingCount--;
+  if (in_index < self->fPendingCount) {
+    self->fPendingIds[in_index] = self->fPendingIds[self->fPendingCount];
+    self->fPendingSince[in_index] = self->fPendingSince[self->fPendingCount];
+  }
+}
+
+static void
+TDownloadInfoModel_AddPending(TDownloadInfoModel *self, sse_int in_request_id)
+{
+  sse_uint oldest = 0;
+  sse_uint i;
+
+  if (self->fPendingCount == DOWNLOAD_INFO_MODEL_MAX_PENDING_NOTIFICATIONS) {
+    for (i = 1; i < self->fPendingCount; i++) {
+      if (self->fPendingSince[i] < self->fPendingSince[oldest]) {
+        oldest = i;
+      }
+    }
+    TDownloadInfoModel_RemovePending(self, oldest);
+  }
+  self->fPendingIds[self->fPendingCount] = in_request_id;
+  self->fPendingSince[self->fPendingCount] = moat_get_timestamp_msec();
+  self->fPendingCount++;
+}
+
+static sse_bool
+TDownloadInfoModel_IsPending(TDownloadInfoModel *self, sse_int in_request_id)
+{
+  sse_uint i;
+
+  for (i = 0; i < self->fPendingCount; i++) {
+    if (self->fPendingIds[i] == in_request_id) {
+      return sse_true;
+    }
+  }
+  return sse_false;
+}
+
+static void
+TDownloadInfoModel_ExpirePending(TDownloadInfoModel *self, sse_uint64 in_now)
+{
+  sse_uint i = 0;
+
+  while (i < self->fPendingCount) {
+    if (in_now - self->fPendingSince[i] > DOWNLOAD_INFO_MODEL_PENDING_EXPIRY_MSEC) {
+      LOG_INFO("no result for notification. request_id=%d", self->fPendingIds[i]);
+      TDownloadInfoModel_RemovePending(self, i);
+      continue;
+    }
+    i++;
+  }
+}
+
 static void
 DownloadInfoModel_OnNotificationResult(Moat in_moat, sse_char *in_urn, sse_char *in_model_name, sse_int in_request_id, sse_int in_result, sse_pointer in_user_data)
 {
+  TDownloadInfoModel *self = (TDownloadInfoModel *)in_user_data;
+  sse_uint i;
+
   TRACE_ENTER();
+  for (i = 0; i < self->fPendingCount; i++) {
+    if (self->fPendingIds[i] == in_request_id) {
+      TDownloadInfoModel_RemovePending(self, i);
+      break;
+    }
+  }
   LOG_INFO("[result] urn=[%s], model=[%s]. request_id=%d, result=[%s]", in_urn, in_model_name, in_request_id, sse_get_error_string(in_result));
   TRACE_LEAVE();
 }
@@ -114,21 +223,19 @@ DownloadInfoModel_OnUpdate(Moat in_moat, sse_char *in_uid, MoatObject *in_object
 sse_int
 DownloadInfo_downloadAndUpdate(Moat in_moat, sse_char *in_uid, sse_char *in_key, MoatValue *in_data, sse_pointer in_model_context)
 {
-  TDownloadInfoModel *model = (TDownloadInfoModel *)in_model_context;
-  sse_int err;
+  return DownloadInfoModel_StartCommand(in_moat, in_uid, in_key, in_data, in_model_context, DownloadInfoModel_OnDownloadAndUpdate);
+}
 
-  TRACE_ENTER();
-  if (model->fCommandCallback == NULL) {
-    LOG_ERROR("Command Callback is nil.");
-    return SSE_E_INVAL;
-  }
-  err = moat_start_async_command(in_moat, in_uid, in_key, in_data, DownloadInfoModel_OnDownloadAndUpdate, in_model_context);
-  if (err) {
-    LOG_ERROR("failed to moat_start_async_command(). err=%s", sse_get_error_string(err));
-    return err;
-  }
-  TRACE_LEAVE();
-  return SSE_E_INPROGRESS;
+sse_int
+DownloadInfo_download(Moat in_moat, sse_char *in_uid, sse_char *in_key, MoatValue *in_data, sse_pointer in_model_context)
+{
+  return DownloadInfoModel_StartCommand(in_moat, in_uid, in_key, in_data, in_model_context, DownloadInfoModel_OnDownload);
+}
+
+sse_int
+DownloadInfo_apply(Moat in_moat, sse_char *in_uid, sse_char *in_key, MoatValue *in_data, sse_pointer in_model_context)
+{
+  return DownloadInfoModel_StartCommand(in_moat, in_uid, in_key, in_data, in_model_context, DownloadInfoModel_OnApply);
 }
 
 /* DownloadInfoModel public */
@@ -143,41 +250,28 @@ TDownloadInfoModel_Clear(TDownloadInfoModel *self)
   TRACE_LEAVE();
 }
 
-sse_int
-TDownloadInfoModel_NotifyResult(TDownloadInfoModel *self, sse_char *in_key, sse_int in_err_code, sse_char *in_err_info)
+static sse_int
+TDownloadInfoModel_SendResult(TDownloadInfoModel *self, sse_char *in_key, sse_char *in_status, sse_int in_err_code, sse_char *in_err_info)
 {
   sse_char *service_id = NULL;
   MoatObject *info;
-  sse_char *status;
-  sse_char *err_info = NULL;
   sse_int err;
   sse_int req_id;
 
   TRACE_ENTER();
-  LOG_DEBUG("err=%s, info=%s", sse_get_error_string(in_err_code), (in_err_info == NULL) ? "" : in_err_info);
   if (self->fCurrentInfo == NULL) {
     LOG_ERROR("Current object is nil.");
     return SSE_E_INVAL;
   }
   service_id = moat_create_notification_id_with_moat(self->fMoat, "update-result", "1.0");
   info = self->fCurrentInfo;
-  if (in_err_code != SSE_E_OK) {
-    status = "ERROR";
-    if (in_err_info == NULL) {
-      err_info = (sse_char *)sse_get_error_string(in_err_code);
-    } else {
-      err_info = in_err_info;
-    }
-  } else {
-    status = "UPDATED";
-  }
-  err = moat_object_add_string_value(info, DOWNLOAD_INFO_MODEL_FIELD_STATUS, status, 0, sse_true, sse_true);
+  err = moat_object_add_string_value(info, DOWNLOAD_INFO_MODEL_FIELD_STATUS, in_status, 0, sse_true, sse_true);
   if (err != SSE_E_OK) {
     LOG_ERROR("failed to moat_object_add_string_value(%s).", DOWNLOAD_INFO_MODEL_FIELD_STATUS);
     goto error_exit;
   }
-  if (err_info != NULL) {
-    err = moat_object_add_string_value(info, DOWNLOAD_INFO_MODEL_FIELD_ERROR_INFO, err_info, 0, sse_true, sse_true);
+  if (in_err_info != NULL) {
+    err = moat_object_add_string_value(info, DOWNLOAD_INFO_MODEL_FIELD_ERROR_INFO, in_err_info, 0, sse_true, sse_true);
     if (err != SSE_E_OK) {
       LOG_ERROR("failed to moat_object_add_string_value(%s).", DOWNLOAD_INFO_MODEL_FIELD_ERROR_INFO);
       goto error_exit;
@@ -189,14 +283,16 @@ TDownloadInfoModel_NotifyResult(TDownloadInfoModel *self, sse_char *in_key, sse_
     LOG_ERROR("failed to moat_object_add_string_value(%s).", DOWNLOAD_INFO_MODEL_FIELD_URL);
     goto error_exit;
   }
-  LOG_INFO("[send] urn=[%s], model=[%s], err=[%s], err_info=[%s]", service_id,
-    DOWNLOAD_INFO_MODEL_NAME, sse_get_error_string(in_err_code), (err_info == NULL) ? "" : err_info);
+  LOG_INFO("[send] urn=[%s], model=[%s], status=[%s], err=[%s], err_info=[%s]", service_id,
+    DOWNLOAD_INFO_MODEL_NAME, in_status, sse_get_error_string(in_err_code), (in_err_info == NULL) ? "" : in_err_info);
   req_id = moat_send_notification(self->fMoat, service_id, in_key, DOWNLOAD_INFO_MODEL_NAME, info, DownloadInfoModel_OnNotificationResult, self);
   if (req_id < 0) {
     err = req_id;
     LOG_ERROR("failed to moat_send_notification(%s). err=%s", DOWNLOAD_INFO_MODEL_NAME, sse_get_error_string(err));
     goto error_exit;
   }
+  TDownloadInfoModel_AddPending(self, req_id);
+  TDownloadInfoModel_ResetProgress(self);
   sse_free(service_id);
   TRACE_LEAVE();
   return SSE_E_OK;
@@ -208,6 +304,200 @@ error_exit:
   return err;
 }
 
+sse_int
+TDownloadInfoModel_NotifyResult(TDownloadInfoModel *self, sse_char *in_key, sse_int in_err_code, sse_char *in_err_info)
+{
+  sse_char *err_info = NULL;
+
+  LOG_DEBUG("err=%s, info=%s", sse_get_error_string(in_err_code), (in_err_info == NULL) ? "" : in_err_info);
+  if (in_err_code == SSE_E_OK) {
+    return TDownloadInfoModel_SendResult(self, in_key, "UPDATED", in_err_code, NULL);
+  }
+  if (in_err_info == NULL) {
+    err_info = (sse_char *)sse_get_error_string(in_err_code);
+  } else {
+    err_info = in_err_info;
+  }
+  return TDownloadInfoModel_SendResult(self, in_key, "ERROR", in_err_code, err_info);
+}
+
+/*
+ * Tells that the package has been downloaded and extracted and waits for
+ * the "apply" command.
+ */
+sse_int
+TDownloadInfoModel_NotifyStaged(TDownloadInfoModel *self, sse_char *in_key)
+{
+  return TDownloadInfoModel_SendResult(self, in_key, "STAGED", SSE_E_OK, NULL);
+}
+
+/*
+ * Tells whether a notification of this model has been waiting for its
+ * result longer than in_max_delay_msec, i.e. the uplink is backed up.
+ */
+sse_bool
+TDownloadInfoModel_IsNotificationBacklogged(TDownloadInfoModel *self, sse_uint64 in_max_delay_msec)
+{
+  sse_uint64 now = moat_get_timestamp_msec();
+  sse_uint i;
+
+  TDownloadInfoModel_ExpirePending(self, now);
+  for (i = 0; i < self->fPendingCount; i++) {
+    if (now - self->fPendingSince[i] > in_max_delay_msec) {
+      return sse_true;
+    }
+  }
+  return sse_false;
+}
+
+void
+TDownloadInfoModel_SetProgressInterval(TDownloadInfoModel *self, sse_uint in_interval_sec)
+{
+  self->fProgressInterval = in_interval_sec;
+}
+
+void
+TDownloadInfoModel_ResetProgress(TDownloadInfoModel *self)
+{
+  self->fProgressStage = NULL;
+  self->fProgressRequestId = -1;
+  self->fProgressSentAt = 0;
+  self->fProgressSentBytes = 0;
+  self->fRateSampleTime = 0;
+  self->fRateSampleBytes = 0;
+  self->fRate = 0;
+}
+
+/*
+ * Smooths the transfer rate over samples taken at least a second apart.
+ */
+static void
+TDownloadInfoModel_SampleRate(TDownloadInfoModel *self, sse_uint64 in_now, sse_int64 in_received)
+{
+  sse_int64 rate;
+
+  if (self->fRateSampleTime == 0 || in_received < self->fRateSampleBytes) {
+    self->fRateSampleTime = in_now;
+    self->fRateSampleBytes = in_received;
+    self->fRate = 0;
+    return;
+  }
+  if (in_now - self->fRateSampleTime < DOWNLOAD_INFO_MODEL_PROGRESS_MIN_GAP_MSEC) {
+    return;
+  }
+  rate = (in_received - self->fRateSampleBytes) * 1000 / (sse_int64)(in_now - self->fRateSampleTime);
+  self->fRate = (self->fRate == 0) ? rate : (self->fRate * 3 + rate) / 4;
+  self->fRateSampleTime = in_now;
+  self->fRateSampleBytes = in_received;
+}
+
+static sse_int
+TDownloadInfoModel_SendProgress(TDownloadInfoModel *self, sse_char *in_key, sse_char *in_stage, sse_int64 in_received, sse_int64 in_total)
+{
+  sse_char *service_id = NULL;
+  MoatObject *info = NULL;
+  sse_int64 eta = -1;
+  sse_int err;
+  sse_int req_id;
+
+  if (in_total > 0 && self->fRate > 0) {
+    eta = (in_total > in_received) ? (in_total - in_received) / self->fRate : 0;
+  }
+  info = moat_object_clone(self->fCurrentInfo);
+  if (info == NULL) {
+    LOG_ERROR("failed to moat_object_clone().");
+    return SSE_E_NOMEM;
+  }
+  err = moat_object_add_string_value(info, DOWNLOAD_INFO_MODEL_FIELD_STAGE, in_stage, 0, sse_true, sse_true);
+  if (err == SSE_E_OK) {
+    err = moat_object_add_int64_value(info, DOWNLOAD_INFO_MODEL_FIELD_BYTES_RECEIVED, in_received, sse_true);
+  }
+  if (err == SSE_E_OK) {
+    err = moat_object_add_int64_value(info, DOWNLOAD_INFO_MODEL_FIELD_TOTAL_BYTES, in_total, sse_true);
+  }
+  if (err == SSE_E_OK) {
+    err = moat_object_add_int32_value(info, DOWNLOAD_INFO_MODEL_FIELD_RATE, (sse_int32)SSE_MIN(self->fRate, 0x7fffffff), sse_true);
+  }
+  if (err == SSE_E_OK) {
+    err = moat_object_add_int32_value(info, DOWNLOAD_INFO_MODEL_FIELD_ETA, (sse_int32)SSE_MIN(eta, 0x7fffffff), sse_true);
+  }
+  if (err == SSE_E_OK) {
+    /* for reduce value size : set url value "" */
+    err = moat_object_add_string_value(info, DOWNLOAD_INFO_MODEL_FIELD_URL, "", 0, sse_true, sse_true);
+  }
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to add progress values. err=%s", sse_get_error_string(err));
+    goto error_exit;
+  }
+  service_id = moat_create_notification_id_with_moat(self->fMoat, "update-progress", "1.0");
+  if (service_id == NULL) {
+    err = SSE_E_NOMEM;
+    goto error_exit;
+  }
+  LOG_DEBUG("[send] stage=%s, received=%lld, total=%lld, rate=%lld, eta=%lld", in_stage, in_received, in_total, self->fRate, eta);
+  req_id = moat_send_notification(self->fMoat, service_id, in_key, DOWNLOAD_INFO_MODEL_NAME, info, DownloadInfoModel_OnNotificationResult, self);
+  if (req_id < 0) {
+    err = req_id;
+    LOG_ERROR("failed to moat_send_notification(%s). err=%s", DOWNLOAD_INFO_MODEL_NAME, sse_get_error_string(err));
+    goto error_exit;
+  }
+  TDownloadInfoModel_AddPending(self, req_id);
+  self->fProgressRequestId = req_id;
+  sse_free(service_id);
+  moat_object_free(info);
+  return SSE_E_OK;
+
+error_exit:
+  if (service_id != NULL) {
+    sse_free(service_id);
+  }
+  moat_object_free(info);
+  return err;
+}
+
+/*
+ * Reports the progress of the current stage. May be called as often as
+ * the caller likes; whatever is not sent is coalesced into the next one.
+ */
+sse_int
+TDownloadInfoModel_NotifyProgress(TDownloadInfoModel *self, sse_char *in_key, sse_char *in_stage, sse_int64 in_received, sse_int64 in_total)
+{
+  sse_uint64 now = moat_get_timestamp_msec();
+  sse_uint64 elapsed;
+  sse_bool stage_changed;
+  sse_bool stepped;
+  sse_int err;
+
+  if (self->fCurrentInfo == NULL || self->fProgressInterval == 0) {
+    return SSE_E_OK;
+  }
+  stage_changed = (self->fProgressStage == NULL || sse_strcmp(self->fProgressStage, in_stage) != 0);
+  if (stage_changed) {
+    self->fRateSampleTime = 0;
+  }
+  TDownloadInfoModel_SampleRate(self, now, in_received);
+  TDownloadInfoModel_ExpirePending(self, now);
+  if (!stage_changed) {
+    if (TDownloadInfoModel_IsPending(self, self->fProgressRequestId)) {
+      return SSE_E_OK;
+    }
+    elapsed = now - self->fProgressSentAt;
+    stepped = (in_total > 0 && (in_received - self->fProgressSentBytes) * DOWNLOAD_INFO_MODEL_PROGRESS_STEPS >= in_total);
+    if (elapsed < (sse_uint64)self->fProgressInterval * 1000 &&
+        !(stepped && elapsed >= DOWNLOAD_INFO_MODEL_PROGRESS_MIN_GAP_MSEC)) {
+      return SSE_E_OK;
+    }
+  }
+  err = TDownloadInfoModel_SendProgress(self, in_key, in_stage, in_received, in_total);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  self->fProgressStage = in_stage;
+  self->fProgressSentAt = now;
+  self->fProgressSentBytes = in_received;
+  return SSE_E_OK;
+}
+
 MoatObject *
 TDownloadInfoModel_GetModelObject(TDownloadInfoModel *self)
 {
@@ -244,7 +534,7 @@ TDownloadInfoModel_SetModelObject(TDownloadInfoModel *self, MoatObject *in_obj)
 }
 
 void
-TDownloadInfoModel_SetDownloadAndUpdateCommandCallback(TDownloadInfoModel *self, DownloadInfoModel_DownloadAndUpdateCommandCallback in_callback, sse_pointer in_user_data)
+TDownloadInfoModel_SetCommandCallback(TDownloadInfoModel *self, DownloadInfoModel_CommandCallback in_callback, sse_pointer in_user_data)
 {
   TRACE_ENTER();
   self->fCommandCallback = in_callback;
@@ -292,6 +582,8 @@ TDownloadInfoModel_Initialize(TDownloadInfoModel *self, Moat in_moat)
   TRACE_ENTER();
   sse_memset(self, 0, sizeof(TDownloadInfoModel));
   self->fMoat = in_moat;
+  self->fProgressInterval = DOWNLOAD_INFO_MODEL_DEFAULT_PROGRESS_INTERVAL_SEC;
+  TDownloadInfoModel_ResetProgress(self);
   TRACE_LEAVE();
   return SSE_E_OK;
 }
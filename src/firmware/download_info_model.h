@@ -21,30 +21,84 @@ SSE_BEGIN_C_DECLS
 
 #define DOWNLOAD_INFO_MODEL_NAME  "DownloadInfo"
 #define DOWNLOAD_INFO_MODEL_FIELD_URL  "url"
+#define DOWNLOAD_INFO_MODEL_FIELD_MIRRORS  "mirrors"
 #define DOWNLOAD_INFO_MODEL_FIELD_NAME  "name"
 #define DOWNLOAD_INFO_MODEL_FIELD_VERSION  "version"
+#define DOWNLOAD_INFO_MODEL_FIELD_SHA256  "sha256"
+#define DOWNLOAD_INFO_MODEL_FIELD_UPDATE_TIMEOUT  "updateTimeout"
+#define DOWNLOAD_INFO_MODEL_FIELD_MAX_CONNECTIONS  "maxConnections"
+#define DOWNLOAD_INFO_MODEL_FIELD_CACHE_BUDGET  "cacheBudget"
+#define DOWNLOAD_INFO_MODEL_FIELD_MAX_RATE  "maxRate"
+#define DOWNLOAD_INFO_MODEL_FIELD_RATE_PROFILES  "rateProfiles"
+#define DOWNLOAD_INFO_MODEL_FIELD_PROGRESS_INTERVAL  "progressInterval"
+#define DOWNLOAD_INFO_MODEL_FIELD_START_AT  "startAt"
+#define DOWNLOAD_INFO_MODEL_FIELD_START_JITTER  "startJitter"
+#define DOWNLOAD_INFO_MODEL_FIELD_APPLY_AT  "applyAt"
+#define DOWNLOAD_INFO_MODEL_FIELD_PRIORITY  "priority"
 #define DOWNLOAD_INFO_MODEL_FIELD_STATUS  "status"
 #define DOWNLOAD_INFO_MODEL_FIELD_ERROR_INFO  "errorInfo"
+#define DOWNLOAD_INFO_MODEL_FIELD_STAGE  "stage"
+#define DOWNLOAD_INFO_MODEL_FIELD_BYTES_RECEIVED  "bytesReceived"
+#define DOWNLOAD_INFO_MODEL_FIELD_TOTAL_BYTES  "totalBytes"
+#define DOWNLOAD_INFO_MODEL_FIELD_RATE  "rate"
+#define DOWNLOAD_INFO_MODEL_FIELD_ETA  "eta"
+
+#define DOWNLOAD_INFO_MODEL_STAGE_DOWNLOADING  "DOWNLOADING"
+#define DOWNLOAD_INFO_MODEL_STAGE_EXTRACTING  "EXTRACTING"
+#define DOWNLOAD_INFO_MODEL_STAGE_UPDATING  "UPDATING"
+
+#define DOWNLOAD_INFO_MODEL_COMMAND_DOWNLOAD_AND_UPDATE  (0)
+#define DOWNLOAD_INFO_MODEL_COMMAND_DOWNLOAD  (1)
+#define DOWNLOAD_INFO_MODEL_COMMAND_APPLY  (2)
+
+#define DOWNLOAD_INFO_MODEL_MAX_PENDING_NOTIFICATIONS  (8)
+#define DOWNLOAD_INFO_MODEL_DEFAULT_PROGRESS_INTERVAL_SEC  (30)
 
 typedef struct TDownloadInfoModel_ TDownloadInfoModel;
 
-typedef sse_int (*DownloadInfoModel_DownloadAndUpdateCommandCallback)(TDownloadInfoModel *model, sse_char *in_key, sse_pointer in_user_data);
+typedef sse_int (*DownloadInfoModel_CommandCallback)(TDownloadInfoModel *model, sse_int in_command, sse_char *in_key, sse_pointer in_user_data);
+
+/*
+ * "downloadAndUpdate" runs a whole update, "download" fetches and extracts
+ * a package and leaves it staged, "apply" installs the staged package. All
+ * of them are handed to the command callback with their command number.
+ * Progress is reported with "update-progress" notifications, coalesced so
+ * that at most one is in flight and a new one goes out only when the
+ * stage changes, the progress interval has passed or the transfer has
+ * advanced by a twentieth, but never more often than once a second.
+ */
 struct TDownloadInfoModel_ {
   Moat fMoat;
   MoatObject *fCurrentInfo;
-  DownloadInfoModel_DownloadAndUpdateCommandCallback fCommandCallback;
+  DownloadInfoModel_CommandCallback fCommandCallback;
   sse_pointer fCommandUserData;
+  sse_int fPendingIds[DOWNLOAD_INFO_MODEL_MAX_PENDING_NOTIFICATIONS];
+  sse_uint64 fPendingSince[DOWNLOAD_INFO_MODEL_MAX_PENDING_NOTIFICATIONS];
+  sse_uint fPendingCount;
+  sse_char *fProgressStage;
+  sse_uint fProgressInterval;
+  sse_int fProgressRequestId;
+  sse_uint64 fProgressSentAt;
+  sse_int64 fProgressSentBytes;
+  sse_uint64 fRateSampleTime;
+  sse_int64 fRateSampleBytes;
+  sse_int64 fRate;
 };
 
 sse_int TDownloadInfoModel_Initialize(TDownloadInfoModel *self, Moat in_moat);
 void TDownloadInfoModel_Finalize(TDownloadInfoModel *self);
 sse_int TDownloadInfoModel_Start(TDownloadInfoModel *self);
 void TDownloadInfoModel_Stop(TDownloadInfoModel *self);
-void TDownloadInfoModel_SetDownloadAndUpdateCommandCallback(TDownloadInfoModel *self, DownloadInfoModel_DownloadAndUpdateCommandCallback in_callback, sse_pointer in_user_data);
+void TDownloadInfoModel_SetCommandCallback(TDownloadInfoModel *self, DownloadInfoModel_CommandCallback in_callback, sse_pointer in_user_data);
 MoatObject * TDownloadInfoModel_GetModelObject(TDownloadInfoModel *self);
 sse_int TDownloadInfoModel_SetModelObject(TDownloadInfoModel *self, MoatObject *in_obj);
 sse_int TDownloadInfoModel_NotifyResult(TDownloadInfoModel *self, sse_char *in_key, sse_int in_err_code, sse_char *in_err_info);
+sse_int TDownloadInfoModel_NotifyStaged(TDownloadInfoModel *self, sse_char *in_key);
 void TDownloadInfoModel_Clear(TDownloadInfoModel *self);
+sse_bool TDownloadInfoModel_IsNotificationBacklogged(TDownloadInfoModel *self, sse_uint64 in_max_delay_msec);
+void TDownloadInfoModel_SetProgressInterval(TDownloadInfoModel *self, sse_uint in_interval_sec);
+sse_int TDownloadInfoModel_NotifyProgress(TDownloadInfoModel *self, sse_char *in_key, sse_char *in_stage, sse_int64 in_received, sse_int64 in_total);
+void TDownloadInfoModel_ResetProgress(TDownloadInfoModel *self);
 
 SSE_END_C_DECLS
 
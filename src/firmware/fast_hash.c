@@ -0,0 +1,1189 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include <servicesync/moat.h>
+#include "fast_hash.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#include <immintrin.h>
+#define FAST_HASH_X86
+#elif defined(__GNUC__) && defined(__aarch64__)
+#include <sys/auxv.h>
+#include <arm_neon.h>
+#define FAST_HASH_ARMV8
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1  (1 << 5)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2  (1 << 6)
+#endif
+#endif
+
+#if defined(__GNUC__) && defined(__ARM_NEON)
+#define FAST_HASH_NEON
+#endif
+
+#define TAG "FastHash"
+
+#define TRACE_ENTER() MOAT_LOG_TRACE(TAG, "== enter =>");
+#define TRACE_LEAVE() MOAT_LOG_TRACE(TAG, "<= leave ==");
+#define LOG_ERROR(format, ...)  MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...)  MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+
+#define FAST_HASH_ROTR(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+#define FAST_HASH_ROTL(x, n)  (((x) << (n)) | ((x) >> (32 - (n))))
+#define FAST_HASH_SHA256_BSIG0(x)  (FAST_HASH_ROTR(x, 2) ^ FAST_HASH_ROTR(x, 13) ^ FAST_HASH_ROTR(x, 22))
+#define FAST_HASH_SHA256_BSIG1(x)  (FAST_HASH_ROTR(x, 6) ^ FAST_HASH_ROTR(x, 11) ^ FAST_HASH_ROTR(x, 25))
+#define FAST_HASH_SHA256_SSIG0(x)  (FAST_HASH_ROTR(x, 7) ^ FAST_HASH_ROTR(x, 18) ^ ((x) >> 3))
+#define FAST_HASH_SHA256_SSIG1(x)  (FAST_HASH_ROTR(x, 17) ^ FAST_HASH_ROTR(x, 19) ^ ((x) >> 10))
+
+typedef void (*FastHash_BlockProc)(sse_uint32 *io_state, const sse_byte *in_data, sse_size in_blocks);
+
+typedef struct FastHashBackend_ FastHashBackend;
+struct FastHashBackend_ {
+  const sse_char *fName;
+  sse_bool (*fIsSupported)(void);
+  FastHash_BlockProc fSha256Blocks;
+  FastHash_BlockProc fSha1Blocks;
+};
+
+enum FastHashTestState_ {
+  FAST_HASH_TEST_UNKNOWN,
+  FAST_HASH_TEST_PASSED,
+  FAST_HASH_TEST_FAILED
+};
+
+static const sse_uint32 FastHash_Sha256K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const sse_uint32 FastHash_Sha256H0[SHA256_MD_WORDS] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const sse_uint32 FastHash_Sha1H0[SHA1_MD_WORDS] = {
+  0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+static sse_uint32
+FastHash_LoadBE32(const sse_byte *in_p)
+{
+  return ((sse_uint32)in_p[0] << 24) | ((sse_uint32)in_p[1] << 16) | ((sse_uint32)in_p[2] << 8) | (sse_uint32)in_p[3];
+}
+
+static void
+FastHash_StoreBE32(sse_byte *out_p, sse_uint32 in_v)
+{
+  out_p[0] = (sse_byte)(in_v >> 24);
+  out_p[1] = (sse_byte)(in_v >> 16);
+  out_p[2] = (sse_byte)(in_v >> 8);
+  out_p[3] = (sse_byte)in_v;
+}
+
+/* portable back end */
+
+static sse_bool
+FastHash_IsPortableSupported(void)
+{
+  return sse_true;
+}
+
+static void
+FastHash_Sha256BlocksPortable(sse_uint32 *io_state, const sse_byte *in_data, sse_size in_blocks)
+{
+  sse_uint32 w[64];
+  sse_uint32 a, b, c, d, e, f, g, h, t1, t2;
+  sse_int i;
+
+  while (in_blocks-- > 0) {
+    for (i = 0; i < 16; i++) {
+      w[i] = FastHash_LoadBE32(in_data + i * 4);
+    }
+    for (i = 16; i < 64; i++) {
+      w[i] = FAST_HASH_SHA256_SSIG1(w[i - 2]) + w[i - 7] + FAST_HASH_SHA256_SSIG0(w[i - 15]) + w[i - 16];
+    }
+    a = io_state[0];
+    b = io_state[1];
+    c = io_state[2];
+    d = io_state[3];
+    e = io_state[4];
+    f = io_state[5];
+    g = io_state[6];
+    h = io_state[7];
+    for (i = 0; i < 64; i++) {
+      t1 = h + FAST_HASH_SHA256_BSIG1(e) + ((e & f) ^ (~e & g)) + FastHash_Sha256K[i] + w[i];
+      t2 = FAST_HASH_SHA256_BSIG0(a) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    io_state[0] += a;
+    io_state[1] += b;
+    io_state[2] += c;
+    io_state[3] += d;
+    io_state[4] += e;
+    io_state[5] += f;
+    io_state[6] += g;
+    io_state[7] += h;
+    in_data += FAST_HASH_BLOCK_BYTES;
+  }
+}
+
+static void
+FastHash_Sha1BlocksPortable(sse_uint32 *io_state, const sse_byte *in_data, sse_size in_blocks)
+{
+  sse_uint32 w[80];
+  sse_uint32 a, b, c, d, e, f, k, t;
+  sse_int i;
+
+  while (in_blocks-- > 0) {
+    for (i = 0; i < 16; i++) {
+      w[i] = FastHash_LoadBE32(in_data + i * 4);
+    }
+    for (i = 16; i < 80; i++) {
+      t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+      w[i] = FAST_HASH_ROTL(t, 1);
+    }
+    a = io_state[0];
+    b = io_state[1];
+    c = io_state[2];
+    d = io_state[3];
+    e = io_state[4];
+    for (i = 0; i < 80; i++) {
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+      t = FAST_HASH_ROTL(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = FAST_HASH_ROTL(b, 30);
+      b = a;
+      a = t;
+    }
+    io_state[0] += a;
+    io_state[1] += b;
+    io_state[2] += c;
+    io_state[3] += d;
+    io_state[4] += e;
+    in_data += FAST_HASH_BLOCK_BYTES;
+  }
+}
+
+#if defined(FAST_HASH_X86)
+/* x86 SHA extensions */
+
+static sse_bool
+FastHash_IsX86ShaSupported(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) {
+    return sse_false;
+  }
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    return sse_false;
+  }
+  /* CPUID.(EAX=7,ECX=0):EBX.SHA[bit 29] */
+  return (ebx & (1U << 29)) ? sse_true : sse_false;
+}
+
+__attribute__((target("sha,sse4.1")))
+static void
+FastHash_Sha256BlocksX86(sse_uint32 *io_state, const sse_byte *in_data, sse_size in_blocks)
+{
+  const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i state0, state1, tmp, msg, abef, cdgh;
+  __m128i w[4];
+  sse_int i;
+
+  /* the rounds work on ABEF and CDGH */
+  tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&io_state[0]), 0xb1);
+  state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&io_state[4]), 0x1b);
+  state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+  while (in_blocks-- > 0) {
+    abef = state0;
+    cdgh = state1;
+    for (i = 0; i < 16; i++) {
+      if (i < 4) {
+        w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in_data + i * 16)), mask);
+      } else {
+        tmp = _mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]), _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+        w[i & 3] = _mm_sha256msg2_epu32(tmp, w[(i + 3) & 3]);
+      }
+      msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *)&FastHash_Sha256K[i * 4]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+    in_data += FAST_HASH_BLOCK_BYTES;
+  }
+  tmp = _mm_shuffle_epi32(state0, 0x1b);
+  state1 = _mm_shuffle_epi32(state1, 0xb1);
+  state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+  state1 = _mm_alignr_epi8(state1, tmp, 8);
+  _mm_storeu_si128((__m128i *)&io_state[0], state0);
+  _mm_storeu_si128((__m128i *)&io_state[4], state1);
+}
+
+/*
+ * Four rounds of group g. The round function has to be an immediate, so
+ * the groups are unrolled. m[] holds the schedule of the groups g to g+3.
+ */
+#define FAST_HASH_SHA1_X86_GROUP(g)                                          \
+  do {                                                                      \
+    if ((g) == 0) {                                                         \
+      e[0] = _mm_add_epi32(e[0], m[0]);                                     \
+    } else {                                                                \
+      e[(g) & 1] = _mm_sha1nexte_epu32(e[(g) & 1], m[(g) & 3]);             \
+    }                                                                       \
+    e[((g) + 1) & 1] = abcd;                                                \
+    if ((g) >= 3 && (g) <= 18) {                                            \
+      m[((g) + 1) & 3] = _mm_sha1msg2_epu32(m[((g) + 1) & 3], m[(g) & 3]);  \
+    }                                                                       \
+    abcd = _mm_sha1rnds4_epu32(abcd, e[(g) & 1], (g) / 5);                  \
+    if ((g) >= 1 && (g) <= 16) {                                            \
+      m[((g) + 3) & 3] = _mm_sha1msg1_epu32(m[((g) + 3) & 3], m[(g) & 3]);  \
+    }                                                                       \
+    if ((g) >= 2 && (g) <= 17) {                                            \
+      m[((g) + 2) & 3] = _mm_xor_si128(m[((g) + 2) & 3], m[(g) & 3]);       \
+    }                                                                       \
+  } while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void
+FastHash_Sha1BlocksX86(sse_uint32 *io_state, const sse_byte *in_data, sse_size in_blocks)
+{
+  const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd, abcd_save, e_save;
+  __m128i e[2];
+  __m128i m[4];
+  sse_int i;
+
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)io_state), 0x1b);
+  e[0] = _mm_set_epi32((int)io_state[4], 0, 0, 0);
+  while (in_blocks-- > 0) {
+    abcd_save = abcd;
+    e_save = e[0];
+    for (i = 0; i < 4; i++) {
+      m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in_data + i * 16)), mask);
+    }
+    FAST_HASH_SHA1_X86_GROUP(0);
+    FAST_HASH_SHA1_X86_GROUP(1);
+    FAST_HASH_SHA1_X86_GROUP(2);
+    FAST_HASH_SHA1_X86_GROUP(3);
+    FAST_HASH_SHA1_X86_GROUP(4);
+    FAST_HASH_SHA1_X86_GROUP(5);
+    FAST_HASH_SHA1_X86_GROUP(6);
+    FAST_HASH_SHA1_X86_GROUP(7);
+    FAST_HASH_SHA1_X86_GROUP(8);
+    FAST_HASH_SHA1_X86_GROUP(9);
+    FAST_HASH_SHA1_X86_GROUP(10);
+    FAST_HASH_SHA1_X86_GROUP(11);
+    FAST_HASH_SHA1_X86_GROUP(12);
+    FAST_HASH_SHA1_X86_GROUP(13);
+    FAST_HASH_SHA1_X86_GROUP(14);
+    FAST_HASH_SHA1_X86_GROUP(15);
+    FAST_HASH_SHA1_X86_GROUP(16);
+    FAST_HASH_SHA1_X86_GROUP(17);
+    FAST_HASH_SHA1_X86_GROUP(18);
+    FAST_HASH_SHA1_X86_GROUP(19);
+    e[0] = _mm_sha1nexte_epu32(e[0], e_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+    in_data += FAST_HASH_BLOCK_BYTES;
+  }
+  abcd = _mm_shuffle_epi32(abcd, 0x1b);
+  _mm_storeu_si128((__m128i *)io_state, abcd);
+  io_state[4] = (sse_uint32)_mm_extract_epi32(e[0], 3);
+}
+#endif /* FAST_HASH_X86 */
+
+#if defined(FAST_HASH_ARMV8)
+/* ARMv8 cryptographic extension */
+
+static sse_bool
+FastHash_IsArmv8CeSupported(void)
+{
+  unsigned long hwcap = getauxval(AT_HWCAP);
+
+  return ((hwcap & HWCAP_SHA1) && (hwcap & HWCAP_SHA2)) ? sse_true : sse_false;
+}
+
+__attribute__((target("+crypto")))
+static void
+FastHash_Sha256BlocksArmv8(sse_uint32 *io_state, const sse_byte *in_data, sse_size in_blocks)
+{
+  uint32x4_t state0, state1, abcd_save, efgh_save, wk, tmp;
+  uint32x4_t w[4];
+  sse_int i;
+
+  state0 = vld1q_u32(&io_state[0]);
+  state1 = vld1q_u32(&io_state[4]);
+  while (in_blocks-- > 0) {
+    abcd_save = state0;
+    efgh_save = state1;
+    for (i = 0; i < 4; i++) {
+      w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(in_data + i * 16)));
+    }
+    for (i = 0; i < 16; i++) {
+      wk = vaddq_u32(w[i & 3], vld1q_u32(&FastHash_Sha256K[i * 4]));
+      if (i < 12) {
+        w[i & 3] = vsha256su1q_u32(vsha256su0q_u32(w[i & 3], w[(i + 1) & 3]), w[(i + 2) & 3], w[(i + 3) & 3]);
+      }
+      tmp = state0;
+      state0 = vsha256hq_u32(state0, state1, wk);
+      state1 = vsha256h2q_u32(state1, tmp, wk);
+    }
+    state0 = vaddq_u32(state0, abcd_save);
+    state1 = vaddq_u32(state1, efgh_save);
+    in_data += FAST_HASH_BLOCK_BYTES;
+  }
+  vst1q_u32(&io_state[0], state0);
+  vst1q_u32(&io_state[4], state1);
+}
+
+__attribute__((target("+crypto")))
+static void
+FastHash_Sha1BlocksArmv8(sse_uint32 *io_state, const sse_byte *in_data, sse_size in_blocks)
+{
+  static const sse_uint32 k[4] = { 0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6 };
+  uint32x4_t abcd, abcd_save, wk;
+  uint32x4_t w[4];
+  uint32_t e, e_save, e_next;
+  sse_int i;
+
+  abcd = vld1q_u32(io_state);
+  e = io_state[4];
+  while (in_blocks-- > 0) {
+    abcd_save = abcd;
+    e_save = e;
+    for (i = 0; i < 4; i++) {
+      w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(in_data + i * 16)));
+    }
+    for (i = 0; i < 20; i++) {
+      wk = vaddq_u32(w[i & 3], vdupq_n_u32(k[i / 5]));
+      if (i < 16) {
+        w[i & 3] = vsha1su1q_u32(vsha1su0q_u32(w[i & 3], w[(i + 1) & 3], w[(i + 2) & 3]), w[(i + 3) & 3]);
+      }
+      e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+      if (i < 5) {
+        abcd = vsha1cq_u32(abcd, e, wk);
+      } else if (i < 10 || i >= 15) {
+        abcd = vsha1pq_u32(abcd, e, wk);
+      } else {
+        abcd = vsha1mq_u32(abcd, e, wk);
+      }
+      e = e_next;
+    }
+    abcd = vaddq_u32(abcd, abcd_save);
+    e += e_save;
+    in_data += FAST_HASH_BLOCK_BYTES;
+  }
+  vst1q_u32(io_state, abcd);
+  io_state[4] = e;
+}
+#endif /* FAST_HASH_ARMV8 */
+
+/*
+ * Multi-buffer SHA-256. Eight independent streams run in the lanes of
+ * vectors of the GCC vector extension, so the same code becomes AVX2,
+ * SSE2 or NEON instructions depending on the target it is inlined into.
+ */
+#define FAST_HASH_MB_KERNEL_LANES  (8)
+
+typedef sse_uint32 FastHashLanes __attribute__((vector_size(4 * FAST_HASH_MB_KERNEL_LANES)));
+
+typedef void (*FastHash_MbBlockProc)(sse_uint32 **io_states, const sse_byte **in_data, sse_size in_blocks);
+
+typedef struct FastHashMbKernel_ FastHashMbKernel;
+struct FastHashMbKernel_ {
+  const sse_char *fName;
+  sse_bool (*fIsSupported)(void);
+  FastHash_MbBlockProc fSha256Blocks; /* NULL for one stream after another */
+};
+
+static inline __attribute__((always_inline)) void
+FastHash_Sha256BlocksLanes(sse_uint32 **io_states, const sse_byte **in_data, sse_size in_blocks)
+{
+  FastHashLanes s[SHA256_MD_WORDS];
+  FastHashLanes w[16];
+  FastHashLanes a, b, c, d, e, f, g, h, t1, t2;
+  sse_size off;
+  sse_int i, j;
+
+  for (i = 0; i < SHA256_MD_WORDS; i++) {
+    for (j = 0; j < FAST_HASH_MB_KERNEL_LANES; j++) {
+      s[i][j] = io_states[j][i];
+    }
+  }
+  for (off = 0; off < in_blocks * FAST_HASH_BLOCK_BYTES; off += FAST_HASH_BLOCK_BYTES) {
+    a = s[0];
+    b = s[1];
+    c = s[2];
+    d = s[3];
+    e = s[4];
+    f = s[5];
+    g = s[6];
+    h = s[7];
+    for (i = 0; i < 64; i++) {
+      if (i < 16) {
+        for (j = 0; j < FAST_HASH_MB_KERNEL_LANES; j++) {
+          w[i][j] = FastHash_LoadBE32(in_data[j] + off + i * 4);
+        }
+      } else {
+        w[i & 15] += FAST_HASH_SHA256_SSIG1(w[(i - 2) & 15]) + w[(i - 7) & 15] + FAST_HASH_SHA256_SSIG0(w[(i - 15) & 15]);
+      }
+      t1 = h + FAST_HASH_SHA256_BSIG1(e) + ((e & f) ^ (~e & g)) + FastHash_Sha256K[i] + w[i & 15];
+      t2 = FAST_HASH_SHA256_BSIG0(a) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    s[0] += a;
+    s[1] += b;
+    s[2] += c;
+    s[3] += d;
+    s[4] += e;
+    s[5] += f;
+    s[6] += g;
+    s[7] += h;
+  }
+  for (i = 0; i < SHA256_MD_WORDS; i++) {
+    for (j = 0; j < FAST_HASH_MB_KERNEL_LANES; j++) {
+      io_states[j][i] = s[i][j];
+    }
+  }
+}
+
+#if defined(FAST_HASH_X86)
+static sse_bool
+FastHash_IsAvx2Supported(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") ? sse_true : sse_false;
+}
+
+static sse_bool
+FastHash_IsSse2Supported(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2") ? sse_true : sse_false;
+}
+
+__attribute__((target("avx2")))
+static void
+FastHash_Sha256BlocksAvx2(sse_uint32 **io_states, const sse_byte **in_data, sse_size in_blocks)
+{
+  FastHash_Sha256BlocksLanes(io_states, in_data, in_blocks);
+}
+
+__attribute__((target("sse2")))
+static void
+FastHash_Sha256BlocksSse2(sse_uint32 **io_states, const sse_byte **in_data, sse_size in_blocks)
+{
+  FastHash_Sha256BlocksLanes(io_states, in_data, in_blocks);
+}
+#endif /* FAST_HASH_X86 */
+
+#if defined(FAST_HASH_NEON)
+static void
+FastHash_Sha256BlocksNeon(sse_uint32 **io_states, const sse_byte **in_data, sse_size in_blocks)
+{
+  FastHash_Sha256BlocksLanes(io_states, in_data, in_blocks);
+}
+#endif /* FAST_HASH_NEON */
+
+/* fastest first, the portable one has to be the last */
+static const FastHashBackend FastHash_Backends[] = {
+#if defined(FAST_HASH_X86)
+  { "x86-sha", FastHash_IsX86ShaSupported, FastHash_Sha256BlocksX86, FastHash_Sha1BlocksX86 },
+#endif
+#if defined(FAST_HASH_ARMV8)
+  { "armv8-ce", FastHash_IsArmv8CeSupported, FastHash_Sha256BlocksArmv8, FastHash_Sha1BlocksArmv8 },
+#endif
+  { "portable", FastHash_IsPortableSupported, FastHash_Sha256BlocksPortable, FastHash_Sha1BlocksPortable }
+};
+
+#define FAST_HASH_BACKEND_COUNT  ((sse_int)(sizeof(FastHash_Backends) / sizeof(FastHash_Backends[0])))
+
+static sse_int FastHash_TestStates[FAST_HASH_BACKEND_COUNT];
+static sse_int FastHash_Selected = FAST_HASH_BACKEND_AUTO;
+
+/* fastest first, one stream after another has to be the last */
+static const FastHashMbKernel FastHash_MbKernels[] = {
+#if defined(FAST_HASH_X86)
+  { "avx2", FastHash_IsAvx2Supported, FastHash_Sha256BlocksAvx2 },
+  { "sse2", FastHash_IsSse2Supported, FastHash_Sha256BlocksSse2 },
+#endif
+#if defined(FAST_HASH_NEON)
+  { "neon", FastHash_IsPortableSupported, FastHash_Sha256BlocksNeon },
+#endif
+  { "serial", FastHash_IsPortableSupported, NULL }
+};
+
+#define FAST_HASH_MB_KERNEL_COUNT  ((sse_int)(sizeof(FastHash_MbKernels) / sizeof(FastHash_MbKernels[0])))
+
+static sse_int FastHash_MbTestStates[FAST_HASH_MB_KERNEL_COUNT];
+static sse_int FastHash_MbSelected = FAST_HASH_BACKEND_AUTO;
+
+/* streaming over the block functions, the same for both digests */
+
+static void
+FastHash_Update(FastHash_BlockProc in_proc, sse_uint32 *io_state, sse_uint64 *io_length, sse_byte *io_block,
+    sse_uint32 *io_block_len, const sse_byte *in_data, sse_size in_len)
+{
+  sse_size len;
+
+  *io_length += in_len;
+  if (*io_block_len > 0) {
+    len = SSE_MIN((sse_size)(FAST_HASH_BLOCK_BYTES - *io_block_len), in_len);
+    memcpy(io_block + *io_block_len, in_data, len);
+    *io_block_len += (sse_uint32)len;
+    in_data += len;
+    in_len -= len;
+    if (*io_block_len < FAST_HASH_BLOCK_BYTES) {
+      return;
+    }
+    (*in_proc)(io_state, io_block, 1);
+    *io_block_len = 0;
+  }
+  if (in_len >= FAST_HASH_BLOCK_BYTES) {
+    (*in_proc)(io_state, in_data, in_len / FAST_HASH_BLOCK_BYTES);
+    in_data += in_len - in_len % FAST_HASH_BLOCK_BYTES;
+    in_len %= FAST_HASH_BLOCK_BYTES;
+  }
+  if (in_len > 0) {
+    memcpy(io_block, in_data, in_len);
+    *io_block_len = (sse_uint32)in_len;
+  }
+}
+
+static void
+FastHash_Final(FastHash_BlockProc in_proc, sse_uint32 *io_state, sse_uint in_words, sse_uint64 in_length,
+    sse_byte *io_block, sse_uint32 in_block_len, sse_byte *out_md)
+{
+  sse_uint64 bits = in_length * 8;
+  sse_uint i;
+
+  io_block[in_block_len++] = 0x80;
+  if (in_block_len > FAST_HASH_BLOCK_BYTES - 8) {
+    memset(io_block + in_block_len, 0, FAST_HASH_BLOCK_BYTES - in_block_len);
+    (*in_proc)(io_state, io_block, 1);
+    in_block_len = 0;
+  }
+  memset(io_block + in_block_len, 0, FAST_HASH_BLOCK_BYTES - 8 - in_block_len);
+  FastHash_StoreBE32(io_block + FAST_HASH_BLOCK_BYTES - 8, (sse_uint32)(bits >> 32));
+  FastHash_StoreBE32(io_block + FAST_HASH_BLOCK_BYTES - 4, (sse_uint32)bits);
+  (*in_proc)(io_state, io_block, 1);
+  for (i = 0; i < in_words; i++) {
+    FastHash_StoreBE32(out_md + i * 4, io_state[i]);
+  }
+}
+
+static const FastHashBackend *
+FastHash_GetBackend(void)
+{
+  if (FastHash_Selected == FAST_HASH_BACKEND_AUTO) {
+    FastHash_SelectBackend(FAST_HASH_BACKEND_AUTO);
+  }
+  return &FastHash_Backends[FastHash_Selected];
+}
+
+static void
+FastHash_Sha256UpdateWith(const FastHashBackend *in_backend, FastHashSha256Context *in_ctx, const sse_byte *in_data, sse_size in_len)
+{
+  FastHash_Update(in_backend->fSha256Blocks, in_ctx->fState, &in_ctx->fLength, in_ctx->fBlock, &in_ctx->fBlockLen, in_data, in_len);
+}
+
+static void
+FastHash_Sha256FinalWith(const FastHashBackend *in_backend, FastHashSha256Context *in_ctx, sse_byte *out_md)
+{
+  FastHash_Final(in_backend->fSha256Blocks, in_ctx->fState, SHA256_MD_WORDS, in_ctx->fLength, in_ctx->fBlock, in_ctx->fBlockLen, out_md);
+}
+
+static void
+FastHash_Sha1UpdateWith(const FastHashBackend *in_backend, FastHashSha1Context *in_ctx, const sse_byte *in_data, sse_size in_len)
+{
+  FastHash_Update(in_backend->fSha1Blocks, in_ctx->fState, &in_ctx->fLength, in_ctx->fBlock, &in_ctx->fBlockLen, in_data, in_len);
+}
+
+static void
+FastHash_Sha1FinalWith(const FastHashBackend *in_backend, FastHashSha1Context *in_ctx, sse_byte *out_md)
+{
+  FastHash_Final(in_backend->fSha1Blocks, in_ctx->fState, SHA1_MD_WORDS, in_ctx->fLength, in_ctx->fBlock, in_ctx->fBlockLen, out_md);
+}
+
+void
+FastHash_Sha256Init(FastHashSha256Context *in_ctx)
+{
+  memcpy(in_ctx->fState, FastHash_Sha256H0, sizeof(in_ctx->fState));
+  in_ctx->fLength = 0;
+  in_ctx->fBlockLen = 0;
+}
+
+void
+FastHash_Sha256Update(FastHashSha256Context *in_ctx, const sse_byte *in_data, sse_size in_len)
+{
+  FastHash_Sha256UpdateWith(FastHash_GetBackend(), in_ctx, in_data, in_len);
+}
+
+void
+FastHash_Sha256Final(FastHashSha256Context *in_ctx, sse_byte *out_md)
+{
+  FastHash_Sha256FinalWith(FastHash_GetBackend(), in_ctx, out_md);
+}
+
+void
+FastHash_Sha256(const sse_byte *in_data, sse_size in_len, sse_byte *out_md)
+{
+  FastHashSha256Context ctx;
+
+  FastHash_Sha256Init(&ctx);
+  FastHash_Sha256Update(&ctx, in_data, in_len);
+  FastHash_Sha256Final(&ctx, out_md);
+}
+
+void
+FastHash_Sha1Init(FastHashSha1Context *in_ctx)
+{
+  memcpy(in_ctx->fState, FastHash_Sha1H0, sizeof(in_ctx->fState));
+  in_ctx->fLength = 0;
+  in_ctx->fBlockLen = 0;
+}
+
+void
+FastHash_Sha1Update(FastHashSha1Context *in_ctx, const sse_byte *in_data, sse_size in_len)
+{
+  FastHash_Sha1UpdateWith(FastHash_GetBackend(), in_ctx, in_data, in_len);
+}
+
+void
+FastHash_Sha1Final(FastHashSha1Context *in_ctx, sse_byte *out_md)
+{
+  FastHash_Sha1FinalWith(FastHash_GetBackend(), in_ctx, out_md);
+}
+
+void
+FastHash_Sha1(const sse_byte *in_data, sse_size in_len, sse_byte *out_md)
+{
+  FastHashSha1Context ctx;
+
+  FastHash_Sha1Init(&ctx);
+  FastHash_Sha1Update(&ctx, in_data, in_len);
+  FastHash_Sha1Final(&ctx, out_md);
+}
+
+static const FastHashMbKernel *
+FastHash_GetMbKernel(void)
+{
+  if (FastHash_MbSelected == FAST_HASH_BACKEND_AUTO) {
+    FastHash_SelectMbKernel(FAST_HASH_BACKEND_AUTO);
+  }
+  return &FastHash_MbKernels[FastHash_MbSelected];
+}
+
+/*
+ * Full blocks which all lanes with data have in common go through the
+ * kernel, lanes without a partner and partial blocks through the single
+ * stream back end.
+ */
+static void
+FastHash_Sha256MbUpdateWith(const FastHashMbKernel *in_kernel, const FastHashBackend *in_backend, FastHashSha256MbContext *in_ctx,
+    const sse_byte *const *in_data, const sse_size *in_lens)
+{
+  FastHashSha256Context *lane;
+  sse_uint32 pad_state[SHA256_MD_WORDS];
+  sse_uint32 *states[FAST_HASH_MB_KERNEL_LANES];
+  const sse_byte *kernel_data[FAST_HASH_MB_KERNEL_LANES];
+  const sse_byte *data[FAST_HASH_MB_MAX_LANES];
+  sse_size lens[FAST_HASH_MB_MAX_LANES];
+  sse_uint active[FAST_HASH_MB_MAX_LANES];
+  sse_uint count;
+  sse_uint i;
+  sse_size blocks;
+  sse_size len;
+
+  for (i = 0; i < in_ctx->fLanes; i++) {
+    lane = &in_ctx->fLaneContexts[i];
+    data[i] = in_data[i];
+    lens[i] = (in_data[i] == NULL) ? 0 : in_lens[i];
+    if (lane->fBlockLen > 0 && lens[i] > 0) {
+      len = SSE_MIN((sse_size)(FAST_HASH_BLOCK_BYTES - lane->fBlockLen), lens[i]);
+      FastHash_Sha256UpdateWith(in_backend, lane, data[i], len);
+      data[i] += len;
+      lens[i] -= len;
+    }
+    lane->fLength += lens[i];
+  }
+  for (;;) {
+    count = 0;
+    blocks = 0;
+    for (i = 0; i < in_ctx->fLanes; i++) {
+      if (lens[i] >= FAST_HASH_BLOCK_BYTES) {
+        blocks = (count == 0) ? lens[i] / FAST_HASH_BLOCK_BYTES : SSE_MIN(blocks, lens[i] / FAST_HASH_BLOCK_BYTES);
+        active[count++] = i;
+      }
+    }
+    if (count == 0) {
+      break;
+    }
+    if (in_kernel->fSha256Blocks == NULL || count == 1) {
+      for (i = 0; i < count; i++) {
+        blocks = lens[active[i]] / FAST_HASH_BLOCK_BYTES;
+        (*in_backend->fSha256Blocks)(in_ctx->fLaneContexts[active[i]].fState, data[active[i]], blocks);
+        data[active[i]] += blocks * FAST_HASH_BLOCK_BYTES;
+        lens[active[i]] -= blocks * FAST_HASH_BLOCK_BYTES;
+      }
+      break;
+    }
+    /* idle lanes hash the data of the first one into a scratch state */
+    for (i = 0; i < FAST_HASH_MB_KERNEL_LANES; i++) {
+      states[i] = (i < count) ? in_ctx->fLaneContexts[active[i]].fState : pad_state;
+      kernel_data[i] = data[active[(i < count) ? i : 0]];
+    }
+    (*in_kernel->fSha256Blocks)(states, kernel_data, blocks);
+    for (i = 0; i < count; i++) {
+      data[active[i]] += blocks * FAST_HASH_BLOCK_BYTES;
+      lens[active[i]] -= blocks * FAST_HASH_BLOCK_BYTES;
+    }
+  }
+  for (i = 0; i < in_ctx->fLanes; i++) {
+    if (lens[i] > 0) {
+      memcpy(in_ctx->fLaneContexts[i].fBlock, data[i], lens[i]);
+      in_ctx->fLaneContexts[i].fBlockLen = (sse_uint32)lens[i];
+    }
+  }
+}
+
+void
+FastHash_Sha256MbInit(FastHashSha256MbContext *in_ctx, sse_uint in_lanes)
+{
+  sse_uint i;
+
+  in_ctx->fLanes = SSE_MIN(in_lanes, FAST_HASH_MB_MAX_LANES);
+  for (i = 0; i < in_ctx->fLanes; i++) {
+    FastHash_Sha256Init(&in_ctx->fLaneContexts[i]);
+  }
+}
+
+/*
+ * in_data and in_lens have one element per lane. A NULL buffer leaves the
+ * lane as it is.
+ */
+void
+FastHash_Sha256MbUpdate(FastHashSha256MbContext *in_ctx, const sse_byte *const *in_data, const sse_size *in_lens)
+{
+  FastHash_Sha256MbUpdateWith(FastHash_GetMbKernel(), FastHash_GetBackend(), in_ctx, in_data, in_lens);
+}
+
+void
+FastHash_Sha256MbFinal(FastHashSha256MbContext *in_ctx, sse_uint in_lane, sse_byte *out_md)
+{
+  FastHash_Sha256Final(&in_ctx->fLaneContexts[in_lane], out_md);
+}
+
+/* known answer tests */
+
+typedef struct FastHashVector_ FastHashVector;
+struct FastHashVector_ {
+  const sse_char *fMessage;
+  sse_uint fRepeat;
+  const sse_char *fSha256;
+  const sse_char *fSha1;
+};
+
+/* FIPS 180-2 and the NIST examples, the last one a million times 'a' */
+static const FastHashVector FastHash_Vectors[] = {
+  { "", 1,
+    "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+    "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+  { "abc", 1,
+    "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+    "a9993e364706816aba3e25717850c26c9cd0d89d" },
+  { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+    "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+    "84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+  { "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu", 1,
+    "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1",
+    "a49b2446a02c645bf419f995b67091253a04a259" },
+  { "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 10000,
+    "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0",
+    "34aa973cd4c4daa4f61eeb2bdbad27316534016f" }
+};
+
+static sse_bool
+FastHash_IsDigest(const sse_byte *in_md, const sse_char *in_hex, sse_uint in_len)
+{
+  sse_char hex[SHA256_MD_BYTES * 2 + 1];
+  sse_uint i;
+
+  for (i = 0; i < in_len; i++) {
+    snprintf(hex + i * 2, 3, "%02x", in_md[i]);
+  }
+  return (memcmp(hex, in_hex, in_len * 2) == 0) ? sse_true : sse_false;
+}
+
+/*
+ * Runs the vectors through a back end, each in one piece and in odd sized
+ * pieces, so that both the block and the buffering paths are covered.
+ */
+static sse_bool
+FastHash_TestBackend(const FastHashBackend *in_backend)
+{
+  FastHashSha256Context sha256;
+  FastHashSha1Context sha1;
+  sse_byte md[SHA256_MD_BYTES];
+  const FastHashVector *v;
+  const sse_byte *p;
+  sse_size len;
+  sse_size step;
+  sse_size off;
+  sse_uint i;
+  sse_uint r;
+  sse_uint pass;
+
+  for (i = 0; i < sizeof(FastHash_Vectors) / sizeof(FastHash_Vectors[0]); i++) {
+    v = &FastHash_Vectors[i];
+    p = (const sse_byte *)v->fMessage;
+    len = strlen(v->fMessage);
+    for (pass = 0; pass < 2; pass++) {
+      step = (pass == 0) ? len : 7;
+      FastHash_Sha256Init(&sha256);
+      FastHash_Sha1Init(&sha1);
+      for (r = 0; r < v->fRepeat; r++) {
+        for (off = 0; off < len; off += step) {
+          FastHash_Sha256UpdateWith(in_backend, &sha256, p + off, SSE_MIN(step, len - off));
+          FastHash_Sha1UpdateWith(in_backend, &sha1, p + off, SSE_MIN(step, len - off));
+        }
+      }
+      FastHash_Sha256FinalWith(in_backend, &sha256, md);
+      if (!FastHash_IsDigest(md, v->fSha256, SHA256_MD_BYTES)) {
+        LOG_ERROR("SHA-256 of vector %u failed on %s.", i, in_backend->fName);
+        return sse_false;
+      }
+      FastHash_Sha1FinalWith(in_backend, &sha1, md);
+      if (!FastHash_IsDigest(md, v->fSha1, SHA1_MD_BYTES)) {
+        LOG_ERROR("SHA-1 of vector %u failed on %s.", i, in_backend->fName);
+        return sse_false;
+      }
+    }
+  }
+  return sse_true;
+}
+
+/*
+ * Runs the vectors in lanes of their own, each fed in pieces of its own
+ * size so that the lanes run out at different times, and checks lanes of
+ * several blocks against the single stream back end.
+ */
+static sse_bool
+FastHash_TestMbKernel(const FastHashMbKernel *in_kernel, const FastHashBackend *in_backend)
+{
+  static sse_byte buf[4096];
+  FastHashSha256MbContext ctx;
+  FastHashSha256Context sha256;
+  sse_byte md[SHA256_MD_BYTES];
+  sse_byte expected[SHA256_MD_BYTES];
+  const sse_byte *data[FAST_HASH_MB_MAX_LANES];
+  sse_size lens[FAST_HASH_MB_MAX_LANES];
+  sse_size offs[FAST_HASH_MB_MAX_LANES];
+  sse_uint rounds[FAST_HASH_MB_MAX_LANES];
+  const FastHashVector *v;
+  sse_size len;
+  sse_bool fed;
+  sse_uint n = sizeof(FastHash_Vectors) / sizeof(FastHash_Vectors[0]);
+  sse_uint i;
+
+  FastHash_Sha256MbInit(&ctx, FAST_HASH_MB_MAX_LANES);
+  for (i = 0; i < FAST_HASH_MB_MAX_LANES; i++) {
+    offs[i] = 0;
+    rounds[i] = 0;
+  }
+  do {
+    fed = sse_false;
+    for (i = 0; i < FAST_HASH_MB_MAX_LANES; i++) {
+      v = &FastHash_Vectors[i % n];
+      len = strlen(v->fMessage);
+      data[i] = NULL;
+      lens[i] = 0;
+      if (rounds[i] >= v->fRepeat || len == 0) {
+        continue;
+      }
+      data[i] = (const sse_byte *)v->fMessage + offs[i];
+      lens[i] = SSE_MIN((sse_size)(i * 13 + 1), len - offs[i]);
+      offs[i] += lens[i];
+      if (offs[i] == len) {
+        offs[i] = 0;
+        rounds[i]++;
+      }
+      fed = sse_true;
+    }
+    FastHash_Sha256MbUpdateWith(in_kernel, in_backend, &ctx, data, lens);
+  } while (fed);
+  for (i = 0; i < FAST_HASH_MB_MAX_LANES; i++) {
+    FastHash_Sha256FinalWith(in_backend, &ctx.fLaneContexts[i], md);
+    if (!FastHash_IsDigest(md, FastHash_Vectors[i % n].fSha256, SHA256_MD_BYTES)) {
+      LOG_ERROR("SHA-256 of vector %u failed on %s.", i % n, in_kernel->fName);
+      return sse_false;
+    }
+  }
+
+  for (i = 0; i < sizeof(buf); i++) {
+    buf[i] = (sse_byte)(i * 131 + 7);
+  }
+  FastHash_Sha256MbInit(&ctx, FAST_HASH_MB_MAX_LANES);
+  for (i = 0; i < FAST_HASH_MB_MAX_LANES; i++) {
+    data[i] = buf + i;
+    lens[i] = sizeof(buf) - i * 389;
+  }
+  FastHash_Sha256MbUpdateWith(in_kernel, in_backend, &ctx, data, lens);
+  for (i = 0; i < FAST_HASH_MB_MAX_LANES; i++) {
+    FastHash_Sha256Init(&sha256);
+    FastHash_Sha256UpdateWith(in_backend, &sha256, data[i], lens[i]);
+    FastHash_Sha256FinalWith(in_backend, &sha256, expected);
+    FastHash_Sha256FinalWith(in_backend, &ctx.fLaneContexts[i], md);
+    if (memcmp(md, expected, SHA256_MD_BYTES) != 0) {
+      LOG_ERROR("SHA-256 of lane %u failed on %s.", i, in_kernel->fName);
+      return sse_false;
+    }
+  }
+  return sse_true;
+}
+
+sse_int
+FastHash_GetBackendCount(void)
+{
+  return FAST_HASH_BACKEND_COUNT;
+}
+
+const sse_char *
+FastHash_GetBackendName(sse_int in_index)
+{
+  if (in_index < 0 || in_index >= FAST_HASH_BACKEND_COUNT) {
+    return NULL;
+  }
+  return FastHash_Backends[in_index].fName;
+}
+
+/*
+ * Whether the CPU has the features of a back end and the back end has
+ * passed the known answer tests on it. The tests run once.
+ */
+sse_bool
+FastHash_IsBackendAvailable(sse_int in_index)
+{
+  const FastHashBackend *backend;
+
+  if (in_index < 0 || in_index >= FAST_HASH_BACKEND_COUNT) {
+    return sse_false;
+  }
+  backend = &FastHash_Backends[in_index];
+  if (FastHash_TestStates[in_index] == FAST_HASH_TEST_UNKNOWN) {
+    if (!(*backend->fIsSupported)()) {
+      FastHash_TestStates[in_index] = FAST_HASH_TEST_FAILED;
+    } else {
+      FastHash_TestStates[in_index] = FastHash_TestBackend(backend) ? FAST_HASH_TEST_PASSED : FAST_HASH_TEST_FAILED;
+    }
+  }
+  return (FastHash_TestStates[in_index] == FAST_HASH_TEST_PASSED) ? sse_true : sse_false;
+}
+
+/*
+ * Selects a back end, or the fastest available one with
+ * FAST_HASH_BACKEND_AUTO.
+ */
+sse_int
+FastHash_SelectBackend(sse_int in_index)
+{
+  sse_int i;
+
+  if (in_index == FAST_HASH_BACKEND_AUTO) {
+    for (i = 0; i < FAST_HASH_BACKEND_COUNT; i++) {
+      if (FastHash_IsBackendAvailable(i)) {
+        FastHash_Selected = i;
+        LOG_INFO("hashing with the %s back end.", FastHash_Backends[i].fName);
+        return SSE_E_OK;
+      }
+    }
+    LOG_ERROR("no back end has passed the known answer tests.");
+    FastHash_Selected = FAST_HASH_BACKEND_COUNT - 1;
+    return SSE_E_GENERIC;
+  }
+  if (!FastHash_IsBackendAvailable(in_index)) {
+    return SSE_E_INVAL;
+  }
+  FastHash_Selected = in_index;
+  return SSE_E_OK;
+}
+
+sse_int
+FastHash_GetSelectedBackend(void)
+{
+  if (FastHash_Selected == FAST_HASH_BACKEND_AUTO) {
+    FastHash_SelectBackend(FAST_HASH_BACKEND_AUTO);
+  }
+  return FastHash_Selected;
+}
+
+sse_int
+FastHash_GetMbKernelCount(void)
+{
+  return FAST_HASH_MB_KERNEL_COUNT;
+}
+
+const sse_char *
+FastHash_GetMbKernelName(sse_int in_index)
+{
+  if (in_index < 0 || in_index >= FAST_HASH_MB_KERNEL_COUNT) {
+    return NULL;
+  }
+  return FastHash_MbKernels[in_index].fName;
+}
+
+/*
+ * Same as FastHash_IsBackendAvailable() for the multi-buffer kernels. They
+ * are tested together with the selected back end.
+ */
+sse_bool
+FastHash_IsMbKernelAvailable(sse_int in_index)
+{
+  const FastHashMbKernel *kernel;
+
+  if (in_index < 0 || in_index >= FAST_HASH_MB_KERNEL_COUNT) {
+    return sse_false;
+  }
+  kernel = &FastHash_MbKernels[in_index];
+  if (FastHash_MbTestStates[in_index] == FAST_HASH_TEST_UNKNOWN) {
+    if (!(*kernel->fIsSupported)()) {
+      FastHash_MbTestStates[in_index] = FAST_HASH_TEST_FAILED;
+    } else {
+      FastHash_MbTestStates[in_index] = FastHash_TestMbKernel(kernel, FastHash_GetBackend()) ? FAST_HASH_TEST_PASSED : FAST_HASH_TEST_FAILED;
+    }
+  }
+  return (FastHash_MbTestStates[in_index] == FAST_HASH_TEST_PASSED) ? sse_true : sse_false;
+}
+
+/*
+ * Selects a multi-buffer kernel, or with FAST_HASH_BACKEND_AUTO the
+ * fastest available one next to the selected back end.
+ */
+sse_int
+FastHash_SelectMbKernel(sse_int in_index)
+{
+  sse_int i;
+
+  if (in_index == FAST_HASH_BACKEND_AUTO) {
+    /* one stream on SHA instructions outruns eight in SIMD lanes */
+    i = (FastHash_GetSelectedBackend() == FAST_HASH_BACKEND_COUNT - 1) ? 0 : FAST_HASH_MB_KERNEL_COUNT - 1;
+    for (; i < FAST_HASH_MB_KERNEL_COUNT; i++) {
+      if (FastHash_IsMbKernelAvailable(i)) {
+        FastHash_MbSelected = i;
+        LOG_INFO("hashing multiple buffers with the %s kernel.", FastHash_MbKernels[i].fName);
+        return SSE_E_OK;
+      }
+    }
+    FastHash_MbSelected = FAST_HASH_MB_KERNEL_COUNT - 1;
+    return SSE_E_GENERIC;
+  }
+  if (!FastHash_IsMbKernelAvailable(in_index)) {
+    return SSE_E_INVAL;
+  }
+  FastHash_MbSelected = in_index;
+  return SSE_E_OK;
+}
+
+sse_int
+FastHash_GetSelectedMbKernel(void)
+{
+  if (FastHash_MbSelected == FAST_HASH_BACKEND_AUTO) {
+    FastHash_SelectMbKernel(FAST_HASH_BACKEND_AUTO);
+  }
+  return FastHash_MbSelected;
+}
+
+/*
+ * Runs the known answer tests on every back end and multi-buffer kernel
+ * this CPU supports again. SSE_E_GENERIC when any of them fails.
+ */
+sse_int
+FastHash_SelfTest(void)
+{
+  sse_int err = SSE_E_OK;
+  sse_int i;
+
+  TRACE_ENTER();
+  for (i = 0; i < FAST_HASH_BACKEND_COUNT; i++) {
+    if (!(*FastHash_Backends[i].fIsSupported)()) {
+      LOG_DEBUG("%s: not supported.", FastHash_Backends[i].fName);
+      continue;
+    }
+    if (FastHash_TestBackend(&FastHash_Backends[i])) {
+      LOG_DEBUG("%s: passed.", FastHash_Backends[i].fName);
+      FastHash_TestStates[i] = FAST_HASH_TEST_PASSED;
+    } else {
+      FastHash_TestStates[i] = FAST_HASH_TEST_FAILED;
+      err = SSE_E_GENERIC;
+    }
+  }
+  for (i = 0; i < FAST_HASH_MB_KERNEL_COUNT; i++) {
+    if (!(*FastHash_MbKernels[i].fIsSupported)()) {
+      LOG_DEBUG("%s: not supported.", FastHash_MbKernels[i].fName);
+      continue;
+    }
+    if (FastHash_TestMbKernel(&FastHash_MbKernels[i], FastHash_GetBackend())) {
+      LOG_DEBUG("%s: passed.", FastHash_MbKernels[i].fName);
+      FastHash_MbTestStates[i] = FAST_HASH_TEST_PASSED;
+    } else {
+      FastHash_MbTestStates[i] = FAST_HASH_TEST_FAILED;
+      err = SSE_E_GENERIC;
+    }
+  }
+  TRACE_LEAVE();
+  return err;
+}
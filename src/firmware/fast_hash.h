@@ -0,0 +1,93 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#ifndef __FAST_HASH__
+#define __FAST_HASH__
+
+#include <sseutils.h>
+
+SSE_BEGIN_C_DECLS
+
+#define FAST_HASH_BLOCK_BYTES  (64)
+#define FAST_HASH_BACKEND_AUTO  (-1)
+#define FAST_HASH_MB_MAX_LANES  (8)
+
+typedef struct FastHashSha256Context_ FastHashSha256Context;
+typedef struct FastHashSha1Context_ FastHashSha1Context;
+typedef struct FastHashSha256MbContext_ FastHashSha256MbContext;
+
+/*
+ * SHA-256 and SHA-1 with the streaming interface of ssehashlib and block
+ * functions picked at run time by the features of the CPU: the SHA
+ * extensions on x86, the cryptographic extension on ARMv8 and portable C
+ * everywhere else. A back end is picked only when it passes the known
+ * answer tests on this CPU, the portable one is the fallback.
+ * A context holds plain data only, so that it can be stored and restored
+ * by a later run even if that picks another back end.
+ */
+struct FastHashSha256Context_ {
+  sse_uint32 fState[SHA256_MD_WORDS];
+  sse_uint64 fLength;
+  sse_byte fBlock[FAST_HASH_BLOCK_BYTES];
+  sse_uint32 fBlockLen;
+};
+
+struct FastHashSha1Context_ {
+  sse_uint32 fState[SHA1_MD_WORDS];
+  sse_uint64 fLength;
+  sse_byte fBlock[FAST_HASH_BLOCK_BYTES];
+  sse_uint32 fBlockLen;
+};
+
+/*
+ * Up to FAST_HASH_MB_MAX_LANES independent SHA-256 streams hashed at once.
+ * An update takes one buffer per lane and the blocks the lanes have in
+ * common run side by side in the lanes of a SIMD kernel (AVX2 or SSE2 on
+ * x86, NEON on ARM), picked at run time like the back ends. A lane can be
+ * finished while the others go on.
+ */
+struct FastHashSha256MbContext_ {
+  sse_uint fLanes;
+  FastHashSha256Context fLaneContexts[FAST_HASH_MB_MAX_LANES];
+};
+
+void FastHash_Sha256Init(FastHashSha256Context *in_ctx);
+void FastHash_Sha256Update(FastHashSha256Context *in_ctx, const sse_byte *in_data, sse_size in_len);
+void FastHash_Sha256Final(FastHashSha256Context *in_ctx, sse_byte *out_md);
+void FastHash_Sha256(const sse_byte *in_data, sse_size in_len, sse_byte *out_md);
+void FastHash_Sha1Init(FastHashSha1Context *in_ctx);
+void FastHash_Sha1Update(FastHashSha1Context *in_ctx, const sse_byte *in_data, sse_size in_len);
+void FastHash_Sha1Final(FastHashSha1Context *in_ctx, sse_byte *out_md);
+void FastHash_Sha1(const sse_byte *in_data, sse_size in_len, sse_byte *out_md);
+void FastHash_Sha256MbInit(FastHashSha256MbContext *in_ctx, sse_uint in_lanes);
+void FastHash_Sha256MbUpdate(FastHashSha256MbContext *in_ctx, const sse_byte *const *in_data, const sse_size *in_lens);
+void FastHash_Sha256MbFinal(FastHashSha256MbContext *in_ctx, sse_uint in_lane, sse_byte *out_md);
+
+sse_int FastHash_GetBackendCount(void);
+const sse_char * FastHash_GetBackendName(sse_int in_index);
+sse_bool FastHash_IsBackendAvailable(sse_int in_index);
+sse_int FastHash_SelectBackend(sse_int in_index);
+sse_int FastHash_GetSelectedBackend(void);
+sse_int FastHash_GetMbKernelCount(void);
+const sse_char * FastHash_GetMbKernelName(sse_int in_index);
+sse_bool FastHash_IsMbKernelAvailable(sse_int in_index);
+sse_int FastHash_SelectMbKernel(sse_int in_index);
+sse_int FastHash_GetSelectedMbKernel(void);
+sse_int FastHash_SelfTest(void);
+
+SSE_END_C_DECLS
+
+#endif /* __FAST_HASH__ */
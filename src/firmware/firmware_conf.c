@@ -0,0 +1,319 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <servicesync/moat.h>
+#include "firmware_conf.h"
+
+#define TAG "FirmwareConf"
+
+#define TRACE_ENTER() MOAT_LOG_TRACE(TAG, "== enter =>");
+#define TRACE_LEAVE() MOAT_LOG_TRACE(TAG, "<= leave ==");
+#define LOG_ERROR(format, ...)  MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...)  MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+
+#define FIRMWARE_CONF_LINE_SIZE  (1024)
+#define FIRMWARE_CONF_VALUE_SIZE  (4096)
+
+static sse_bool
+FirmwareConf_IsNameChar(sse_char in_c, sse_bool in_first)
+{
+  if ((in_c >= 'A' && in_c <= 'Z') || (in_c >= 'a' && in_c <= 'z') || in_c == '_') {
+    return sse_true;
+  }
+  return (!in_first && in_c >= '0' && in_c <= '9') ? sse_true : sse_false;
+}
+
+static sse_int
+FirmwareConf_Append(sse_char *out_value, sse_uint *io_len, sse_char *in_str, sse_uint in_len)
+{
+  if (*io_len + in_len >= FIRMWARE_CONF_VALUE_SIZE) {
+    return SSE_E_INVAL;
+  }
+  sse_memcpy(out_value + *io_len, in_str, in_len);
+  *io_len += in_len;
+  return SSE_E_OK;
+}
+
+static sse_char *
+TFirmwareConf_Lookup(TFirmwareConf *self, sse_char *in_name, sse_uint in_name_len)
+{
+  sse_uint i;
+
+  for (i = 0; i < self->fCount; i++) {
+    if (sse_strlen(self->fNames[i]) == (sse_int)in_name_len && sse_strncmp(self->fNames[i], in_name, in_name_len) == 0) {
+      return self->fValues[i];
+    }
+  }
+  return NULL;
+}
+
+static sse_int
+TFirmwareConf_SetValue(TFirmwareConf *self, sse_char *in_name, sse_uint in_name_len, sse_char *in_value)
+{
+  sse_char *name;
+  sse_char *value;
+  sse_uint i;
+
+  value = sse_strdup(in_value);
+  if (value == NULL) {
+    return SSE_E_NOMEM;
+  }
+  for (i = 0; i < self->fCount; i++) {
+    if (sse_strlen(self->fNames[i]) == (sse_int)in_name_len && sse_strncmp(self->fNames[i], in_name, in_name_len) == 0) {
+      sse_free(self->fValues[i]);
+      self->fValues[i] = value;
+      return SSE_E_OK;
+    }
+  }
+  if (self->fCount >= FIRMWARE_CONF_MAX_ENTRIES) {
+    LOG_ERROR("too many variables.");
+    sse_free(value);
+    return SSE_E_INVAL;
+  }
+  name = sse_strndup(in_name, in_name_len);
+  if (name == NULL) {
+    sse_free(value);
+    return SSE_E_NOMEM;
+  }
+  self->fNames[self->fCount] = name;
+  self->fValues[self->fCount] = value;
+  self->fCount++;
+  return SSE_E_OK;
+}
+
+/*
+ * Expands $NAME or ${NAME} at *io_p. An unknown variable expands to
+ * nothing as it does in a shell.
+ */
+static sse_int
+TFirmwareConf_Expand(TFirmwareConf *self, sse_char **io_p, sse_char *out_value, sse_uint *io_len)
+{
+  sse_char *p = *io_p + 1;
+  sse_char *name;
+  sse_char *value;
+  sse_bool braced = (*p == '{') ? sse_true : sse_false;
+
+  if (braced) {
+    p++;
+  }
+  name = p;
+  while (FirmwareConf_IsNameChar(*p, (p == name) ? sse_true : sse_false)) {
+    p++;
+  }
+  if (braced) {
+    if (*p != '}' || p == name) {
+      return SSE_E_INVAL;
+    }
+    value = TFirmwareConf_Lookup(self, name, (sse_uint)(p - name));
+    p++;
+  } else if (p == name) {
+    /* a lone dollar sign */
+    *io_p = p;
+    return FirmwareConf_Append(out_value, io_len, "$", 1);
+  } else {
+    value = TFirmwareConf_Lookup(self, name, (sse_uint)(p - name));
+  }
+  *io_p = p;
+  if (value == NULL) {
+    return SSE_E_OK;
+  }
+  return FirmwareConf_Append(out_value, io_len, value, sse_strlen(value));
+}
+
+static sse_int
+TFirmwareConf_ParseLine(TFirmwareConf *self, sse_char *in_line, sse_char *out_value)
+{
+  sse_char *p = in_line;
+  sse_char *name;
+  sse_uint name_len;
+  sse_uint len = 0;
+  sse_char quote = '\0';
+  sse_int err = SSE_E_OK;
+
+  while (*p == ' ' || *p == '\t') {
+    p++;
+  }
+  if (*p == '\0' || *p == '#') {
+    return SSE_E_OK;
+  }
+  if (sse_strncmp(p, "export ", 7) == 0) {
+    p += 7;
+    while (*p == ' ' || *p == '\t') {
+      p++;
+    }
+  }
+  name = p;
+  while (FirmwareConf_IsNameChar(*p, (p == name) ? sse_true : sse_false)) {
+    p++;
+  }
+  name_len = (sse_uint)(p - name);
+  if (name_len == 0 || *p != '=') {
+    return SSE_E_INVAL;
+  }
+  p++;
+  while (err == SSE_E_OK && *p != '\0') {
+    if (quote == '\'') {
+      if (*p == '\'') {
+        quote = '\0';
+      } else {
+        err = FirmwareConf_Append(out_value, &len, p, 1);
+      }
+      p++;
+    } else if (quote == '\0' && (*p == ' ' || *p == '\t')) {
+      break;
+    } else if (*p == '"') {
+      quote = (quote == '\0') ? '"' : '\0';
+      p++;
+    } else if (*p == '\'' && quote == '\0') {
+      quote = '\'';
+      p++;
+    } else if (*p == '\\' && p[1] != '\0') {
+      /* within double quotes only these are escaped */
+      if (quote == '"' && sse_strchr("$`\"\\", p[1]) == NULL) {
+        err = FirmwareConf_Append(out_value, &len, p, 1);
+      }
+      if (err == SSE_E_OK) {
+        err = FirmwareConf_Append(out_value, &len, p + 1, 1);
+      }
+      p += 2;
+    } else if (*p == '$') {
+      err = TFirmwareConf_Expand(self, &p, out_value, &len);
+    } else {
+      err = FirmwareConf_Append(out_value, &len, p, 1);
+      p++;
+    }
+  }
+  if (err != SSE_E_OK || quote != '\0') {
+    return SSE_E_INVAL;
+  }
+  while (*p == ' ' || *p == '\t') {
+    p++;
+  }
+  if (*p != '\0' && *p != '#') {
+    return SSE_E_INVAL;
+  }
+  out_value[len] = '\0';
+  return TFirmwareConf_SetValue(self, name, name_len, out_value);
+}
+
+static void
+TFirmwareConf_Clear(TFirmwareConf *self)
+{
+  sse_uint i;
+
+  for (i = 0; i < self->fCount; i++) {
+    sse_free(self->fNames[i]);
+    sse_free(self->fValues[i]);
+  }
+  self->fCount = 0;
+}
+
+/*
+ * Replaces the variables with the ones assigned in in_path.
+ */
+sse_int
+TFirmwareConf_Load(TFirmwareConf *self, sse_char *in_path)
+{
+  FILE *fp;
+  sse_char *line = NULL;
+  sse_char *value = NULL;
+  sse_uint line_no = 0;
+  sse_int len;
+  sse_int err = SSE_E_OK;
+
+  TRACE_ENTER();
+  TFirmwareConf_Clear(self);
+  fp = fopen(in_path, "r");
+  if (fp == NULL) {
+    LOG_ERROR("failed to fopen(%s). err=[%s]", in_path, strerror(errno));
+    return SSE_E_NOENT;
+  }
+  line = sse_malloc(FIRMWARE_CONF_LINE_SIZE);
+  value = sse_malloc(FIRMWARE_CONF_VALUE_SIZE);
+  if (line == NULL || value == NULL) {
+    LOG_ERROR("failed to sse_malloc().");
+    err = SSE_E_NOMEM;
+    goto error_exit;
+  }
+  while (fgets(line, FIRMWARE_CONF_LINE_SIZE, fp) != NULL) {
+    line_no++;
+    len = sse_strlen(line);
+    if (len > 0 && line[len - 1] == '\n') {
+      line[--len] = '\0';
+    } else if (!feof(fp)) {
+      LOG_ERROR("line %u of [%s] is too long.", line_no, in_path);
+      err = SSE_E_INVAL;
+      goto error_exit;
+    }
+    if (len > 0 && line[len - 1] == '\r') {
+      line[--len] = '\0';
+    }
+    err = TFirmwareConf_ParseLine(self, line, value);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("failed to parse line %u of [%s]. err=%s", line_no, in_path, sse_get_error_string(err));
+      goto error_exit;
+    }
+  }
+  if (ferror(fp)) {
+    LOG_ERROR("failed to read [%s].", in_path);
+    err = SSE_E_GENERIC;
+  }
+
+error_exit:
+  if (value != NULL) {
+    sse_free(value);
+  }
+  if (line != NULL) {
+    sse_free(line);
+  }
+  fclose(fp);
+  if (err != SSE_E_OK) {
+    TFirmwareConf_Clear(self);
+  }
+  TRACE_LEAVE();
+  return err;
+}
+
+sse_char *
+TFirmwareConf_GetValue(TFirmwareConf *self, sse_char *in_name)
+{
+  return TFirmwareConf_Lookup(self, in_name, sse_strlen(in_name));
+}
+
+TFirmwareConf *
+FirmwareConf_New(void)
+{
+  TFirmwareConf *conf;
+
+  conf = sse_zeroalloc(sizeof(TFirmwareConf));
+  if (conf == NULL) {
+    LOG_ERROR("failed to sse_zeroalloc().");
+    return NULL;
+  }
+  return conf;
+}
+
+void
+TFirmwareConf_Delete(TFirmwareConf *self)
+{
+  TFirmwareConf_Clear(self);
+  sse_free(self);
+}
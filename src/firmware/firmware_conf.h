@@ -0,0 +1,49 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#ifndef __FIRMWARE_CONF__
+#define __FIRMWARE_CONF__
+
+#include <sseutils.h>
+
+SSE_BEGIN_C_DECLS
+
+#define FIRMWARE_CONF_MAX_ENTRIES  (32)
+/* variables which name the images of a package */
+#define FIRMWARE_CONF_IMAGE_NAMES  { "KERNEL", "USERLAND", NULL }
+
+typedef struct TFirmwareConf_ TFirmwareConf;
+
+/*
+ * Reader for the variable assignments of firmware.conf and the other
+ * configuration files written in its format. Values may be quoted and may
+ * refer to the variables assigned above them as $NAME or ${NAME}. Nothing
+ * else a shell would do with the file is supported.
+ */
+struct TFirmwareConf_ {
+  sse_uint fCount;
+  sse_char *fNames[FIRMWARE_CONF_MAX_ENTRIES];
+  sse_char *fValues[FIRMWARE_CONF_MAX_ENTRIES];
+};
+
+TFirmwareConf * FirmwareConf_New(void);
+void TFirmwareConf_Delete(TFirmwareConf *self);
+sse_int TFirmwareConf_Load(TFirmwareConf *self, sse_char *in_path);
+sse_char * TFirmwareConf_GetValue(TFirmwareConf *self, sse_char *in_name);
+
+SSE_END_C_DECLS
+
+#endif /* __FIRMWARE_CONF__ */
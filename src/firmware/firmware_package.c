@@ -21,6 +21,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <dirent.h>
 
 #include <servicesync/moat.h>
@@ -37,8 +39,32 @@
 #define PATH_DELIMITER_CHR '/'
 #define FWPKG_FILE_NAME  "fwpackage.bin"
 #define FWPKG_DIR_NAME  "fwpackage"
+#define FWPKG_CACHE_DIR_NAME  "fwcache"
 #define FWPKG_UPGRADE_SCRIPT_PATH "fw/fw_upgrade.sh"
 #define FWPKG_CHECK_SCRIPT_PATH "fw/check_result.sh"
+#define FWPKG_CONF_PATH "fw/firmware.conf"
+#define FWPKG_SLOTS_CONF_NAME  "fwslots.conf"
+#define FWPKG_ACTIVE_SLOT_FILE_NAME  "fwslot"
+#define FWPKG_IMAGE_DIR_PATH "fw"
+#define FWPKG_BASE_DIR_NAME  "fwbase"
+#define FWPKG_PUBLIC_KEY_NAME  "fwpackage.pub"
+#define FWPKG_FALLBACK_MAX_SIZE  (1024ULL * 1024 * 1024)
+
+/*
+ * Extracted data is bounded by the free space of the file system it goes
+ * to rather than by a fixed size, so that large images can be shipped.
+ */
+static sse_uint64
+FirmwarePackage_GetMaxSize(sse_char *in_dir_path)
+{
+  struct statvfs fs;
+
+  if (statvfs(in_dir_path, &fs) != 0) {
+    LOG_ERROR("failed to statvfs(%s). err=[%s]", in_dir_path, strerror(errno));
+    return FWPKG_FALLBACK_MAX_SIZE;
+  }
+  return (sse_uint64)fs.f_bavail * fs.f_frsize;
+}
 
 static sse_char *
 FirmwarePackage_MakeFullPath(sse_char *in_base_path, sse_char *in_path)
@@ -139,6 +165,64 @@ TFirmwarePackage_HandleCheckResultResult(TFirmwarePackage *self, sse_int in_err,
   return err;
 }
 
+/*
+ * Keeps the images of the firmware which is running now as the sources of
+ * the deltas of the next package, named by their SHA-256 as
+ * TDeltaPatch_FindSource() looks them up. The flash may hold the images in
+ * another form than shipped, so the shipped ones are kept. Bases of the
+ * earlier firmware are removed.
+ */
+static void
+TFirmwarePackage_StoreBases(TFirmwarePackage *self)
+{
+  TManifestEntry *entry;
+  sse_char *base_dir_path;
+  sse_char *path;
+  sse_char *p;
+  sse_uint len;
+  sse_uint i;
+  sse_uint j;
+
+  if (self->fVerifier == NULL) {
+    return;
+  }
+  base_dir_path = FirmwarePackage_MakeFullPath(NULL, FWPKG_BASE_DIR_NAME);
+  if (base_dir_path == NULL) {
+    return;
+  }
+  FirmwarePackage_RemoveDir(base_dir_path);
+  if (mkdir(base_dir_path, 0755) != 0 && errno != EEXIST) {
+    LOG_ERROR("failed to mkdir(%s). err=[%s]", base_dir_path, strerror(errno));
+    sse_free(base_dir_path);
+    return;
+  }
+  len = sse_strlen(base_dir_path) + 1 + SHA256_MD_BYTES * 2;
+  path = sse_malloc(len + 1);
+  if (path == NULL) {
+    LOG_ERROR("failed to sse_malloc().");
+    sse_free(base_dir_path);
+    return;
+  }
+  for (i = 0; i < TManifestVerifier_GetCount(self->fVerifier); i++) {
+    entry = TManifestVerifier_GetEntry(self->fVerifier, i);
+    if (entry->fDigestType != MANIFEST_DIGEST_SHA256) {
+      /* packages made before the manifest cannot be a base */
+      continue;
+    }
+    p = path + snprintf(path, len + 1, "%s/", base_dir_path);
+    for (j = 0; j < SHA256_MD_BYTES; j++) {
+      p += snprintf(p, 3, "%02x", entry->fDigest[j]);
+    }
+    if (rename(entry->fPath, path) != 0) {
+      LOG_INFO("[%s] is not kept as a base. err=[%s]", entry->fName, strerror(errno));
+      continue;
+    }
+    LOG_INFO("[%s] is kept as a base. path=[%s]", entry->fName, path);
+  }
+  sse_free(path);
+  sse_free(base_dir_path);
+}
+
 static void
 FirmwarePackage_OnCheckCommandCompleted(TSseUtilShellCommand* self, sse_pointer in_user_data, sse_int in_result)
 {
@@ -149,6 +233,7 @@ FirmwarePackage_OnCheckCommandCompleted(TSseUtilShellCommand* self, sse_pointer
   TRACE_ENTER();
   if (in_result == 0) {
       err = SSE_E_OK;
+      TFirmwarePackage_StoreBases(package);
   } else {
     err = SSE_E_GENERIC;
     err_info = "Failed to check result command.";
@@ -171,43 +256,287 @@ FirmwarePackage_OnCheckCommandError(TSseUtilShellCommand* self, sse_pointer in_u
 }
 
 static sse_int
-TFirmwarePackage_DoExtract(TFirmwarePackage *self)
+FirmwarePackage_ApplyDelta(sse_char *in_dir_path, sse_char *in_name, sse_char *in_base_dir_path)
+{
+  TDeltaPatch *patch = NULL;
+  sse_char *patch_path = NULL;
+  sse_char *target_path = NULL;
+  sse_int err;
+
+  patch_path = FirmwarePackage_MakeFullPath(in_dir_path, in_name);
+  if (patch_path == NULL) {
+    return SSE_E_NOMEM;
+  }
+  target_path = sse_strndup(patch_path, sse_strlen(patch_path) - sse_strlen(DELTA_PATCH_FILE_SUFFIX));
+  if (target_path == NULL) {
+    LOG_ERROR("failed to sse_strndup().");
+    err = SSE_E_NOMEM;
+    goto error_exit;
+  }
+  patch = DeltaPatch_New(target_path, in_base_dir_path);
+  if (patch == NULL) {
+    LOG_ERROR("failed to DeltaPatch_New().");
+    err = SSE_E_NOMEM;
+    goto error_exit;
+  }
+  TDeltaPatch_SetMaxTargetSize(patch, FirmwarePackage_GetMaxSize(in_dir_path));
+  err = TDeltaPatch_ApplyFile(patch, patch_path);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to TDeltaPatch_ApplyFile(%s). err=%s", patch_path, sse_get_error_string(err));
+    goto error_exit;
+  }
+  unlink(patch_path);
+
+error_exit:
+  if (patch != NULL) {
+    TDeltaPatch_Delete(patch);
+  }
+  if (target_path != NULL) {
+    sse_free(target_path);
+  }
+  sse_free(patch_path);
+  return err;
+}
+
+/*
+ * Rebuilds the images which have been shipped as deltas.
+ */
+static sse_int
+FirmwarePackage_ApplyDeltas(sse_char *in_package_dir_path)
 {
+  DIR *dir;
+  struct dirent *entry;
+  sse_char *dir_path = NULL;
+  sse_char *base_dir_path = NULL;
+  sse_int name_len;
+  sse_int suffix_len = sse_strlen(DELTA_PATCH_FILE_SUFFIX);
+  sse_int err = SSE_E_OK;
+
+  dir_path = FirmwarePackage_MakeFullPath(in_package_dir_path, FWPKG_IMAGE_DIR_PATH);
+  base_dir_path = FirmwarePackage_MakeFullPath(NULL, FWPKG_BASE_DIR_NAME);
+  if (dir_path == NULL || base_dir_path == NULL) {
+    err = SSE_E_NOMEM;
+    goto error_exit;
+  }
+  dir = opendir(dir_path);
+  if (dir == NULL) {
+    goto error_exit;
+  }
+  while (err == SSE_E_OK && (entry = readdir(dir)) != NULL) {
+    name_len = sse_strlen(entry->d_name);
+    if (name_len <= suffix_len || sse_strcmp(entry->d_name + name_len - suffix_len, DELTA_PATCH_FILE_SUFFIX) != 0) {
+      continue;
+    }
+    LOG_INFO("applying delta [%s].", entry->d_name);
+    err = FirmwarePackage_ApplyDelta(dir_path, entry->d_name, base_dir_path);
+  }
+  closedir(dir);
+
+error_exit:
+  if (base_dir_path != NULL) {
+    sse_free(base_dir_path);
+  }
+  if (dir_path != NULL) {
+    sse_free(dir_path);
+  }
+  return err;
+}
+
+static sse_bool
+FirmwarePackage_IsFile(sse_char *in_path)
+{
+  MoatValue *path_value;
+  sse_bool ok;
+
+  path_value = moat_value_new_string(in_path, 0, sse_true);
+  if (path_value == NULL) {
+    LOG_ERROR("failed to moat_value_new_string(%s).", in_path);
+    return sse_false;
+  }
+  ok = SseUtilFile_IsFile(path_value);
+  moat_value_free(path_value);
+  return ok;
+}
+
+/*
+ * Loads the key which packages have to be signed with. Returns SSE_E_NOENT
+ * when the device has none, then packages are not authenticated.
+ */
+static sse_int
+TFirmwarePackage_LoadPublicKey(TFirmwarePackage *self)
+{
+  sse_char *path;
+  sse_int err;
+
+  if (self->fPublicKey != NULL) {
+    return SSE_E_OK;
+  }
+  path = FirmwarePackage_MakeFullPath(NULL, FWPKG_PUBLIC_KEY_NAME);
+  if (path == NULL) {
+    return SSE_E_NOMEM;
+  }
+  if (!FirmwarePackage_IsFile(path)) {
+    LOG_DEBUG("[%s] is not found, package is not authenticated.", path);
+    sse_free(path);
+    return SSE_E_NOENT;
+  }
+  self->fPublicKey = RsaPublicKey_New();
+  if (self->fPublicKey == NULL) {
+    sse_free(path);
+    return SSE_E_NOMEM;
+  }
+  err = TRsaPublicKey_Load(self->fPublicKey, path);
+  sse_free(path);
+  if (err != SSE_E_OK) {
+    /* a broken key must not turn authentication off */
+    LOG_ERROR("failed to TRsaPublicKey_Load(). err=%s", sse_get_error_string(err));
+    TRsaPublicKey_Delete(self->fPublicKey);
+    self->fPublicKey = NULL;
+    return SSE_E_PERM;
+  }
+  return SSE_E_OK;
+}
+
+/*
+ * Makes in_stream authenticate the entries against the signed manifest,
+ * when the device has a key. *out_manifest is left NULL otherwise.
+ */
+static sse_int
+TFirmwarePackage_AttachManifest(TFirmwarePackage *self, TZipStream *in_stream, TSignedManifest **out_manifest)
+{
+  sse_int err;
+
+  *out_manifest = NULL;
+  err = TFirmwarePackage_LoadPublicKey(self);
+  if (err == SSE_E_NOENT) {
+    return SSE_E_OK;
+  }
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  *out_manifest = SignedManifest_New(self->fPublicKey);
+  if (*out_manifest == NULL) {
+    LOG_ERROR("failed to SignedManifest_New().");
+    return SSE_E_NOMEM;
+  }
+  TSignedManifest_Attach(*out_manifest, in_stream);
+  return SSE_E_OK;
+}
+
+/*
+ * Runs in the worker process.
+ */
+static sse_int
+FirmwarePackage_ExtractProc(sse_pointer in_proc_data)
+{
+  TFirmwarePackage *self = (TFirmwarePackage *)in_proc_data;
   MoatValue *dir_path = NULL;
-  const char * command = "unzip " FWPKG_FILE_NAME " -d ./" FWPKG_DIR_NAME "/";
-  int result;
+  TZipStream *stream = NULL;
+  TSignedManifest *manifest = NULL;
+  sse_uint64 max_size;
   sse_int err;
-  sse_char *err_info = NULL;
 
-  TRACE_ENTER();
+  if (self->fStream != NULL && TZipStream_IsCompleted(self->fStream)) {
+    if (self->fManifest != NULL && !TSignedManifest_IsComplete(self->fManifest)) {
+      return SSE_E_PERM;
+    }
+    return FirmwarePackage_ApplyDeltas(self->fPackageDirPath);
+  }
   dir_path = moat_value_new_string(self->fPackageDirPath, 0, sse_true);
   if (dir_path == NULL) {
     LOG_ERROR("failed to create moat_value for dir_path.");
-    err = SSE_E_NOMEM;
-    err_info = "Out of memory.";
-    goto error_exit;
+    return SSE_E_NOMEM;
   }
   FirmwarePackage_RemoveDir(self->fPackageDirPath);
   err = SseUtilFile_MakeDirectory(dir_path);
+  moat_value_free(dir_path);
   if (err != SSE_E_OK) {
     LOG_ERROR("failed to SseUtilFile_MakeDirectory(). path=[%s], err=%d", self->fPackageDirPath, err);
+    return SSE_E_ACCES;
+  }
+  stream = ZipStream_New(self->fPackageDirPath);
+  if (stream == NULL) {
+    LOG_ERROR("failed to ZipStream_New().");
+    return SSE_E_NOMEM;
+  }
+  max_size = FirmwarePackage_GetMaxSize(self->fPackageDirPath);
+  TZipStream_SetLimits(stream, max_size, max_size);
+  err = TFirmwarePackage_AttachManifest(self, stream, &manifest);
+  if (err == SSE_E_OK) {
+    err = TZipStream_ExtractFile(stream, self->fPackageFilePath);
+  }
+  if (err == SSE_E_OK && manifest != NULL && !TSignedManifest_IsComplete(manifest)) {
+    err = SSE_E_PERM;
+  }
+  if (manifest != NULL) {
+    TSignedManifest_Delete(manifest);
+  }
+  TZipStream_Delete(stream);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to TZipStream_ExtractFile(%s). err=%s", self->fPackageFilePath, sse_get_error_string(err));
+    return (err == SSE_E_NOENT) ? SSE_E_GENERIC : err;
+  }
+  return FirmwarePackage_ApplyDeltas(self->fPackageDirPath);
+}
+
+static void
+FirmwarePackage_OnExtracted(TWorkerProcess *in_worker, sse_int in_result, sse_pointer in_user_data)
+{
+  TFirmwarePackage *self = (TFirmwarePackage *)in_user_data;
+  sse_char *err_info = NULL;
+  sse_int err;
+
+  TRACE_ENTER();
+  if (in_result == SSE_E_ACCES) {
     err_info = "Failed to create working directory.";
-    goto error_exit;
+  } else if (in_result == SSE_E_NOMEM) {
+    err_info = "Out of memory.";
+  } else if (in_result == SSE_E_NOENT) {
+    err_info = "Source image of delta was not found.";
+  } else if (in_result == SSE_E_PERM) {
+    err_info = "Package is not signed or does not match its manifest.";
+  } else if (in_result != SSE_E_OK) {
+    err_info = "Failed to extract package.";
+  } else {
+    /* the extracted tree stands for the package from now on, and the cache keeps a link of its own */
+    LOG_DEBUG("remove [%s] which has been extracted.", self->fPackageFilePath);
+    unlink(self->fPackageFilePath);
   }
+  err = (*self->fCommandCallback)(self, in_result, err_info, self->fCommandUserData);
+  LOG_DEBUG("Callback result=%s", sse_get_error_string(err));
+  TRACE_LEAVE();
+}
 
-  result = system(command);
-  if (result != 0) {
-    LOG_ERROR("failed to command:[%s]. result=%d", command, result);
-    err = SSE_E_GENERIC;
-    err_info = "Failed to extract command.";
+static sse_int
+TFirmwarePackage_DoExtract(TFirmwarePackage *self)
+{
+  sse_int err;
+  sse_char *err_info = NULL;
+
+  TRACE_ENTER();
+  if (self->fStream != NULL && TZipStream_IsCompleted(self->fStream)) {
+    LOG_INFO("package has been extracted while downloading.");
+  }
+  if (self->fWorker == NULL) {
+    self->fWorker = WorkerProcess_New();
+    if (self->fWorker == NULL) {
+      LOG_ERROR("failed to WorkerProcess_New().");
+      err = SSE_E_NOMEM;
+      err_info = "Out of memory.";
+      goto error_exit;
+    }
+  }
+  /* extraction of a large package and applying deltas take long, so keep them off the event loop */
+  err = TWorkerProcess_Start(self->fWorker, FirmwarePackage_ExtractProc, self, 0, FirmwarePackage_OnExtracted, self);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to TWorkerProcess_Start(). err=%s", sse_get_error_string(err));
+    err_info = "Failed to start extraction.";
     goto error_exit;
   }
-  err = SSE_E_OK;
+  TRACE_LEAVE();
+  return SSE_E_OK;
 
 error_exit:
-  if (dir_path != NULL) {
-    moat_value_free(dir_path);
-  }
   err = (*self->fCommandCallback)(self, err, err_info, self->fCommandUserData);
   LOG_DEBUG("Callback result=%s", sse_get_error_string(err));
   TRACE_LEAVE();
@@ -225,87 +554,449 @@ FirmwarePackage_OnStartExtract(MoatIdle *in_idle, sse_pointer in_user_data)
   TRACE_LEAVE();
 }
 
+static void
+FirmwarePackage_OnUpdateOutput(TWorkerProcess *in_worker, sse_char *in_line, sse_uint in_len, sse_pointer in_user_data)
+{
+  LOG_INFO("%s: %s", FWPKG_UPGRADE_SCRIPT_PATH, in_line);
+}
+
+static void
+FirmwarePackage_OnUpdated(TWorkerProcess *in_worker, sse_int in_result, sse_pointer in_user_data)
+{
+  TFirmwarePackage *self = (TFirmwarePackage *)in_user_data;
+  sse_char *err_info = NULL;
+  sse_int err;
+
+  TRACE_ENTER();
+  if (in_result == SSE_E_OK) {
+    LOG_DEBUG("update command was successful.");
+  } else if (in_result == SSE_E_TIMEDOUT) {
+    err_info = "Update timed out.";
+  } else {
+    LOG_ERROR("update command failed. err=%s", sse_get_error_string(in_result));
+    err_info = "Failed to update.";
+  }
+  err = (*self->fCommandCallback)(self, in_result, err_info, self->fCommandUserData);
+  LOG_DEBUG("Callback result=%s", sse_get_error_string(err));
+  TRACE_LEAVE();
+}
+
+/*
+ * Images are installed into A/B slots natively when the device has a slot
+ * configuration, otherwise by fw/fw_upgrade.sh.
+ */
+static sse_bool
+FirmwarePackage_HasSlots(void)
+{
+  sse_char *path;
+  sse_bool ok;
+
+  path = FirmwarePackage_MakeFullPath(NULL, FWPKG_SLOTS_CONF_NAME);
+  if (path == NULL) {
+    return sse_false;
+  }
+  ok = FirmwarePackage_IsFile(path);
+  sse_free(path);
+  return ok;
+}
+
+static sse_int
+FirmwarePackage_InstallImage(TSlotInstaller *in_installer, sse_char *in_image_dir_path, sse_char *in_name, sse_char *in_file_name)
+{
+  sse_char *image_path = NULL;
+  sse_char *md5_path = NULL;
+  sse_uint len;
+  sse_int err;
+
+  if (sse_strchr(in_file_name, PATH_DELIMITER_CHR) != NULL) {
+    LOG_ERROR("%s [%s] is not in the package.", in_name, in_file_name);
+    return SSE_E_INVAL;
+  }
+  image_path = FirmwarePackage_MakeFullPath(in_image_dir_path, in_file_name);
+  if (image_path == NULL) {
+    return SSE_E_NOMEM;
+  }
+  len = sse_strlen(image_path) + 5;
+  md5_path = sse_malloc(len);
+  if (md5_path == NULL) {
+    sse_free(image_path);
+    return SSE_E_NOMEM;
+  }
+  snprintf(md5_path, len, "%s.md5", image_path);
+  err = TSlotInstaller_InstallFile(in_installer, in_name, image_path, md5_path);
+  sse_free(md5_path);
+  sse_free(image_path);
+  return err;
+}
+
+/*
+ * Runs in the worker process. Streams the images listed in firmware.conf
+ * into the inactive slot and switches to it once all of them are verified.
+ */
+static sse_int
+FirmwarePackage_InstallProc(sse_pointer in_proc_data)
+{
+  static sse_char *names[] = FIRMWARE_CONF_IMAGE_NAMES;
+  TFirmwarePackage *self = (TFirmwarePackage *)in_proc_data;
+  TFirmwareConf *conf = NULL;
+  TSlotInstaller *installer = NULL;
+  sse_char *conf_path = NULL;
+  sse_char *slots_conf_path = NULL;
+  sse_char *slot_file_path = NULL;
+  sse_char *image_dir_path = NULL;
+  sse_char *file_name;
+  sse_int i;
+  sse_int err;
+
+  conf_path = FirmwarePackage_MakeFullPath(self->fPackageDirPath, FWPKG_CONF_PATH);
+  slots_conf_path = FirmwarePackage_MakeFullPath(NULL, FWPKG_SLOTS_CONF_NAME);
+  slot_file_path = FirmwarePackage_MakeFullPath(NULL, FWPKG_ACTIVE_SLOT_FILE_NAME);
+  image_dir_path = FirmwarePackage_MakeFullPath(self->fPackageDirPath, FWPKG_IMAGE_DIR_PATH);
+  conf = FirmwareConf_New();
+  if (conf_path == NULL || slots_conf_path == NULL || slot_file_path == NULL || image_dir_path == NULL || conf == NULL) {
+    err = SSE_E_NOMEM;
+    goto error_exit;
+  }
+  err = TFirmwareConf_Load(conf, conf_path);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to TFirmwareConf_Load(%s). err=%s", conf_path, sse_get_error_string(err));
+    err = SSE_E_INVAL;
+    goto error_exit;
+  }
+  installer = SlotInstaller_New(slot_file_path);
+  if (installer == NULL) {
+    err = SSE_E_NOMEM;
+    goto error_exit;
+  }
+  err = TSlotInstaller_Load(installer, slots_conf_path);
+  for (i = 0; err == SSE_E_OK && names[i] != NULL; i++) {
+    file_name = TFirmwareConf_GetValue(conf, names[i]);
+    if (file_name == NULL || *file_name == '\0') {
+      continue;
+    }
+    err = FirmwarePackage_InstallImage(installer, image_dir_path, names[i], file_name);
+  }
+  if (err == SSE_E_OK) {
+    err = TSlotInstaller_Switch(installer);
+  }
+
+error_exit:
+  if (installer != NULL) {
+    TSlotInstaller_Delete(installer);
+  }
+  if (conf != NULL) {
+    TFirmwareConf_Delete(conf);
+  }
+  if (image_dir_path != NULL) {
+    sse_free(image_dir_path);
+  }
+  if (slot_file_path != NULL) {
+    sse_free(slot_file_path);
+  }
+  if (slots_conf_path != NULL) {
+    sse_free(slots_conf_path);
+  }
+  if (conf_path != NULL) {
+    sse_free(conf_path);
+  }
+  return err;
+}
+
+static void
+FirmwarePackage_OnInstalled(TWorkerProcess *in_worker, sse_int in_result, sse_pointer in_user_data)
+{
+  TFirmwarePackage *self = (TFirmwarePackage *)in_user_data;
+  sse_char *err_info = NULL;
+  sse_int err;
+
+  TRACE_ENTER();
+  if (in_result == SSE_E_OK) {
+    LOG_INFO("images have been installed into the inactive slot.");
+  } else if (in_result == SSE_E_TIMEDOUT) {
+    LOG_ERROR("install timed out.");
+    err_info = "Update timed out.";
+  } else if (in_result == SSE_E_INVAL) {
+    err_info = "Image verification failed.";
+  } else if (in_result == SSE_E_NOENT) {
+    err_info = "Image or slot was not found.";
+  } else if (in_result == SSE_E_NOMEM) {
+    err_info = "Out of memory.";
+  } else {
+    LOG_ERROR("install failed. err=%s", sse_get_error_string(in_result));
+    err_info = "Failed to update.";
+  }
+  err = (*self->fCommandCallback)(self, in_result, err_info, self->fCommandUserData);
+  LOG_DEBUG("Callback result=%s", sse_get_error_string(err));
+  TRACE_LEAVE();
+}
+
+/*
+ * Runs fw/fw_upgrade.sh in a child process. The output of the script goes to
+ * the log line by line and in_callback is called when the script has exited
+ * or has been killed after in_timeout_sec (0 for no limit).
+ * When the device has a slot configuration, the images are installed into
+ * the inactive slot by the worker instead, within the same time limit.
+ */
 sse_int
-TFirmwarePackage_InvokeUpdate(TFirmwarePackage *self)
+TFirmwarePackage_InvokeUpdate(TFirmwarePackage *self, sse_uint in_timeout_sec, FirmwarePackage_CommandCallback in_callback, sse_pointer in_user_data)
 {
   sse_char *path = NULL;
-  int result;
-  int err;
+  sse_int err;
 
   TRACE_ENTER();
+  if (self->fWorker == NULL) {
+    self->fWorker = WorkerProcess_New();
+    if (self->fWorker == NULL) {
+      LOG_ERROR("failed to WorkerProcess_New().");
+      return SSE_E_NOMEM;
+    }
+  }
+  if (FirmwarePackage_HasSlots()) {
+    err = TWorkerProcess_Start(self->fWorker, FirmwarePackage_InstallProc, self, in_timeout_sec, FirmwarePackage_OnInstalled, self);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("failed to TWorkerProcess_Start(). err=%s", sse_get_error_string(err));
+      return err;
+    }
+    self->fCommandCallback = in_callback;
+    self->fCommandUserData = in_user_data;
+    TRACE_LEAVE();
+    return SSE_E_OK;
+  }
   path = FirmwarePackage_MakeFullPath(self->fPackageDirPath, FWPKG_UPGRADE_SCRIPT_PATH);
   if (path == NULL) {
     LOG_ERROR("failed to FirmwarePackage_MakeFullPath(%s).", FWPKG_UPGRADE_SCRIPT_PATH);
     return SSE_E_NOMEM;
   }
-  result = system(path);
-  if (result != 0) {
-    LOG_ERROR("command failed:[%s]. result=%d", path, result);
-    err = SSE_E_GENERIC;
-  } else {
-    LOG_DEBUG("update command was successful:[%s].", path);
-    err = SSE_E_OK;
+  TWorkerProcess_SetOutputCallback(self->fWorker, FirmwarePackage_OnUpdateOutput, self);
+  err = TWorkerProcess_Execute(self->fWorker, path, in_timeout_sec, FirmwarePackage_OnUpdated, self);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to TWorkerProcess_Execute(%s). err=%s", path, sse_get_error_string(err));
+    sse_free(path);
+    return err;
   }
   sse_free(path);
+  self->fCommandCallback = in_callback;
+  self->fCommandUserData = in_user_data;
   TRACE_LEAVE();
-  return err;
+  return SSE_E_OK;
+}
+
+static void
+TFirmwarePackage_EndStreamExtract(TFirmwarePackage *self)
+{
+  if (self->fManifest != NULL) {
+    TSignedManifest_Delete(self->fManifest);
+    self->fManifest = NULL;
+  }
+  if (self->fStream != NULL) {
+    TZipStream_Delete(self->fStream);
+    self->fStream = NULL;
+  }
+}
+
+/*
+ * Prepares the package directory so that the package can be extracted while
+ * it is being downloaded. If the stream can not be decoded on the fly, the
+ * package is extracted from the file by TFirmwarePackage_Extract() instead.
+ */
+sse_int
+TFirmwarePackage_BeginStreamExtract(TFirmwarePackage *self)
+{
+  MoatValue *dir_path = NULL;
+  sse_uint64 max_size;
+  sse_int err;
+
+  TRACE_ENTER();
+  TFirmwarePackage_EndStreamExtract(self);
+  dir_path = moat_value_new_string(self->fPackageDirPath, 0, sse_true);
+  if (dir_path == NULL) {
+    LOG_ERROR("failed to create moat_value for dir_path.");
+    return SSE_E_NOMEM;
+  }
+  FirmwarePackage_RemoveDir(self->fPackageDirPath);
+  err = SseUtilFile_MakeDirectory(dir_path);
+  moat_value_free(dir_path);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to SseUtilFile_MakeDirectory(). path=[%s], err=%d", self->fPackageDirPath, err);
+    return err;
+  }
+  self->fStream = ZipStream_New(self->fPackageDirPath);
+  if (self->fStream == NULL) {
+    LOG_ERROR("failed to ZipStream_New().");
+    return SSE_E_NOMEM;
+  }
+  max_size = FirmwarePackage_GetMaxSize(self->fPackageDirPath);
+  TZipStream_SetLimits(self->fStream, max_size, max_size);
+  err = TFirmwarePackage_AttachManifest(self, self->fStream, &self->fManifest);
+  if (err != SSE_E_OK) {
+    TFirmwarePackage_EndStreamExtract(self);
+    return err;
+  }
+  self->fStreamEnabled = sse_true;
+  TRACE_LEAVE();
+  return SSE_E_OK;
+}
+
+void
+TFirmwarePackage_WriteStream(TFirmwarePackage *self, sse_byte *in_data, sse_size in_len)
+{
+  sse_int err;
+
+  if (in_data == NULL) {
+    /* the download starts over */
+    if (self->fStreamEnabled) {
+      TFirmwarePackage_BeginStreamExtract(self);
+    }
+    return;
+  }
+  if (self->fStream == NULL) {
+    return;
+  }
+  err = TZipStream_Write(self->fStream, in_data, in_len);
+  if (err != SSE_E_OK) {
+    LOG_INFO("streaming extraction has been stopped. err=%s", sse_get_error_string(err));
+    TFirmwarePackage_EndStreamExtract(self);
+  }
 }
 
 sse_bool
 TFirmwarePackage_Verify(TFirmwarePackage *self)
 {
+  sse_char *paths[] = { FWPKG_UPGRADE_SCRIPT_PATH, FWPKG_CHECK_SCRIPT_PATH };
   sse_char *path = NULL;
-  MoatValue *path_value = NULL;
+  TSignedManifest *manifest;
   sse_bool ok;
+  sse_int err;
+  sse_int i;
 
   TRACE_ENTER();
-  path = FirmwarePackage_MakeFullPath(self->fPackageDirPath, FWPKG_UPGRADE_SCRIPT_PATH);
-  if (path == NULL) {
-    LOG_ERROR("failed to FirmwarePackage_MakeFullPath(%s).", FWPKG_UPGRADE_SCRIPT_PATH);
-    goto error_exit;
-  }
-  path_value = moat_value_new_string(path, 0, sse_true);
-  if (path_value == NULL) {
-    LOG_ERROR("failed to moat_value_new_string(%s).", path);
-    goto error_exit;
+  if (FirmwarePackage_HasSlots()) {
+    /* installed natively, the images are listed in firmware.conf */
+    paths[0] = FWPKG_CONF_PATH;
   }
-  ok = SseUtilFile_IsFile(path_value);
-  if (!ok) {
-    LOG_ERROR("file [%s] is not exists or is not a file.", path);
-    goto error_exit;
+  for (i = 0; i < 2; i++) {
+    path = FirmwarePackage_MakeFullPath(self->fPackageDirPath, paths[i]);
+    if (path == NULL) {
+      LOG_ERROR("failed to FirmwarePackage_MakeFullPath(%s).", paths[i]);
+      return sse_false;
+    }
+    ok = FirmwarePackage_IsFile(path);
+    if (!ok) {
+      LOG_ERROR("file [%s] is not exists or is not a file.", path);
+      sse_free(path);
+      return sse_false;
+    }
+    sse_free(path);
   }
-  moat_value_free(path_value);
-  sse_free(path);
-  path = NULL;
-  path_value = NULL;
-  path = FirmwarePackage_MakeFullPath(self->fPackageDirPath, FWPKG_CHECK_SCRIPT_PATH);
-  if (path == NULL) {
-    LOG_ERROR("failed to FirmwarePackage_MakeFullPath(%s).", FWPKG_CHECK_SCRIPT_PATH);
-    goto error_exit;
+  /* the entries have been authenticated while they were extracted, the manifest is checked again here for a package staged before */
+  err = TFirmwarePackage_LoadPublicKey(self);
+  if (err == SSE_E_OK) {
+    manifest = SignedManifest_New(self->fPublicKey);
+    if (manifest == NULL) {
+      LOG_ERROR("failed to SignedManifest_New().");
+      return sse_false;
+    }
+    err = TSignedManifest_Load(manifest, self->fPackageDirPath);
+    TSignedManifest_Delete(manifest);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("package is not signed with the key of this device.");
+      return sse_false;
+    }
+  } else if (err != SSE_E_NOENT) {
+    return sse_false;
   }
-  path_value = moat_value_new_string(path, 0, sse_true);
-  if (path_value == NULL) {
-    LOG_ERROR("failed to moat_value_new_string(%s).", path);
-    goto error_exit;
+  /* every image must come with a digest, they are hashed by TFirmwarePackage_VerifyImages() */
+  if (self->fVerifier == NULL) {
+    path = FirmwarePackage_MakeFullPath(self->fPackageDirPath, FWPKG_IMAGE_DIR_PATH);
+    if (path == NULL) {
+      return sse_false;
+    }
+    self->fVerifier = ManifestVerifier_New(path);
+    sse_free(path);
+    if (self->fVerifier == NULL) {
+      LOG_ERROR("failed to ManifestVerifier_New().");
+      return sse_false;
+    }
   }
-  ok = SseUtilFile_IsFile(path_value);
-  if (!ok) {
-    LOG_ERROR("file [%s] is not exists or is not a file.", path);
-    goto error_exit;
+  if (TManifestVerifier_Load(self->fVerifier) != SSE_E_OK) {
+    LOG_ERROR("failed to TManifestVerifier_Load().");
+    return sse_false;
   }
-  moat_value_free(path_value);
-  sse_free(path);
   TRACE_LEAVE();
   return sse_true;
+}
 
-error_exit:
-  if (path_value != NULL) {
-    moat_value_free(path_value);
+static void
+FirmwarePackage_OnImagesVerified(TManifestVerifier *in_verifier, sse_int in_err, sse_pointer in_user_data)
+{
+  TFirmwarePackage *self = (TFirmwarePackage *)in_user_data;
+  sse_char *err_info = NULL;
+  sse_int err;
+
+  TRACE_ENTER();
+  if (in_err == SSE_E_INVAL) {
+    err_info = "Image digest mismatch.";
+  } else if (in_err == SSE_E_NOENT) {
+    err_info = "Image was not found.";
+  } else if (in_err != SSE_E_OK) {
+    err_info = "Failed to verify images.";
   }
-  if (path != NULL) {
-    sse_free(path);
+  err = (*self->fCommandCallback)(self, in_err, err_info, self->fCommandUserData);
+  LOG_DEBUG("Callback result=%s", sse_get_error_string(err));
+  TRACE_LEAVE();
+}
+
+static void
+FirmwarePackage_OnNothingToVerify(MoatIdle *in_idle, sse_pointer in_user_data)
+{
+  TRACE_ENTER();
+  moat_idle_stop(in_idle);
+  moat_idle_free(in_idle);
+  FirmwarePackage_OnImagesVerified(NULL, SSE_E_OK, in_user_data);
+  TRACE_LEAVE();
+}
+
+/*
+ * Hashes the images against the digests found by TFirmwarePackage_Verify(),
+ * concurrently in worker processes. in_callback is called when all of them
+ * have been verified or one of them has failed.
+ */
+sse_int
+TFirmwarePackage_VerifyImages(TFirmwarePackage *self, FirmwarePackage_CommandCallback in_callback, sse_pointer in_user_data)
+{
+  MoatIdle *idle;
+  sse_int err;
+
+  TRACE_ENTER();
+  if (self->fVerifier == NULL) {
+    LOG_ERROR("package has not been verified.");
+    return SSE_E_INVAL;
   }
-  return sse_false;
+  if (TManifestVerifier_GetCount(self->fVerifier) == 0) {
+    /* neither a manifest nor images, completes on the next turn of the loop */
+    LOG_INFO("package has no digests to verify.");
+    idle = moat_idle_new(FirmwarePackage_OnNothingToVerify, self);
+    if (idle == NULL) {
+      LOG_ERROR("failed to moat_idle_new().");
+      return SSE_E_NOMEM;
+    }
+    err = moat_idle_start(idle);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("failed to moat_idle_start(). err=%s", sse_get_error_string(err));
+      moat_idle_free(idle);
+      return err;
+    }
+  } else {
+    err = TManifestVerifier_Start(self->fVerifier, FirmwarePackage_OnImagesVerified, self);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("failed to TManifestVerifier_Start(). err=%s", sse_get_error_string(err));
+      return err;
+    }
+  }
+  self->fCommandCallback = in_callback;
+  self->fCommandUserData = in_user_data;
+  TRACE_LEAVE();
+  return SSE_E_OK;
 }
 
 sse_int
@@ -439,6 +1130,16 @@ void
 TFirmwarePackage_Delete(TFirmwarePackage *self)
 {
   TRACE_ENTER();
+  if (self->fVerifier != NULL) {
+    TManifestVerifier_Delete(self->fVerifier);
+  }
+  if (self->fWorker != NULL) {
+    TWorkerProcess_Delete(self->fWorker);
+  }
+  TFirmwarePackage_EndStreamExtract(self);
+  if (self->fPublicKey != NULL) {
+    TRsaPublicKey_Delete(self->fPublicKey);
+  }
   if (self->fPackageDirPath != NULL) {
     sse_free(self->fPackageDirPath);
   }
@@ -464,3 +1165,11 @@ FirmwarePackage_GetPackageDirPath(void)
   TRACE_LEAVE();
   return FirmwarePackage_MakeFullPath(NULL, FWPKG_DIR_NAME);
 }
+
+sse_char *
+FirmwarePackage_GetCacheDirPath(void)
+{
+  TRACE_ENTER();
+  TRACE_LEAVE();
+  return FirmwarePackage_MakeFullPath(NULL, FWPKG_CACHE_DIR_NAME);
+}
@@ -20,6 +20,14 @@
 SSE_BEGIN_C_DECLS
 
 #include <sseutils.h>
+#include "zip_stream.h"
+#include "delta_patch.h"
+#include "firmware_conf.h"
+#include "slot_installer.h"
+#include "manifest_verifier.h"
+#include "rsa_public_key.h"
+#include "signed_manifest.h"
+#include "worker_process.h"
 
 typedef struct TFirmwarePackage_ TFirmwarePackage;
 
@@ -29,20 +37,30 @@ struct TFirmwarePackage_ {
   sse_char *fPackageFilePath;
   sse_char *fPackageDirPath;
   TSseUtilShellCommand *fCurrentCommand;
+  TZipStream *fStream;
+  sse_bool fStreamEnabled;
+  TWorkerProcess *fWorker;
+  TManifestVerifier *fVerifier;
+  TRsaPublicKey *fPublicKey;
+  TSignedManifest *fManifest;
   FirmwarePackage_CommandCallback fCommandCallback;
   sse_pointer fCommandUserData;
 };
 
 TFirmwarePackage * FirmwarePackage_New(void);
 void TFirmwarePackage_Delete(TFirmwarePackage *self);
+sse_int TFirmwarePackage_BeginStreamExtract(TFirmwarePackage *self);
+void TFirmwarePackage_WriteStream(TFirmwarePackage *self, sse_byte *in_data, sse_size in_len);
 sse_int TFirmwarePackage_Extract(TFirmwarePackage *self, FirmwarePackage_CommandCallback in_callback, sse_pointer in_user_data);
 sse_bool TFirmwarePackage_Verify(TFirmwarePackage *self);
-sse_int TFirmwarePackage_InvokeUpdate(TFirmwarePackage *self);
+sse_int TFirmwarePackage_VerifyImages(TFirmwarePackage *self, FirmwarePackage_CommandCallback in_callback, sse_pointer in_user_data);
+sse_int TFirmwarePackage_InvokeUpdate(TFirmwarePackage *self, sse_uint in_timeout_sec, FirmwarePackage_CommandCallback in_callback, sse_pointer in_user_data);
 sse_int TFirmwarePackage_CheckResult(TFirmwarePackage *self, FirmwarePackage_CommandCallback in_callback, sse_pointer in_user_data);
 void TFirmwarePackage_RemovePackage(TFirmwarePackage *self);
 
 sse_char * FirmwarePackage_GetPackageFilePath(void);
 sse_char * FirmwarePackage_GetPackageDirPath(void);
+sse_char * FirmwarePackage_GetCacheDirPath(void);
 
 SSE_END_C_DECLS
 
@@ -15,6 +15,7 @@
  * http://www.yourinventit.com/
  */
 #include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
@@ -33,15 +34,127 @@
 
 #define FW_UPDATE_ASYNC_KEY "@asyncKey"
 #define FW_UPDATE_STORED_CONTEXT_KEY  "FirmwareUpdateContext"
+#define FW_UPDATE_STORED_STAGED_KEY  "FirmwareStagedPackage"
+#define FW_UPDATE_PREFETCH_STATE_KEY  "PackagePrefetchState"
+#define FW_UPDATE_PREFETCH_SUFFIX  ".next"
+#define FW_UPDATE_DEFAULT_TIMEOUT_SEC  (2 * 60 * 60)
+#define FW_UPDATE_DEFAULT_MAX_CONNECTIONS  (4)
+#define FW_UPDATE_NOTIFICATION_BACKLOG_MSEC  (10 * 1000)
+#define FW_UPDATE_PROGRESS_POLL_SEC  (1)
+#define FW_UPDATE_RETRY_BASE_SEC  (2)
+#define FW_UPDATE_RETRY_MAX_SEC  (5 * 60)
+#define FW_UPDATE_MAX_RETRY_ROUNDS  (5)
+#define FW_UPDATE_MAX_RESUMES  (3)
+
+enum FirmwareUpdaterState_ {
+  FW_UPDATE_STATE_IDLE,
+  FW_UPDATE_STATE_SCHEDULED,
+  FW_UPDATE_STATE_DOWNLOADING,
+  FW_UPDATE_STATE_EXTRACTING,
+  FW_UPDATE_STATE_STAGED,
+  FW_UPDATE_STATE_UPDATING,
+  FW_UPDATE_STATE_CHECKING
+};
 
 /* FirmwareUpdater private */
 
+static void FirmwareUpdater_OnDownloaded(TPackageDownloader *in_dl, sse_int in_err, sse_pointer in_user_data);
+static sse_bool FirmwareUpdater_OnSchedule(sse_int in_timer_id, sse_pointer in_user_data);
+static sse_bool FirmwareUpdater_OnQueue(sse_int in_timer_id, sse_pointer in_user_data);
+
+static void
+TFirmwareUpdater_StopProgress(TFirmwareUpdater *self)
+{
+  if (self->fProgressTimer != NULL && self->fProgressTimerId >= 0) {
+    moat_timer_cancel(self->fProgressTimer, self->fProgressTimerId);
+  }
+  self->fProgressTimerId = -1;
+}
+
+static sse_bool
+FirmwareUpdater_OnProgressTimer(sse_int in_timer_id, sse_pointer in_user_data)
+{
+  TFirmwareUpdater *self = (TFirmwareUpdater *)in_user_data;
+  sse_int64 received;
+  sse_int64 total;
+
+  self->fProgressTimerId = -1;
+  if (self->fDownloader == NULL || self->fAsyncKey == NULL) {
+    return sse_false;
+  }
+  TPackageDownloader_GetProgress(self->fDownloader, &received, &total);
+  TDownloadInfoModel_NotifyProgress(&self->fInfo, self->fAsyncKey, DOWNLOAD_INFO_MODEL_STAGE_DOWNLOADING, received, total);
+  TUpdateJournal_SetOffset(self->fJournal, received);
+  self->fProgressTimerId = moat_timer_set(self->fProgressTimer, FW_UPDATE_PROGRESS_POLL_SEC, FirmwareUpdater_OnProgressTimer, self);
+  return sse_false;
+}
+
+/*
+ * Samples the download once a second. The model decides what of it is
+ * worth a notification.
+ */
+static void
+TFirmwareUpdater_StartProgress(TFirmwareUpdater *self)
+{
+  if (self->fProgressTimer == NULL) {
+    self->fProgressTimer = moat_timer_new();
+    if (self->fProgressTimer == NULL) {
+      LOG_ERROR("failed to moat_timer_new(). progress will not be reported.");
+      return;
+    }
+  }
+  TDownloadInfoModel_ResetProgress(&self->fInfo);
+  TDownloadInfoModel_NotifyProgress(&self->fInfo, self->fAsyncKey, DOWNLOAD_INFO_MODEL_STAGE_DOWNLOADING, 0, -1);
+  self->fProgressTimerId = moat_timer_set(self->fProgressTimer, FW_UPDATE_PROGRESS_POLL_SEC, FirmwareUpdater_OnProgressTimer, self);
+  if (self->fProgressTimerId < 0) {
+    LOG_ERROR("failed to moat_timer_set(). err=%s", sse_get_error_string(self->fProgressTimerId));
+  }
+}
+
+/*
+ * Lets the next queued job start once the current one has let go. The job
+ * is started from a timer so that it never runs inside the callbacks of
+ * the job before it.
+ */
+static void
+TFirmwareUpdater_KickQueue(TFirmwareUpdater *self)
+{
+  if (self->fQueue == NULL || TUpdateQueue_IsEmpty(self->fQueue) || self->fQueueTimerId >= 0) {
+    return;
+  }
+  if (self->fQueueTimer == NULL) {
+    self->fQueueTimer = moat_timer_new();
+    if (self->fQueueTimer == NULL) {
+      LOG_ERROR("failed to moat_timer_new().");
+      return;
+    }
+  }
+  self->fQueueTimerId = moat_timer_set(self->fQueueTimer, 1, FirmwareUpdater_OnQueue, self);
+  if (self->fQueueTimerId < 0) {
+    LOG_ERROR("failed to moat_timer_set(). err=%s", sse_get_error_string(self->fQueueTimerId));
+    self->fQueueTimerId = -1;
+  }
+}
+
 static void
 TFirmwareUpdater_Clear(TFirmwareUpdater *self)
 {
   TRACE_ENTER();
+  TFirmwareUpdater_StopProgress(self);
+  if (self->fRetryTimer != NULL && self->fRetryTimerId >= 0) {
+    moat_timer_cancel(self->fRetryTimer, self->fRetryTimerId);
+  }
+  self->fRetryTimerId = -1;
+  if (self->fScheduleTimer != NULL && self->fScheduleTimerId >= 0) {
+    moat_timer_cancel(self->fScheduleTimer, self->fScheduleTimerId);
+  }
+  self->fScheduleTimerId = -1;
+  if (self->fMirrors != NULL) {
+    TMirrorList_Delete(self->fMirrors);
+    self->fMirrors = NULL;
+  }
   if (self->fDownloader != NULL) {
-    moat_downloader_free(self->fDownloader);
+    TPackageDownloader_Delete(self->fDownloader);
     self->fDownloader = NULL;
   }
   if (self->fAsyncKey != NULL) {
@@ -52,6 +165,15 @@ TFirmwareUpdater_Clear(TFirmwareUpdater *self)
     TFirmwarePackage_Delete(self->fPackage);
     self->fPackage = NULL;
   }
+  if (self->fRateLimiter != NULL) {
+    TRateLimiter_Delete(self->fRateLimiter);
+    self->fRateLimiter = NULL;
+  }
+  if (self->fJournal != NULL) {
+    TUpdateJournal_End(self->fJournal);
+  }
+  self->fState = FW_UPDATE_STATE_IDLE;
+  TFirmwareUpdater_KickQueue(self);
   TRACE_LEAVE();
 }
 
@@ -91,6 +213,202 @@ error_exit:
   return err;
 }
 
+static sse_int
+TFirmwareUpdater_HandleUpdateResult(TFirmwareUpdater *self, sse_int in_err, sse_char *in_err_info)
+{
+  TRACE_ENTER();
+  if (in_err != SSE_E_OK) {
+    LOG_ERROR("failed to update. err=%s", sse_get_error_string(in_err));
+    moat_datastore_remove_object(self->fMoat, FW_UPDATE_STORED_CONTEXT_KEY);
+    TDownloadInfoModel_NotifyResult(&self->fInfo, self->fAsyncKey, in_err, in_err_info);
+    TFirmwareUpdater_Clear(self);
+  } else {
+    /* the result is checked by check_result.sh after the device has restarted */
+    LOG_INFO("update command has been completed.");
+  }
+  TRACE_LEAVE();
+  return SSE_E_OK;
+}
+
+static sse_int
+FirmwareUpdater_OnUpdated(TFirmwarePackage *package, sse_int in_err, sse_char *in_err_info, sse_pointer in_user_data)
+{
+  int err;
+  TRACE_ENTER();
+  err = TFirmwareUpdater_HandleUpdateResult((TFirmwareUpdater *)in_user_data, in_err, in_err_info);
+  LOG_DEBUG("in_err=%s, in_err_info=%s, err=%s", sse_get_error_string(in_err), in_err_info, sse_get_error_string(err));
+  TRACE_LEAVE();
+  return err;
+}
+
+static sse_uint
+TFirmwareUpdater_GetUpdateTimeout(TFirmwareUpdater *self)
+{
+  MoatObject *obj;
+  sse_int32 timeout;
+
+  obj = TDownloadInfoModel_GetModelObject(&self->fInfo);
+  if (obj == NULL || moat_object_get_int32_value(obj, DOWNLOAD_INFO_MODEL_FIELD_UPDATE_TIMEOUT, &timeout) != SSE_E_OK || timeout < 0) {
+    return FW_UPDATE_DEFAULT_TIMEOUT_SEC;
+  }
+  return (sse_uint)timeout;
+}
+
+static sse_int
+FirmwareUpdater_GetMaxConnections(MoatObject *in_info_obj)
+{
+  sse_int32 max_connections;
+
+  if (moat_object_get_int32_value(in_info_obj, DOWNLOAD_INFO_MODEL_FIELD_MAX_CONNECTIONS, &max_connections) != SSE_E_OK || max_connections < 1) {
+    return FW_UPDATE_DEFAULT_MAX_CONNECTIONS;
+  }
+  return max_connections;
+}
+
+static sse_uint
+FirmwareUpdater_GetProgressInterval(MoatObject *in_info_obj)
+{
+  sse_int32 interval;
+
+  if (moat_object_get_int32_value(in_info_obj, DOWNLOAD_INFO_MODEL_FIELD_PROGRESS_INTERVAL, &interval) != SSE_E_OK || interval < 0) {
+    return DOWNLOAD_INFO_MODEL_DEFAULT_PROGRESS_INTERVAL_SEC;
+  }
+  return (sse_uint)interval;
+}
+
+/*
+ * Start time of a job in seconds since the epoch, spread at random over
+ * startJitter seconds. 0 when the job is due now.
+ */
+static sse_int64
+FirmwareUpdater_GetStartTime(MoatObject *in_info_obj)
+{
+  sse_int64 now = moat_get_timestamp_sec();
+  sse_int64 start_at;
+  sse_int32 jitter;
+
+  if (moat_object_get_int64_value(in_info_obj, DOWNLOAD_INFO_MODEL_FIELD_START_AT, &start_at) != SSE_E_OK || start_at < now) {
+    start_at = now;
+  }
+  if (moat_object_get_int32_value(in_info_obj, DOWNLOAD_INFO_MODEL_FIELD_START_JITTER, &jitter) == SSE_E_OK && jitter > 0) {
+    start_at += random() % ((sse_int64)jitter + 1);
+  }
+  return (start_at > now) ? start_at : 0;
+}
+
+static sse_int64
+FirmwareUpdater_GetApplyTime(MoatObject *in_info_obj)
+{
+  sse_int64 apply_at;
+
+  if (moat_object_get_int64_value(in_info_obj, DOWNLOAD_INFO_MODEL_FIELD_APPLY_AT, &apply_at) != SSE_E_OK ||
+      apply_at <= (sse_int64)moat_get_timestamp_sec()) {
+    return 0;
+  }
+  return apply_at;
+}
+
+static sse_bool
+FirmwareUpdater_IsUplinkCongested(TRateLimiter *in_limiter, sse_pointer in_user_data)
+{
+  TFirmwareUpdater *self = (TFirmwareUpdater *)in_user_data;
+
+  return TDownloadInfoModel_IsNotificationBacklogged(&self->fInfo, FW_UPDATE_NOTIFICATION_BACKLOG_MSEC);
+}
+
+static sse_int
+TFirmwareUpdater_NewRateLimiter(TFirmwareUpdater *self, MoatObject *in_info_obj, TRateLimiter **out_limiter)
+{
+  TRateLimiter *limiter;
+  sse_int32 rate;
+  sse_char *profiles;
+  sse_uint profiles_len;
+  sse_int err;
+
+  *out_limiter = NULL;
+  limiter = RateLimiter_New();
+  if (limiter == NULL) {
+    LOG_ERROR("failed to RateLimiter_New().");
+    return SSE_E_NOMEM;
+  }
+  if (moat_object_get_int32_value(in_info_obj, DOWNLOAD_INFO_MODEL_FIELD_MAX_RATE, &rate) == SSE_E_OK) {
+    TRateLimiter_SetRate(limiter, rate);
+  }
+  if (moat_object_get_string_value(in_info_obj, DOWNLOAD_INFO_MODEL_FIELD_RATE_PROFILES, &profiles, &profiles_len) == SSE_E_OK &&
+      profiles_len > 0) {
+    err = TRateLimiter_SetProfiles(limiter, profiles, profiles_len);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("invalid %s.", DOWNLOAD_INFO_MODEL_FIELD_RATE_PROFILES);
+      TRateLimiter_Delete(limiter);
+      return err;
+    }
+  }
+  /* firmware transfers give way whenever the uplink is backed up */
+  TRateLimiter_SetCongestionCallback(limiter, FirmwareUpdater_IsUplinkCongested, self);
+  *out_limiter = limiter;
+  return SSE_E_OK;
+}
+
+static sse_int64
+FirmwareUpdater_GetCacheBudget(MoatObject *in_info_obj)
+{
+  sse_int64 budget;
+
+  if (moat_object_get_int64_value(in_info_obj, DOWNLOAD_INFO_MODEL_FIELD_CACHE_BUDGET, &budget) != SSE_E_OK || budget < 0) {
+    return PACKAGE_CACHE_DEFAULT_BUDGET;
+  }
+  return budget;
+}
+
+static sse_int
+TFirmwareUpdater_InvokeUpdate(TFirmwareUpdater *self)
+{
+  sse_int err;
+  sse_char *err_info;
+
+  TRACE_ENTER();
+  TUpdateJournal_SetStage(self->fJournal, UPDATE_JOURNAL_STAGE_VERIFIED);
+  TUpdateJournal_SetStage(self->fJournal, UPDATE_JOURNAL_STAGE_APPLYING);
+  err = TFirmwareUpdater_PrepareUpdate(self);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to TFirmwareUpdater_PrepareUpdate(). err=%s", sse_get_error_string(err));
+    err_info = "Failed to prepare update.";
+    goto error_exit;
+  }
+  TDownloadInfoModel_NotifyProgress(&self->fInfo, self->fAsyncKey, DOWNLOAD_INFO_MODEL_STAGE_UPDATING, 0, -1);
+  err = TFirmwarePackage_InvokeUpdate(self->fPackage, TFirmwareUpdater_GetUpdateTimeout(self), FirmwareUpdater_OnUpdated, self);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to TFirmwarePackage_InvokeUpdate(). err=%s", sse_get_error_string(err));
+    err_info = "Failed to update.";
+    moat_datastore_remove_object(self->fMoat, FW_UPDATE_STORED_CONTEXT_KEY);
+    goto error_exit;
+  }
+  TRACE_LEAVE();
+  return SSE_E_OK;
+
+error_exit:
+  TDownloadInfoModel_NotifyResult(&self->fInfo, self->fAsyncKey, err, err_info);
+  TFirmwareUpdater_Clear(self);
+  return err;
+}
+
+static sse_int
+FirmwareUpdater_OnImagesVerified(TFirmwarePackage *package, sse_int in_err, sse_char *in_err_info, sse_pointer in_user_data)
+{
+  TFirmwareUpdater *self = (TFirmwareUpdater *)in_user_data;
+
+  TRACE_ENTER();
+  if (in_err != SSE_E_OK) {
+    LOG_ERROR("failed to verify images. err=%s", sse_get_error_string(in_err));
+    TDownloadInfoModel_NotifyResult(&self->fInfo, self->fAsyncKey, in_err, in_err_info);
+    TFirmwareUpdater_Clear(self);
+    return SSE_E_OK;
+  }
+  TFirmwareUpdater_InvokeUpdate(self);
+  TRACE_LEAVE();
+  return SSE_E_OK;
+}
+
 static sse_int
 TFirmwareUpdater_UpdateFirmware(TFirmwareUpdater *self)
 {
@@ -99,6 +417,7 @@ TFirmwareUpdater_UpdateFirmware(TFirmwareUpdater *self)
   sse_bool ok;
 
   TRACE_ENTER();
+  self->fState = FW_UPDATE_STATE_UPDATING;
   ok = TFirmwarePackage_Verify(self->fPackage);
   if (!ok) {
     LOG_ERROR("failed to TFirmwarePackage_Verify().");
@@ -106,19 +425,144 @@ TFirmwareUpdater_UpdateFirmware(TFirmwareUpdater *self)
     err_info = "Invalid package or state.";
     goto error_exit;
   }
-  err = TFirmwareUpdater_PrepareUpdate(self);
+  /* a corrupt image is caught before anything is written to the device */
+  err = TFirmwarePackage_VerifyImages(self->fPackage, FirmwareUpdater_OnImagesVerified, self);
   if (err != SSE_E_OK) {
-    LOG_ERROR("failed to TFirmwareUpdater_PrepareUpdate(). err=%s", sse_get_error_string(err));
-    err_info = "Failed to prepare update.";
+    LOG_ERROR("failed to TFirmwarePackage_VerifyImages(). err=%s", sse_get_error_string(err));
+    err_info = "Failed to verify images.";
     goto error_exit;
   }
-  err = TFirmwarePackage_InvokeUpdate(self->fPackage);
+  TRACE_LEAVE();
+  return SSE_E_OK;
+
+error_exit:
+  TDownloadInfoModel_NotifyResult(&self->fInfo, self->fAsyncKey, err, err_info);
+  TFirmwareUpdater_Clear(self);
+  return err;
+}
+
+static sse_int
+TFirmwareUpdater_ArmSchedule(TFirmwareUpdater *self, sse_int64 in_run_at)
+{
+  sse_int64 now = moat_get_timestamp_sec();
+  sse_uint delay = 1;
+
+  if (self->fScheduleTimer == NULL) {
+    self->fScheduleTimer = moat_timer_new();
+    if (self->fScheduleTimer == NULL) {
+      LOG_ERROR("failed to moat_timer_new().");
+      return SSE_E_NOMEM;
+    }
+  }
+  if (in_run_at > now + 1) {
+    delay = (sse_uint)(in_run_at - now);
+  }
+  self->fScheduleTimerId = moat_timer_set(self->fScheduleTimer, delay, FirmwareUpdater_OnSchedule, self);
+  if (self->fScheduleTimerId < 0) {
+    LOG_ERROR("failed to moat_timer_set(). err=%s", sse_get_error_string(self->fScheduleTimerId));
+    self->fScheduleTimerId = -1;
+    return SSE_E_GENERIC;
+  }
+  LOG_INFO("job will start in %u sec.", delay);
+  self->fState = FW_UPDATE_STATE_SCHEDULED;
+  return SSE_E_OK;
+}
+
+/*
+ * Records a job together with the current DownloadInfo and lets it wait
+ * until in_run_at.
+ */
+static sse_int
+TFirmwareUpdater_Schedule(TFirmwareUpdater *self, sse_int in_command, sse_char *in_key, sse_int64 in_run_at)
+{
+  sse_int err;
+
+  TRACE_ENTER();
+  err = TUpdateJournal_Begin(self->fJournal, TDownloadInfoModel_GetModelObject(&self->fInfo), in_key, in_command, in_run_at);
   if (err != SSE_E_OK) {
-    LOG_ERROR("failed to TFirmwarePackage_InvokeUpdate(). err=%s", sse_get_error_string(err));
-    err_info = "Failed to update.";
-    moat_datastore_remove_object(self->fMoat, FW_UPDATE_STORED_CONTEXT_KEY);
+    LOG_ERROR("failed to TUpdateJournal_Begin(). err=%s", sse_get_error_string(err));
+    return err;
+  }
+  err = TFirmwareUpdater_ArmSchedule(self, in_run_at);
+  if (err != SSE_E_OK) {
+    TUpdateJournal_End(self->fJournal);
+  }
+  TRACE_LEAVE();
+  return err;
+}
+
+/*
+ * Takes the recorded job back: its DownloadInfo becomes the model object.
+ */
+static sse_int
+TFirmwareUpdater_RestoreJob(TFirmwareUpdater *self, sse_char **out_key)
+{
+  MoatObject *info;
+  sse_int err;
+
+  TRACE_ENTER();
+  info = TUpdateJournal_CopyInfo(self->fJournal);
+  if (info == NULL) {
+    return SSE_E_NOMEM;
+  }
+  err = TDownloadInfoModel_SetModelObject(&self->fInfo, info);
+  moat_object_free(info);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to TDownloadInfoModel_SetModelObject(). err=%s", sse_get_error_string(err));
+    return err;
+  }
+  *out_key = TUpdateJournal_CopyKey(self->fJournal);
+  if (*out_key == NULL) {
+    LOG_ERROR("failed to alloc async key.");
+    return SSE_E_NOMEM;
+  }
+  TRACE_LEAVE();
+  return SSE_E_OK;
+}
+
+static sse_int
+TFirmwareUpdater_StagePackage(TFirmwareUpdater *self, sse_int64 in_apply_at)
+{
+  MoatObject *obj;
+  sse_char *key;
+  sse_int err = SSE_E_OK;
+  sse_char *err_info = "";
+  sse_bool ok;
+
+  TRACE_ENTER();
+  ok = TFirmwarePackage_Verify(self->fPackage);
+  if (!ok) {
+    LOG_ERROR("failed to TFirmwarePackage_Verify().");
+    err = SSE_E_INVAL;
+    err_info = "Invalid package or state.";
+    goto error_exit;
+  }
+  TUpdateJournal_SetStage(self->fJournal, UPDATE_JOURNAL_STAGE_VERIFIED);
+  obj = TDownloadInfoModel_GetModelObject(&self->fInfo);
+  err = moat_datastore_save_object(self->fMoat, FW_UPDATE_STORED_STAGED_KEY, obj);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to save staged package. err=%s", sse_get_error_string(err));
+    err_info = "Failed to stage package.";
     goto error_exit;
   }
+  LOG_INFO("package has been staged.");
+  if (in_apply_at > 0) {
+    key = self->fAsyncKey;
+    self->fAsyncKey = NULL;
+    TFirmwareUpdater_Clear(self);
+    err = TFirmwareUpdater_Schedule(self, DOWNLOAD_INFO_MODEL_COMMAND_APPLY, key, in_apply_at);
+    if (err != SSE_E_OK) {
+      /* the package stays staged for a later "apply" */
+      TDownloadInfoModel_NotifyResult(&self->fInfo, key, err, "Failed to schedule apply.");
+      self->fState = FW_UPDATE_STATE_STAGED;
+    }
+    sse_free(key);
+    TRACE_LEAVE();
+    return err;
+  }
+  TDownloadInfoModel_NotifyStaged(&self->fInfo, self->fAsyncKey);
+  TFirmwareUpdater_Clear(self);
+  self->fState = FW_UPDATE_STATE_STAGED;
   TRACE_LEAVE();
   return SSE_E_OK;
 
@@ -128,16 +572,77 @@ error_exit:
   return err;
 }
 
+/*
+ * Installs the package which a former "download" has left extracted. The
+ * staged record is consumed here; from now on the update context takes
+ * over as it does for "downloadAndUpdate".
+ */
+static sse_int
+TFirmwareUpdater_ApplyStaged(TFirmwareUpdater *self, sse_char *in_key)
+{
+  MoatObject *staged = NULL;
+  sse_int err;
+
+  TRACE_ENTER();
+  err = moat_datastore_load_object(self->fMoat, FW_UPDATE_STORED_STAGED_KEY, &staged);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("no staged package. err=%s", sse_get_error_string(err));
+    err = SSE_E_NOENT;
+    if (TDownloadInfoModel_GetModelObject(&self->fInfo) != NULL) {
+      TDownloadInfoModel_NotifyResult(&self->fInfo, in_key, err, "No staged package.");
+    }
+    TFirmwareUpdater_Clear(self);
+    return err;
+  }
+  moat_datastore_remove_object(self->fMoat, FW_UPDATE_STORED_STAGED_KEY);
+  err = TDownloadInfoModel_SetModelObject(&self->fInfo, staged);
+  moat_object_free(staged);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to TDownloadInfoModel_SetModelObject(). err=%s", sse_get_error_string(err));
+    goto error_exit;
+  }
+  self->fAsyncKey = sse_strdup(in_key);
+  if (self->fAsyncKey == NULL) {
+    LOG_ERROR("failed to duplicate key.");
+    err = SSE_E_NOMEM;
+    goto error_exit;
+  }
+  self->fPackage = FirmwarePackage_New();
+  if (self->fPackage == NULL) {
+    LOG_ERROR("failed to FirmwarePackage_New().");
+    err = SSE_E_NOMEM;
+    goto error_exit;
+  }
+  err = TFirmwareUpdater_UpdateFirmware(self);
+  TRACE_LEAVE();
+  return err;
+
+error_exit:
+  TDownloadInfoModel_NotifyResult(&self->fInfo, in_key, err, "Failed to apply staged package.");
+  TFirmwareUpdater_Clear(self);
+  return err;
+}
+
 static sse_int
 TFirmwareUpdater_HandleExtractResult(TFirmwareUpdater *self, sse_int in_err, sse_char *in_err_info)
 {
   sse_int err = in_err;
+  sse_int64 apply_at = 0;
 
   TRACE_ENTER();
   if (in_err != SSE_E_OK) {
     LOG_ERROR("failed to extract. err=%s", sse_get_error_string(in_err));
     TDownloadInfoModel_NotifyResult(&self->fInfo, self->fAsyncKey, err, in_err_info);
     TFirmwareUpdater_Clear(self);
+    TRACE_LEAVE();
+    return SSE_E_OK;
+  }
+  TUpdateJournal_SetStage(self->fJournal, UPDATE_JOURNAL_STAGE_EXTRACTED);
+  if (self->fApplyWhenStaged) {
+    apply_at = FirmwareUpdater_GetApplyTime(TDownloadInfoModel_GetModelObject(&self->fInfo));
+  }
+  if (!self->fApplyWhenStaged || apply_at > 0) {
+    TFirmwareUpdater_StagePackage(self, apply_at);
   } else {
     TFirmwareUpdater_UpdateFirmware(self);
   }
@@ -150,38 +655,276 @@ FirmwareUpdater_OnExtracted(TFirmwarePackage *package, sse_int in_err, sse_char
 {
   int err;
   TRACE_ENTER();
-  err = TFirmwareUpdater_HandleExtractResult((TFirmwareUpdater *)in_user_data, in_err, in_err_info);
-  LOG_DEBUG("in_err=%s, in_err_info=%s, err=%s", sse_get_error_string(in_err), in_err_info, sse_get_error_string(err));
+  err = TFirmwareUpdater_HandleExtractResult((TFirmwareUpdater *)in_user_data, in_err, in_err_info);
+  LOG_DEBUG("in_err=%s, in_err_info=%s, err=%s", sse_get_error_string(in_err), in_err_info, sse_get_error_string(err));
+  TRACE_LEAVE();
+  return err;
+}
+
+static sse_int
+TFirmwareUpdater_ExtractPackage(TFirmwareUpdater *self)
+{
+  TFirmwarePackage *package = NULL;
+  sse_int err;
+
+  TRACE_ENTER();
+  package = self->fPackage;
+  if (package == NULL) {
+    package = FirmwarePackage_New();
+    if (package == NULL) {
+      LOG_ERROR("failed to FirmwarePackage_New().");
+      return SSE_E_NOMEM;
+    }
+    self->fPackage = package;
+  }
+  err = TFirmwarePackage_Extract(package, FirmwareUpdater_OnExtracted, self);
+  if (err != SSE_E_OK) {
+    goto error_exit;
+  }
+  TRACE_LEAVE();
+  return SSE_E_OK;
+
+error_exit:
+  if (package != NULL) {
+    TFirmwarePackage_Delete(package);
+    self->fPackage = NULL;
+  }
+  return err;
+}
+
+static sse_int
+TFirmwareUpdater_StartDownload(TFirmwareUpdater *self)
+{
+  sse_char *url;
+  sse_char *file_path;
+  sse_int64 total;
+  sse_int err;
+
+  url = TMirrorList_GetCurrent(self->fMirrors);
+  file_path = FirmwarePackage_GetPackageFilePath();
+  if (file_path == NULL) {
+    LOG_ERROR("failed to create download path.");
+    return SSE_E_NOMEM;
+  }
+  LOG_INFO("download from [%s]", url);
+  err = TPackageDownloader_Download(self->fDownloader, url, sse_strlen(url), file_path, FirmwareUpdater_OnDownloaded, self);
+  sse_free(file_path);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to TPackageDownloader_Download(). err=%s", sse_get_error_string(err));
+    return err;
+  }
+  self->fAttemptStartedAt = moat_get_timestamp_msec();
+  TPackageDownloader_GetProgress(self->fDownloader, &self->fAttemptStartBytes, &total);
+  return SSE_E_OK;
+}
+
+static sse_bool
+FirmwareUpdater_OnRetry(sse_int in_timer_id, sse_pointer in_user_data)
+{
+  TFirmwareUpdater *self = (TFirmwareUpdater *)in_user_data;
+  sse_int err;
+
+  self->fRetryTimerId = -1;
+  err = TFirmwareUpdater_StartDownload(self);
+  if (err != SSE_E_OK) {
+    FirmwareUpdater_OnDownloaded(self->fDownloader, err, self);
+  }
+  return sse_false;
+}
+
+/*
+ * Schedules another attempt after a failed one. Transient errors are retried
+ * after a backoff, on the next mirror when the package has a digest to resume
+ * it by and on the same mirror otherwise; a mirror that has answered with a
+ * client error or a wrong package is not asked again in this job.
+ */
+static sse_int
+TFirmwareUpdater_RetryDownload(TFirmwareUpdater *self, sse_int in_err)
+{
+  sse_bool drop;
+  sse_bool next;
+  sse_uint delay;
+  sse_int id;
+
+  if (self->fMirrors == NULL || self->fDownloader == NULL) {
+    return in_err;
+  }
+  switch (in_err) {
+  case SSE_E_GENERIC:
+  case SSE_E_AGAIN:
+  case SSE_E_TIMEDOUT:
+  case SSE_E_INTR:
+  case SSE_E_NOTCONN:
+  case SSE_E_PROTO:
+    drop = sse_false;
+    break;
+  case SSE_E_INVAL:
+  case SSE_E_NOENT:
+  case SSE_E_ACCES:
+    drop = sse_true;
+    break;
+  default:
+    return in_err;
+  }
+  TMirrorList_ReportFailure(self->fMirrors);
+  if (drop) {
+    LOG_INFO("[%s] is dropped. err=%s", TMirrorList_GetCurrent(self->fMirrors), sse_get_error_string(in_err));
+    TMirrorList_Drop(self->fMirrors);
+  }
+  if (drop || TPackageDownloader_HasExpectedDigest(self->fDownloader)) {
+    next = TMirrorList_Advance(self->fMirrors);
+  } else {
+    /* another mirror would not take over the partial package */
+    next = TMirrorList_Repeat(self->fMirrors);
+  }
+  if (!next || TMirrorList_GetRound(self->fMirrors) >= FW_UPDATE_MAX_RETRY_ROUNDS) {
+    return in_err;
+  }
+  delay = drop ? 1 : TMirrorList_GetBackoff(self->fMirrors, FW_UPDATE_RETRY_BASE_SEC, FW_UPDATE_RETRY_MAX_SEC);
+  if (self->fRetryTimer == NULL) {
+    self->fRetryTimer = moat_timer_new();
+    if (self->fRetryTimer == NULL) {
+      LOG_ERROR("failed to moat_timer_new().");
+      return in_err;
+    }
+  }
+  id = moat_timer_set(self->fRetryTimer, SSE_MAX(delay, 1), FirmwareUpdater_OnRetry, self);
+  if (id < 0) {
+    LOG_ERROR("failed to moat_timer_set(). err=%s", sse_get_error_string(id));
+    return in_err;
+  }
+  self->fRetryTimerId = id;
+  LOG_INFO("download will be retried in %u sec. err=%s, round=%u", SSE_MAX(delay, 1), sse_get_error_string(in_err),
+    TMirrorList_GetRound(self->fMirrors));
+  return SSE_E_OK;
+}
+
+static sse_char *
+FirmwareUpdater_GetPrefetchFilePath(void)
+{
+  sse_char *path;
+  sse_char *prefetch_path;
+  sse_size len;
+
+  path = FirmwarePackage_GetPackageFilePath();
+  if (path == NULL) {
+    return NULL;
+  }
+  len = sse_strlen(path) + sse_strlen(FW_UPDATE_PREFETCH_SUFFIX);
+  prefetch_path = sse_malloc(len + 1);
+  if (prefetch_path != NULL) {
+    snprintf(prefetch_path, len + 1, "%s%s", path, FW_UPDATE_PREFETCH_SUFFIX);
+  }
+  sse_free(path);
+  return prefetch_path;
+}
+
+static void
+TFirmwareUpdater_StopPrefetch(TFirmwareUpdater *self)
+{
+  if (self->fPrefetcher != NULL) {
+    TPackageDownloader_Delete(self->fPrefetcher);
+    self->fPrefetcher = NULL;
+  }
+  /* the limiter goes after the downloader which refers to it */
+  if (self->fPrefetchLimiter != NULL) {
+    TRateLimiter_Delete(self->fPrefetchLimiter);
+    self->fPrefetchLimiter = NULL;
+  }
+}
+
+static void
+FirmwareUpdater_OnPrefetched(TPackageDownloader *in_dl, sse_int in_err, sse_pointer in_user_data)
+{
+  TFirmwareUpdater *self = (TFirmwareUpdater *)in_user_data;
+  sse_char *file_path;
+
+  TRACE_ENTER();
+  LOG_INFO("prefetch has ended. err=%s", sse_get_error_string(in_err));
+  /* a verified package has been linked into the cache */
+  TPackageDownloader_ClearState(self->fPrefetcher);
+  TFirmwareUpdater_StopPrefetch(self);
+  file_path = FirmwareUpdater_GetPrefetchFilePath();
+  if (file_path != NULL) {
+    unlink(file_path);
+    sse_free(file_path);
+  }
+  if (self->fStartAfterPrefetch) {
+    self->fStartAfterPrefetch = sse_false;
+    TFirmwareUpdater_KickQueue(self);
+  }
   TRACE_LEAVE();
-  return err;
 }
 
-static sse_int
-TFirmwareUpdater_ExtractPackage(TFirmwareUpdater *self)
+/*
+ * Fetches the package of the next queued job into the cache while the
+ * current job extracts and installs its own. Only a package with a digest
+ * can be cached, so others are left to their job.
+ */
+static void
+TFirmwareUpdater_Prefetch(TFirmwareUpdater *self)
 {
-  TFirmwarePackage *package = NULL;
-  sse_int err;
+  TUpdateJob *next;
+  TPackageDownloader *downloader = NULL;
+  TRateLimiter *limiter = NULL;
+  sse_char *file_path = NULL;
+  sse_char *url;
+  sse_uint url_len;
+  sse_char *digest;
+  sse_uint digest_len;
+  sse_int err = SSE_E_NOMEM;
 
+  if (self->fCache == NULL || self->fPrefetcher != NULL) {
+    return;
+  }
+  next = TUpdateQueue_Peek(self->fQueue);
+  if (next == NULL || next->fCommand == DOWNLOAD_INFO_MODEL_COMMAND_APPLY ||
+      moat_object_get_string_value(next->fInfo, DOWNLOAD_INFO_MODEL_FIELD_URL, &url, &url_len) != SSE_E_OK ||
+      moat_object_get_string_value(next->fInfo, DOWNLOAD_INFO_MODEL_FIELD_SHA256, &digest, &digest_len) != SSE_E_OK) {
+    return;
+  }
   TRACE_ENTER();
-  package = FirmwarePackage_New();
-  if (package == NULL) {
-    LOG_ERROR("failed to FirmwarePackage_New().");
-    return SSE_E_NOMEM;
+  downloader = PackageDownloader_New(self->fMoat);
+  file_path = FirmwareUpdater_GetPrefetchFilePath();
+  if (downloader == NULL || file_path == NULL) {
+    goto error_exit;
   }
-  self->fPackage = package;
-  err = TFirmwarePackage_Extract(package, FirmwareUpdater_OnExtracted, self);
+  err = TPackageDownloader_SetExpectedDigest(downloader, digest, digest_len);
+  if (err == SSE_E_OK) {
+    err = TPackageDownloader_SetStateKey(downloader, FW_UPDATE_PREFETCH_STATE_KEY);
+  }
+  if (err != SSE_E_OK) {
+    goto error_exit;
+  }
+  TPackageDownloader_SetCache(downloader, self->fCache);
+  /* the next job's transfer obeys its own rate settings */
+  err = TFirmwareUpdater_NewRateLimiter(self, next->fInfo, &limiter);
+  if (err != SSE_E_OK) {
+    goto error_exit;
+  }
+  TPackageDownloader_SetRateLimiter(downloader, limiter);
+  err = TPackageDownloader_Download(downloader, url, url_len, file_path, FirmwareUpdater_OnPrefetched, self);
   if (err != SSE_E_OK) {
     goto error_exit;
   }
+  LOG_INFO("prefetch package for key=%s", next->fKey);
+  self->fPrefetcher = downloader;
+  self->fPrefetchLimiter = limiter;
+  sse_free(file_path);
   TRACE_LEAVE();
-  return SSE_E_OK;
+  return;
 
 error_exit:
-  if (package != NULL) {
-    TFirmwarePackage_Delete(package);
-    self->fPackage = NULL;
+  LOG_ERROR("failed to prefetch. err=%s", sse_get_error_string(err));
+  if (downloader != NULL) {
+    TPackageDownloader_Delete(downloader);
+  }
+  if (limiter != NULL) {
+    TRateLimiter_Delete(limiter);
+  }
+  if (file_path != NULL) {
+    sse_free(file_path);
   }
-  return err;
 }
 
 static sse_int
@@ -189,16 +932,36 @@ TFirmwareUpdater_HandleDownloadResult(TFirmwareUpdater *self, sse_int in_err)
 {
   sse_int err = in_err;
   sse_char *err_info = "";
+  sse_int64 received = 0;
+  sse_int64 total = -1;
 
   TRACE_ENTER();
+  if (err != SSE_E_OK && TFirmwareUpdater_RetryDownload(self, err) == SSE_E_OK) {
+    TRACE_LEAVE();
+    return SSE_E_OK;
+  }
+  TFirmwareUpdater_StopProgress(self);
   if (self->fDownloader != NULL) {
-    moat_downloader_free(self->fDownloader);
+    TPackageDownloader_GetProgress(self->fDownloader, &received, &total);
+    if (err == SSE_E_OK && self->fMirrors != NULL) {
+      TMirrorList_ReportSuccess(self->fMirrors, received - self->fAttemptStartBytes,
+        moat_get_timestamp_msec() - self->fAttemptStartedAt, TPackageDownloader_GetLatency(self->fDownloader));
+    }
+    TPackageDownloader_Delete(self->fDownloader);
     self->fDownloader = NULL;
   }
-  if (err != SSE_E_OK) {
+  if (err == SSE_E_INVAL) {
+    LOG_ERROR("package digest mismatch.");
+    err_info = "Package digest mismatch.";
+  } else if (err != SSE_E_OK) {
     LOG_ERROR("failed to download. err=%s", sse_get_error_string(err));
     err_info = "Failed to download package";
   } else {
+    self->fState = FW_UPDATE_STATE_EXTRACTING;
+    TUpdateJournal_SetOffset(self->fJournal, received);
+    TUpdateJournal_SetStage(self->fJournal, UPDATE_JOURNAL_STAGE_DOWNLOADED);
+    TFirmwareUpdater_Prefetch(self);
+    TDownloadInfoModel_NotifyProgress(&self->fInfo, self->fAsyncKey, DOWNLOAD_INFO_MODEL_STAGE_EXTRACTING, received, total);
     err = TFirmwareUpdater_ExtractPackage(self);
     if (err != SSE_E_OK) {
       LOG_ERROR("failed to extract. err=%s", sse_get_error_string(err));
@@ -214,42 +977,45 @@ TFirmwareUpdater_HandleDownloadResult(TFirmwareUpdater *self, sse_int in_err)
 }
 
 static void
-FirmwareUpdater_OnDownloaded(MoatDownloader *in_dl, sse_bool in_canceled, sse_pointer in_user_data)
+FirmwareUpdater_OnDownloaded(TPackageDownloader *in_dl, sse_int in_err, sse_pointer in_user_data)
 {
   int err;
-  int result = in_canceled ? SSE_E_INTR : SSE_E_OK;
 
   TRACE_ENTER();
-  err = TFirmwareUpdater_HandleDownloadResult((TFirmwareUpdater *)in_user_data, result);
+  if (in_err != SSE_E_OK) {
+    LOG_ERROR("err=%s", sse_get_error_string(in_err));
+  }
+  err = TFirmwareUpdater_HandleDownloadResult((TFirmwareUpdater *)in_user_data, in_err);
   LOG_DEBUG("err=%s", sse_get_error_string(err));
   TRACE_LEAVE();
 }
 
 static void
-FirmwareUpdater_OnDownloadError(MoatDownloader *in_dl, sse_int in_err_code, sse_pointer in_user_data)
+FirmwareUpdater_OnDownloadData(TPackageDownloader *in_dl, sse_byte *in_data, sse_size in_len, sse_pointer in_user_data)
 {
-  int err;
-
-  TRACE_ENTER();
-  LOG_ERROR("err=%s", sse_get_error_string(in_err_code));
-  err = TFirmwareUpdater_HandleDownloadResult((TFirmwareUpdater *)in_user_data, in_err_code);
-  LOG_DEBUG("err=%s", sse_get_error_string(err));
-  TRACE_LEAVE();
+  TFirmwarePackage_WriteStream((TFirmwarePackage *)in_user_data, in_data, in_len);
 }
 
 static sse_int
-FirmwareUpdater_OnDownloadAndUpdate(TDownloadInfoModel *in_info, sse_char *in_key, sse_pointer in_user_data)
+TFirmwareUpdater_DownloadPackage(TFirmwareUpdater *updater, TDownloadInfoModel *in_info, sse_char *in_key)
 {
-  TFirmwareUpdater *updater = (TFirmwareUpdater *)in_user_data;
   MoatObject *info_obj = NULL;
-  MoatDownloader *downloader = NULL;
+  TPackageDownloader *downloader = NULL;
+  TFirmwarePackage *package = NULL;
   sse_char *key;
   sse_char *url;
   sse_uint url_len;
-  sse_char *file_path = NULL;
+  sse_char *digest;
+  sse_uint digest_len;
+  sse_char *mirrors;
+  sse_uint mirrors_len;
   sse_int err = SSE_E_INVAL;
 
   TRACE_ENTER();
+  /* a new package replaces the staged one */
+  moat_datastore_remove_object(updater->fMoat, FW_UPDATE_STORED_STAGED_KEY);
+  updater->fState = FW_UPDATE_STATE_DOWNLOADING;
+  TUpdateJournal_SetStage(updater->fJournal, UPDATE_JOURNAL_STAGE_DOWNLOADING);
   key = sse_strdup(in_key);
   if (key == NULL) {
     LOG_ERROR("failed to duplicate key.");
@@ -267,36 +1033,73 @@ FirmwareUpdater_OnDownloadAndUpdate(TDownloadInfoModel *in_info, sse_char *in_ke
     LOG_ERROR("failed to get url.");
     goto error_exit;
   }
-  file_path = FirmwarePackage_GetPackageFilePath();
-  if (file_path == NULL) {
-    LOG_ERROR("failed to create download path.");
+  updater->fMirrors = MirrorList_New(updater->fMoat);
+  if (updater->fMirrors == NULL) {
+    LOG_ERROR("failed to MirrorList_New().");
+    err = SSE_E_NOMEM;
+    goto error_exit;
+  }
+  err = TMirrorList_Add(updater->fMirrors, url, url_len);
+  if (err == SSE_E_OK &&
+      moat_object_get_string_value(info_obj, DOWNLOAD_INFO_MODEL_FIELD_MIRRORS, &mirrors, &mirrors_len) == SSE_E_OK) {
+    err = TMirrorList_AddList(updater->fMirrors, mirrors, mirrors_len);
+  }
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to set up mirrors. err=%s", sse_get_error_string(err));
     goto error_exit;
   }
-  downloader = moat_downloader_new();
+  TMirrorList_Rank(updater->fMirrors);
+  downloader = PackageDownloader_New(updater->fMoat);
   if (downloader == NULL) {
-    LOG_ERROR("failed to moat_downloader_new().");
+    LOG_ERROR("failed to PackageDownloader_New().");
     err = SSE_E_NOMEM;
     goto error_exit;
   }
-  moat_downloader_set_callbacks(downloader, FirmwareUpdater_OnDownloaded, FirmwareUpdater_OnDownloadError, updater);
-  unlink(file_path);
-  err = moat_downloader_download(downloader, url, url_len, file_path);
-  if (err) {
-    LOG_ERROR("failed to moat_downloader_download(). err=%s", sse_get_error_string(err));
+  if (moat_object_get_string_value(info_obj, DOWNLOAD_INFO_MODEL_FIELD_SHA256, &digest, &digest_len) == SSE_E_OK) {
+    err = TPackageDownloader_SetExpectedDigest(downloader, digest, digest_len);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("invalid %s.", DOWNLOAD_INFO_MODEL_FIELD_SHA256);
+      goto error_exit;
+    }
+  }
+  TPackageDownloader_SetMaxSegments(downloader, FirmwareUpdater_GetMaxConnections(info_obj));
+  TDownloadInfoModel_SetProgressInterval(in_info, FirmwareUpdater_GetProgressInterval(info_obj));
+  if (updater->fCache != NULL) {
+    TPackageCache_SetBudget(updater->fCache, FirmwareUpdater_GetCacheBudget(info_obj));
+    TPackageDownloader_SetCache(downloader, updater->fCache);
+  }
+  err = TFirmwareUpdater_NewRateLimiter(updater, info_obj, &updater->fRateLimiter);
+  if (err != SSE_E_OK) {
+    goto error_exit;
+  }
+  TPackageDownloader_SetRateLimiter(downloader, updater->fRateLimiter);
+  package = FirmwarePackage_New();
+  if (package == NULL) {
+    LOG_ERROR("failed to FirmwarePackage_New().");
+    err = SSE_E_NOMEM;
     goto error_exit;
   }
-  sse_free(file_path);
-  updater->fAsyncKey = key;
+  updater->fPackage = package;
+  err = TFirmwarePackage_BeginStreamExtract(package);
+  if (err == SSE_E_OK) {
+    TPackageDownloader_SetDataCallback(downloader, FirmwareUpdater_OnDownloadData, package);
+  } else {
+    LOG_INFO("package will be extracted after download. err=%s", sse_get_error_string(err));
+  }
   updater->fDownloader = downloader;
+  downloader = NULL;
+  err = TFirmwareUpdater_StartDownload(updater);
+  if (err != SSE_E_OK) {
+    goto error_exit;
+  }
+  updater->fAsyncKey = key;
+  TFirmwareUpdater_StartProgress(updater);
   TRACE_LEAVE();
   return SSE_E_OK;
 
 error_exit:
   if (downloader != NULL) {
-    moat_downloader_free(downloader);
-  }
-  if (file_path != NULL) {
-    sse_free(file_path);
+    TPackageDownloader_Delete(downloader);
   }
   TFirmwareUpdater_Clear(updater);
   TDownloadInfoModel_Clear(&updater->fInfo);
@@ -304,6 +1107,179 @@ error_exit:
   return err;
 }
 
+static sse_int
+TFirmwareUpdater_RunCommand(TFirmwareUpdater *self, sse_int in_command, sse_char *in_key)
+{
+  switch (in_command) {
+  case DOWNLOAD_INFO_MODEL_COMMAND_DOWNLOAD_AND_UPDATE:
+    self->fApplyWhenStaged = sse_true;
+    return TFirmwareUpdater_DownloadPackage(self, &self->fInfo, in_key);
+  case DOWNLOAD_INFO_MODEL_COMMAND_DOWNLOAD:
+    self->fApplyWhenStaged = sse_false;
+    return TFirmwareUpdater_DownloadPackage(self, &self->fInfo, in_key);
+  case DOWNLOAD_INFO_MODEL_COMMAND_APPLY:
+    return TFirmwareUpdater_ApplyStaged(self, in_key);
+  default:
+    LOG_ERROR("unknown command. command=%d", in_command);
+    TFirmwareUpdater_Clear(self);
+    return SSE_E_INVAL;
+  }
+}
+
+static sse_bool
+FirmwareUpdater_OnSchedule(sse_int in_timer_id, sse_pointer in_user_data)
+{
+  TFirmwareUpdater *self = (TFirmwareUpdater *)in_user_data;
+  sse_int command;
+  sse_char *key = NULL;
+  sse_int err;
+
+  TRACE_ENTER();
+  self->fScheduleTimerId = -1;
+  self->fState = FW_UPDATE_STATE_IDLE;
+  /* the DownloadInfo may have been changed while the job was waiting */
+  err = TFirmwareUpdater_RestoreJob(self, &key);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to restore job. err=%s", sse_get_error_string(err));
+    TFirmwareUpdater_Clear(self);
+    return sse_false;
+  }
+  command = TUpdateJournal_GetCommand(self->fJournal);
+  LOG_INFO("scheduled job starts. command=%d", command);
+  TFirmwareUpdater_RunCommand(self, command, key);
+  sse_free(key);
+  TRACE_LEAVE();
+  return sse_false;
+}
+
+static sse_int32
+FirmwareUpdater_GetPriority(MoatObject *in_info_obj)
+{
+  sse_int32 priority;
+
+  if (in_info_obj == NULL || moat_object_get_int32_value(in_info_obj, DOWNLOAD_INFO_MODEL_FIELD_PRIORITY, &priority) != SSE_E_OK) {
+    return 0;
+  }
+  return priority;
+}
+
+/*
+ * Starts a job on the current DownloadInfo, or lets it wait for its start
+ * time. A job which can not even be recorded is answered here.
+ */
+static sse_int
+TFirmwareUpdater_StartJob(TFirmwareUpdater *self, sse_int in_command, sse_char *in_key)
+{
+  MoatObject *info_obj;
+  sse_int64 start_at = 0;
+  sse_int err;
+
+  TRACE_ENTER();
+  info_obj = TDownloadInfoModel_GetModelObject(&self->fInfo);
+  if (in_command != DOWNLOAD_INFO_MODEL_COMMAND_APPLY) {
+    start_at = FirmwareUpdater_GetStartTime(info_obj);
+  }
+  if (start_at > 0) {
+    err = TFirmwareUpdater_Schedule(self, in_command, in_key, start_at);
+  } else {
+    err = TUpdateJournal_Begin(self->fJournal, info_obj, in_key, in_command, 0);
+    if (err == SSE_E_OK) {
+      return TFirmwareUpdater_RunCommand(self, in_command, in_key);
+    }
+    LOG_ERROR("failed to TUpdateJournal_Begin(). err=%s", sse_get_error_string(err));
+  }
+  if (err != SSE_E_OK && info_obj != NULL) {
+    TDownloadInfoModel_NotifyResult(&self->fInfo, in_key, err, "Failed to start job.");
+  }
+  TRACE_LEAVE();
+  return err;
+}
+
+/*
+ * Queues a command which has arrived while another job is running. Its
+ * DownloadInfo has replaced the one of the running job in the model, so
+ * that one is put back from the journal.
+ */
+static sse_int
+TFirmwareUpdater_EnqueueJob(TFirmwareUpdater *self, sse_int in_command, sse_char *in_key)
+{
+  MoatObject *info_obj;
+  MoatObject *running;
+  sse_int err;
+
+  TRACE_ENTER();
+  info_obj = TDownloadInfoModel_GetModelObject(&self->fInfo);
+  running = TUpdateJournal_CopyInfo(self->fJournal);
+  if (running != NULL && TUpdateJournal_GetCommand(self->fJournal) == in_command &&
+      UpdateQueue_IsSamePackage(running, info_obj)) {
+    LOG_INFO("same job is running.");
+    err = SSE_E_ALREADY;
+  } else {
+    err = TUpdateQueue_Push(self->fQueue, info_obj, in_key, in_command, FirmwareUpdater_GetPriority(info_obj));
+  }
+  if (running != NULL) {
+    TDownloadInfoModel_SetModelObject(&self->fInfo, running);
+    moat_object_free(running);
+  }
+  if (err == SSE_E_OK && (self->fState == FW_UPDATE_STATE_EXTRACTING || self->fState == FW_UPDATE_STATE_UPDATING)) {
+    TFirmwareUpdater_Prefetch(self);
+  }
+  TRACE_LEAVE();
+  return err;
+}
+
+static sse_int
+FirmwareUpdater_OnCommand(TDownloadInfoModel *in_info, sse_int in_command, sse_char *in_key, sse_pointer in_user_data)
+{
+  TFirmwareUpdater *updater = (TFirmwareUpdater *)in_user_data;
+  sse_int err;
+
+  TRACE_ENTER();
+  if (updater->fState != FW_UPDATE_STATE_IDLE && updater->fState != FW_UPDATE_STATE_STAGED) {
+    LOG_INFO("another job is running. state=%d", updater->fState);
+    return TFirmwareUpdater_EnqueueJob(updater, in_command, in_key);
+  }
+  err = TFirmwareUpdater_StartJob(updater, in_command, in_key);
+  TRACE_LEAVE();
+  return err;
+}
+
+static sse_bool
+FirmwareUpdater_OnQueue(sse_int in_timer_id, sse_pointer in_user_data)
+{
+  TFirmwareUpdater *self = (TFirmwareUpdater *)in_user_data;
+  MoatObject *info;
+  sse_char *key;
+  sse_char *url;
+  sse_uint url_len;
+  sse_int command;
+
+  TRACE_ENTER();
+  self->fQueueTimerId = -1;
+  if (self->fState != FW_UPDATE_STATE_IDLE && self->fState != FW_UPDATE_STATE_STAGED) {
+    /* kicked again when this job has ended */
+    return sse_false;
+  }
+  if (self->fPrefetcher != NULL) {
+    self->fStartAfterPrefetch = sse_true;
+    return sse_false;
+  }
+  TUpdateQueue_Pop(self->fQueue, &info, &key, &command);
+  if (key == NULL) {
+    return sse_false;
+  }
+  LOG_INFO("queued job starts. key=%s, command=%d", key, command);
+  /* "apply" may have been queued without any DownloadInfo */
+  if (moat_object_get_string_value(info, DOWNLOAD_INFO_MODEL_FIELD_URL, &url, &url_len) == SSE_E_OK) {
+    TDownloadInfoModel_SetModelObject(&self->fInfo, info);
+  }
+  TFirmwareUpdater_StartJob(self, command, key);
+  moat_object_free(info);
+  sse_free(key);
+  TRACE_LEAVE();
+  return sse_false;
+}
+
 static sse_int
 TFirmwareUpdater_HandleCheckResult(TFirmwareUpdater *self, sse_int in_err, sse_char *in_err_info)
 {
@@ -326,18 +1302,50 @@ FirmwareUpdater_OnCheckEnded(TFirmwarePackage *package, sse_int in_err, sse_char
   return err;
 }
 
+static sse_int
+TFirmwareUpdater_StartCheck(TFirmwareUpdater *self, sse_char **out_err_info)
+{
+  TFirmwarePackage *package;
+  sse_int err;
+  sse_bool ok;
+
+  package = FirmwarePackage_New();
+  if (package == NULL) {
+    LOG_ERROR("failed to FirmwarePackage_New().");
+    *out_err_info = "Out of memory.";
+    return SSE_E_NOMEM;
+  }
+  ok = TFirmwarePackage_Verify(package);
+  if (!ok) {
+    LOG_ERROR("failed to TFirmwarePackage_Verify().");
+    err = SSE_E_INVAL;
+    *out_err_info = "Check failed: Invalid package.";
+    goto error_exit;
+  }
+  err = TFirmwarePackage_CheckResult(package, FirmwareUpdater_OnCheckEnded, self);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to TFirmwarePackage_CheckResult(). err=%s", sse_get_error_string(err));
+    goto error_exit;
+  }
+  self->fPackage = package;
+  self->fState = FW_UPDATE_STATE_CHECKING;
+  TUpdateJournal_SetStage(self->fJournal, UPDATE_JOURNAL_STAGE_CHECKING);
+  return SSE_E_OK;
+
+error_exit:
+  TFirmwarePackage_Delete(package);
+  return err;
+}
 
 static sse_int
 TFirmwareUpdater_CheckResult(TFirmwareUpdater *self)
 {
   MoatObject *stored_ctx = NULL;
-  TFirmwarePackage *package = NULL;
   sse_char *p;
   sse_uint len;
   sse_char *async_key = NULL;
   sse_int err;
   sse_char *err_info = "";
-  sse_bool ok;
 
   TRACE_ENTER();
   err = moat_datastore_load_object(self->fMoat, FW_UPDATE_STORED_CONTEXT_KEY, &stored_ctx);
@@ -365,29 +1373,14 @@ TFirmwareUpdater_CheckResult(TFirmwareUpdater *self)
     err_info = "Failed to set model object.";
     goto error_exit;
   }
-  package = FirmwarePackage_New();
-  if (package == NULL) {
-    LOG_ERROR("failed to FirmwarePackage_New().");
-    err = SSE_E_NOMEM;
-    err_info = "Out of memory.";
-    goto error_exit;
-  }
-  ok = TFirmwarePackage_Verify(package);
-  if (!ok) {
-    LOG_ERROR("failed to TFirmwarePackage_Verify().");
-    err = SSE_E_INVAL;
-    err_info = "Check failed: Invalid package.";
-    goto error_exit;
-  }
-  err = TFirmwarePackage_CheckResult(package, FirmwareUpdater_OnCheckEnded, self);
+  err = TFirmwareUpdater_StartCheck(self, &err_info);
   if (err != SSE_E_OK) {
-    LOG_ERROR("failed to TFirmwarePackage_CheckResult(). err=%s", sse_get_error_string(err));
     goto error_exit;
   }
+  /* from here on the journal tells that the result is being checked */
   moat_datastore_remove_object(self->fMoat, FW_UPDATE_STORED_CONTEXT_KEY);
   moat_object_free(stored_ctx);
   self->fAsyncKey = async_key;
-  self->fPackage = package;
   TRACE_LEAVE();
   return SSE_E_OK;
 
@@ -396,9 +1389,6 @@ error_exit:
     moat_object_free(stored_ctx);
     moat_datastore_remove_object(self->fMoat, FW_UPDATE_STORED_CONTEXT_KEY);
   }
-  if (package != NULL) {
-    TFirmwarePackage_Delete(package);
-  }
   if (async_key != NULL) {
     TDownloadInfoModel_NotifyResult(&self->fInfo, async_key, err, err_info);
     sse_free(async_key);
@@ -407,22 +1397,132 @@ error_exit:
   return err;
 }
 
+/*
+ * Takes up the job which the journal has recorded before the process went
+ * down, from the last stage that has been saved. A download goes on from
+ * where its part file ends; an extracted package is verified again.
+ */
+static void
+TFirmwareUpdater_ResumeJob(TFirmwareUpdater *self)
+{
+  sse_char *key = NULL;
+  sse_char *err_info = "Failed to resume job.";
+  sse_int command;
+  sse_int stage;
+  sse_int err;
+
+  TRACE_ENTER();
+  command = TUpdateJournal_GetCommand(self->fJournal);
+  stage = TUpdateJournal_GetStage(self->fJournal);
+  LOG_INFO("resume job. command=%d, stage=%d, offset=%lld", command, stage, TUpdateJournal_GetOffset(self->fJournal));
+  err = TFirmwareUpdater_RestoreJob(self, &key);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to restore job. err=%s", sse_get_error_string(err));
+    TFirmwareUpdater_Clear(self);
+    return;
+  }
+  if (TUpdateJournal_CountResume(self->fJournal) > FW_UPDATE_MAX_RESUMES) {
+    LOG_ERROR("job has been interrupted too many times.");
+    err = SSE_E_GENERIC;
+    err_info = "Job has been interrupted too many times.";
+    goto error_exit;
+  }
+  switch (stage) {
+  case UPDATE_JOURNAL_STAGE_QUEUED:
+    err = TFirmwareUpdater_ArmSchedule(self, TUpdateJournal_GetRunAt(self->fJournal));
+    if (err != SSE_E_OK) {
+      goto error_exit;
+    }
+    break;
+  case UPDATE_JOURNAL_STAGE_DOWNLOADING:
+  case UPDATE_JOURNAL_STAGE_DOWNLOADED:
+    TFirmwareUpdater_RunCommand(self, command, key);
+    break;
+  default:
+    self->fAsyncKey = key;
+    key = NULL;
+    if (stage == UPDATE_JOURNAL_STAGE_CHECKING) {
+      err = TFirmwareUpdater_StartCheck(self, &err_info);
+      if (err != SSE_E_OK) {
+        goto error_exit;
+      }
+      break;
+    }
+    self->fPackage = FirmwarePackage_New();
+    if (self->fPackage == NULL) {
+      LOG_ERROR("failed to FirmwarePackage_New().");
+      err = SSE_E_NOMEM;
+      goto error_exit;
+    }
+    if (stage == UPDATE_JOURNAL_STAGE_APPLYING || command == DOWNLOAD_INFO_MODEL_COMMAND_APPLY) {
+      TFirmwareUpdater_UpdateFirmware(self);
+    } else {
+      self->fApplyWhenStaged = (command == DOWNLOAD_INFO_MODEL_COMMAND_DOWNLOAD_AND_UPDATE) ? sse_true : sse_false;
+      TFirmwareUpdater_HandleExtractResult(self, SSE_E_OK, NULL);
+    }
+    break;
+  }
+  if (key != NULL) {
+    sse_free(key);
+  }
+  TRACE_LEAVE();
+  return;
+
+error_exit:
+  TDownloadInfoModel_NotifyResult(&self->fInfo, (key != NULL) ? key : self->fAsyncKey, err, err_info);
+  if (key != NULL) {
+    sse_free(key);
+  }
+  TFirmwareUpdater_Clear(self);
+}
+
 /* FirmwareUpdater public */
 
 sse_int
 TFirmwareUpdater_Start(TFirmwareUpdater *self)
 {
+  MoatObject *staged = NULL;
+  sse_char *cache_dir_path;
   sse_int err;
 
   TRACE_ENTER();
+  cache_dir_path = FirmwarePackage_GetCacheDirPath();
+  if (cache_dir_path != NULL) {
+    self->fCache = PackageCache_New(self->fMoat, cache_dir_path);
+    sse_free(cache_dir_path);
+  }
+  if (self->fCache == NULL) {
+    LOG_INFO("packages will not be cached.");
+  }
+  self->fJournal = UpdateJournal_New(self->fMoat);
+  if (self->fJournal == NULL) {
+    LOG_ERROR("failed to UpdateJournal_New().");
+    return SSE_E_NOMEM;
+  }
+  TUpdateJournal_Load(self->fJournal);
+  self->fQueue = UpdateQueue_New(self->fMoat);
+  if (self->fQueue == NULL) {
+    LOG_ERROR("failed to UpdateQueue_New().");
+    return SSE_E_NOMEM;
+  }
+  TUpdateQueue_Load(self->fQueue);
   err = TDownloadInfoModel_Start(&self->fInfo);
   if (err != SSE_E_OK) {
     LOG_ERROR("failed to TDownloadInfoModel_Start(). err=%s", sse_get_error_string(err));
     return err;
   }
-  TDownloadInfoModel_SetDownloadAndUpdateCommandCallback(&self->fInfo,
-      FirmwareUpdater_OnDownloadAndUpdate, self);
+  TDownloadInfoModel_SetCommandCallback(&self->fInfo,
+      FirmwareUpdater_OnCommand, self);
   err = TFirmwareUpdater_CheckResult(self);
+  if (self->fState == FW_UPDATE_STATE_IDLE && TUpdateJournal_IsActive(self->fJournal)) {
+    TFirmwareUpdater_ResumeJob(self);
+  }
+  if (self->fState == FW_UPDATE_STATE_IDLE && moat_datastore_load_object(self->fMoat, FW_UPDATE_STORED_STAGED_KEY, &staged) == SSE_E_OK) {
+    LOG_INFO("a staged package is waiting for apply.");
+    moat_object_free(staged);
+    self->fState = FW_UPDATE_STATE_STAGED;
+  }
+  TFirmwareUpdater_KickQueue(self);
   TRACE_LEAVE();
   return SSE_E_OK;
 }
@@ -431,7 +1531,7 @@ void
 TFirmwareUpdater_Stop(TFirmwareUpdater *self)
 {
   TRACE_ENTER();
-  TDownloadInfoModel_SetDownloadAndUpdateCommandCallback(&self->fInfo, NULL, NULL);
+  TDownloadInfoModel_SetCommandCallback(&self->fInfo, NULL, NULL);
   TDownloadInfoModel_Stop(&self->fInfo);
   TRACE_LEAVE();
 }
@@ -442,6 +1542,11 @@ TFirmwareUpdater_Initialize(TFirmwareUpdater *self, Moat in_moat)
   TRACE_ENTER();
   sse_memset(self, 0, sizeof(TFirmwareUpdater));
   self->fMoat = in_moat;
+  self->fProgressTimerId = -1;
+  self->fRetryTimerId = -1;
+  self->fScheduleTimerId = -1;
+  self->fQueueTimerId = -1;
+  srandom((unsigned int)(moat_get_timestamp_msec() ^ getpid()));
   TDownloadInfoModel_Initialize(&self->fInfo, in_moat);
   TRACE_LEAVE();
   return SSE_E_OK;
@@ -452,6 +1557,39 @@ TFirmwareUpdater_Finalize(TFirmwareUpdater *self)
 {
   TRACE_ENTER();
   TDownloadInfoModel_Finalize(&self->fInfo);
+  /* the journal and the queue are kept for the next start */
+  if (self->fJournal != NULL) {
+    TUpdateJournal_Delete(self->fJournal);
+    self->fJournal = NULL;
+  }
+  if (self->fQueue != NULL) {
+    TUpdateQueue_Delete(self->fQueue);
+    self->fQueue = NULL;
+  }
+  TFirmwareUpdater_StopPrefetch(self);
   TFirmwareUpdater_Clear(self);
+  if (self->fCache != NULL) {
+    TPackageCache_Delete(self->fCache);
+    self->fCache = NULL;
+  }
+  if (self->fProgressTimer != NULL) {
+    moat_timer_free(self->fProgressTimer);
+    self->fProgressTimer = NULL;
+  }
+  if (self->fRetryTimer != NULL) {
+    moat_timer_free(self->fRetryTimer);
+    self->fRetryTimer = NULL;
+  }
+  if (self->fScheduleTimer != NULL) {
+    moat_timer_free(self->fScheduleTimer);
+    self->fScheduleTimer = NULL;
+  }
+  if (self->fQueueTimer != NULL) {
+    if (self->fQueueTimerId >= 0) {
+      moat_timer_cancel(self->fQueueTimer, self->fQueueTimerId);
+    }
+    moat_timer_free(self->fQueueTimer);
+    self->fQueueTimer = NULL;
+  }
   TRACE_LEAVE();
 }
@@ -20,18 +20,55 @@
 #include <sseutils.h>
 #include "download_info_model.h"
 #include "firmware_package.h"
-#include "firmware_package.h"
+#include "package_downloader.h"
+#include "mirror_list.h"
+#include "update_journal.h"
+#include "update_queue.h"
 
 SSE_BEGIN_C_DECLS
 
 typedef struct TFirmwareUpdater_ TFirmwareUpdater;
 
+/*
+ * Runs one job at a time. A job goes from DOWNLOADING through EXTRACTING
+ * to UPDATING, or stops at STAGED when it has been started by "download".
+ * A staged package is recorded in the datastore so that "apply" finds it
+ * after a restart as well.
+ * A job whose DownloadInfo has a start time (startAt, in seconds since the
+ * epoch, spread by a random delay of up to startJitter seconds) waits in
+ * SCHEDULED until then; applyAt defers the installation in the same way.
+ * Every job is recorded in the journal from the moment it is accepted, and
+ * Start takes up a recorded job from the last stage which has been saved.
+ * Commands which arrive while a job is running are queued. Once the current
+ * job has downloaded its package, the package of the next job is fetched
+ * into the cache, so that it is ready when that job starts.
+ */
 struct TFirmwareUpdater_ {
   Moat fMoat;
   TDownloadInfoModel fInfo;
+  sse_int fState;
+  sse_bool fApplyWhenStaged;
   sse_char *fAsyncKey;
-  MoatDownloader *fDownloader;
+  TPackageDownloader *fDownloader;
   TFirmwarePackage *fPackage;
+  TPackageCache *fCache;
+  TRateLimiter *fRateLimiter;
+  MoatTimer *fProgressTimer;
+  sse_int fProgressTimerId;
+  TMirrorList *fMirrors;
+  MoatTimer *fRetryTimer;
+  sse_int fRetryTimerId;
+  sse_uint64 fAttemptStartedAt;
+  sse_int64 fAttemptStartBytes;
+  MoatTimer *fScheduleTimer;
+  sse_int fScheduleTimerId;
+  TUpdateJournal *fJournal;
+  TUpdateQueue *fQueue;
+  MoatTimer *fQueueTimer;
+  sse_int fQueueTimerId;
+  TPackageDownloader *fPrefetcher;
+  TRateLimiter *fPrefetchLimiter;
+  sse_bool fStartAfterPrefetch;
 };
 
 sse_int TFirmwareUpdater_Initialize(TFirmwareUpdater *self, Moat in_moat);
@@ -0,0 +1,493 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/if_alg.h>
+
+#include <servicesync/moat.h>
+#include "fast_hash.h"
+#include "kernel_hash.h"
+
+#ifndef AF_ALG
+#define AF_ALG  (38)
+#endif
+
+#define TAG "KernelHash"
+
+#define TRACE_ENTER() MOAT_LOG_TRACE(TAG, "== enter =>");
+#define TRACE_LEAVE() MOAT_LOG_TRACE(TAG, "<= leave ==");
+#define LOG_ERROR(format, ...)  MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...)  MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+
+#define KERNEL_HASH_PIPE_SIZE  (1024 * 1024)
+#define KERNEL_HASH_BUFFER_SIZE  (64 * 1024)
+
+enum KernelHashState_ {
+  KERNEL_HASH_STATE_UNKNOWN,
+  KERNEL_HASH_STATE_YES,
+  KERNEL_HASH_STATE_NO
+};
+
+typedef union KernelHashContext_ KernelHashContext;
+union KernelHashContext_ {
+  FastHashSha256Context fSha256;
+  FastHashSha1Context fSha1;
+  SSEMd5Context fMd5;
+};
+
+static const sse_char *KernelHash_Names[KERNEL_HASH_ALGORITHMs] = { "sha256", "sha1", "md5" };
+static const sse_uint KernelHash_DigestSizes[KERNEL_HASH_ALGORITHMs] = { SHA256_MD_BYTES, SHA1_MD_BYTES, MD5_MD_BYTES };
+
+static sse_int KernelHash_Mode = KERNEL_HASH_MODE_AUTO;
+static sse_int KernelHash_Available[KERNEL_HASH_ALGORITHMs];
+static sse_int KernelHash_Preferred[KERNEL_HASH_ALGORITHMs];
+
+static void
+KernelHash_SoftwareInit(sse_int in_algorithm, KernelHashContext *in_ctx)
+{
+  if (in_algorithm == KERNEL_HASH_SHA256) {
+    FastHash_Sha256Init(&in_ctx->fSha256);
+  } else if (in_algorithm == KERNEL_HASH_SHA1) {
+    FastHash_Sha1Init(&in_ctx->fSha1);
+  } else {
+    sse_hashlib_md5_init(&in_ctx->fMd5);
+  }
+}
+
+static void
+KernelHash_SoftwareUpdate(sse_int in_algorithm, KernelHashContext *in_ctx, sse_byte *in_data, sse_size in_len)
+{
+  if (in_algorithm == KERNEL_HASH_SHA256) {
+    FastHash_Sha256Update(&in_ctx->fSha256, in_data, in_len);
+  } else if (in_algorithm == KERNEL_HASH_SHA1) {
+    FastHash_Sha1Update(&in_ctx->fSha1, in_data, in_len);
+  } else {
+    sse_hashlib_md5_update(&in_ctx->fMd5, in_data, in_len);
+  }
+}
+
+static void
+KernelHash_SoftwareFinal(sse_int in_algorithm, KernelHashContext *in_ctx, sse_byte *out_md)
+{
+  if (in_algorithm == KERNEL_HASH_SHA256) {
+    FastHash_Sha256Final(&in_ctx->fSha256, out_md);
+  } else if (in_algorithm == KERNEL_HASH_SHA1) {
+    FastHash_Sha1Final(&in_ctx->fSha1, out_md);
+  } else {
+    sse_hashlib_md5_fini(&in_ctx->fMd5, out_md);
+  }
+}
+
+/*
+ * Reads the next chunk of [in_offset, in_offset + in_len) into io_buffer,
+ * up to the end of the file when in_len is negative. Returns the number of
+ * bytes read, 0 at the end or -1 on an error, which includes a file
+ * shorter than in_len.
+ */
+static ssize_t
+KernelHash_ReadChunk(int in_fd, sse_byte *io_buffer, sse_int64 in_offset, sse_int64 in_len)
+{
+  sse_size size;
+  ssize_t n;
+
+  if (in_len == 0) {
+    return 0;
+  }
+  size = (in_len < 0) ? KERNEL_HASH_BUFFER_SIZE : (sse_size)SSE_MIN(in_len, (sse_int64)KERNEL_HASH_BUFFER_SIZE);
+  do {
+    n = pread(in_fd, io_buffer, size, (off_t)in_offset);
+  } while (n < 0 && errno == EINTR);
+  if (n == 0 && in_len > 0) {
+    return -1;
+  }
+  return n;
+}
+
+static sse_int
+KernelHash_SoftwareHashFile(sse_int in_algorithm, int in_fd, sse_int64 in_offset, sse_int64 in_len, sse_byte *out_md)
+{
+  KernelHashContext ctx;
+  sse_byte *buffer;
+  ssize_t n;
+
+  buffer = sse_malloc(KERNEL_HASH_BUFFER_SIZE);
+  if (buffer == NULL) {
+    LOG_ERROR("failed to sse_malloc().");
+    return SSE_E_NOMEM;
+  }
+  KernelHash_SoftwareInit(in_algorithm, &ctx);
+  while ((n = KernelHash_ReadChunk(in_fd, buffer, in_offset, in_len)) > 0) {
+    KernelHash_SoftwareUpdate(in_algorithm, &ctx, buffer, (sse_size)n);
+    in_offset += n;
+    if (in_len > 0) {
+      in_len -= n;
+    }
+  }
+  sse_free(buffer);
+  if (n < 0) {
+    LOG_ERROR("failed to read the file.");
+    return SSE_E_GENERIC;
+  }
+  KernelHash_SoftwareFinal(in_algorithm, &ctx, out_md);
+  return SSE_E_OK;
+}
+
+TKernelHash *
+KernelHash_New(sse_int in_algorithm)
+{
+  TKernelHash *self;
+  struct sockaddr_alg sa;
+  int size;
+
+  if (in_algorithm < 0 || in_algorithm >= KERNEL_HASH_ALGORITHMs) {
+    return NULL;
+  }
+  self = sse_zeroalloc(sizeof(TKernelHash));
+  if (self == NULL) {
+    LOG_ERROR("failed to sse_zeroalloc().");
+    return NULL;
+  }
+  self->fAlgorithm = in_algorithm;
+  self->fOpFd = -1;
+  self->fPipe[0] = -1;
+  self->fPipe[1] = -1;
+  self->fTfmFd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (self->fTfmFd < 0) {
+    LOG_DEBUG("AF_ALG is not available. err=[%s]", strerror(errno));
+    goto error_exit;
+  }
+  sse_memset(&sa, 0, sizeof(sa));
+  sa.salg_family = AF_ALG;
+  snprintf((char *)sa.salg_type, sizeof(sa.salg_type), "hash");
+  snprintf((char *)sa.salg_name, sizeof(sa.salg_name), "%s", KernelHash_Names[in_algorithm]);
+  if (bind(self->fTfmFd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+    LOG_DEBUG("%s is not available. err=[%s]", KernelHash_Names[in_algorithm], strerror(errno));
+    goto error_exit;
+  }
+  self->fOpFd = accept4(self->fTfmFd, NULL, 0, SOCK_CLOEXEC);
+  if (self->fOpFd < 0) {
+    LOG_ERROR("failed to accept(). err=[%s]", strerror(errno));
+    goto error_exit;
+  }
+  if (pipe2(self->fPipe, O_CLOEXEC) != 0) {
+    LOG_ERROR("failed to pipe(). err=[%s]", strerror(errno));
+    goto error_exit;
+  }
+  /* a larger pipe takes fewer splices, the default one works as well */
+  fcntl(self->fPipe[1], F_SETPIPE_SZ, KERNEL_HASH_PIPE_SIZE);
+  size = fcntl(self->fPipe[1], F_GETPIPE_SZ);
+  self->fPipeSize = (size > 0) ? (sse_size)size : 4096;
+  return self;
+
+error_exit:
+  TKernelHash_Delete(self);
+  return NULL;
+}
+
+void
+TKernelHash_Delete(TKernelHash *self)
+{
+  if (self->fPipe[0] >= 0) {
+    close(self->fPipe[0]);
+  }
+  if (self->fPipe[1] >= 0) {
+    close(self->fPipe[1]);
+  }
+  if (self->fOpFd >= 0) {
+    close(self->fOpFd);
+  }
+  if (self->fTfmFd >= 0) {
+    close(self->fTfmFd);
+  }
+  sse_free(self);
+}
+
+sse_int
+TKernelHash_Update(TKernelHash *self, const sse_byte *in_data, sse_size in_len)
+{
+  ssize_t n;
+
+  while (in_len > 0) {
+    n = send(self->fOpFd, in_data, in_len, MSG_MORE);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      LOG_ERROR("failed to send(). err=[%s]", strerror(errno));
+      return SSE_E_GENERIC;
+    }
+    in_data += n;
+    in_len -= (sse_size)n;
+  }
+  return SSE_E_OK;
+}
+
+static sse_int
+TKernelHash_SendFile(TKernelHash *self, int in_fd, sse_int64 in_offset, sse_int64 in_len)
+{
+  sse_byte *buffer;
+  ssize_t n;
+  sse_int err = SSE_E_OK;
+
+  buffer = sse_malloc(KERNEL_HASH_BUFFER_SIZE);
+  if (buffer == NULL) {
+    LOG_ERROR("failed to sse_malloc().");
+    return SSE_E_NOMEM;
+  }
+  while ((n = KernelHash_ReadChunk(in_fd, buffer, in_offset, in_len)) > 0) {
+    err = TKernelHash_Update(self, buffer, (sse_size)n);
+    if (err != SSE_E_OK) {
+      break;
+    }
+    in_offset += n;
+    if (in_len > 0) {
+      in_len -= n;
+    }
+  }
+  sse_free(buffer);
+  if (n < 0) {
+    LOG_ERROR("failed to read the file.");
+    return SSE_E_GENERIC;
+  }
+  return err;
+}
+
+/*
+ * Hashes in_len bytes of in_fd from in_offset on, or up to the end of the
+ * file when in_len is negative. The file offset of in_fd is not moved.
+ */
+sse_int
+TKernelHash_UpdateFile(TKernelHash *self, int in_fd, sse_int64 in_offset, sse_int64 in_len)
+{
+  loff_t offset = (loff_t)in_offset;
+  sse_size chunk;
+  ssize_t n;
+  ssize_t m;
+
+  while (in_len != 0) {
+    chunk = (in_len < 0) ? self->fPipeSize : (sse_size)SSE_MIN(in_len, (sse_int64)self->fPipeSize);
+    n = splice(in_fd, &offset, self->fPipe[1], NULL, chunk, SPLICE_F_MOVE);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EINVAL || errno == ENOSYS) && offset == (loff_t)in_offset) {
+      /* nothing is in the pipe yet, so the rest can be sent instead */
+      LOG_DEBUG("failed to splice() the file, sending it. err=[%s]", strerror(errno));
+      return TKernelHash_SendFile(self, in_fd, in_offset, in_len);
+    }
+    if (n < 0 || (n == 0 && in_len > 0)) {
+      LOG_ERROR("failed to splice() the file. err=[%s]", (n < 0) ? strerror(errno) : "unexpected end of file");
+      return SSE_E_GENERIC;
+    }
+    if (n == 0) {
+      break;
+    }
+    while (n > 0) {
+      m = splice(self->fPipe[0], NULL, self->fOpFd, NULL, (sse_size)n, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (m < 0 && errno == EINTR) {
+        continue;
+      }
+      if (m <= 0) {
+        LOG_ERROR("failed to splice() into the socket. err=[%s]", strerror(errno));
+        return SSE_E_GENERIC;
+      }
+      n -= m;
+    }
+    if (in_len > 0) {
+      in_len -= (sse_int64)offset - in_offset;
+    }
+    in_offset = (sse_int64)offset;
+  }
+  return SSE_E_OK;
+}
+
+/*
+ * Completes the digest. The object can hash the next message after that.
+ */
+sse_int
+TKernelHash_Final(TKernelHash *self, sse_byte *out_md)
+{
+  sse_uint size = KernelHash_DigestSizes[self->fAlgorithm];
+  ssize_t n;
+
+  do {
+    n = send(self->fOpFd, NULL, 0, 0);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    LOG_ERROR("failed to send(). err=[%s]", strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  do {
+    n = read(self->fOpFd, out_md, size);
+  } while (n < 0 && errno == EINTR);
+  if (n != (ssize_t)size) {
+    LOG_ERROR("failed to read() the digest. err=[%s]", (n < 0) ? strerror(errno) : "short digest");
+    return SSE_E_GENERIC;
+  }
+  return SSE_E_OK;
+}
+
+sse_uint
+KernelHash_GetDigestSize(sse_int in_algorithm)
+{
+  return KernelHash_DigestSizes[in_algorithm];
+}
+
+sse_bool
+KernelHash_IsAvailable(sse_int in_algorithm)
+{
+  TKernelHash *hash;
+
+  if (in_algorithm < 0 || in_algorithm >= KERNEL_HASH_ALGORITHMs) {
+    return sse_false;
+  }
+  if (KernelHash_Available[in_algorithm] == KERNEL_HASH_STATE_UNKNOWN) {
+    hash = KernelHash_New(in_algorithm);
+    if (hash != NULL) {
+      TKernelHash_Delete(hash);
+      KernelHash_Available[in_algorithm] = KERNEL_HASH_STATE_YES;
+    } else {
+      KernelHash_Available[in_algorithm] = KERNEL_HASH_STATE_NO;
+    }
+  }
+  return (KernelHash_Available[in_algorithm] == KERNEL_HASH_STATE_YES);
+}
+
+void
+KernelHash_SetMode(sse_int in_mode)
+{
+  KernelHash_Mode = in_mode;
+}
+
+static sse_uint64
+KernelHash_GetNanoseconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (sse_uint64)ts.tv_sec * 1000000000ULL + (sse_uint64)ts.tv_nsec;
+}
+
+/*
+ * Hashes the same data in the kernel and in software. The kernel is
+ * preferred when both agree on the digest and the kernel is faster.
+ */
+static sse_bool
+KernelHash_Calibrate(sse_int in_algorithm)
+{
+  TKernelHash *hash;
+  KernelHashContext ctx;
+  sse_byte kernel_md[SHA256_MD_BYTES];
+  sse_byte software_md[SHA256_MD_BYTES];
+  sse_byte *buffer;
+  sse_uint64 start;
+  sse_uint64 kernel_ns;
+  sse_uint64 software_ns;
+  sse_bool preferred = sse_false;
+  sse_uint i;
+
+  buffer = sse_malloc(KERNEL_HASH_CALIBRATION_SIZE);
+  if (buffer == NULL) {
+    LOG_ERROR("failed to sse_malloc().");
+    return sse_false;
+  }
+  hash = KernelHash_New(in_algorithm);
+  if (hash == NULL) {
+    sse_free(buffer);
+    return sse_false;
+  }
+  for (i = 0; i < KERNEL_HASH_CALIBRATION_SIZE; i++) {
+    buffer[i] = (sse_byte)(i * 131 + 7);
+  }
+  start = KernelHash_GetNanoseconds();
+  if (TKernelHash_Update(hash, buffer, KERNEL_HASH_CALIBRATION_SIZE) != SSE_E_OK ||
+      TKernelHash_Final(hash, kernel_md) != SSE_E_OK) {
+    goto exit;
+  }
+  kernel_ns = KernelHash_GetNanoseconds() - start;
+  start = KernelHash_GetNanoseconds();
+  KernelHash_SoftwareInit(in_algorithm, &ctx);
+  KernelHash_SoftwareUpdate(in_algorithm, &ctx, buffer, KERNEL_HASH_CALIBRATION_SIZE);
+  KernelHash_SoftwareFinal(in_algorithm, &ctx, software_md);
+  software_ns = KernelHash_GetNanoseconds() - start;
+  if (sse_memcmp(kernel_md, software_md, KernelHash_DigestSizes[in_algorithm]) != 0) {
+    LOG_ERROR("%s digest of the kernel differs from software, not using it.", KernelHash_Names[in_algorithm]);
+    goto exit;
+  }
+  preferred = (kernel_ns < software_ns);
+  LOG_INFO("%s: kernel=[%llu us], software=[%llu us], hashing in %s.", KernelHash_Names[in_algorithm],
+           (unsigned long long)(kernel_ns / 1000), (unsigned long long)(software_ns / 1000),
+           preferred ? "the kernel" : "software");
+
+exit:
+  TKernelHash_Delete(hash);
+  sse_free(buffer);
+  return preferred;
+}
+
+sse_bool
+KernelHash_IsPreferred(sse_int in_algorithm)
+{
+  if (KernelHash_Mode == KERNEL_HASH_MODE_SOFTWARE || !KernelHash_IsAvailable(in_algorithm)) {
+    return sse_false;
+  }
+  if (KernelHash_Mode == KERNEL_HASH_MODE_KERNEL) {
+    return sse_true;
+  }
+  if (KernelHash_Preferred[in_algorithm] == KERNEL_HASH_STATE_UNKNOWN) {
+    KernelHash_Preferred[in_algorithm] = KernelHash_Calibrate(in_algorithm) ? KERNEL_HASH_STATE_YES : KERNEL_HASH_STATE_NO;
+  }
+  return (KernelHash_Preferred[in_algorithm] == KERNEL_HASH_STATE_YES);
+}
+
+/*
+ * Hashes in_len bytes of in_fd from in_offset on, or up to the end of the
+ * file when in_len is negative, in the kernel when it is preferred and in
+ * software otherwise or when the kernel fails.
+ */
+sse_int
+KernelHash_HashFile(sse_int in_algorithm, int in_fd, sse_int64 in_offset, sse_int64 in_len, sse_byte *out_md)
+{
+  TKernelHash *hash;
+  sse_int err;
+
+  if (in_algorithm < 0 || in_algorithm >= KERNEL_HASH_ALGORITHMs) {
+    return SSE_E_INVAL;
+  }
+  if (KernelHash_IsPreferred(in_algorithm)) {
+    hash = KernelHash_New(in_algorithm);
+    if (hash != NULL) {
+      err = TKernelHash_UpdateFile(hash, in_fd, in_offset, in_len);
+      if (err == SSE_E_OK) {
+        err = TKernelHash_Final(hash, out_md);
+      }
+      TKernelHash_Delete(hash);
+      if (err == SSE_E_OK) {
+        return SSE_E_OK;
+      }
+      LOG_ERROR("failed to hash in the kernel, hashing in software.");
+    }
+  }
+  return KernelHash_SoftwareHashFile(in_algorithm, in_fd, in_offset, in_len, out_md);
+}
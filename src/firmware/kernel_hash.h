@@ -0,0 +1,76 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#ifndef __KERNEL_HASH__
+#define __KERNEL_HASH__
+
+#include <sseutils.h>
+
+SSE_BEGIN_C_DECLS
+
+#define KERNEL_HASH_CALIBRATION_SIZE  (1024 * 1024)
+
+enum KernelHashAlgorithm_ {
+  KERNEL_HASH_SHA256,
+  KERNEL_HASH_SHA1,
+  KERNEL_HASH_MD5,
+  KERNEL_HASH_ALGORITHMs
+};
+
+enum KernelHashMode_ {
+  KERNEL_HASH_MODE_AUTO,
+  KERNEL_HASH_MODE_KERNEL,
+  KERNEL_HASH_MODE_SOFTWARE
+};
+
+typedef struct TKernelHash_ TKernelHash;
+
+/*
+ * Hashing offloaded to the kernel crypto API through an AF_ALG socket, so
+ * that a hash accelerator of the SoC is used when the kernel has a driver
+ * for it. Files are spliced through a pipe into the socket and are never
+ * copied to user space; where a file can not be spliced it is read and
+ * sent instead.
+ * KernelHash_HashFile() hashes a file with the kernel or in software
+ * (fast_hash, ssehashlib for MD5). In KERNEL_HASH_MODE_AUTO the kernel is
+ * used for an algorithm once it has hashed KERNEL_HASH_CALIBRATION_SIZE
+ * bytes to the same digest and faster than software, which is measured
+ * the first time the algorithm is asked for. Without AF_ALG everything is
+ * hashed in software.
+ */
+struct TKernelHash_ {
+  sse_int fAlgorithm;
+  int fTfmFd;
+  int fOpFd;
+  int fPipe[2];
+  sse_size fPipeSize;
+};
+
+TKernelHash * KernelHash_New(sse_int in_algorithm);
+void TKernelHash_Delete(TKernelHash *self);
+sse_int TKernelHash_Update(TKernelHash *self, const sse_byte *in_data, sse_size in_len);
+sse_int TKernelHash_UpdateFile(TKernelHash *self, int in_fd, sse_int64 in_offset, sse_int64 in_len);
+sse_int TKernelHash_Final(TKernelHash *self, sse_byte *out_md);
+
+sse_uint KernelHash_GetDigestSize(sse_int in_algorithm);
+sse_bool KernelHash_IsAvailable(sse_int in_algorithm);
+void KernelHash_SetMode(sse_int in_mode);
+sse_bool KernelHash_IsPreferred(sse_int in_algorithm);
+sse_int KernelHash_HashFile(sse_int in_algorithm, int in_fd, sse_int64 in_offset, sse_int64 in_len, sse_byte *out_md);
+
+SSE_END_C_DECLS
+
+#endif /* __KERNEL_HASH__ */
@@ -0,0 +1,581 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <servicesync/moat.h>
+#include "manifest_verifier.h"
+#include "kernel_hash.h"
+
+#define TAG "ManifestVerifier"
+
+#define TRACE_ENTER() MOAT_LOG_TRACE(TAG, "== enter =>");
+#define TRACE_LEAVE() MOAT_LOG_TRACE(TAG, "<= leave ==");
+#define LOG_ERROR(format, ...)  MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...)  MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+
+#define MANIFEST_VERIFIER_CONF_NAME  "firmware.conf"
+#define MANIFEST_VERIFIER_MD5_SUFFIX  ".md5"
+#define MANIFEST_VERIFIER_LINE_SIZE  (512)
+#define MANIFEST_VERIFIER_BUFFER_SIZE  (64 * 1024)
+
+static sse_uint ManifestVerifier_DigestSizes[MANIFEST_DIGEST_TYPEs] = { SHA256_MD_BYTES, MD5_MD_BYTES };
+static sse_int ManifestVerifier_KernelAlgorithms[MANIFEST_DIGEST_TYPEs] = { KERNEL_HASH_SHA256, KERNEL_HASH_MD5 };
+
+static sse_int
+ManifestVerifier_HexValue(sse_char in_c)
+{
+  if (in_c >= '0' && in_c <= '9') {
+    return in_c - '0';
+  }
+  if (in_c >= 'a' && in_c <= 'f') {
+    return in_c - 'a' + 10;
+  }
+  if (in_c >= 'A' && in_c <= 'F') {
+    return in_c - 'A' + 10;
+  }
+  return -1;
+}
+
+/*
+ * Decodes the digest at the head of a line of sha256sum or md5sum and
+ * returns the file name which follows it, or NULL when the line is
+ * malformed.
+ */
+static sse_char *
+ManifestVerifier_ParseLine(sse_char *in_line, sse_uint in_digest_size, sse_byte *out_digest)
+{
+  sse_char *p = in_line;
+  sse_int hi;
+  sse_int lo;
+  sse_uint i;
+
+  for (i = 0; i < in_digest_size; i++) {
+    hi = ManifestVerifier_HexValue(p[0]);
+    lo = (hi < 0) ? -1 : ManifestVerifier_HexValue(p[1]);
+    if (lo < 0) {
+      return NULL;
+    }
+    out_digest[i] = (sse_byte)((hi << 4) | lo);
+    p += 2;
+  }
+  /* "<digest>  <name>" or "<digest> *<name>" */
+  if (p[0] != ' ' || (p[1] != ' ' && p[1] != '*') || p[2] == '\0') {
+    return NULL;
+  }
+  p += 2;
+  p[strcspn(p, "\r\n")] = '\0';
+  return p;
+}
+
+static sse_char *
+ManifestVerifier_MakePath(sse_char *in_dir_path, sse_char *in_name, sse_char *in_suffix)
+{
+  sse_char *path;
+  sse_uint len;
+
+  len = sse_strlen(in_dir_path) + 1 + sse_strlen(in_name) + sse_strlen(in_suffix) + 1;
+  path = sse_malloc(len);
+  if (path == NULL) {
+    LOG_ERROR("failed to sse_malloc().");
+    return NULL;
+  }
+  snprintf(path, len, "%s/%s%s", in_dir_path, in_name, in_suffix);
+  return path;
+}
+
+static TManifestEntry *
+TManifestVerifier_FindEntry(TManifestVerifier *self, sse_char *in_name)
+{
+  sse_uint i;
+
+  for (i = 0; i < self->fCount; i++) {
+    if (sse_strcmp(self->fEntries[i].fName, in_name) == 0) {
+      return &self->fEntries[i];
+    }
+  }
+  return NULL;
+}
+
+static sse_int
+TManifestVerifier_AddEntry(TManifestVerifier *self, sse_char *in_name, sse_int in_type, sse_byte *in_digest)
+{
+  TManifestEntry *entry;
+
+  /* every entry lives in the package directory */
+  if (*in_name == '\0' || sse_strchr(in_name, '/') != NULL || sse_strcmp(in_name, "..") == 0) {
+    LOG_ERROR("[%s] is not in the package.", in_name);
+    return SSE_E_INVAL;
+  }
+  if (TManifestVerifier_FindEntry(self, in_name) != NULL) {
+    LOG_ERROR("[%s] is listed twice.", in_name);
+    return SSE_E_INVAL;
+  }
+  if (self->fCount >= MANIFEST_VERIFIER_MAX_ENTRIES) {
+    LOG_ERROR("too many entries.");
+    return SSE_E_INVAL;
+  }
+  entry = &self->fEntries[self->fCount];
+  entry->fName = sse_strdup(in_name);
+  entry->fPath = ManifestVerifier_MakePath(self->fDirPath, in_name, "");
+  if (entry->fName == NULL || entry->fPath == NULL) {
+    if (entry->fName != NULL) {
+      sse_free(entry->fName);
+    }
+    if (entry->fPath != NULL) {
+      sse_free(entry->fPath);
+    }
+    entry->fName = NULL;
+    entry->fPath = NULL;
+    return SSE_E_NOMEM;
+  }
+  entry->fDigestType = in_type;
+  sse_memcpy(entry->fDigest, in_digest, ManifestVerifier_DigestSizes[in_type]);
+  self->fCount++;
+  return SSE_E_OK;
+}
+
+/*
+ * Reads the digests of a file in the format of sha256sum or md5sum. A
+ * missing file is not an error, the caller decides what is required.
+ */
+static sse_int
+TManifestVerifier_LoadDigests(TManifestVerifier *self, sse_char *in_path, sse_int in_type, sse_char *in_only_name)
+{
+  FILE *fp;
+  sse_char line[MANIFEST_VERIFIER_LINE_SIZE];
+  sse_byte digest[SHA256_MD_BYTES];
+  sse_char *name;
+  sse_int err = SSE_E_OK;
+
+  fp = fopen(in_path, "r");
+  if (fp == NULL) {
+    return SSE_E_NOENT;
+  }
+  while (err == SSE_E_OK && fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] == '\n' || line[0] == '#') {
+      continue;
+    }
+    name = ManifestVerifier_ParseLine(line, ManifestVerifier_DigestSizes[in_type], digest);
+    if (name == NULL) {
+      LOG_ERROR("malformed line in [%s].", in_path);
+      err = SSE_E_INVAL;
+      break;
+    }
+    if (in_only_name != NULL && sse_strcmp(name, in_only_name) != 0) {
+      LOG_ERROR("[%s] is not about [%s].", in_path, in_only_name);
+      err = SSE_E_INVAL;
+      break;
+    }
+    err = TManifestVerifier_AddEntry(self, name, in_type, digest);
+  }
+  fclose(fp);
+  return err;
+}
+
+static void
+TManifestVerifier_Clear(TManifestVerifier *self)
+{
+  sse_uint i;
+
+  for (i = 0; i < self->fCount; i++) {
+    sse_free(self->fEntries[i].fName);
+    sse_free(self->fEntries[i].fPath);
+  }
+  self->fCount = 0;
+}
+
+static sse_int
+ManifestVerifier_CheckDigest(TManifestEntry *in_entry, sse_byte *in_digest)
+{
+  if (sse_memcmp(in_digest, in_entry->fDigest, ManifestVerifier_DigestSizes[in_entry->fDigestType]) != 0) {
+    LOG_ERROR("%s digest of [%s] mismatched.", (in_entry->fDigestType == MANIFEST_DIGEST_SHA256) ? "SHA-256" : "MD5", in_entry->fName);
+    return SSE_E_INVAL;
+  }
+  return SSE_E_OK;
+}
+
+/*
+ * Runs in a worker process. Entries whose algorithm the kernel hashes
+ * faster are spliced into it one after another. The other files of the
+ * batch are read a chunk at a time in turn and their SHA-256 streams are
+ * hashed together, one lane per entry.
+ */
+static sse_int
+ManifestVerifier_VerifyProc(sse_pointer in_proc_data)
+{
+  TManifestBatch *batch = (TManifestBatch *)in_proc_data;
+  TManifestEntry *entry;
+  FastHashSha256MbContext sha256;
+  SSEMd5Context md5[FAST_HASH_MB_MAX_LANES];
+  const sse_byte *data[FAST_HASH_MB_MAX_LANES];
+  sse_size lens[FAST_HASH_MB_MAX_LANES];
+  int fds[FAST_HASH_MB_MAX_LANES];
+  sse_bool in_kernel[FAST_HASH_MB_MAX_LANES];
+  sse_byte digest[SHA256_MD_BYTES];
+  sse_byte *buffer;
+  sse_uint open_count = 0;
+  sse_uint i;
+  ssize_t n;
+  sse_int err = SSE_E_OK;
+
+  buffer = sse_malloc(MANIFEST_VERIFIER_BUFFER_SIZE * batch->fCount);
+  if (buffer == NULL) {
+    return SSE_E_NOMEM;
+  }
+  for (i = 0; i < batch->fCount; i++) {
+    fds[i] = -1;
+  }
+  FastHash_Sha256MbInit(&sha256, batch->fCount);
+  for (i = 0; i < batch->fCount; i++) {
+    entry = &batch->fEntries[i];
+    fds[i] = open(entry->fPath, O_RDONLY);
+    if (fds[i] < 0) {
+      LOG_ERROR("failed to open(%s). err=[%s]", entry->fPath, strerror(errno));
+      err = SSE_E_NOENT;
+      goto exit;
+    }
+    in_kernel[i] = KernelHash_IsPreferred(ManifestVerifier_KernelAlgorithms[entry->fDigestType]);
+    if (in_kernel[i]) {
+      err = KernelHash_HashFile(ManifestVerifier_KernelAlgorithms[entry->fDigestType], fds[i], 0, -1, digest);
+      close(fds[i]);
+      fds[i] = -1;
+      if (err == SSE_E_OK) {
+        err = ManifestVerifier_CheckDigest(entry, digest);
+      }
+      if (err != SSE_E_OK) {
+        goto exit;
+      }
+      continue;
+    }
+    open_count++;
+    if (entry->fDigestType == MANIFEST_DIGEST_MD5) {
+      sse_hashlib_md5_init(&md5[i]);
+    }
+  }
+  while (open_count > 0) {
+    for (i = 0; i < batch->fCount; i++) {
+      data[i] = NULL;
+      lens[i] = 0;
+      if (fds[i] < 0) {
+        continue;
+      }
+      entry = &batch->fEntries[i];
+      do {
+        n = read(fds[i], buffer + i * MANIFEST_VERIFIER_BUFFER_SIZE, MANIFEST_VERIFIER_BUFFER_SIZE);
+      } while (n < 0 && errno == EINTR);
+      if (n < 0) {
+        LOG_ERROR("failed to read(%s). err=[%s]", entry->fPath, strerror(errno));
+        err = SSE_E_GENERIC;
+        goto exit;
+      }
+      if (n == 0) {
+        close(fds[i]);
+        fds[i] = -1;
+        open_count--;
+      } else if (entry->fDigestType == MANIFEST_DIGEST_SHA256) {
+        data[i] = buffer + i * MANIFEST_VERIFIER_BUFFER_SIZE;
+        lens[i] = (sse_size)n;
+      } else {
+        sse_hashlib_md5_update(&md5[i], buffer + i * MANIFEST_VERIFIER_BUFFER_SIZE, (sse_size)n);
+      }
+    }
+    FastHash_Sha256MbUpdate(&sha256, data, lens);
+  }
+  for (i = 0; i < batch->fCount; i++) {
+    entry = &batch->fEntries[i];
+    if (in_kernel[i]) {
+      continue;
+    }
+    if (entry->fDigestType == MANIFEST_DIGEST_SHA256) {
+      FastHash_Sha256MbFinal(&sha256, i, digest);
+    } else {
+      sse_hashlib_md5_fini(&md5[i], digest);
+    }
+    err = ManifestVerifier_CheckDigest(entry, digest);
+    if (err != SSE_E_OK) {
+      break;
+    }
+  }
+
+exit:
+  for (i = 0; i < batch->fCount; i++) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+  sse_free(buffer);
+  return err;
+}
+
+static void ManifestVerifier_OnVerified(TWorkerProcess *in_worker, sse_int in_result, sse_pointer in_user_data);
+
+/*
+ * Hands the next entries to a worker, as many as fit in the lanes of the
+ * multi-buffer hash but no more than an even share of what is left.
+ */
+static sse_int
+TManifestVerifier_StartNext(TManifestVerifier *self, sse_uint in_worker)
+{
+  TManifestBatch *batch = &self->fBatches[in_worker];
+  sse_uint left = self->fCount - self->fNext;
+  sse_int err;
+
+  batch->fEntries = &self->fEntries[self->fNext];
+  batch->fCount = SSE_MIN((left + MANIFEST_VERIFIER_MAX_WORKERS - 1) / MANIFEST_VERIFIER_MAX_WORKERS, FAST_HASH_MB_MAX_LANES);
+  err = TWorkerProcess_Start(self->fWorkers[in_worker], ManifestVerifier_VerifyProc, batch, 0, ManifestVerifier_OnVerified, self);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to TWorkerProcess_Start(). err=%s", sse_get_error_string(err));
+    return err;
+  }
+  self->fNext += batch->fCount;
+  self->fRunning++;
+  return SSE_E_OK;
+}
+
+static void
+ManifestVerifier_OnVerified(TWorkerProcess *in_worker, sse_int in_result, sse_pointer in_user_data)
+{
+  TManifestVerifier *self = (TManifestVerifier *)in_user_data;
+  TManifestBatch *batch;
+  sse_uint i;
+
+  TRACE_ENTER();
+  for (i = 0; i < MANIFEST_VERIFIER_MAX_WORKERS && self->fWorkers[i] != in_worker; i++) {
+  }
+  batch = &self->fBatches[i];
+  self->fRunning--;
+  if (in_result == SSE_E_OK) {
+    LOG_DEBUG("[%s] and %u more have been verified.", batch->fEntries[0].fName, batch->fCount - 1);
+    if (self->fNext < self->fCount && TManifestVerifier_StartNext(self, i) != SSE_E_OK) {
+      in_result = SSE_E_GENERIC;
+    }
+  }
+  if (in_result != SSE_E_OK) {
+    LOG_ERROR("failed to verify [%s] or %u more. err=%s", batch->fEntries[0].fName, batch->fCount - 1, sse_get_error_string(in_result));
+    self->fResult = in_result;
+    TManifestVerifier_Cancel(self);
+  }
+  if (self->fRunning == 0) {
+    if (self->fResult == SSE_E_OK) {
+      LOG_INFO("%u files have been verified.", self->fCount);
+    }
+    (*self->fCallback)(self, self->fResult, self->fUserData);
+  }
+  TRACE_LEAVE();
+}
+
+/*
+ * Collects the entries to verify. Fails with SSE_E_INVAL when the manifest
+ * is malformed or an image has no digest. A package without firmware.conf
+ * names no images and has only the entries of its manifest, if any.
+ */
+sse_int
+TManifestVerifier_Load(TManifestVerifier *self)
+{
+  static sse_char *names[] = FIRMWARE_CONF_IMAGE_NAMES;
+  TFirmwareConf *conf = NULL;
+  sse_char *path = NULL;
+  sse_char *name;
+  sse_int i;
+  sse_int err;
+
+  TRACE_ENTER();
+  TManifestVerifier_Cancel(self);
+  TManifestVerifier_Clear(self);
+  path = ManifestVerifier_MakePath(self->fDirPath, MANIFEST_VERIFIER_FILE_NAME, "");
+  if (path == NULL) {
+    return SSE_E_NOMEM;
+  }
+  err = TManifestVerifier_LoadDigests(self, path, MANIFEST_DIGEST_SHA256, NULL);
+  sse_free(path);
+  path = NULL;
+  if (err == SSE_E_NOENT) {
+    LOG_INFO("package has no manifest, images are verified with MD5.");
+  } else if (err != SSE_E_OK) {
+    goto error_exit;
+  }
+  conf = FirmwareConf_New();
+  path = ManifestVerifier_MakePath(self->fDirPath, MANIFEST_VERIFIER_CONF_NAME, "");
+  if (conf == NULL || path == NULL) {
+    err = SSE_E_NOMEM;
+    goto error_exit;
+  }
+  err = TFirmwareConf_Load(conf, path);
+  if (err == SSE_E_NOENT) {
+    /* packages for Debian based gateways come with package.conf */
+    LOG_DEBUG("package has no %s.", MANIFEST_VERIFIER_CONF_NAME);
+  } else if (err != SSE_E_OK) {
+    goto error_exit;
+  }
+  sse_free(path);
+  path = NULL;
+  for (i = 0; err == SSE_E_OK && names[i] != NULL; i++) {
+    name = TFirmwareConf_GetValue(conf, names[i]);
+    if (name == NULL || *name == '\0' || TManifestVerifier_FindEntry(self, name) != NULL) {
+      continue;
+    }
+    path = ManifestVerifier_MakePath(self->fDirPath, name, MANIFEST_VERIFIER_MD5_SUFFIX);
+    if (path == NULL) {
+      err = SSE_E_NOMEM;
+      goto error_exit;
+    }
+    err = TManifestVerifier_LoadDigests(self, path, MANIFEST_DIGEST_MD5, name);
+    if (err == SSE_E_NOENT) {
+      LOG_ERROR("%s [%s] has no digest.", names[i], name);
+      err = SSE_E_INVAL;
+    }
+    if (err != SSE_E_OK) {
+      goto error_exit;
+    }
+    sse_free(path);
+    path = NULL;
+  }
+  TFirmwareConf_Delete(conf);
+  TRACE_LEAVE();
+  return SSE_E_OK;
+
+error_exit:
+  if (path != NULL) {
+    sse_free(path);
+  }
+  if (conf != NULL) {
+    TFirmwareConf_Delete(conf);
+  }
+  TManifestVerifier_Clear(self);
+  return err;
+}
+
+sse_uint
+TManifestVerifier_GetCount(TManifestVerifier *self)
+{
+  return self->fCount;
+}
+
+TManifestEntry *
+TManifestVerifier_GetEntry(TManifestVerifier *self, sse_uint in_index)
+{
+  return (in_index < self->fCount) ? &self->fEntries[in_index] : NULL;
+}
+
+/*
+ * Hashes the loaded entries and calls in_callback when all of them have
+ * been verified or one of them has failed.
+ */
+sse_int
+TManifestVerifier_Start(TManifestVerifier *self, ManifestVerifier_CompletionCallback in_callback, sse_pointer in_user_data)
+{
+  sse_uint i;
+  sse_int err = SSE_E_OK;
+
+  TRACE_ENTER();
+  if (self->fRunning > 0) {
+    return SSE_E_ALREADY;
+  }
+  if (self->fCount == 0) {
+    return SSE_E_NOENT;
+  }
+  /* pick the hash back ends once here rather than in every worker */
+  FastHash_GetSelectedMbKernel();
+  for (i = 0; i < MANIFEST_DIGEST_TYPEs; i++) {
+    KernelHash_IsPreferred(ManifestVerifier_KernelAlgorithms[i]);
+  }
+  self->fNext = 0;
+  self->fResult = SSE_E_OK;
+  self->fCallback = in_callback;
+  self->fUserData = in_user_data;
+  for (i = 0; i < MANIFEST_VERIFIER_MAX_WORKERS && self->fNext < self->fCount; i++) {
+    if (self->fWorkers[i] == NULL) {
+      self->fWorkers[i] = WorkerProcess_New();
+      if (self->fWorkers[i] == NULL) {
+        err = SSE_E_NOMEM;
+        break;
+      }
+    }
+    err = TManifestVerifier_StartNext(self, i);
+    if (err != SSE_E_OK) {
+      break;
+    }
+  }
+  if (self->fRunning == 0) {
+    return err;
+  }
+  /* the workers started carry on with the rest */
+  TRACE_LEAVE();
+  return SSE_E_OK;
+}
+
+void
+TManifestVerifier_Cancel(TManifestVerifier *self)
+{
+  sse_uint i;
+
+  for (i = 0; i < MANIFEST_VERIFIER_MAX_WORKERS; i++) {
+    if (self->fWorkers[i] != NULL) {
+      TWorkerProcess_Cancel(self->fWorkers[i]);
+    }
+  }
+  self->fRunning = 0;
+}
+
+sse_bool
+TManifestVerifier_IsRunning(TManifestVerifier *self)
+{
+  return (self->fRunning > 0) ? sse_true : sse_false;
+}
+
+TManifestVerifier *
+ManifestVerifier_New(sse_char *in_dir_path)
+{
+  TManifestVerifier *verifier;
+
+  TRACE_ENTER();
+  verifier = sse_zeroalloc(sizeof(TManifestVerifier));
+  if (verifier == NULL) {
+    LOG_ERROR("failed to sse_zeroalloc().");
+    return NULL;
+  }
+  verifier->fDirPath = sse_strdup(in_dir_path);
+  if (verifier->fDirPath == NULL) {
+    LOG_ERROR("failed to sse_strdup().");
+    sse_free(verifier);
+    return NULL;
+  }
+  TRACE_LEAVE();
+  return verifier;
+}
+
+void
+TManifestVerifier_Delete(TManifestVerifier *self)
+{
+  sse_uint i;
+
+  TRACE_ENTER();
+  for (i = 0; i < MANIFEST_VERIFIER_MAX_WORKERS; i++) {
+    if (self->fWorkers[i] != NULL) {
+      TWorkerProcess_Delete(self->fWorkers[i]);
+    }
+  }
+  TManifestVerifier_Clear(self);
+  sse_free(self->fDirPath);
+  sse_free(self);
+  TRACE_LEAVE();
+}
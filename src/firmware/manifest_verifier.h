@@ -0,0 +1,92 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#ifndef __MANIFEST_VERIFIER__
+#define __MANIFEST_VERIFIER__
+
+#include <sseutils.h>
+#include "fast_hash.h"
+#include "firmware_conf.h"
+#include "worker_process.h"
+
+SSE_BEGIN_C_DECLS
+
+#define MANIFEST_VERIFIER_FILE_NAME  "manifest.sha256"
+#define MANIFEST_VERIFIER_MAX_ENTRIES  (64)
+#define MANIFEST_VERIFIER_MAX_WORKERS  (4)
+
+enum ManifestDigestType_ {
+  MANIFEST_DIGEST_SHA256,
+  MANIFEST_DIGEST_MD5,
+  MANIFEST_DIGEST_TYPEs
+};
+
+typedef struct TManifestEntry_ TManifestEntry;
+typedef struct TManifestBatch_ TManifestBatch;
+typedef struct TManifestVerifier_ TManifestVerifier;
+
+typedef void (*ManifestVerifier_CompletionCallback)(TManifestVerifier *in_verifier, sse_int in_err, sse_pointer in_user_data);
+
+struct TManifestEntry_ {
+  sse_char *fName;
+  sse_char *fPath;
+  sse_int fDigestType;
+  sse_byte fDigest[SHA256_MD_BYTES];
+};
+
+struct TManifestBatch_ {
+  TManifestEntry *fEntries;
+  sse_uint fCount;
+};
+
+/*
+ * Verifies the files of an extracted package against their digests. The
+ * entries are read from manifest.sha256 (in the format of sha256sum) and
+ * from the images named in firmware.conf. An image which is not in the
+ * manifest falls back to the MD5 digest in its .md5 file, as packages made
+ * before the manifest have no other.
+ * Files are hashed in-process by a pool of worker processes, so that they
+ * are hashed concurrently without blocking the event loop. Each worker
+ * takes a batch of up to FAST_HASH_MB_MAX_LANES files and hashes their
+ * SHA-256 streams together with the multi-buffer hash. The first file
+ * which is missing or mismatches stops the other workers and completes the
+ * verification with SSE_E_NOENT or SSE_E_INVAL.
+ */
+struct TManifestVerifier_ {
+  sse_char *fDirPath;
+  TManifestEntry fEntries[MANIFEST_VERIFIER_MAX_ENTRIES];
+  sse_uint fCount;
+  TWorkerProcess *fWorkers[MANIFEST_VERIFIER_MAX_WORKERS];
+  TManifestBatch fBatches[MANIFEST_VERIFIER_MAX_WORKERS];
+  sse_uint fNext;
+  sse_uint fRunning;
+  sse_int fResult;
+  ManifestVerifier_CompletionCallback fCallback;
+  sse_pointer fUserData;
+};
+
+TManifestVerifier * ManifestVerifier_New(sse_char *in_dir_path);
+void TManifestVerifier_Delete(TManifestVerifier *self);
+sse_int TManifestVerifier_Load(TManifestVerifier *self);
+sse_uint TManifestVerifier_GetCount(TManifestVerifier *self);
+TManifestEntry * TManifestVerifier_GetEntry(TManifestVerifier *self, sse_uint in_index);
+sse_int TManifestVerifier_Start(TManifestVerifier *self, ManifestVerifier_CompletionCallback in_callback, sse_pointer in_user_data);
+void TManifestVerifier_Cancel(TManifestVerifier *self);
+sse_bool TManifestVerifier_IsRunning(TManifestVerifier *self);
+
+SSE_END_C_DECLS
+
+#endif /* __MANIFEST_VERIFIER__ */
@@ -0,0 +1,379 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#include <stdlib.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include <servicesync/moat.h>
+#include "mirror_list.h"
+
+#define TAG "MirrorList"
+
+#define TRACE_ENTER() MOAT_LOG_TRACE(TAG, "== enter =>");
+#define TRACE_LEAVE() MOAT_LOG_TRACE(TAG, "<= leave ==");
+#define LOG_ERROR(format, ...)  MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...)  MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+
+#define MIRROR_LIST_STORED_STATS_KEY  "MirrorStats"
+#define MIRROR_STATS_FIELD_THROUGHPUT  "throughput"
+#define MIRROR_STATS_FIELD_LATENCY  "latency"
+#define MIRROR_STATS_FIELD_FAILURES  "failures"
+
+/* mirrors are compared by the time they would take for this much */
+#define MIRROR_LIST_REFERENCE_SIZE  (1024 * 1024)
+
+/* MirrorList private */
+
+/*
+ * Scheme, host and port of a URL, which is what the statistics are kept for.
+ */
+static sse_char *
+MirrorList_MakeOrigin(sse_char *in_url)
+{
+  sse_char *p;
+  sse_char *end;
+
+  p = sse_strstr(in_url, "://");
+  if (p == NULL) {
+    return sse_strdup(in_url);
+  }
+  end = sse_strchr(p + 3, '/');
+  if (end == NULL) {
+    return sse_strdup(in_url);
+  }
+  return sse_strndup(in_url, end - in_url);
+}
+
+static sse_int64
+MirrorList_GetCost(TMirror *in_mirror)
+{
+  if (in_mirror->fThroughput <= 0) {
+    return 0;
+  }
+  return in_mirror->fLatency + (sse_int64)MIRROR_LIST_REFERENCE_SIZE * 1000 / in_mirror->fThroughput;
+}
+
+static sse_bool
+MirrorList_IsBetter(TMirror *in_a, TMirror *in_b)
+{
+  if (in_a->fFailures != in_b->fFailures) {
+    return in_a->fFailures < in_b->fFailures;
+  }
+  return MirrorList_GetCost(in_a) < MirrorList_GetCost(in_b);
+}
+
+static void
+TMirrorList_LoadStats(TMirrorList *self)
+{
+  MoatObject *stats = NULL;
+  MoatObject *entry;
+  TMirror *m;
+  sse_uint i;
+
+  if (moat_datastore_load_object(self->fMoat, MIRROR_LIST_STORED_STATS_KEY, &stats) != SSE_E_OK) {
+    return;
+  }
+  for (i = 0; i < self->fCount; i++) {
+    m = &self->fMirrors[i];
+    if (moat_object_get_object_value(stats, m->fOrigin, &entry) != SSE_E_OK) {
+      continue;
+    }
+    moat_object_get_int64_value(entry, MIRROR_STATS_FIELD_THROUGHPUT, &m->fThroughput);
+    moat_object_get_int32_value(entry, MIRROR_STATS_FIELD_LATENCY, &m->fLatency);
+    moat_object_get_int32_value(entry, MIRROR_STATS_FIELD_FAILURES, &m->fFailures);
+  }
+  moat_object_free(stats);
+}
+
+/*
+ * Merges the statistics of the current mirror into the stored ones, which
+ * may cover origins that are not in this list.
+ */
+static void
+TMirrorList_SaveStats(TMirrorList *self)
+{
+  TMirror *m = &self->fMirrors[self->fCurrent];
+  MoatObject *stats = NULL;
+  MoatObject *entry = NULL;
+  sse_int err;
+
+  if (moat_datastore_load_object(self->fMoat, MIRROR_LIST_STORED_STATS_KEY, &stats) != SSE_E_OK) {
+    stats = moat_object_new();
+  }
+  entry = moat_object_new();
+  if (stats == NULL || entry == NULL) {
+    err = SSE_E_NOMEM;
+    goto error_exit;
+  }
+  err = moat_object_add_int64_value(entry, MIRROR_STATS_FIELD_THROUGHPUT, m->fThroughput, sse_true);
+  if (err == SSE_E_OK) {
+    err = moat_object_add_int32_value(entry, MIRROR_STATS_FIELD_LATENCY, m->fLatency, sse_true);
+  }
+  if (err == SSE_E_OK) {
+    err = moat_object_add_int32_value(entry, MIRROR_STATS_FIELD_FAILURES, m->fFailures, sse_true);
+  }
+  if (err == SSE_E_OK) {
+    err = moat_object_add_object_value(stats, m->fOrigin, entry, sse_true, sse_true);
+  }
+  if (err == SSE_E_OK) {
+    err = moat_datastore_save_object(self->fMoat, MIRROR_LIST_STORED_STATS_KEY, stats);
+  }
+  if (err != SSE_E_OK) {
+    goto error_exit;
+  }
+  moat_object_free(entry);
+  moat_object_free(stats);
+  return;
+
+error_exit:
+  LOG_ERROR("failed to save mirror statistics. err=%s", sse_get_error_string(err));
+  if (entry != NULL) {
+    moat_object_free(entry);
+  }
+  if (stats != NULL) {
+    moat_object_free(stats);
+  }
+}
+
+/* MirrorList public */
+
+sse_int
+TMirrorList_Add(TMirrorList *self, sse_char *in_url, sse_uint in_len)
+{
+  TMirror *m;
+  sse_uint i;
+
+  for (i = 0; i < self->fCount; i++) {
+    m = &self->fMirrors[i];
+    if (sse_strlen(m->fUrl) == in_len && sse_strncmp(m->fUrl, in_url, in_len) == 0) {
+      return SSE_E_OK;
+    }
+  }
+  if (self->fCount == MIRROR_LIST_MAX_MIRRORS) {
+    LOG_INFO("too many mirrors. [%.*s] is ignored.", in_len, in_url);
+    return SSE_E_OK;
+  }
+  m = &self->fMirrors[self->fCount];
+  sse_memset(m, 0, sizeof(TMirror));
+  m->fUrl = sse_strndup(in_url, in_len);
+  if (m->fUrl == NULL) {
+    return SSE_E_NOMEM;
+  }
+  m->fOrigin = MirrorList_MakeOrigin(m->fUrl);
+  if (m->fOrigin == NULL) {
+    sse_free(m->fUrl);
+    return SSE_E_NOMEM;
+  }
+  self->fCount++;
+  return SSE_E_OK;
+}
+
+/*
+ * Adds the URLs of a list separated by commas or white space.
+ */
+sse_int
+TMirrorList_AddList(TMirrorList *self, sse_char *in_list, sse_uint in_len)
+{
+  sse_uint start;
+  sse_uint i = 0;
+  sse_int err;
+
+  while (i < in_len) {
+    while (i < in_len && (in_list[i] == ',' || isspace((unsigned char)in_list[i]))) {
+      i++;
+    }
+    start = i;
+    while (i < in_len && in_list[i] != ',' && !isspace((unsigned char)in_list[i])) {
+      i++;
+    }
+    if (i > start) {
+      err = TMirrorList_Add(self, in_list + start, i - start);
+      if (err != SSE_E_OK) {
+        return err;
+      }
+    }
+  }
+  return SSE_E_OK;
+}
+
+void
+TMirrorList_Rank(TMirrorList *self)
+{
+  TMirror m;
+  sse_uint i;
+  sse_uint j;
+
+  TRACE_ENTER();
+  TMirrorList_LoadStats(self);
+  for (i = 1; i < self->fCount; i++) {
+    m = self->fMirrors[i];
+    for (j = i; j > 0 && MirrorList_IsBetter(&m, &self->fMirrors[j - 1]); j--) {
+      self->fMirrors[j] = self->fMirrors[j - 1];
+    }
+    self->fMirrors[j] = m;
+  }
+  for (i = 0; i < self->fCount; i++) {
+    LOG_DEBUG("mirror %u: [%s] failures=%d, throughput=%lld, latency=%d", i, self->fMirrors[i].fOrigin,
+      self->fMirrors[i].fFailures, self->fMirrors[i].fThroughput, self->fMirrors[i].fLatency);
+  }
+  self->fCurrent = 0;
+  self->fRound = 0;
+  TRACE_LEAVE();
+}
+
+sse_char *
+TMirrorList_GetCurrent(TMirrorList *self)
+{
+  if (self->fCount == 0) {
+    return NULL;
+  }
+  return self->fMirrors[self->fCurrent].fUrl;
+}
+
+/*
+ * Moves on to the next mirror which has not been dropped. Returns sse_false
+ * when all of them have been.
+ */
+sse_bool
+TMirrorList_Advance(TMirrorList *self)
+{
+  sse_uint i;
+  sse_uint next;
+
+  for (i = 1; i <= self->fCount; i++) {
+    next = (self->fCurrent + i) % self->fCount;
+    if (!self->fMirrors[next].fDropped) {
+      if (next <= self->fCurrent) {
+        self->fRound++;
+      }
+      self->fCurrent = next;
+      return sse_true;
+    }
+  }
+  return sse_false;
+}
+
+/*
+ * Stays on the current mirror for another attempt. Each attempt counts as a
+ * round, so that the backoff grows as it does over a rotation.
+ */
+sse_bool
+TMirrorList_Repeat(TMirrorList *self)
+{
+  if (self->fCount == 0 || self->fMirrors[self->fCurrent].fDropped) {
+    return sse_false;
+  }
+  self->fRound++;
+  return sse_true;
+}
+
+/*
+ * Takes the current mirror out of the rotation of this job.
+ */
+void
+TMirrorList_Drop(TMirrorList *self)
+{
+  if (self->fCount > 0) {
+    self->fMirrors[self->fCurrent].fDropped = sse_true;
+  }
+}
+
+sse_uint
+TMirrorList_GetRound(TMirrorList *self)
+{
+  return self->fRound;
+}
+
+/*
+ * Exponential backoff for the current round, with full jitter over its
+ * upper half so that devices failed by the same outage do not come back
+ * all at once.
+ */
+sse_uint
+TMirrorList_GetBackoff(TMirrorList *self, sse_uint in_base_sec, sse_uint in_max_sec)
+{
+  sse_uint delay = in_max_sec;
+
+  if (self->fRound < 16 && ((sse_uint64)in_base_sec << self->fRound) < in_max_sec) {
+    delay = in_base_sec << self->fRound;
+  }
+  return delay / 2 + (sse_uint)(random() % (delay / 2 + 1));
+}
+
+void
+TMirrorList_ReportSuccess(TMirrorList *self, sse_int64 in_bytes, sse_uint64 in_elapsed_msec, sse_int32 in_latency_msec)
+{
+  TMirror *m;
+  sse_int64 throughput;
+
+  if (self->fCount == 0) {
+    return;
+  }
+  m = &self->fMirrors[self->fCurrent];
+  m->fFailures = 0;
+  if (in_bytes > 0 && in_elapsed_msec > 0) {
+    throughput = in_bytes * 1000 / (sse_int64)in_elapsed_msec;
+    m->fThroughput = (m->fThroughput <= 0) ? throughput : (m->fThroughput + throughput) / 2;
+  }
+  if (in_latency_msec >= 0) {
+    m->fLatency = (m->fLatency <= 0) ? in_latency_msec : (m->fLatency + in_latency_msec) / 2;
+  }
+  LOG_DEBUG("[%s] throughput=%lld, latency=%d", m->fOrigin, m->fThroughput, m->fLatency);
+  TMirrorList_SaveStats(self);
+}
+
+void
+TMirrorList_ReportFailure(TMirrorList *self)
+{
+  if (self->fCount == 0) {
+    return;
+  }
+  self->fMirrors[self->fCurrent].fFailures++;
+  TMirrorList_SaveStats(self);
+}
+
+TMirrorList *
+MirrorList_New(Moat in_moat)
+{
+  TMirrorList *list;
+
+  TRACE_ENTER();
+  list = sse_zeroalloc(sizeof(TMirrorList));
+  if (list == NULL) {
+    LOG_ERROR("failed to sse_zeroalloc().");
+    return NULL;
+  }
+  list->fMoat = in_moat;
+  srandom((unsigned int)(moat_get_timestamp_msec() ^ getpid()));
+  TRACE_LEAVE();
+  return list;
+}
+
+void
+TMirrorList_Delete(TMirrorList *self)
+{
+  sse_uint i;
+
+  TRACE_ENTER();
+  for (i = 0; i < self->fCount; i++) {
+    sse_free(self->fMirrors[i].fUrl);
+    sse_free(self->fMirrors[i].fOrigin);
+  }
+  sse_free(self);
+  TRACE_LEAVE();
+}
@@ -0,0 +1,71 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#ifndef __MIRROR_LIST__
+#define __MIRROR_LIST__
+
+#include <sseutils.h>
+
+SSE_BEGIN_C_DECLS
+
+#define MIRROR_LIST_MAX_MIRRORS  (8)
+
+typedef struct TMirror_ TMirror;
+typedef struct TMirrorList_ TMirrorList;
+
+struct TMirror_ {
+  sse_char *fUrl;
+  sse_char *fOrigin;
+  sse_int64 fThroughput;
+  sse_int32 fLatency;
+  sse_int32 fFailures;
+  sse_bool fDropped;
+};
+
+/*
+ * Ordered list of URLs which serve the same package. Mirrors are ranked by
+ * the failures, throughput and latency they have shown in earlier jobs,
+ * which are kept per origin (scheme, host and port) in the datastore.
+ * Mirrors without any record keep their order and are tried before the
+ * measured ones, so that they get measured. Attempts rotate through the
+ * mirrors which have not been dropped; each full rotation is a round and
+ * doubles the backoff.
+ */
+struct TMirrorList_ {
+  Moat fMoat;
+  TMirror fMirrors[MIRROR_LIST_MAX_MIRRORS];
+  sse_uint fCount;
+  sse_uint fCurrent;
+  sse_uint fRound;
+};
+
+TMirrorList * MirrorList_New(Moat in_moat);
+void TMirrorList_Delete(TMirrorList *self);
+sse_int TMirrorList_Add(TMirrorList *self, sse_char *in_url, sse_uint in_len);
+sse_int TMirrorList_AddList(TMirrorList *self, sse_char *in_list, sse_uint in_len);
+void TMirrorList_Rank(TMirrorList *self);
+sse_char * TMirrorList_GetCurrent(TMirrorList *self);
+sse_bool TMirrorList_Advance(TMirrorList *self);
+sse_bool TMirrorList_Repeat(TMirrorList *self);
+void TMirrorList_Drop(TMirrorList *self);
+sse_uint TMirrorList_GetRound(TMirrorList *self);
+sse_uint TMirrorList_GetBackoff(TMirrorList *self, sse_uint in_base_sec, sse_uint in_max_sec);
+void TMirrorList_ReportSuccess(TMirrorList *self, sse_int64 in_bytes, sse_uint64 in_elapsed_msec, sse_int32 in_latency_msec);
+void TMirrorList_ReportFailure(TMirrorList *self);
+
+SSE_END_C_DECLS
+
+#endif /* __MIRROR_LIST__ */
@@ -0,0 +1,494 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <servicesync/moat.h>
+#include "package_cache.h"
+
+#define TAG "PackageCache"
+
+#define TRACE_ENTER() MOAT_LOG_TRACE(TAG, "== enter =>");
+#define TRACE_LEAVE() MOAT_LOG_TRACE(TAG, "<= leave ==");
+#define LOG_ERROR(format, ...)  MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...)  MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+
+#define PKG_CACHE_STORED_INDEX_KEY  "PackageCacheIndex"
+#define PKG_CACHE_ENTRY_FIELD_SIZE  "size"
+#define PKG_CACHE_ENTRY_FIELD_SEQUENCE  "sequence"
+#define PKG_CACHE_COPY_BUFFER_SIZE  (64 * 1024)
+
+/* PackageCache private */
+
+static void
+PackageCache_ToHex(sse_byte *in_digest, sse_char *out_hex)
+{
+  sse_int i;
+
+  for (i = 0; i < SHA256_MD_BYTES; i++) {
+    snprintf(out_hex + i * 2, 3, "%02x", in_digest[i]);
+  }
+}
+
+static sse_bool
+PackageCache_IsDigest(sse_char *in_key)
+{
+  sse_int i;
+
+  for (i = 0; i < SHA256_MD_BYTES * 2; i++) {
+    if (!((in_key[i] >= '0' && in_key[i] <= '9') || (in_key[i] >= 'a' && in_key[i] <= 'f'))) {
+      return sse_false;
+    }
+  }
+  return (in_key[i] == '\0') ? sse_true : sse_false;
+}
+
+static sse_char *
+TPackageCache_MakePath(TPackageCache *self, sse_char *in_hex)
+{
+  sse_char *path;
+  sse_int len;
+
+  len = sse_strlen(self->fDirPath) + 1 + SHA256_MD_BYTES * 2;
+  path = sse_malloc(len + 1);
+  if (path == NULL) {
+    LOG_ERROR("failed to sse_malloc().");
+    return NULL;
+  }
+  snprintf(path, len + 1, "%s/%s", self->fDirPath, in_hex);
+  return path;
+}
+
+static sse_int64
+PackageCache_GetFileSize(sse_char *in_path)
+{
+  struct stat st;
+
+  if (stat(in_path, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return -1;
+  }
+  return (sse_int64)st.st_size;
+}
+
+static sse_int
+PackageCache_CopyFile(sse_char *in_src_path, sse_char *in_dst_path)
+{
+  sse_byte *buffer = NULL;
+  sse_int err = SSE_E_OK;
+  ssize_t n;
+  ssize_t written;
+  int src = -1;
+  int dst = -1;
+
+  src = open(in_src_path, O_RDONLY);
+  dst = open(in_dst_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  buffer = sse_malloc(PKG_CACHE_COPY_BUFFER_SIZE);
+  if (src < 0 || dst < 0 || buffer == NULL) {
+    LOG_ERROR("failed to prepare copy of [%s]. err=[%s]", in_src_path, strerror(errno));
+    err = (buffer == NULL) ? SSE_E_NOMEM : SSE_E_GENERIC;
+    goto error_exit;
+  }
+  while ((n = read(src, buffer, PKG_CACHE_COPY_BUFFER_SIZE)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      err = SSE_E_GENERIC;
+      break;
+    }
+    written = write(dst, buffer, (size_t)n);
+    if (written != n) {
+      LOG_ERROR("failed to write(%s). err=[%s]", in_dst_path, strerror(errno));
+      err = SSE_E_GENERIC;
+      break;
+    }
+  }
+
+error_exit:
+  if (buffer != NULL) {
+    sse_free(buffer);
+  }
+  if (src >= 0) {
+    close(src);
+  }
+  if (dst >= 0) {
+    if (close(dst) != 0 && err == SSE_E_OK) {
+      err = SSE_E_GENERIC;
+    }
+    if (err != SSE_E_OK) {
+      unlink(in_dst_path);
+    }
+  }
+  return err;
+}
+
+/*
+ * Makes in_dst_path refer to the content of in_src_path. The content is
+ * copied only when the two paths are on different file systems.
+ */
+static sse_int
+PackageCache_LinkFile(sse_char *in_src_path, sse_char *in_dst_path)
+{
+  unlink(in_dst_path);
+  if (link(in_src_path, in_dst_path) == 0) {
+    return SSE_E_OK;
+  }
+  LOG_DEBUG("failed to link(%s). err=[%s], copying.", in_src_path, strerror(errno));
+  return PackageCache_CopyFile(in_src_path, in_dst_path);
+}
+
+static sse_int
+TPackageCache_Find(TPackageCache *self, sse_char *in_hex)
+{
+  sse_uint i;
+
+  for (i = 0; i < self->fCount; i++) {
+    if (sse_strcmp(self->fEntries[i].fDigest, in_hex) == 0) {
+      return (sse_int)i;
+    }
+  }
+  return -1;
+}
+
+static sse_int
+TPackageCache_Add(TPackageCache *self, sse_char *in_hex, sse_int64 in_size, sse_int64 in_sequence)
+{
+  TPackageCacheEntry *entries;
+  TPackageCacheEntry *entry;
+  sse_uint capacity;
+
+  if (self->fCount == self->fCapacity) {
+    capacity = (self->fCapacity == 0) ? 8 : self->fCapacity * 2;
+    entries = sse_malloc(sizeof(TPackageCacheEntry) * capacity);
+    if (entries == NULL) {
+      LOG_ERROR("failed to sse_malloc().");
+      return SSE_E_NOMEM;
+    }
+    if (self->fEntries != NULL) {
+      sse_memcpy(entries, self->fEntries, sizeof(TPackageCacheEntry) * self->fCount);
+      sse_free(self->fEntries);
+    }
+    self->fEntries = entries;
+    self->fCapacity = capacity;
+  }
+  entry = &self->fEntries[self->fCount++];
+  sse_memcpy(entry->fDigest, in_hex, sizeof(entry->fDigest));
+  entry->fSize = in_size;
+  entry->fSequence = in_sequence;
+  self->fTotalSize += in_size;
+  if (in_sequence > self->fSequence) {
+    self->fSequence = in_sequence;
+  }
+  return SSE_E_OK;
+}
+
+static void
+TPackageCache_Remove(TPackageCache *self, sse_uint in_index)
+{
+  sse_char *path;
+
+  path = TPackageCache_MakePath(self, self->fEntries[in_index].fDigest);
+  if (path != NULL) {
+    unlink(path);
+    sse_free(path);
+  }
+  self->fTotalSize -= self->fEntries[in_index].fSize;
+  self->fCount--;
+  if (in_index < self->fCount) {
+    sse_memcpy(&self->fEntries[in_index], &self->fEntries[self->fCount], sizeof(TPackageCacheEntry));
+  }
+}
+
+static sse_int
+TPackageCache_SaveIndex(TPackageCache *self)
+{
+  MoatObject *index = NULL;
+  MoatObject *entry = NULL;
+  sse_uint i;
+  sse_int err = SSE_E_NOMEM;
+
+  index = moat_object_new();
+  if (index == NULL) {
+    LOG_ERROR("failed to moat_object_new().");
+    return SSE_E_NOMEM;
+  }
+  for (i = 0; i < self->fCount; i++) {
+    entry = moat_object_new();
+    if (entry == NULL) {
+      goto error_exit;
+    }
+    err = moat_object_add_int64_value(entry, PKG_CACHE_ENTRY_FIELD_SIZE, self->fEntries[i].fSize, sse_true);
+    if (err != SSE_E_OK) {
+      goto error_exit;
+    }
+    err = moat_object_add_int64_value(entry, PKG_CACHE_ENTRY_FIELD_SEQUENCE, self->fEntries[i].fSequence, sse_true);
+    if (err != SSE_E_OK) {
+      goto error_exit;
+    }
+    err = moat_object_add_object_value(index, self->fEntries[i].fDigest, entry, sse_true, sse_true);
+    if (err != SSE_E_OK) {
+      goto error_exit;
+    }
+    moat_object_free(entry);
+    entry = NULL;
+  }
+  err = moat_datastore_save_object(self->fMoat, PKG_CACHE_STORED_INDEX_KEY, index);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to moat_datastore_save_object(). err=%s", sse_get_error_string(err));
+  }
+  moat_object_free(index);
+  return err;
+
+error_exit:
+  LOG_ERROR("failed to build cache index. err=%s", sse_get_error_string(err));
+  if (entry != NULL) {
+    moat_object_free(entry);
+  }
+  moat_object_free(index);
+  return err;
+}
+
+/*
+ * Loads the index and drops the entries whose file has gone or has been
+ * changed in size.
+ */
+static void
+TPackageCache_LoadIndex(TPackageCache *self)
+{
+  MoatObject *index = NULL;
+  MoatObject *entry;
+  MoatObjectIterator *it = NULL;
+  sse_char *key;
+  sse_char *path;
+  sse_int64 size;
+  sse_int64 sequence;
+  sse_bool dirty = sse_false;
+
+  TRACE_ENTER();
+  if (moat_datastore_load_object(self->fMoat, PKG_CACHE_STORED_INDEX_KEY, &index) != SSE_E_OK) {
+    return;
+  }
+  it = moat_object_create_iterator(index);
+  while (it != NULL && moat_object_iterator_has_next(it)) {
+    key = moat_object_iterator_get_next_key(it);
+    if (key == NULL || !PackageCache_IsDigest(key) ||
+        moat_object_get_object_value(index, key, &entry) != SSE_E_OK ||
+        moat_object_get_int64_value(entry, PKG_CACHE_ENTRY_FIELD_SIZE, &size) != SSE_E_OK ||
+        moat_object_get_int64_value(entry, PKG_CACHE_ENTRY_FIELD_SEQUENCE, &sequence) != SSE_E_OK) {
+      dirty = sse_true;
+      continue;
+    }
+    path = TPackageCache_MakePath(self, key);
+    if (path == NULL) {
+      break;
+    }
+    if (PackageCache_GetFileSize(path) != size) {
+      LOG_INFO("cached package [%s] is missing or broken.", key);
+      unlink(path);
+      dirty = sse_true;
+    } else if (TPackageCache_Add(self, key, size, sequence) != SSE_E_OK) {
+      sse_free(path);
+      break;
+    }
+    sse_free(path);
+  }
+  if (it != NULL) {
+    moat_object_iterator_free(it);
+  }
+  moat_object_free(index);
+  if (dirty) {
+    TPackageCache_SaveIndex(self);
+  }
+  LOG_DEBUG("%u packages in cache. size=%lld", self->fCount, self->fTotalSize);
+  TRACE_LEAVE();
+}
+
+/*
+ * Evicts the least recently used packages until the cache fits in the
+ * budget. Returns whether anything has been evicted.
+ */
+static sse_bool
+TPackageCache_Evict(TPackageCache *self)
+{
+  sse_uint i;
+  sse_uint lru;
+  sse_bool evicted = sse_false;
+
+  while (self->fCount > 0 && self->fTotalSize > self->fBudget) {
+    lru = 0;
+    for (i = 1; i < self->fCount; i++) {
+      if (self->fEntries[i].fSequence < self->fEntries[lru].fSequence) {
+        lru = i;
+      }
+    }
+    LOG_INFO("evicting cached package [%s]. size=%lld", self->fEntries[lru].fDigest, self->fEntries[lru].fSize);
+    TPackageCache_Remove(self, lru);
+    evicted = sse_true;
+  }
+  return evicted;
+}
+
+/* PackageCache public */
+
+void
+TPackageCache_SetBudget(TPackageCache *self, sse_int64 in_budget)
+{
+  TRACE_ENTER();
+  self->fBudget = (in_budget < 0) ? 0 : in_budget;
+  if (TPackageCache_Evict(self)) {
+    TPackageCache_SaveIndex(self);
+  }
+  TRACE_LEAVE();
+}
+
+/*
+ * Places the cached package with the digest at in_file_path. Returns
+ * SSE_E_NOENT when the package is not in the cache.
+ */
+sse_int
+TPackageCache_Fetch(TPackageCache *self, sse_byte *in_digest, sse_char *in_file_path)
+{
+  sse_char hex[SHA256_MD_BYTES * 2 + 1];
+  sse_char *path;
+  sse_int index;
+  sse_int err;
+
+  TRACE_ENTER();
+  PackageCache_ToHex(in_digest, hex);
+  index = TPackageCache_Find(self, hex);
+  if (index < 0) {
+    return SSE_E_NOENT;
+  }
+  path = TPackageCache_MakePath(self, hex);
+  if (path == NULL) {
+    return SSE_E_NOMEM;
+  }
+  if (PackageCache_GetFileSize(path) != self->fEntries[index].fSize) {
+    LOG_INFO("cached package [%s] is missing or broken.", hex);
+    TPackageCache_Remove(self, (sse_uint)index);
+    TPackageCache_SaveIndex(self);
+    sse_free(path);
+    return SSE_E_NOENT;
+  }
+  err = PackageCache_LinkFile(path, in_file_path);
+  sse_free(path);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to fetch cached package [%s]. err=%s", hex, sse_get_error_string(err));
+    return err;
+  }
+  self->fEntries[index].fSequence = ++self->fSequence;
+  TPackageCache_SaveIndex(self);
+  LOG_INFO("package [%s] has been fetched from cache.", hex);
+  TRACE_LEAVE();
+  return SSE_E_OK;
+}
+
+/*
+ * Adds the package at in_file_path, whose content has been verified against
+ * the digest, to the cache.
+ */
+sse_int
+TPackageCache_Store(TPackageCache *self, sse_byte *in_digest, sse_char *in_file_path)
+{
+  sse_char hex[SHA256_MD_BYTES * 2 + 1];
+  sse_char *path;
+  sse_int64 size;
+  sse_int index;
+  sse_int err;
+
+  TRACE_ENTER();
+  PackageCache_ToHex(in_digest, hex);
+  size = PackageCache_GetFileSize(in_file_path);
+  if (size < 0 || size > self->fBudget) {
+    LOG_DEBUG("package [%s] is not cached. size=%lld, budget=%lld", hex, size, self->fBudget);
+    return SSE_E_INVAL;
+  }
+  index = TPackageCache_Find(self, hex);
+  if (index >= 0) {
+    self->fEntries[index].fSequence = ++self->fSequence;
+    return TPackageCache_SaveIndex(self);
+  }
+  path = TPackageCache_MakePath(self, hex);
+  if (path == NULL) {
+    return SSE_E_NOMEM;
+  }
+  err = PackageCache_LinkFile(in_file_path, path);
+  if (err == SSE_E_OK) {
+    err = TPackageCache_Add(self, hex, size, self->fSequence + 1);
+    if (err != SSE_E_OK) {
+      unlink(path);
+    }
+  }
+  sse_free(path);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to store package [%s]. err=%s", hex, sse_get_error_string(err));
+    return err;
+  }
+  TPackageCache_Evict(self);
+  TPackageCache_SaveIndex(self);
+  LOG_INFO("package [%s] has been cached. size=%lld, total=%lld", hex, size, self->fTotalSize);
+  TRACE_LEAVE();
+  return SSE_E_OK;
+}
+
+TPackageCache *
+PackageCache_New(Moat in_moat, sse_char *in_dir_path)
+{
+  TPackageCache *cache;
+
+  TRACE_ENTER();
+  if (mkdir(in_dir_path, 0755) != 0 && errno != EEXIST) {
+    LOG_ERROR("failed to mkdir(%s). err=[%s]", in_dir_path, strerror(errno));
+    return NULL;
+  }
+  cache = sse_zeroalloc(sizeof(TPackageCache));
+  if (cache == NULL) {
+    LOG_ERROR("failed to sse_zeroalloc().");
+    return NULL;
+  }
+  cache->fMoat = in_moat;
+  cache->fBudget = PACKAGE_CACHE_DEFAULT_BUDGET;
+  cache->fDirPath = sse_strdup(in_dir_path);
+  if (cache->fDirPath == NULL) {
+    LOG_ERROR("failed to sse_strdup().");
+    sse_free(cache);
+    return NULL;
+  }
+  TPackageCache_LoadIndex(cache);
+  TRACE_LEAVE();
+  return cache;
+}
+
+void
+TPackageCache_Delete(TPackageCache *self)
+{
+  TRACE_ENTER();
+  if (self->fEntries != NULL) {
+    sse_free(self->fEntries);
+  }
+  if (self->fDirPath != NULL) {
+    sse_free(self->fDirPath);
+  }
+  sse_free(self);
+  TRACE_LEAVE();
+}
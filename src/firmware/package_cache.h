@@ -0,0 +1,62 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#ifndef __PACKAGE_CACHE__
+#define __PACKAGE_CACHE__
+
+#include <sseutils.h>
+
+SSE_BEGIN_C_DECLS
+
+#define PACKAGE_CACHE_DEFAULT_BUDGET  (128LL * 1024 * 1024)
+
+typedef struct TPackageCacheEntry_ TPackageCacheEntry;
+typedef struct TPackageCache_ TPackageCache;
+
+struct TPackageCacheEntry_ {
+  sse_char fDigest[SHA256_MD_BYTES * 2 + 1];
+  sse_int64 fSize;
+  sse_int64 fSequence;
+};
+
+/*
+ * Keeps downloaded packages in a directory, named after the hex SHA-256
+ * digest of their content. Packages are hard-linked in and out of the cache
+ * (copied when linking is not possible), so storing and fetching do not
+ * move the content. The least recently used packages are evicted as soon as
+ * the total size exceeds the budget. The index is kept in the datastore and
+ * is checked against the directory when it is loaded.
+ */
+struct TPackageCache_ {
+  Moat fMoat;
+  sse_char *fDirPath;
+  sse_int64 fBudget;
+  sse_int64 fTotalSize;
+  sse_int64 fSequence;
+  TPackageCacheEntry *fEntries;
+  sse_uint fCount;
+  sse_uint fCapacity;
+};
+
+TPackageCache * PackageCache_New(Moat in_moat, sse_char *in_dir_path);
+void TPackageCache_Delete(TPackageCache *self);
+void TPackageCache_SetBudget(TPackageCache *self, sse_int64 in_budget);
+sse_int TPackageCache_Fetch(TPackageCache *self, sse_byte *in_digest, sse_char *in_file_path);
+sse_int TPackageCache_Store(TPackageCache *self, sse_byte *in_digest, sse_char *in_file_path);
+
+SSE_END_C_DECLS
+
+#endif /* __PACKAGE_CACHE__ */
@@ -0,0 +1,1660 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <servicesync/moat.h>
+#include "package_downloader.h"
+#include "kernel_hash.h"
+
+#define TAG "PackageDownloader"
+
+#define TRACE_ENTER() MOAT_LOG_TRACE(TAG, "== enter =>");
+#define TRACE_LEAVE() MOAT_LOG_TRACE(TAG, "<= leave ==");
+#define LOG_ERROR(format, ...)  MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...)  MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+
+#define PKG_DL_STORED_STATE_KEY "PackageDownloadState"
+#define PKG_DL_STATE_FIELD_URL  "url"
+#define PKG_DL_STATE_FIELD_VALIDATOR  "validator"
+#define PKG_DL_STATE_FIELD_OFFSET  "offset"
+#define PKG_DL_STATE_FIELD_STATUS  "status"
+/* fast_hash context, ssehashlib ones were stored as "digestContext" */
+#define PKG_DL_STATE_FIELD_DIGEST_CONTEXT  "sha256Context"
+#define PKG_DL_STATE_FIELD_DIGEST_OFFSET  "digestOffset"
+#define PKG_DL_STATE_FIELD_COMPLETED  "completed"
+#define PKG_DL_STATE_FIELD_SHA256  "sha256"
+
+#define PKG_DL_PART_SUFFIX  ".part"
+#define PKG_DL_COPY_BUFFER_SIZE (64 * 1024)
+#define PKG_DL_CONSUME_BUFFER_SIZE (64 * 1024)
+#define PKG_DL_MAX_REDIRECTS  (5)
+#define PKG_DL_INITIAL_SEGMENTS  (2)
+#define PKG_DL_MIN_SEGMENT_SIZE  (1024 * 1024)
+#define PKG_DL_SEGMENT_MAX_RETRIES  (5)
+#define PKG_DL_SEGMENT_RETRY_MSEC  (1000)
+#define PKG_DL_SAMPLE_INTERVAL_MSEC  (3000)
+
+#define HTTP_STATUS_OK  (200)
+#define HTTP_STATUS_PARTIAL_CONTENT  (206)
+#define HTTP_STATUS_NOT_MODIFIED  (304)
+#define HTTP_STATUS_UNAUTHORIZED  (401)
+#define HTTP_STATUS_FORBIDDEN  (403)
+#define HTTP_STATUS_RANGE_NOT_SATISFIABLE  (416)
+
+enum PackageDownloaderState_ {
+  PKG_DL_STATE_IDLE,
+  PKG_DL_STATE_SENDING,
+  PKG_DL_STATE_RECEIVING,
+  PKG_DL_STATE_SEGMENTED,
+  PKG_DL_STATE_CACHED,
+  PKG_DL_STATEs
+};
+
+/* PackageDownloader private */
+
+static sse_char *
+TPackageDownloader_GetStateKey(TPackageDownloader *self)
+{
+  return (self->fStateKey != NULL) ? self->fStateKey : PKG_DL_STORED_STATE_KEY;
+}
+
+static sse_int64
+PackageDownloader_GetFileSize(sse_char *in_path)
+{
+  struct stat st;
+
+  if (stat(in_path, &st) != 0) {
+    return -1;
+  }
+  return (sse_int64)st.st_size;
+}
+
+static sse_int
+PackageDownloader_AppendFile(sse_char *in_dst_path, sse_char *in_src_path)
+{
+  sse_byte *buf = NULL;
+  int src = -1;
+  int dst = -1;
+  ssize_t n;
+  sse_int err = SSE_E_OK;
+
+  TRACE_ENTER();
+  buf = sse_malloc(PKG_DL_COPY_BUFFER_SIZE);
+  if (buf == NULL) {
+    LOG_ERROR("failed to sse_malloc().");
+    return SSE_E_NOMEM;
+  }
+  src = open(in_src_path, O_RDONLY);
+  if (src < 0) {
+    LOG_ERROR("failed to open(%s). err=[%s]", in_src_path, strerror(errno));
+    err = SSE_E_NOENT;
+    goto exit;
+  }
+  dst = open(in_dst_path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (dst < 0) {
+    LOG_ERROR("failed to open(%s). err=[%s]", in_dst_path, strerror(errno));
+    err = SSE_E_ACCES;
+    goto exit;
+  }
+  while ((n = read(src, buf, PKG_DL_COPY_BUFFER_SIZE)) > 0) {
+    if (write(dst, buf, n) != n) {
+      LOG_ERROR("failed to write(%s). err=[%s]", in_dst_path, strerror(errno));
+      err = SSE_E_GENERIC;
+      goto exit;
+    }
+  }
+  if (n < 0) {
+    LOG_ERROR("failed to read(%s). err=[%s]", in_src_path, strerror(errno));
+    err = SSE_E_GENERIC;
+  }
+
+exit:
+  if (dst >= 0) {
+    close(dst);
+  }
+  if (src >= 0) {
+    close(src);
+  }
+  sse_free(buf);
+  TRACE_LEAVE();
+  return err;
+}
+
+static sse_int
+PackageDownloader_HashFile(sse_char *in_path, sse_byte *out_digest)
+{
+  sse_int err;
+  int fd;
+
+  fd = open(in_path, O_RDONLY);
+  if (fd < 0) {
+    return SSE_E_NOENT;
+  }
+  err = KernelHash_HashFile(KERNEL_HASH_SHA256, fd, 0, -1, out_digest);
+  close(fd);
+  return err;
+}
+
+static sse_char *
+PackageDownloader_MakePartFilePath(sse_char *in_file_path)
+{
+  sse_char *p;
+  sse_int len;
+
+  len = sse_strlen(in_file_path) + sse_strlen(PKG_DL_PART_SUFFIX);
+  p = sse_malloc(len + 1);
+  if (p == NULL) {
+    return NULL;
+  }
+  snprintf(p, len + 1, "%s%s", in_file_path, PKG_DL_PART_SUFFIX);
+  return p;
+}
+
+static void
+TPackageDownloader_SetValidator(TPackageDownloader *self, sse_char *in_validator, sse_uint in_len)
+{
+  if (self->fValidator != NULL) {
+    sse_free(self->fValidator);
+    self->fValidator = NULL;
+  }
+  if (in_validator != NULL && in_len > 0) {
+    self->fValidator = sse_strndup(in_validator, in_len);
+  }
+}
+
+static void
+TPackageDownloader_ResetConsumers(TPackageDownloader *self)
+{
+  FastHash_Sha256Init(&self->fDigestContext);
+  if (self->fConsumedOffset > 0 && self->fDataCallback != NULL) {
+    (*self->fDataCallback)(self, NULL, 0, self->fDataUserData);
+  }
+  self->fConsumedOffset = 0;
+}
+
+static void
+TPackageDownloader_CloseConsumeFile(TPackageDownloader *self)
+{
+  if (self->fConsumeFd >= 0) {
+    close(self->fConsumeFd);
+    self->fConsumeFd = -1;
+  }
+}
+
+/*
+ * Feeds bytes of in_fd from in_pos up to in_end (EOF if negative) into the
+ * digest and the data callback. The data has just been written, so it is
+ * served from the page cache.
+ */
+static sse_int
+TPackageDownloader_ConsumeFrom(TPackageDownloader *self, int in_fd, sse_int64 in_pos, sse_int64 in_end)
+{
+  sse_size len;
+  ssize_t n = 0;
+
+  for (;;) {
+    len = PKG_DL_CONSUME_BUFFER_SIZE;
+    if (in_end >= 0) {
+      len = (sse_size)SSE_MIN((sse_int64)len, in_end - in_pos);
+    }
+    if (len == 0) {
+      break;
+    }
+    n = pread(in_fd, self->fConsumeBuffer, len, (off_t)in_pos);
+    if (n <= 0) {
+      break;
+    }
+    if (self->fVerifyDigest) {
+      FastHash_Sha256Update(&self->fDigestContext, self->fConsumeBuffer, n);
+    }
+    if (self->fDataCallback != NULL) {
+      (*self->fDataCallback)(self, self->fConsumeBuffer, n, self->fDataUserData);
+    }
+    self->fConsumedOffset += n;
+    in_pos += n;
+  }
+  if (n < 0) {
+    LOG_ERROR("failed to pread(). err=[%s]", strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  return SSE_E_OK;
+}
+
+/*
+ * Brings the consumers up to date with everything received so far: first the
+ * merged part of the package file which has not been consumed yet (after a
+ * restart only), then the body of the current transfer.
+ */
+static sse_int
+TPackageDownloader_Consume(TPackageDownloader *self)
+{
+  int fd;
+  sse_int err;
+
+  if (self->fConsumeBuffer == NULL) {
+    return SSE_E_OK;
+  }
+  if (self->fConsumedOffset > self->fOffset) {
+    if (self->fStatusCode != HTTP_STATUS_OK && self->fStatusCode != HTTP_STATUS_PARTIAL_CONTENT) {
+      return SSE_E_OK;
+    }
+  } else if (self->fConsumedOffset < self->fOffset) {
+    fd = open(self->fFilePath, O_RDONLY);
+    if (fd < 0) {
+      LOG_ERROR("failed to open(%s). err=[%s]", self->fFilePath, strerror(errno));
+      return SSE_E_NOENT;
+    }
+    err = TPackageDownloader_ConsumeFrom(self, fd, self->fConsumedOffset, self->fOffset);
+    close(fd);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+  }
+  if (self->fStatusCode != HTTP_STATUS_OK && self->fStatusCode != HTTP_STATUS_PARTIAL_CONTENT) {
+    return SSE_E_OK;
+  }
+  if (self->fConsumeFd < 0) {
+    self->fConsumeFd = open(self->fPartFilePath, O_RDONLY);
+    if (self->fConsumeFd < 0) {
+      /* nothing has been written yet */
+      return SSE_E_OK;
+    }
+  }
+  return TPackageDownloader_ConsumeFrom(self, self->fConsumeFd, self->fConsumedOffset - self->fOffset, -1);
+}
+
+static sse_int
+TPackageDownloader_VerifyDigest(TPackageDownloader *self)
+{
+  sse_byte digest[SHA256_MD_BYTES];
+
+  TRACE_ENTER();
+  if (!self->fVerifyDigest) {
+    return SSE_E_OK;
+  }
+  FastHash_Sha256Final(&self->fDigestContext, digest);
+  if (sse_memcmp(digest, self->fExpectedDigest, SHA256_MD_BYTES) != 0) {
+    LOG_ERROR("SHA-256 digest mismatch. size=%lld", self->fConsumedOffset);
+    return SSE_E_INVAL;
+  }
+  LOG_INFO("SHA-256 digest verified. size=%lld", self->fConsumedOffset);
+  TRACE_LEAVE();
+  return SSE_E_OK;
+}
+
+/*
+ * Moves the body received by the last transfer into the package file.
+ * 206 appends it at the current offset, 200 replaces the whole file.
+ */
+static sse_int
+TPackageDownloader_CommitPart(TPackageDownloader *self, sse_int in_status_code)
+{
+  sse_int64 size;
+  sse_int err = SSE_E_OK;
+
+  TRACE_ENTER();
+  size = PackageDownloader_GetFileSize(self->fPartFilePath);
+  if (size < 0) {
+    /* nothing to merge */
+  } else if (in_status_code == HTTP_STATUS_PARTIAL_CONTENT) {
+    err = PackageDownloader_AppendFile(self->fFilePath, self->fPartFilePath);
+    unlink(self->fPartFilePath);
+  } else if (in_status_code == HTTP_STATUS_OK) {
+    if (rename(self->fPartFilePath, self->fFilePath) != 0) {
+      LOG_ERROR("failed to rename(%s). err=[%s]", self->fPartFilePath, strerror(errno));
+      err = SSE_E_GENERIC;
+    }
+  } else {
+    unlink(self->fPartFilePath);
+  }
+  if (err != SSE_E_OK) {
+    /* the merged data can not be trusted any longer */
+    unlink(self->fPartFilePath);
+    unlink(self->fFilePath);
+    TPackageDownloader_SetValidator(self, NULL, 0);
+  }
+  size = PackageDownloader_GetFileSize(self->fFilePath);
+  self->fOffset = (size < 0) ? 0 : size;
+  LOG_DEBUG("committed: status=%d, offset=%lld", in_status_code, self->fOffset);
+  TRACE_LEAVE();
+  return err;
+}
+
+static sse_int
+TPackageDownloader_SaveState(TPackageDownloader *self)
+{
+  MoatObject *state = NULL;
+  sse_int err;
+
+  TRACE_ENTER();
+  if (self->fValidator == NULL && !self->fVerifyDigest) {
+    /* without a validator or a digest the partial file can not be resumed safely */
+    moat_datastore_remove_object(self->fMoat, TPackageDownloader_GetStateKey(self));
+    return SSE_E_OK;
+  }
+  state = moat_object_new();
+  if (state == NULL) {
+    LOG_ERROR("failed to moat_object_new().");
+    return SSE_E_NOMEM;
+  }
+  err = moat_object_add_string_value(state, PKG_DL_STATE_FIELD_URL, self->fUrl, 0, sse_true, sse_true);
+  if (err != SSE_E_OK) {
+    goto exit;
+  }
+  if (self->fValidator != NULL) {
+    err = moat_object_add_string_value(state, PKG_DL_STATE_FIELD_VALIDATOR, self->fValidator, 0, sse_true, sse_true);
+    if (err != SSE_E_OK) {
+      goto exit;
+    }
+  }
+  err = moat_object_add_int64_value(state, PKG_DL_STATE_FIELD_OFFSET, self->fOffset, sse_true);
+  if (err != SSE_E_OK) {
+    goto exit;
+  }
+  err = moat_object_add_int32_value(state, PKG_DL_STATE_FIELD_STATUS, self->fStatusCode, sse_true);
+  if (err != SSE_E_OK) {
+    goto exit;
+  }
+  if (self->fVerifyDigest) {
+    /* the package is identified by its digest, so any mirror of it can go on */
+    err = moat_object_add_binary_value(state, PKG_DL_STATE_FIELD_SHA256, self->fExpectedDigest, SHA256_MD_BYTES, sse_true, sse_true);
+    if (err != SSE_E_OK) {
+      goto exit;
+    }
+    err = moat_object_add_binary_value(state, PKG_DL_STATE_FIELD_DIGEST_CONTEXT,
+        (sse_byte *)&self->fDigestContext, sizeof(FastHashSha256Context), sse_true, sse_true);
+    if (err != SSE_E_OK) {
+      goto exit;
+    }
+    err = moat_object_add_int64_value(state, PKG_DL_STATE_FIELD_DIGEST_OFFSET, self->fConsumedOffset, sse_true);
+    if (err != SSE_E_OK) {
+      goto exit;
+    }
+  }
+  err = moat_datastore_save_object(self->fMoat, TPackageDownloader_GetStateKey(self), state);
+
+exit:
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to save download state. err=%s", sse_get_error_string(err));
+  }
+  moat_object_free(state);
+  TRACE_LEAVE();
+  return err;
+}
+
+/*
+ * Keeps the validator and digest of a completed package, so that a download
+ * of the same URL can ask the server whether it has changed.
+ */
+static void
+TPackageDownloader_SaveCompleted(TPackageDownloader *self)
+{
+  MoatObject *state = NULL;
+  sse_byte digest[SHA256_MD_BYTES];
+  sse_int err;
+
+  TRACE_ENTER();
+  moat_datastore_remove_object(self->fMoat, TPackageDownloader_GetStateKey(self));
+  if (self->fValidator == NULL) {
+    return;
+  }
+  if (self->fVerifyDigest) {
+    sse_memcpy(digest, self->fExpectedDigest, SHA256_MD_BYTES);
+  } else if (PackageDownloader_HashFile(self->fFilePath, digest) != SSE_E_OK) {
+    return;
+  }
+  state = moat_object_new();
+  if (state == NULL) {
+    LOG_ERROR("failed to moat_object_new().");
+    return;
+  }
+  err = moat_object_add_string_value(state, PKG_DL_STATE_FIELD_URL, self->fUrl, 0, sse_true, sse_true);
+  if (err == SSE_E_OK) {
+    err = moat_object_add_string_value(state, PKG_DL_STATE_FIELD_VALIDATOR, self->fValidator, 0, sse_true, sse_true);
+  }
+  if (err == SSE_E_OK) {
+    err = moat_object_add_int64_value(state, PKG_DL_STATE_FIELD_OFFSET, self->fOffset, sse_true);
+  }
+  if (err == SSE_E_OK) {
+    err = moat_object_add_boolean_value(state, PKG_DL_STATE_FIELD_COMPLETED, sse_true, sse_true);
+  }
+  if (err == SSE_E_OK) {
+    err = moat_object_add_binary_value(state, PKG_DL_STATE_FIELD_SHA256, digest, SHA256_MD_BYTES, sse_true, sse_true);
+  }
+  if (err == SSE_E_OK) {
+    err = moat_datastore_save_object(self->fMoat, TPackageDownloader_GetStateKey(self), state);
+  }
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to save completed download. err=%s", sse_get_error_string(err));
+  }
+  moat_object_free(state);
+  TRACE_LEAVE();
+}
+
+/*
+ * Tells whether the package file still is the completed package the state
+ * describes, and the package that is expected this time.
+ */
+static sse_bool
+TPackageDownloader_IsRetained(TPackageDownloader *self, MoatObject *in_state, sse_int64 in_size)
+{
+  sse_byte digest[SHA256_MD_BYTES];
+  sse_byte *stored;
+  sse_uint stored_len;
+
+  if (PackageDownloader_GetFileSize(self->fFilePath) != in_size) {
+    return sse_false;
+  }
+  if (moat_object_get_binary_value(in_state, PKG_DL_STATE_FIELD_SHA256, &stored, &stored_len) != SSE_E_OK ||
+      stored_len != SHA256_MD_BYTES) {
+    return sse_false;
+  }
+  if (self->fVerifyDigest && sse_memcmp(stored, self->fExpectedDigest, SHA256_MD_BYTES) != 0) {
+    return sse_false;
+  }
+  if (PackageDownloader_HashFile(self->fFilePath, digest) != SSE_E_OK) {
+    return sse_false;
+  }
+  return (sse_memcmp(digest, stored, SHA256_MD_BYTES) == 0);
+}
+
+static sse_bool
+TPackageDownloader_IsSameDigest(TPackageDownloader *self, MoatObject *in_state)
+{
+  sse_byte *stored;
+  sse_uint stored_len;
+
+  if (!self->fVerifyDigest ||
+      moat_object_get_binary_value(in_state, PKG_DL_STATE_FIELD_SHA256, &stored, &stored_len) != SSE_E_OK ||
+      stored_len != SHA256_MD_BYTES) {
+    return sse_false;
+  }
+  return (sse_memcmp(stored, self->fExpectedDigest, SHA256_MD_BYTES) == 0);
+}
+
+/*
+ * Restores the offset and validator of an interrupted download of the same
+ * URL, or of the same digest when one is expected, so that a download goes
+ * on from another mirror. A body left in the part file by a crash is merged
+ * first. Anything that does not belong to the requested package is thrown
+ * away.
+ */
+static void
+TPackageDownloader_LoadState(TPackageDownloader *self)
+{
+  MoatObject *state = NULL;
+  sse_char *p;
+  sse_uint len;
+  sse_byte *ctx;
+  sse_uint ctx_len;
+  sse_int64 offset = 0;
+  sse_int32 status = 0;
+  sse_bool completed = sse_false;
+  sse_bool same_url;
+  sse_int64 size;
+  sse_int err;
+
+  TRACE_ENTER();
+  self->fOffset = 0;
+  self->fConditional = sse_false;
+  TPackageDownloader_SetValidator(self, NULL, 0);
+  TPackageDownloader_ResetConsumers(self);
+  err = moat_datastore_load_object(self->fMoat, TPackageDownloader_GetStateKey(self), &state);
+  if (err != SSE_E_OK) {
+    goto discard;
+  }
+  err = moat_object_get_string_value(state, PKG_DL_STATE_FIELD_URL, &p, &len);
+  same_url = (err == SSE_E_OK && len == sse_strlen(self->fUrl) && sse_strncmp(p, self->fUrl, len) == 0);
+  moat_object_get_boolean_value(state, PKG_DL_STATE_FIELD_COMPLETED, &completed);
+  if (!same_url && (completed || !TPackageDownloader_IsSameDigest(self, state))) {
+    LOG_DEBUG("stored state belongs to another package.");
+    goto discard;
+  }
+  /* a validator is only understood by the server which has issued it */
+  if (!same_url || moat_object_get_string_value(state, PKG_DL_STATE_FIELD_VALIDATOR, &p, &len) != SSE_E_OK) {
+    p = NULL;
+    len = 0;
+  }
+  if (len == 0 && !self->fVerifyDigest) {
+    goto discard;
+  }
+  moat_object_get_int64_value(state, PKG_DL_STATE_FIELD_OFFSET, &offset);
+  moat_object_get_int32_value(state, PKG_DL_STATE_FIELD_STATUS, &status);
+  if (completed) {
+    if (!TPackageDownloader_IsRetained(self, state, offset)) {
+      LOG_INFO("retained package does not match. fetch whole package.");
+      goto discard;
+    }
+    TPackageDownloader_SetValidator(self, p, len);
+    self->fOffset = offset;
+    self->fConditional = (self->fValidator != NULL);
+    moat_object_free(state);
+    LOG_INFO("package is retained. size=%lld", self->fOffset);
+    TRACE_LEAVE();
+    return;
+  }
+  size = PackageDownloader_GetFileSize(self->fFilePath);
+  if (status == HTTP_STATUS_OK) {
+    size = 0;
+  } else if (size > offset && truncate(self->fFilePath, (off_t)offset) == 0) {
+    /* bytes beyond the recorded offset (a torn merge or unfinished segments) are not trusted */
+    size = offset;
+  }
+  if ((size < 0 ? 0 : size) != offset) {
+    LOG_INFO("package file does not match the stored state. size=%lld, offset=%lld", size, offset);
+    goto discard;
+  }
+  TPackageDownloader_SetValidator(self, p, len);
+  if (self->fVerifyDigest && self->fDataCallback == NULL) {
+    /* the data callback needs the whole package, so the digest starts over */
+    err = moat_object_get_binary_value(state, PKG_DL_STATE_FIELD_DIGEST_CONTEXT, &ctx, &ctx_len);
+    if (err == SSE_E_OK && ctx_len == sizeof(FastHashSha256Context)) {
+      sse_memcpy(&self->fDigestContext, ctx, ctx_len);
+      moat_object_get_int64_value(state, PKG_DL_STATE_FIELD_DIGEST_OFFSET, &self->fConsumedOffset);
+    }
+    if (self->fConsumedOffset > offset) {
+      TPackageDownloader_ResetConsumers(self);
+    }
+  }
+  TPackageDownloader_CommitPart(self, status);
+  if ((self->fValidator == NULL && !self->fVerifyDigest) || TPackageDownloader_Consume(self) != SSE_E_OK) {
+    goto discard;
+  }
+  moat_object_free(state);
+  LOG_INFO("resume download from offset=%lld%s", self->fOffset, same_url ? "" : " of another mirror");
+  TRACE_LEAVE();
+  return;
+
+discard:
+  if (state != NULL) {
+    moat_object_free(state);
+    moat_datastore_remove_object(self->fMoat, TPackageDownloader_GetStateKey(self));
+  }
+  TPackageDownloader_SetValidator(self, NULL, 0);
+  TPackageDownloader_ResetConsumers(self);
+  unlink(self->fPartFilePath);
+  unlink(self->fFilePath);
+  self->fOffset = 0;
+  TRACE_LEAVE();
+}
+
+static sse_int
+TPackageDownloader_SendRequest(TPackageDownloader *self)
+{
+  MoatHttpRequest *req = NULL;
+  sse_char range[64];
+  sse_int err;
+
+  TRACE_ENTER();
+  if (self->fHttpClient == NULL) {
+    self->fHttpClient = moat_httpc_new();
+    if (self->fHttpClient == NULL) {
+      LOG_ERROR("failed to moat_httpc_new().");
+      return SSE_E_NOMEM;
+    }
+  } else {
+    moat_httpc_reset(self->fHttpClient);
+  }
+  TPackageDownloader_CloseConsumeFile(self);
+  unlink(self->fPartFilePath);
+  self->fShapedPartSize = 0;
+  req = moat_httpc_create_request(self->fHttpClient, MOAT_HTTP_METHOD_GET, self->fRequestUrl, sse_strlen(self->fRequestUrl));
+  if (req == NULL) {
+    LOG_ERROR("failed to moat_httpc_create_request().");
+    return SSE_E_NOMEM;
+  }
+  if (self->fConditional) {
+    /* If-None-Match takes entity tags only */
+    if (self->fValidator[0] == '"' || sse_strncmp(self->fValidator, "W/", 2) == 0) {
+      err = moat_httpreq_add_header(req, "If-None-Match", 13, self->fValidator, sse_strlen(self->fValidator));
+    } else {
+      err = moat_httpreq_add_header(req, "If-Modified-Since", 17, self->fValidator, sse_strlen(self->fValidator));
+    }
+    if (err != SSE_E_OK) {
+      LOG_ERROR("failed to moat_httpreq_add_header(). err=%s", sse_get_error_string(err));
+      goto error_exit;
+    }
+    LOG_INFO("request unless modified. validator=[%s]", self->fValidator);
+  } else if (self->fOffset > 0 && (self->fValidator != NULL || self->fVerifyDigest)) {
+    snprintf(range, sizeof(range), "bytes=%lld-", self->fOffset);
+    err = moat_httpreq_add_header(req, "Range", 5, range, sse_strlen(range));
+    if (err != SSE_E_OK) {
+      LOG_ERROR("failed to moat_httpreq_add_header(Range). err=%s", sse_get_error_string(err));
+      goto error_exit;
+    }
+    /* without a validator, the digest checked at the end protects the merged package */
+    if (self->fValidator != NULL) {
+      err = moat_httpreq_add_header(req, "If-Range", 8, self->fValidator, sse_strlen(self->fValidator));
+      if (err != SSE_E_OK) {
+        LOG_ERROR("failed to moat_httpreq_add_header(If-Range). err=%s", sse_get_error_string(err));
+        goto error_exit;
+      }
+    }
+    LOG_INFO("request range=[%s], validator=[%s]", range, (self->fValidator != NULL) ? self->fValidator : "");
+  }
+  err = moat_httpc_set_download_file_path(self->fHttpClient, self->fPartFilePath, sse_strlen(self->fPartFilePath));
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to moat_httpc_set_download_file_path(). err=%s", sse_get_error_string(err));
+    goto error_exit;
+  }
+  err = moat_httpc_send_request(self->fHttpClient, req);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to moat_httpc_send_request(). err=%s", sse_get_error_string(err));
+    goto error_exit;
+  }
+  self->fStatusCode = 0;
+  self->fState = PKG_DL_STATE_SENDING;
+  if (!moat_idle_is_active(self->fIdle)) {
+    err = moat_idle_start(self->fIdle);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("failed to moat_idle_start(). err=%s", sse_get_error_string(err));
+      self->fState = PKG_DL_STATE_IDLE;
+      return err;
+    }
+  }
+  TRACE_LEAVE();
+  return SSE_E_OK;
+
+error_exit:
+  moat_httpreq_free(req);
+  return err;
+}
+
+static sse_int
+TPackageDownloader_Redirect(TPackageDownloader *self, MoatHttpResponse *in_res)
+{
+  sse_char *url;
+  sse_size url_len;
+  sse_int err;
+
+  TRACE_ENTER();
+  if (self->fRedirectCount >= PKG_DL_MAX_REDIRECTS) {
+    LOG_ERROR("too many redirects.");
+    return SSE_E_PROTO;
+  }
+  err = moat_httpres_get_redirect_to(in_res, &url, &url_len);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to moat_httpres_get_redirect_to(). err=%s", sse_get_error_string(err));
+    return err;
+  }
+  url = sse_strndup(url, url_len);
+  if (url == NULL) {
+    return SSE_E_NOMEM;
+  }
+  sse_free(self->fRequestUrl);
+  self->fRequestUrl = url;
+  self->fRedirectCount++;
+  LOG_DEBUG("redirect to [%s]", self->fRequestUrl);
+  err = TPackageDownloader_SendRequest(self);
+  TRACE_LEAVE();
+  return err;
+}
+
+/*
+ * Tells the size of the whole package, or -1 when the response does not
+ * tell it.
+ */
+static sse_int64
+PackageDownloader_GetTotalSize(MoatHttpResponse *in_res, sse_int in_status)
+{
+  sse_char buf[32];
+  sse_char *value;
+  sse_size value_len;
+  sse_size i;
+
+  if (in_status == HTTP_STATUS_PARTIAL_CONTENT) {
+    if (moat_httpres_get_header_value(in_res, "Content-Range", 13, &value, &value_len) != SSE_E_OK) {
+      return -1;
+    }
+    for (i = value_len; i > 0 && value[i - 1] != '/'; i--) {
+      ;
+    }
+    value += i;
+    value_len -= i;
+  } else if (moat_httpres_get_header_value(in_res, "Content-Length", 14, &value, &value_len) != SSE_E_OK) {
+    return -1;
+  }
+  if (value_len == 0 || value_len >= sizeof(buf) || !sse_is_digit(value[0])) {
+    return -1;
+  }
+  sse_memcpy(buf, value, value_len);
+  buf[value_len] = '\0';
+  return (sse_int64)strtoll(buf, NULL, 10);
+}
+
+/*
+ * The package is complete up to the lowest position any unfinished segment
+ * still has to fill.
+ */
+static sse_int64
+TPackageDownloader_GetSegmentPrefix(TPackageDownloader *self)
+{
+  TPackageSegment *seg;
+  sse_int64 prefix = self->fTotalSize;
+  sse_int i;
+
+  for (i = 0; i < PACKAGE_DOWNLOADER_MAX_SEGMENTS; i++) {
+    seg = self->fSegments[i];
+    if (seg != NULL && seg->fState != PKG_SEGMENT_STATE_DONE && seg->fPos < prefix) {
+      prefix = seg->fPos;
+    }
+  }
+  return prefix;
+}
+
+static sse_int
+TPackageDownloader_CountActiveSegments(TPackageDownloader *self, sse_int64 *out_remaining)
+{
+  TPackageSegment *seg;
+  sse_int64 remaining = 0;
+  sse_int count = 0;
+  sse_int i;
+
+  for (i = 0; i < PACKAGE_DOWNLOADER_MAX_SEGMENTS; i++) {
+    seg = self->fSegments[i];
+    if (seg != NULL && seg->fState != PKG_SEGMENT_STATE_DONE) {
+      remaining += seg->fEnd - seg->fPos;
+      count++;
+    }
+  }
+  if (out_remaining != NULL) {
+    *out_remaining = remaining;
+  }
+  return count;
+}
+
+static sse_int
+TPackageDownloader_StartSegment(TPackageDownloader *self, sse_int in_slot, sse_int64 in_pos, sse_int64 in_end)
+{
+  sse_char *path;
+  sse_int len;
+
+  if (self->fSegments[in_slot] == NULL) {
+    len = sse_strlen(self->fPartFilePath) + 4;
+    path = sse_malloc(len + 1);
+    if (path == NULL) {
+      LOG_ERROR("failed to sse_malloc().");
+      return SSE_E_NOMEM;
+    }
+    snprintf(path, len + 1, "%s.%d", self->fPartFilePath, in_slot);
+    self->fSegments[in_slot] = PackageSegment_New(path);
+    sse_free(path);
+    if (self->fSegments[in_slot] == NULL) {
+      LOG_ERROR("failed to PackageSegment_New().");
+      return SSE_E_NOMEM;
+    }
+  }
+  self->fSegments[in_slot]->fRetryCount = 0;
+  return TPackageSegment_Start(self->fSegments[in_slot], self->fRequestUrl, self->fValidator, in_pos, in_end);
+}
+
+/*
+ * Hands the upper half of the largest remaining range to a new connection.
+ */
+static sse_bool
+TPackageDownloader_SplitSegment(TPackageDownloader *self)
+{
+  TPackageSegment *seg;
+  TPackageSegment *largest = NULL;
+  sse_int64 mid;
+  sse_int64 end;
+  sse_int slot = -1;
+  sse_int i;
+
+  for (i = 0; i < PACKAGE_DOWNLOADER_MAX_SEGMENTS; i++) {
+    seg = self->fSegments[i];
+    if (seg == NULL || seg->fState == PKG_SEGMENT_STATE_DONE) {
+      if (slot < 0) {
+        slot = i;
+      }
+    } else if (largest == NULL || seg->fEnd - seg->fPos > largest->fEnd - largest->fPos) {
+      largest = seg;
+    }
+  }
+  if (slot < 0 || largest == NULL || largest->fEnd - largest->fPos < 2 * PKG_DL_MIN_SEGMENT_SIZE) {
+    return sse_false;
+  }
+  end = largest->fEnd;
+  mid = largest->fPos + (end - largest->fPos) / 2;
+  if (TPackageDownloader_StartSegment(self, slot, mid, end) != SSE_E_OK) {
+    if (self->fSegments[slot] != NULL) {
+      TPackageSegment_Delete(self->fSegments[slot]);
+      self->fSegments[slot] = NULL;
+    }
+    return sse_false;
+  }
+  /* the running transfer of the lower half is cut off at mid */
+  largest->fEnd = mid;
+  LOG_DEBUG("split segment at %lld-%lld", mid, end);
+  return sse_true;
+}
+
+/*
+ * Drops every connection. The file keeps the contiguous head only, which is
+ * what a resumed download continues from.
+ */
+static void
+TPackageDownloader_StopSegments(TPackageDownloader *self)
+{
+  sse_int i;
+
+  self->fOffset = TPackageDownloader_GetSegmentPrefix(self);
+  for (i = 0; i < PACKAGE_DOWNLOADER_MAX_SEGMENTS; i++) {
+    if (self->fSegments[i] != NULL) {
+      TPackageSegment_Delete(self->fSegments[i]);
+      self->fSegments[i] = NULL;
+    }
+  }
+  if (self->fFileFd >= 0) {
+    if (self->fOffset < self->fTotalSize && ftruncate(self->fFileFd, (off_t)self->fOffset) != 0) {
+      LOG_ERROR("failed to ftruncate(%s). err=[%s]", self->fFilePath, strerror(errno));
+    }
+    close(self->fFileFd);
+    self->fFileFd = -1;
+  }
+}
+
+static sse_bool
+TPackageDownloader_CanSegment(TPackageDownloader *self, MoatHttpResponse *in_res, sse_int in_status)
+{
+  sse_char *value;
+  sse_size value_len;
+
+  if (self->fMaxSegments < 2 || self->fValidator == NULL) {
+    return sse_false;
+  }
+  if (in_status == HTTP_STATUS_OK &&
+      (moat_httpres_get_header_value(in_res, "Accept-Ranges", 13, &value, &value_len) != SSE_E_OK ||
+       value_len != 5 || sse_strncmp(value, "bytes", 5) != 0)) {
+    return sse_false;
+  }
+  if (self->fTotalSize < 0 || self->fTotalSize - self->fOffset < PKG_DL_INITIAL_SEGMENTS * PKG_DL_MIN_SEGMENT_SIZE) {
+    return sse_false;
+  }
+  return sse_true;
+}
+
+/*
+ * Replaces the transfer which has just told the size of the package by
+ * segments which cover the rest of it.
+ */
+static sse_int
+TPackageDownloader_StartSegments(TPackageDownloader *self)
+{
+  sse_int64 remaining = self->fTotalSize - self->fOffset;
+  sse_int64 pos;
+  sse_int64 len;
+  sse_int count;
+  sse_int i;
+  sse_int err;
+
+  TRACE_ENTER();
+  if (self->fSegmentBuffer == NULL) {
+    self->fSegmentBuffer = sse_malloc(PKG_DL_COPY_BUFFER_SIZE);
+    if (self->fSegmentBuffer == NULL) {
+      LOG_ERROR("failed to sse_malloc().");
+      return SSE_E_NOMEM;
+    }
+  }
+  self->fFileFd = open(self->fFilePath, O_WRONLY | O_CREAT, 0644);
+  if (self->fFileFd < 0) {
+    LOG_ERROR("failed to open(%s). err=[%s]", self->fFilePath, strerror(errno));
+    return SSE_E_ACCES;
+  }
+  self->fTargetSegments = SSE_MIN(PKG_DL_INITIAL_SEGMENTS, self->fMaxSegments);
+  count = self->fTargetSegments;
+  pos = self->fOffset;
+  for (i = 0; i < count; i++) {
+    len = (i == count - 1) ? self->fTotalSize - pos : remaining / count;
+    err = TPackageDownloader_StartSegment(self, i, pos, pos + len);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("failed to start segment. err=%s", sse_get_error_string(err));
+      TPackageDownloader_StopSegments(self);
+      return err;
+    }
+    pos += len;
+  }
+  /* the first transfer is not needed any longer */
+  moat_httpc_free(self->fHttpClient);
+  self->fHttpClient = NULL;
+  TPackageDownloader_CloseConsumeFile(self);
+  unlink(self->fPartFilePath);
+  self->fStatusCode = HTTP_STATUS_PARTIAL_CONTENT;
+  self->fSegmentBase = self->fOffset;
+  self->fSampleTime = moat_get_timestamp_msec();
+  self->fSampleBytes = 0;
+  self->fLastThroughput = 0;
+  self->fSegmentsSettled = sse_false;
+  self->fState = PKG_DL_STATE_SEGMENTED;
+  TPackageDownloader_SaveState(self);
+  LOG_INFO("download in %d segments. offset=%lld, size=%lld", count, self->fOffset, self->fTotalSize);
+  TRACE_LEAVE();
+  return SSE_E_OK;
+}
+
+/*
+ * Inspects the response header once it is available. Returns SSE_E_AGAIN
+ * while the header has not arrived yet and SSE_E_INPROGRESS when a new
+ * request has been issued instead.
+ */
+static sse_int
+TPackageDownloader_HandleResponse(TPackageDownloader *self, MoatHttpResponse *in_res)
+{
+  sse_char expected[64];
+  sse_char *value;
+  sse_size value_len;
+  sse_int status;
+  sse_int err;
+
+  TRACE_ENTER();
+  err = moat_httpres_get_status_code(in_res, &status);
+  if (err != SSE_E_OK) {
+    return SSE_E_AGAIN;
+  }
+  if (self->fLatency < 0) {
+    self->fLatency = (sse_int32)(moat_get_timestamp_msec() - self->fRequestedAt);
+  }
+  LOG_DEBUG("status=%d, offset=%lld", status, self->fOffset);
+  if (moat_httpres_need_redirect(in_res)) {
+    err = TPackageDownloader_Redirect(self, in_res);
+    return (err == SSE_E_OK) ? SSE_E_INPROGRESS : err;
+  }
+  if (self->fConditional) {
+    self->fConditional = sse_false;
+    if (status == HTTP_STATUS_NOT_MODIFIED) {
+      LOG_INFO("package has not been modified. size=%lld", self->fOffset);
+      self->fStatusCode = status;
+      TRACE_LEAVE();
+      return SSE_E_OK;
+    }
+    LOG_INFO("package has been modified. status=%d", status);
+    unlink(self->fFilePath);
+    self->fOffset = 0;
+    TPackageDownloader_SetValidator(self, NULL, 0);
+  }
+  if (status == HTTP_STATUS_PARTIAL_CONTENT) {
+    snprintf(expected, sizeof(expected), "bytes %lld-", self->fOffset);
+    err = moat_httpres_get_header_value(in_res, "Content-Range", 13, &value, &value_len);
+    if (err != SSE_E_OK || value_len < sse_strlen(expected) ||
+        sse_strncmp(value, expected, sse_strlen(expected)) != 0) {
+      LOG_INFO("unexpected Content-Range. fetch whole package.");
+      status = HTTP_STATUS_RANGE_NOT_SATISFIABLE;
+    }
+  }
+  if (status == HTTP_STATUS_RANGE_NOT_SATISFIABLE && self->fOffset > 0) {
+    unlink(self->fFilePath);
+    self->fOffset = 0;
+    TPackageDownloader_ResetConsumers(self);
+    TPackageDownloader_SetValidator(self, NULL, 0);
+    err = TPackageDownloader_SendRequest(self);
+    return (err == SSE_E_OK) ? SSE_E_INPROGRESS : err;
+  }
+  if (status != HTTP_STATUS_OK && status != HTTP_STATUS_PARTIAL_CONTENT) {
+    LOG_ERROR("unexpected status code. status=%d", status);
+    self->fStatusCode = status;
+    if (status == HTTP_STATUS_UNAUTHORIZED || status == HTTP_STATUS_FORBIDDEN) {
+      return SSE_E_ACCES;
+    }
+    /* a client error will not go away by asking again */
+    return (status >= 400 && status < 500) ? SSE_E_NOENT : SSE_E_PROTO;
+  }
+  if (status == HTTP_STATUS_OK && self->fOffset > 0) {
+    LOG_INFO("server ignored the range request. fetch whole package.");
+    unlink(self->fFilePath);
+    self->fOffset = 0;
+  }
+  if (status == HTTP_STATUS_OK) {
+    TPackageDownloader_ResetConsumers(self);
+  }
+  self->fStatusCode = status;
+  if (status == HTTP_STATUS_OK) {
+    /* If-Range accepts only strong entity tags */
+    err = moat_httpres_get_header_value(in_res, "ETag", 4, &value, &value_len);
+    if (err != SSE_E_OK || value_len == 0 || sse_strncmp(value, "W/", 2) == 0) {
+      err = moat_httpres_get_header_value(in_res, "Last-Modified", 13, &value, &value_len);
+    }
+    if (err == SSE_E_OK) {
+      TPackageDownloader_SetValidator(self, value, value_len);
+    } else {
+      LOG_INFO("no validator in response. the download will not be resumable.");
+      TPackageDownloader_SetValidator(self, NULL, 0);
+    }
+  }
+  self->fTotalSize = PackageDownloader_GetTotalSize(in_res, status);
+  if (TPackageDownloader_CanSegment(self, in_res, status) && TPackageDownloader_StartSegments(self) == SSE_E_OK) {
+    return SSE_E_INPROGRESS;
+  }
+  TPackageDownloader_SaveState(self);
+  TRACE_LEAVE();
+  return SSE_E_OK;
+}
+
+static sse_bool
+PackageDownloader_OnResume(sse_int in_timer_id, sse_pointer in_user_data)
+{
+  TPackageDownloader *self = (TPackageDownloader *)in_user_data;
+
+  self->fShapingTimerId = -1;
+  if (self->fState != PKG_DL_STATE_IDLE && !moat_idle_is_active(self->fIdle)) {
+    moat_idle_start(self->fIdle);
+  }
+  return sse_false;
+}
+
+/*
+ * Stops receiving for in_wait_sec seconds. Unread data stays in the socket,
+ * so the sender is slowed down by TCP flow control.
+ */
+static sse_int
+TPackageDownloader_Pause(TPackageDownloader *self, sse_uint in_wait_sec)
+{
+  sse_int id;
+
+  if (self->fShapingTimer == NULL) {
+    self->fShapingTimer = moat_timer_new();
+    if (self->fShapingTimer == NULL) {
+      LOG_ERROR("failed to moat_timer_new().");
+      return SSE_E_NOMEM;
+    }
+  }
+  id = moat_timer_set(self->fShapingTimer, in_wait_sec, PackageDownloader_OnResume, self);
+  if (id < 0) {
+    LOG_ERROR("failed to moat_timer_set(). err=%s", sse_get_error_string(id));
+    return id;
+  }
+  self->fShapingTimerId = id;
+  moat_idle_stop(self->fIdle);
+  LOG_DEBUG("receiving paused for %u sec.", in_wait_sec);
+  return SSE_E_OK;
+}
+
+static void
+TPackageDownloader_CancelPause(TPackageDownloader *self)
+{
+  if (self->fShapingTimer != NULL && self->fShapingTimerId >= 0) {
+    moat_timer_cancel(self->fShapingTimer, self->fShapingTimerId);
+  }
+  self->fShapingTimerId = -1;
+}
+
+static void
+TPackageDownloader_Finish(TPackageDownloader *self, sse_int in_err)
+{
+  sse_int err = in_err;
+  sse_int status = self->fStatusCode;
+
+  TRACE_ENTER();
+  if (self->fState == PKG_DL_STATE_SEGMENTED) {
+    TPackageDownloader_StopSegments(self);
+  }
+  TPackageDownloader_CancelPause(self);
+  moat_idle_stop(self->fIdle);
+  self->fState = PKG_DL_STATE_IDLE;
+  if (self->fHttpClient != NULL) {
+    moat_httpc_free(self->fHttpClient);
+    self->fHttpClient = NULL;
+  }
+  if (TPackageDownloader_Consume(self) != SSE_E_OK && err == SSE_E_OK) {
+    err = SSE_E_GENERIC;
+  }
+  TPackageDownloader_CloseConsumeFile(self);
+  if (TPackageDownloader_CommitPart(self, status) != SSE_E_OK && err == SSE_E_OK) {
+    err = SSE_E_GENERIC;
+  }
+  if (err == SSE_E_OK) {
+    err = TPackageDownloader_VerifyDigest(self);
+    if (err != SSE_E_OK) {
+      unlink(self->fFilePath);
+      moat_datastore_remove_object(self->fMoat, TPackageDownloader_GetStateKey(self));
+    } else {
+      if (self->fVerifyDigest && self->fCache != NULL) {
+        TPackageCache_Store(self->fCache, self->fExpectedDigest, self->fFilePath);
+      }
+      TPackageDownloader_SaveCompleted(self);
+    }
+  } else if (self->fConditional) {
+    /* the retained package stays as it is */
+    self->fConditional = sse_false;
+    LOG_INFO("conditional request failed. err=%s", sse_get_error_string(err));
+  } else {
+    /* whatever arrives next continues the merged file */
+    self->fStatusCode = HTTP_STATUS_PARTIAL_CONTENT;
+    TPackageDownloader_SaveState(self);
+    LOG_INFO("download interrupted at offset=%lld. err=%s", self->fOffset, sse_get_error_string(err));
+  }
+  if (self->fCallback != NULL) {
+    (*self->fCallback)(self, err, self->fUserData);
+  }
+  TRACE_LEAVE();
+}
+
+/*
+ * Adds a connection as long as the last one has raised the throughput by
+ * more than a tenth, and gives the last one up when it has not.
+ */
+static void
+TPackageDownloader_AdaptSegments(TPackageDownloader *self, sse_uint64 in_now)
+{
+  sse_int64 remaining;
+  sse_int64 filled;
+  sse_int64 throughput;
+  sse_int active;
+
+  if (in_now - self->fSampleTime < PKG_DL_SAMPLE_INTERVAL_MSEC) {
+    return;
+  }
+  active = TPackageDownloader_CountActiveSegments(self, &remaining);
+  filled = self->fTotalSize - self->fSegmentBase - remaining;
+  throughput = (filled - self->fSampleBytes) * 1000 / (sse_int64)(in_now - self->fSampleTime);
+  LOG_DEBUG("throughput=%lld B/s, segments=%d", throughput, active);
+  if (!self->fSegmentsSettled && active >= self->fTargetSegments) {
+    if (throughput > self->fLastThroughput + self->fLastThroughput / 10) {
+      self->fLastThroughput = throughput;
+      if (self->fTargetSegments < self->fMaxSegments) {
+        self->fTargetSegments++;
+      } else {
+        self->fSegmentsSettled = sse_true;
+      }
+    } else {
+      if (self->fTargetSegments > 1) {
+        self->fTargetSegments--;
+      }
+      self->fSegmentsSettled = sse_true;
+    }
+    if (self->fSegmentsSettled) {
+      LOG_INFO("settled at %d segments. throughput=%lld B/s", self->fTargetSegments, throughput);
+    }
+  }
+  self->fSampleTime = in_now;
+  self->fSampleBytes = filled;
+  /* keep the stored offset close, so that a crash loses little */
+  self->fOffset = TPackageDownloader_GetSegmentPrefix(self);
+  TPackageDownloader_SaveState(self);
+}
+
+static void
+TPackageDownloader_PollSegments(TPackageDownloader *self)
+{
+  TPackageSegment *seg;
+  sse_uint64 now = moat_get_timestamp_msec();
+  sse_int64 received = 0;
+  sse_int64 pos;
+  sse_int i;
+  sse_int err;
+
+  for (i = 0; i < PACKAGE_DOWNLOADER_MAX_SEGMENTS; i++) {
+    seg = self->fSegments[i];
+    if (seg == NULL || seg->fState == PKG_SEGMENT_STATE_DONE) {
+      continue;
+    }
+    if (seg->fState == PKG_SEGMENT_STATE_IDLE) {
+      if (now < seg->fRetryAt) {
+        continue;
+      }
+      err = TPackageSegment_Start(seg, self->fRequestUrl, self->fValidator, seg->fPos, seg->fEnd);
+    } else {
+      pos = seg->fPos;
+      err = TPackageSegment_Poll(seg, self->fFileFd, self->fSegmentBuffer, PKG_DL_COPY_BUFFER_SIZE);
+      received += seg->fPos - pos;
+    }
+    if (err == SSE_E_AGAIN || (err == SSE_E_OK && seg->fState != PKG_SEGMENT_STATE_DONE)) {
+      continue;
+    }
+    if (err == SSE_E_OK) {
+      LOG_DEBUG("segment %d completed at %lld.", i, seg->fEnd);
+      continue;
+    }
+    if (err == SSE_E_INVAL || seg->fRetryCount >= PKG_DL_SEGMENT_MAX_RETRIES) {
+      LOG_ERROR("segment %d failed at %lld. err=%s", i, seg->fPos, sse_get_error_string(err));
+      TPackageDownloader_Finish(self, (err == SSE_E_INVAL) ? SSE_E_PROTO : err);
+      return;
+    }
+    seg->fRetryAt = now + ((sse_uint64)PKG_DL_SEGMENT_RETRY_MSEC << seg->fRetryCount);
+    seg->fRetryCount++;
+    LOG_INFO("segment %d will be retried from %lld. err=%s", i, seg->fPos, sse_get_error_string(err));
+  }
+  if (self->fRateLimiter != NULL) {
+    TRateLimiter_Consume(self->fRateLimiter, received);
+  }
+  self->fOffset = TPackageDownloader_GetSegmentPrefix(self);
+  if (TPackageDownloader_Consume(self) != SSE_E_OK) {
+    TPackageDownloader_Finish(self, SSE_E_GENERIC);
+    return;
+  }
+  if (self->fOffset == self->fTotalSize) {
+    LOG_INFO("download completed. size=%lld", self->fTotalSize);
+    TPackageDownloader_Finish(self, SSE_E_OK);
+    return;
+  }
+  TPackageDownloader_AdaptSegments(self, now);
+  while (TPackageDownloader_CountActiveSegments(self, NULL) < self->fTargetSegments &&
+         TPackageDownloader_SplitSegment(self)) {
+    ;
+  }
+}
+
+/*
+ * Charges the rate limiter with what the last receive has added to the
+ * part file.
+ */
+static void
+TPackageDownloader_ChargeReceived(TPackageDownloader *self)
+{
+  sse_int64 size;
+
+  if (self->fRateLimiter == NULL || !TRateLimiter_IsLimited(self->fRateLimiter)) {
+    return;
+  }
+  size = PackageDownloader_GetFileSize(self->fPartFilePath);
+  if (size < 0) {
+    size = 0;
+  }
+  TRateLimiter_Consume(self->fRateLimiter, (size >= self->fShapedPartSize) ? size - self->fShapedPartSize : size);
+  self->fShapedPartSize = size;
+}
+
+static void
+PackageDownloader_OnIdle(MoatIdle *in_idle, sse_pointer in_user_data)
+{
+  TPackageDownloader *self = (TPackageDownloader *)in_user_data;
+  MoatHttpResponse *res;
+  sse_bool complete = sse_false;
+  sse_int64 received;
+  sse_int64 total;
+  sse_uint wait;
+  sse_int err = SSE_E_OK;
+
+  if (self->fRateLimiter != NULL && (self->fState == PKG_DL_STATE_RECEIVING || self->fState == PKG_DL_STATE_SEGMENTED)) {
+    wait = TRateLimiter_GetWait(self->fRateLimiter);
+    if (wait > 0 && TPackageDownloader_Pause(self, wait) == SSE_E_OK) {
+      return;
+    }
+  }
+  switch (self->fState) {
+  case PKG_DL_STATE_SENDING:
+    err = moat_httpc_do_send(self->fHttpClient, &complete);
+    if (err == SSE_E_OK && complete) {
+      err = moat_httpc_recv_response(self->fHttpClient);
+      if (err == SSE_E_OK) {
+        self->fState = PKG_DL_STATE_RECEIVING;
+      }
+      complete = sse_false;
+    }
+    break;
+  case PKG_DL_STATE_RECEIVING:
+    err = moat_httpc_do_recv(self->fHttpClient, &complete);
+    TPackageDownloader_ChargeReceived(self);
+    if (err != SSE_E_OK && err != SSE_E_AGAIN) {
+      break;
+    }
+    if (self->fStatusCode != 0) {
+      if (TPackageDownloader_Consume(self) != SSE_E_OK) {
+        err = SSE_E_GENERIC;
+      }
+      break;
+    }
+    if (err != SSE_E_OK) {
+      break;
+    }
+    res = moat_httpc_get_response(self->fHttpClient);
+    if (res == NULL) {
+      err = complete ? SSE_E_PROTO : SSE_E_AGAIN;
+      break;
+    }
+    err = TPackageDownloader_HandleResponse(self, res);
+    if (err == SSE_E_INPROGRESS) {
+      /* a new request has been issued */
+      return;
+    }
+    if (err == SSE_E_AGAIN && complete) {
+      err = SSE_E_PROTO;
+    }
+    break;
+  case PKG_DL_STATE_SEGMENTED:
+    TPackageDownloader_PollSegments(self);
+    return;
+  case PKG_DL_STATE_CACHED:
+    moat_idle_stop(in_idle);
+    self->fState = PKG_DL_STATE_IDLE;
+    if (self->fCallback != NULL) {
+      (*self->fCallback)(self, SSE_E_OK, self->fUserData);
+    }
+    return;
+  default:
+    moat_idle_stop(in_idle);
+    return;
+  }
+  if (err == SSE_E_AGAIN || err == SSE_E_INPROGRESS) {
+    return;
+  }
+  if (err != SSE_E_OK) {
+    LOG_ERROR("download failed. err=%s, status=%d", sse_get_error_string(err), self->fStatusCode);
+    TPackageDownloader_Finish(self, err);
+    return;
+  }
+  if (complete) {
+    TPackageDownloader_GetProgress(self, &received, &total);
+    LOG_INFO("download completed. size=%lld", received);
+    TPackageDownloader_Finish(self, SSE_E_OK);
+  }
+}
+
+/* PackageDownloader public */
+
+sse_int
+TPackageDownloader_Download(TPackageDownloader *self, sse_char *in_url, sse_uint in_url_len, sse_char *in_file_path, PackageDownloader_CompletionCallback in_callback, sse_pointer in_user_data)
+{
+  sse_int err;
+
+  TRACE_ENTER();
+  if (self->fState != PKG_DL_STATE_IDLE) {
+    LOG_ERROR("download is in progress.");
+    return SSE_E_ALREADY;
+  }
+  if (self->fUrl != NULL) {
+    sse_free(self->fUrl);
+  }
+  if (self->fRequestUrl != NULL) {
+    sse_free(self->fRequestUrl);
+  }
+  if (self->fFilePath != NULL) {
+    sse_free(self->fFilePath);
+  }
+  if (self->fPartFilePath != NULL) {
+    sse_free(self->fPartFilePath);
+  }
+  self->fUrl = sse_strndup(in_url, in_url_len);
+  self->fRequestUrl = sse_strndup(in_url, in_url_len);
+  self->fFilePath = sse_strdup(in_file_path);
+  self->fPartFilePath = PackageDownloader_MakePartFilePath(in_file_path);
+  if (self->fUrl == NULL || self->fRequestUrl == NULL || self->fFilePath == NULL || self->fPartFilePath == NULL) {
+    LOG_ERROR("failed to allocate download parameters.");
+    return SSE_E_NOMEM;
+  }
+  if ((self->fVerifyDigest || self->fDataCallback != NULL) && self->fConsumeBuffer == NULL) {
+    self->fConsumeBuffer = sse_malloc(PKG_DL_CONSUME_BUFFER_SIZE);
+    if (self->fConsumeBuffer == NULL) {
+      LOG_ERROR("failed to sse_malloc().");
+      return SSE_E_NOMEM;
+    }
+  }
+  self->fRedirectCount = 0;
+  self->fConditional = sse_false;
+  self->fTotalSize = -1;
+  self->fLatency = -1;
+  self->fRequestedAt = moat_get_timestamp_msec();
+  /* a consumer fed by an earlier attempt has to start over */
+  TPackageDownloader_ResetConsumers(self);
+  self->fCallback = in_callback;
+  self->fUserData = in_user_data;
+  if (self->fVerifyDigest && self->fCache != NULL &&
+      TPackageCache_Fetch(self->fCache, self->fExpectedDigest, self->fFilePath) == SSE_E_OK) {
+    /* completes on the next idle, as a transfer would */
+    moat_datastore_remove_object(self->fMoat, TPackageDownloader_GetStateKey(self));
+    unlink(self->fPartFilePath);
+    err = moat_idle_start(self->fIdle);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("failed to moat_idle_start(). err=%s", sse_get_error_string(err));
+      return err;
+    }
+    self->fState = PKG_DL_STATE_CACHED;
+    TRACE_LEAVE();
+    return SSE_E_OK;
+  }
+  TPackageDownloader_LoadState(self);
+  err = TPackageDownloader_SendRequest(self);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to TPackageDownloader_SendRequest(). err=%s", sse_get_error_string(err));
+    return err;
+  }
+  TRACE_LEAVE();
+  return SSE_E_OK;
+}
+
+sse_int
+TPackageDownloader_SetExpectedDigest(TPackageDownloader *self, sse_char *in_hex, sse_uint in_len)
+{
+  sse_uint i;
+
+  TRACE_ENTER();
+  self->fVerifyDigest = sse_false;
+  if (in_hex == NULL || in_len == 0) {
+    return SSE_E_OK;
+  }
+  if (in_len != SHA256_MD_BYTES * 2) {
+    LOG_ERROR("invalid SHA-256 digest length. len=%u", in_len);
+    return SSE_E_INVAL;
+  }
+  for (i = 0; i < in_len; i++) {
+    if (!sse_is_digit(in_hex[i]) && !(in_hex[i] >= 'a' && in_hex[i] <= 'f') && !(in_hex[i] >= 'A' && in_hex[i] <= 'F')) {
+      LOG_ERROR("invalid SHA-256 digest.");
+      return SSE_E_INVAL;
+    }
+  }
+  for (i = 0; i < SHA256_MD_BYTES; i++) {
+    self->fExpectedDigest[i] = sse_hexntobyte(&in_hex[i * 2], 2);
+  }
+  self->fVerifyDigest = sse_true;
+  TRACE_LEAVE();
+  return SSE_E_OK;
+}
+
+/*
+ * A download with an expected digest may be resumed from another mirror.
+ */
+sse_bool
+TPackageDownloader_HasExpectedDigest(TPackageDownloader *self)
+{
+  return self->fVerifyDigest;
+}
+
+/*
+ * Allows the package to be fetched over up to in_max_segments connections.
+ */
+void
+TPackageDownloader_SetMaxSegments(TPackageDownloader *self, sse_int in_max_segments)
+{
+  self->fMaxSegments = SSE_MIN(in_max_segments, PACKAGE_DOWNLOADER_MAX_SEGMENTS);
+}
+
+void
+TPackageDownloader_SetCache(TPackageDownloader *self, TPackageCache *in_cache)
+{
+  self->fCache = in_cache;
+}
+
+void
+TPackageDownloader_SetRateLimiter(TPackageDownloader *self, TRateLimiter *in_limiter)
+{
+  self->fRateLimiter = in_limiter;
+}
+
+/*
+ * Datastore key of the resume state, for a downloader which runs next to
+ * another one.
+ */
+sse_int
+TPackageDownloader_SetStateKey(TPackageDownloader *self, sse_char *in_key)
+{
+  sse_char *key;
+
+  key = sse_strdup(in_key);
+  if (key == NULL) {
+    return SSE_E_NOMEM;
+  }
+  if (self->fStateKey != NULL) {
+    sse_free(self->fStateKey);
+  }
+  self->fStateKey = key;
+  return SSE_E_OK;
+}
+
+void
+TPackageDownloader_SetDataCallback(TPackageDownloader *self, PackageDownloader_DataCallback in_callback, sse_pointer in_user_data)
+{
+  TRACE_ENTER();
+  self->fDataCallback = in_callback;
+  self->fDataUserData = in_user_data;
+  TRACE_LEAVE();
+}
+
+/*
+ * Tells how much of the package is in place. out_total is -1 until the
+ * server has told the size of the package.
+ */
+void
+TPackageDownloader_GetProgress(TPackageDownloader *self, sse_int64 *out_received, sse_int64 *out_total)
+{
+  sse_int64 received = self->fOffset;
+  sse_int64 remaining;
+  sse_int64 size;
+
+  if (self->fState == PKG_DL_STATE_SEGMENTED) {
+    TPackageDownloader_CountActiveSegments(self, &remaining);
+    received = self->fTotalSize - remaining;
+  } else if (self->fState == PKG_DL_STATE_RECEIVING) {
+    size = PackageDownloader_GetFileSize(self->fPartFilePath);
+    if (size > 0) {
+      received += size;
+    }
+  } else if (self->fState == PKG_DL_STATE_CACHED) {
+    received = PackageDownloader_GetFileSize(self->fFilePath);
+    self->fTotalSize = received;
+  }
+  *out_received = received;
+  *out_total = self->fTotalSize;
+}
+
+/*
+ * Tells how long the first response of the last download took, or -1.
+ */
+sse_int32
+TPackageDownloader_GetLatency(TPackageDownloader *self)
+{
+  return self->fLatency;
+}
+
+void
+TPackageDownloader_Cancel(TPackageDownloader *self)
+{
+  TRACE_ENTER();
+  if (self->fState == PKG_DL_STATE_IDLE) {
+    return;
+  }
+  self->fCallback = NULL;
+  if (self->fState == PKG_DL_STATE_CACHED) {
+    /* the file is the cached package itself, nothing to resume */
+    moat_idle_stop(self->fIdle);
+    self->fState = PKG_DL_STATE_IDLE;
+    return;
+  }
+  TPackageDownloader_Finish(self, SSE_E_INTR);
+  TRACE_LEAVE();
+}
+
+/*
+ * Forgets the resumable download stored under the state key of this
+ * downloader, e.g. after the package has been consumed.
+ */
+void
+TPackageDownloader_ClearState(TPackageDownloader *self)
+{
+  TRACE_ENTER();
+  moat_datastore_remove_object(self->fMoat, TPackageDownloader_GetStateKey(self));
+  if (self->fPartFilePath != NULL) {
+    unlink(self->fPartFilePath);
+  }
+  TRACE_LEAVE();
+}
+
+TPackageDownloader *
+PackageDownloader_New(Moat in_moat)
+{
+  TPackageDownloader *dl;
+
+  TRACE_ENTER();
+  dl = sse_zeroalloc(sizeof(TPackageDownloader));
+  if (dl == NULL) {
+    LOG_ERROR("failed to sse_zeroalloc().");
+    return NULL;
+  }
+  dl->fMoat = in_moat;
+  dl->fState = PKG_DL_STATE_IDLE;
+  dl->fConsumeFd = -1;
+  dl->fFileFd = -1;
+  dl->fShapingTimerId = -1;
+  dl->fTotalSize = -1;
+  dl->fLatency = -1;
+  dl->fIdle = moat_idle_new(PackageDownloader_OnIdle, dl);
+  if (dl->fIdle == NULL) {
+    LOG_ERROR("failed to moat_idle_new().");
+    sse_free(dl);
+    return NULL;
+  }
+  TRACE_LEAVE();
+  return dl;
+}
+
+void
+TPackageDownloader_Delete(TPackageDownloader *self)
+{
+  TRACE_ENTER();
+  TPackageDownloader_Cancel(self);
+  moat_idle_stop(self->fIdle);
+  moat_idle_free(self->fIdle);
+  if (self->fShapingTimer != NULL) {
+    moat_timer_free(self->fShapingTimer);
+  }
+  if (self->fHttpClient != NULL) {
+    moat_httpc_free(self->fHttpClient);
+  }
+  if (self->fUrl != NULL) {
+    sse_free(self->fUrl);
+  }
+  if (self->fRequestUrl != NULL) {
+    sse_free(self->fRequestUrl);
+  }
+  if (self->fFilePath != NULL) {
+    sse_free(self->fFilePath);
+  }
+  if (self->fPartFilePath != NULL) {
+    sse_free(self->fPartFilePath);
+  }
+  if (self->fValidator != NULL) {
+    sse_free(self->fValidator);
+  }
+  if (self->fStateKey != NULL) {
+    sse_free(self->fStateKey);
+  }
+  TPackageDownloader_CloseConsumeFile(self);
+  if (self->fConsumeBuffer != NULL) {
+    sse_free(self->fConsumeBuffer);
+  }
+  if (self->fSegmentBuffer != NULL) {
+    sse_free(self->fSegmentBuffer);
+  }
+  sse_free(self);
+  TRACE_LEAVE();
+}
@@ -0,0 +1,124 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#ifndef __PACKAGE_DOWNLOADER__
+#define __PACKAGE_DOWNLOADER__
+
+#include <sseutils.h>
+#include "package_segment.h"
+#include "fast_hash.h"
+#include "package_cache.h"
+#include "rate_limiter.h"
+
+SSE_BEGIN_C_DECLS
+
+#define PACKAGE_DOWNLOADER_MAX_SEGMENTS  (8)
+
+typedef struct TPackageDownloader_ TPackageDownloader;
+
+typedef void (*PackageDownloader_CompletionCallback)(TPackageDownloader *in_dl, sse_int in_err, sse_pointer in_user_data);
+typedef void (*PackageDownloader_DataCallback)(TPackageDownloader *in_dl, sse_byte *in_data, sse_size in_len, sse_pointer in_user_data);
+
+/*
+ * Downloads a package into a file. The body of each HTTP transfer is received
+ * into "<file>.part" and merged into the file when the transfer ends, so that
+ * an interrupted download can be continued with a Range request later on.
+ * The validator (ETag or Last-Modified) and the merged length are kept in the
+ * datastore until the download has been completed.
+ * When an expected SHA-256 digest is given, the body is hashed while it is
+ * being received and a mismatch completes the download with SSE_E_INVAL.
+ * A data callback sees the package from its first byte on, in order, as it
+ * arrives. in_data == NULL tells that the package starts over from byte 0.
+ * When more than one segment is allowed and the server serves byte ranges
+ * of a strongly validated package, the rest of the package is fetched in
+ * segments over concurrent connections. The number of connections grows as
+ * long as it raises the throughput. The digest and the data callback follow
+ * the contiguous part at the head of the file.
+ * With a cache, a package whose expected digest is cached completes without
+ * any transfer and a package whose digest has been verified is cached.
+ * With a rate limiter, receiving is suspended on a timer whenever the
+ * limiter asks to wait.
+ * A completed package is retained with its validator and digest. When the
+ * same URL is downloaded again and the file still has that digest, the
+ * request is made conditional (If-None-Match or If-Modified-Since) and a
+ * 304 completes the download with the retained file, which the consumers
+ * see as if it had been transferred.
+ * A client error (4xx) completes the download with SSE_E_ACCES or
+ * SSE_E_NOENT, any other unexpected status with SSE_E_PROTO.
+ */
+struct TPackageDownloader_ {
+  Moat fMoat;
+  MoatHttpClient *fHttpClient;
+  MoatIdle *fIdle;
+  sse_int fState;
+  sse_char *fUrl;
+  sse_char *fRequestUrl;
+  sse_char *fFilePath;
+  sse_char *fPartFilePath;
+  sse_char *fValidator;
+  sse_int64 fOffset;
+  sse_int fStatusCode;
+  sse_int fRedirectCount;
+  sse_bool fVerifyDigest;
+  sse_byte fExpectedDigest[SHA256_MD_BYTES];
+  FastHashSha256Context fDigestContext;
+  sse_int64 fConsumedOffset;
+  int fConsumeFd;
+  sse_byte *fConsumeBuffer;
+  PackageDownloader_DataCallback fDataCallback;
+  sse_pointer fDataUserData;
+  PackageDownloader_CompletionCallback fCallback;
+  sse_pointer fUserData;
+  sse_int fMaxSegments;
+  sse_int fTargetSegments;
+  TPackageSegment *fSegments[PACKAGE_DOWNLOADER_MAX_SEGMENTS];
+  sse_byte *fSegmentBuffer;
+  int fFileFd;
+  sse_int64 fTotalSize;
+  sse_int64 fSegmentBase;
+  sse_uint64 fSampleTime;
+  sse_int64 fSampleBytes;
+  sse_int64 fLastThroughput;
+  sse_bool fSegmentsSettled;
+  TPackageCache *fCache;
+  TRateLimiter *fRateLimiter;
+  MoatTimer *fShapingTimer;
+  sse_int fShapingTimerId;
+  sse_int64 fShapedPartSize;
+  sse_uint64 fRequestedAt;
+  sse_int32 fLatency;
+  sse_bool fConditional;
+  sse_char *fStateKey;
+};
+
+TPackageDownloader * PackageDownloader_New(Moat in_moat);
+void TPackageDownloader_Delete(TPackageDownloader *self);
+sse_int TPackageDownloader_Download(TPackageDownloader *self, sse_char *in_url, sse_uint in_url_len, sse_char *in_file_path, PackageDownloader_CompletionCallback in_callback, sse_pointer in_user_data);
+void TPackageDownloader_Cancel(TPackageDownloader *self);
+sse_int TPackageDownloader_SetExpectedDigest(TPackageDownloader *self, sse_char *in_hex, sse_uint in_len);
+sse_bool TPackageDownloader_HasExpectedDigest(TPackageDownloader *self);
+void TPackageDownloader_SetMaxSegments(TPackageDownloader *self, sse_int in_max_segments);
+void TPackageDownloader_SetCache(TPackageDownloader *self, TPackageCache *in_cache);
+void TPackageDownloader_SetRateLimiter(TPackageDownloader *self, TRateLimiter *in_limiter);
+sse_int TPackageDownloader_SetStateKey(TPackageDownloader *self, sse_char *in_key);
+void TPackageDownloader_SetDataCallback(TPackageDownloader *self, PackageDownloader_DataCallback in_callback, sse_pointer in_user_data);
+void TPackageDownloader_GetProgress(TPackageDownloader *self, sse_int64 *out_received, sse_int64 *out_total);
+sse_int32 TPackageDownloader_GetLatency(TPackageDownloader *self);
+void TPackageDownloader_ClearState(TPackageDownloader *self);
+
+SSE_END_C_DECLS
+
+#endif /* __PACKAGE_DOWNLOADER__ */
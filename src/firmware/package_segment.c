@@ -0,0 +1,297 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include <servicesync/moat.h>
+#include "package_segment.h"
+
+#define TAG "PackageSegment"
+
+#define TRACE_ENTER() MOAT_LOG_TRACE(TAG, "== enter =>");
+#define TRACE_LEAVE() MOAT_LOG_TRACE(TAG, "<= leave ==");
+#define LOG_ERROR(format, ...)  MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...)  MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+
+#define HTTP_STATUS_PARTIAL_CONTENT  (206)
+
+/* PackageSegment private */
+
+static void
+TPackageSegment_ClosePart(TPackageSegment *self)
+{
+  if (self->fPartFd >= 0) {
+    close(self->fPartFd);
+    self->fPartFd = -1;
+  }
+  unlink(self->fPartFilePath);
+  self->fPartOffset = 0;
+}
+
+/*
+ * Checks that the server sends exactly the requested range of the same
+ * entity. Anything else means the package can not be fetched in segments.
+ */
+static sse_int
+TPackageSegment_HandleResponse(TPackageSegment *self, MoatHttpResponse *in_res)
+{
+  sse_char expected[64];
+  sse_char *value;
+  sse_size value_len;
+  sse_int status;
+  sse_int err;
+
+  err = moat_httpres_get_status_code(in_res, &status);
+  if (err != SSE_E_OK) {
+    return SSE_E_AGAIN;
+  }
+  if (status != HTTP_STATUS_PARTIAL_CONTENT) {
+    LOG_ERROR("unexpected status code. status=%d, pos=%lld", status, self->fPos);
+    return SSE_E_INVAL;
+  }
+  snprintf(expected, sizeof(expected), "bytes %lld-", self->fPos);
+  err = moat_httpres_get_header_value(in_res, "Content-Range", 13, &value, &value_len);
+  if (err != SSE_E_OK || value_len < sse_strlen(expected) ||
+      sse_strncmp(value, expected, sse_strlen(expected)) != 0) {
+    LOG_ERROR("unexpected Content-Range. pos=%lld", self->fPos);
+    return SSE_E_INVAL;
+  }
+  self->fStatusCode = status;
+  return SSE_E_OK;
+}
+
+/*
+ * Writes the bytes received since the last call into in_fd, never beyond
+ * the end of the range.
+ */
+static sse_int
+TPackageSegment_Copy(TPackageSegment *self, int in_fd, sse_byte *in_buffer, sse_size in_buffer_size)
+{
+  ssize_t n;
+  ssize_t w;
+  sse_size len;
+
+  if (self->fPartFd < 0) {
+    self->fPartFd = open(self->fPartFilePath, O_RDONLY);
+    if (self->fPartFd < 0) {
+      /* nothing has been written yet */
+      return SSE_E_OK;
+    }
+  }
+  while (self->fPos < self->fEnd) {
+    len = (sse_size)SSE_MIN((sse_int64)in_buffer_size, self->fEnd - self->fPos);
+    n = pread(self->fPartFd, in_buffer, len, (off_t)self->fPartOffset);
+    if (n < 0) {
+      LOG_ERROR("failed to pread(%s). err=[%s]", self->fPartFilePath, strerror(errno));
+      return SSE_E_GENERIC;
+    }
+    if (n == 0) {
+      break;
+    }
+    w = pwrite(in_fd, in_buffer, n, (off_t)self->fPos);
+    if (w != n) {
+      LOG_ERROR("failed to pwrite(). err=[%s]", strerror(errno));
+      return SSE_E_GENERIC;
+    }
+    self->fPartOffset += n;
+    self->fPos += n;
+  }
+  return SSE_E_OK;
+}
+
+/* PackageSegment public */
+
+/*
+ * Requests bytes in_pos to in_end - 1 of in_url. in_validator is sent as
+ * If-Range, so that a changed package is never mixed into the file.
+ */
+sse_int
+TPackageSegment_Start(TPackageSegment *self, sse_char *in_url, sse_char *in_validator, sse_int64 in_pos, sse_int64 in_end)
+{
+  MoatHttpRequest *req = NULL;
+  sse_char range[64];
+  sse_int err;
+
+  TRACE_ENTER();
+  TPackageSegment_Abort(self);
+  self->fPos = in_pos;
+  self->fEnd = in_end;
+  self->fHttpClient = moat_httpc_new();
+  if (self->fHttpClient == NULL) {
+    LOG_ERROR("failed to moat_httpc_new().");
+    return SSE_E_NOMEM;
+  }
+  req = moat_httpc_create_request(self->fHttpClient, MOAT_HTTP_METHOD_GET, in_url, sse_strlen(in_url));
+  if (req == NULL) {
+    LOG_ERROR("failed to moat_httpc_create_request().");
+    err = SSE_E_NOMEM;
+    goto error_exit;
+  }
+  snprintf(range, sizeof(range), "bytes=%lld-%lld", in_pos, in_end - 1);
+  err = moat_httpreq_add_header(req, "Range", 5, range, sse_strlen(range));
+  if (err == SSE_E_OK) {
+    err = moat_httpreq_add_header(req, "If-Range", 8, in_validator, sse_strlen(in_validator));
+  }
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to moat_httpreq_add_header(). err=%s", sse_get_error_string(err));
+    goto error_exit;
+  }
+  err = moat_httpc_set_download_file_path(self->fHttpClient, self->fPartFilePath, sse_strlen(self->fPartFilePath));
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to moat_httpc_set_download_file_path(). err=%s", sse_get_error_string(err));
+    goto error_exit;
+  }
+  err = moat_httpc_send_request(self->fHttpClient, req);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to moat_httpc_send_request(). err=%s", sse_get_error_string(err));
+    goto error_exit;
+  }
+  self->fState = PKG_SEGMENT_STATE_SENDING;
+  LOG_DEBUG("request range=[%s]", range);
+  TRACE_LEAVE();
+  return SSE_E_OK;
+
+error_exit:
+  if (req != NULL) {
+    moat_httpreq_free(req);
+  }
+  TPackageSegment_Abort(self);
+  return err;
+}
+
+/*
+ * Drives the transfer a step further. Returns SSE_E_AGAIN while the range
+ * is being filled and SSE_E_OK once it is complete. SSE_E_INVAL tells that
+ * the server does not serve the range of the same package, other errors
+ * are worth a retry.
+ */
+sse_int
+TPackageSegment_Poll(TPackageSegment *self, int in_fd, sse_byte *in_buffer, sse_size in_buffer_size)
+{
+  MoatHttpResponse *res;
+  sse_bool complete = sse_false;
+  sse_int err = SSE_E_AGAIN;
+
+  switch (self->fState) {
+  case PKG_SEGMENT_STATE_DONE:
+    return SSE_E_OK;
+  case PKG_SEGMENT_STATE_SENDING:
+    err = moat_httpc_do_send(self->fHttpClient, &complete);
+    if (err == SSE_E_OK && complete) {
+      err = moat_httpc_recv_response(self->fHttpClient);
+      if (err == SSE_E_OK) {
+        self->fState = PKG_SEGMENT_STATE_RECEIVING;
+      }
+    }
+    if (err == SSE_E_OK) {
+      err = SSE_E_AGAIN;
+    }
+    break;
+  case PKG_SEGMENT_STATE_RECEIVING:
+    err = moat_httpc_do_recv(self->fHttpClient, &complete);
+    if (err != SSE_E_OK && err != SSE_E_AGAIN) {
+      break;
+    }
+    if (self->fStatusCode == 0) {
+      res = moat_httpc_get_response(self->fHttpClient);
+      err = (res == NULL) ? SSE_E_AGAIN : TPackageSegment_HandleResponse(self, res);
+      if (err == SSE_E_AGAIN) {
+        err = complete ? SSE_E_PROTO : SSE_E_AGAIN;
+        break;
+      }
+      if (err != SSE_E_OK) {
+        break;
+      }
+    }
+    err = TPackageSegment_Copy(self, in_fd, in_buffer, in_buffer_size);
+    if (err != SSE_E_OK) {
+      break;
+    }
+    if (self->fPos >= self->fEnd) {
+      TPackageSegment_Abort(self);
+      self->fState = PKG_SEGMENT_STATE_DONE;
+      return SSE_E_OK;
+    }
+    if (complete) {
+      LOG_ERROR("transfer ended before the range. pos=%lld, end=%lld", self->fPos, self->fEnd);
+      err = SSE_E_PROTO;
+      break;
+    }
+    err = SSE_E_AGAIN;
+    break;
+  default:
+    return SSE_E_INVAL;
+  }
+  if (err != SSE_E_AGAIN) {
+    TPackageSegment_Abort(self);
+  }
+  return err;
+}
+
+/*
+ * Drops the transfer. Bytes that have already been written stay, so the
+ * segment can be started again from fPos.
+ */
+void
+TPackageSegment_Abort(TPackageSegment *self)
+{
+  if (self->fHttpClient != NULL) {
+    moat_httpc_free(self->fHttpClient);
+    self->fHttpClient = NULL;
+  }
+  TPackageSegment_ClosePart(self);
+  self->fStatusCode = 0;
+  self->fState = PKG_SEGMENT_STATE_IDLE;
+}
+
+TPackageSegment *
+PackageSegment_New(sse_char *in_part_file_path)
+{
+  TPackageSegment *segment;
+
+  TRACE_ENTER();
+  segment = sse_zeroalloc(sizeof(TPackageSegment));
+  if (segment == NULL) {
+    LOG_ERROR("failed to sse_zeroalloc().");
+    return NULL;
+  }
+  segment->fPartFd = -1;
+  segment->fState = PKG_SEGMENT_STATE_IDLE;
+  segment->fPartFilePath = sse_strdup(in_part_file_path);
+  if (segment->fPartFilePath == NULL) {
+    LOG_ERROR("failed to sse_strdup().");
+    sse_free(segment);
+    return NULL;
+  }
+  TRACE_LEAVE();
+  return segment;
+}
+
+void
+TPackageSegment_Delete(TPackageSegment *self)
+{
+  TRACE_ENTER();
+  TPackageSegment_Abort(self);
+  sse_free(self->fPartFilePath);
+  sse_free(self);
+  TRACE_LEAVE();
+}
@@ -0,0 +1,62 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#ifndef __PACKAGE_SEGMENT__
+#define __PACKAGE_SEGMENT__
+
+#include <sseutils.h>
+
+SSE_BEGIN_C_DECLS
+
+typedef struct TPackageSegment_ TPackageSegment;
+
+enum PackageSegmentState_ {
+  PKG_SEGMENT_STATE_IDLE,
+  PKG_SEGMENT_STATE_SENDING,
+  PKG_SEGMENT_STATE_RECEIVING,
+  PKG_SEGMENT_STATE_DONE,
+  PKG_SEGMENT_STATEs
+};
+
+/*
+ * One byte range of a package fetched over a connection of its own. The
+ * HTTP client receives the body into a part file of the segment and every
+ * new byte is written into the package file at its offset with pwrite().
+ * The end of the range may be moved down while the transfer is running,
+ * the transfer is dropped as soon as the range has been filled.
+ */
+struct TPackageSegment_ {
+  MoatHttpClient *fHttpClient;
+  sse_int fState;
+  sse_char *fPartFilePath;
+  int fPartFd;
+  sse_int64 fPartOffset;
+  sse_int64 fPos;
+  sse_int64 fEnd;
+  sse_int fStatusCode;
+  sse_int fRetryCount;
+  sse_uint64 fRetryAt;
+};
+
+TPackageSegment * PackageSegment_New(sse_char *in_part_file_path);
+void TPackageSegment_Delete(TPackageSegment *self);
+sse_int TPackageSegment_Start(TPackageSegment *self, sse_char *in_url, sse_char *in_validator, sse_int64 in_pos, sse_int64 in_end);
+sse_int TPackageSegment_Poll(TPackageSegment *self, int in_fd, sse_byte *in_buffer, sse_size in_buffer_size);
+void TPackageSegment_Abort(TPackageSegment *self);
+
+SSE_END_C_DECLS
+
+#endif /* __PACKAGE_SEGMENT__ */
@@ -0,0 +1,244 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <servicesync/moat.h>
+#include "rate_limiter.h"
+
+#define TAG "RateLimiter"
+
+#define TRACE_ENTER() MOAT_LOG_TRACE(TAG, "== enter =>");
+#define TRACE_LEAVE() MOAT_LOG_TRACE(TAG, "<= leave ==");
+#define LOG_ERROR(format, ...)  MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...)  MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+
+#define RATE_LIMITER_PAUSE_KEYWORD  "pause"
+#define RATE_LIMITER_MIN_BURST  (16 * 1024)
+#define RATE_LIMITER_CONGESTION_WAIT_SEC  (2)
+#define RATE_LIMITER_PAUSED_WAIT_SEC  (60)
+#define MINUTES_PER_DAY  (24 * 60)
+
+/* RateLimiter private */
+
+static sse_int64
+TRateLimiter_GetProfileRate(TRateLimiter *self)
+{
+  TRateLimiterProfile *profile;
+  struct tm tm;
+  time_t now;
+  sse_uint minute;
+  sse_uint i;
+
+  if (self->fProfileCount == 0) {
+    return self->fDefaultRate;
+  }
+  now = time(NULL);
+  if (localtime_r(&now, &tm) == NULL) {
+    return self->fDefaultRate;
+  }
+  minute = (sse_uint)(tm.tm_hour * 60 + tm.tm_min);
+  for (i = 0; i < self->fProfileCount; i++) {
+    profile = &self->fProfiles[i];
+    if (profile->fStart < profile->fEnd) {
+      if (minute >= profile->fStart && minute < profile->fEnd) {
+        return profile->fRate;
+      }
+    } else if (minute >= profile->fStart || minute < profile->fEnd) {
+      /* across midnight */
+      return profile->fRate;
+    }
+  }
+  return self->fDefaultRate;
+}
+
+static sse_int
+TRateLimiter_ParseProfile(TRateLimiter *self, sse_char *in_item)
+{
+  TRateLimiterProfile *profile;
+  unsigned int h1, m1, h2, m2;
+  sse_char *value;
+  sse_char *end;
+  int n = 0;
+
+  if (sscanf(in_item, " %u:%u-%u:%u=%n", &h1, &m1, &h2, &m2, &n) != 4 || n == 0 ||
+      h1 > 24 || h2 > 24 || m1 > 59 || m2 > 59 ||
+      h1 * 60 + m1 > MINUTES_PER_DAY || h2 * 60 + m2 > MINUTES_PER_DAY) {
+    return SSE_E_INVAL;
+  }
+  if (self->fProfileCount >= RATE_LIMITER_MAX_PROFILES) {
+    return SSE_E_INVAL;
+  }
+  profile = &self->fProfiles[self->fProfileCount];
+  profile->fStart = h1 * 60 + m1;
+  profile->fEnd = h2 * 60 + m2;
+  value = in_item + n;
+  if (sse_strncmp(value, RATE_LIMITER_PAUSE_KEYWORD, sse_strlen(RATE_LIMITER_PAUSE_KEYWORD)) == 0) {
+    profile->fRate = RATE_LIMITER_PAUSED;
+  } else {
+    profile->fRate = strtoll(value, &end, 10);
+    if (end == value || profile->fRate < 0) {
+      return SSE_E_INVAL;
+    }
+  }
+  self->fProfileCount++;
+  return SSE_E_OK;
+}
+
+/* RateLimiter public */
+
+void
+TRateLimiter_SetRate(TRateLimiter *self, sse_int64 in_rate)
+{
+  self->fDefaultRate = (in_rate < 0) ? 0 : in_rate;
+}
+
+/*
+ * Profiles are given as "HH:MM-HH:MM=<bytes per second>|pause", separated
+ * with commas, e.g. "08:00-18:00=32768,01:00-05:00=0". The first profile
+ * covering the local time of day wins.
+ */
+sse_int
+TRateLimiter_SetProfiles(TRateLimiter *self, sse_char *in_spec, sse_uint in_len)
+{
+  sse_char *spec;
+  sse_char *item;
+  sse_char *saveptr = NULL;
+  sse_int err = SSE_E_OK;
+
+  TRACE_ENTER();
+  self->fProfileCount = 0;
+  spec = sse_strndup(in_spec, in_len);
+  if (spec == NULL) {
+    LOG_ERROR("failed to sse_strndup().");
+    return SSE_E_NOMEM;
+  }
+  for (item = strtok_r(spec, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+    err = TRateLimiter_ParseProfile(self, item);
+    if (err != SSE_E_OK) {
+      LOG_ERROR("invalid rate profile [%s].", item);
+      self->fProfileCount = 0;
+      break;
+    }
+  }
+  sse_free(spec);
+  TRACE_LEAVE();
+  return err;
+}
+
+void
+TRateLimiter_SetCongestionCallback(TRateLimiter *self, RateLimiter_CongestionCallback in_callback, sse_pointer in_user_data)
+{
+  self->fCongestionCallback = in_callback;
+  self->fCongestionUserData = in_user_data;
+}
+
+/*
+ * Returns the seconds to wait before the transfer may receive again, 0 when
+ * it may receive right now.
+ */
+sse_uint
+TRateLimiter_GetWait(TRateLimiter *self)
+{
+  sse_uint64 now = moat_get_timestamp_msec();
+  sse_uint64 elapsed;
+  sse_int64 burst;
+  sse_int64 added;
+  sse_int64 rate;
+
+  if (self->fCongestionCallback != NULL && (*self->fCongestionCallback)(self, self->fCongestionUserData)) {
+    if (!self->fCongested) {
+      LOG_INFO("transfer paused, the uplink is backed up.");
+      self->fCongested = sse_true;
+    }
+    return RATE_LIMITER_CONGESTION_WAIT_SEC;
+  }
+  if (self->fCongested) {
+    LOG_INFO("transfer resumed.");
+    self->fCongested = sse_false;
+  }
+  rate = TRateLimiter_GetProfileRate(self);
+  if (rate != self->fCurrentRate) {
+    LOG_INFO("rate changed. rate=%lld B/s", rate);
+    self->fCurrentRate = rate;
+    self->fTokens = SSE_MAX(rate, (sse_int64)RATE_LIMITER_MIN_BURST);
+    self->fLastRefill = now;
+  }
+  if (rate == RATE_LIMITER_PAUSED) {
+    return RATE_LIMITER_PAUSED_WAIT_SEC;
+  }
+  if (rate == 0) {
+    return 0;
+  }
+  burst = SSE_MAX(rate, (sse_int64)RATE_LIMITER_MIN_BURST);
+  elapsed = now - self->fLastRefill;
+  added = (sse_int64)(elapsed * (sse_uint64)rate / 1000);
+  if (added > 0) {
+    /* only the time which has turned into tokens is accounted */
+    self->fLastRefill += (sse_uint64)added * 1000 / (sse_uint64)rate;
+    self->fTokens += added;
+  }
+  if (self->fTokens >= burst) {
+    self->fTokens = burst;
+    self->fLastRefill = now;
+  }
+  if (self->fTokens > 0) {
+    return 0;
+  }
+  return (sse_uint)(-self->fTokens / rate) + 1;
+}
+
+sse_bool
+TRateLimiter_IsLimited(TRateLimiter *self)
+{
+  return (self->fCurrentRate > 0) ? sse_true : sse_false;
+}
+
+void
+TRateLimiter_Consume(TRateLimiter *self, sse_int64 in_bytes)
+{
+  if (self->fCurrentRate > 0) {
+    self->fTokens -= in_bytes;
+  }
+}
+
+TRateLimiter *
+RateLimiter_New(void)
+{
+  TRateLimiter *limiter;
+
+  TRACE_ENTER();
+  limiter = sse_zeroalloc(sizeof(TRateLimiter));
+  if (limiter == NULL) {
+    LOG_ERROR("failed to sse_zeroalloc().");
+    return NULL;
+  }
+  limiter->fLastRefill = moat_get_timestamp_msec();
+  TRACE_LEAVE();
+  return limiter;
+}
+
+void
+TRateLimiter_Delete(TRateLimiter *self)
+{
+  TRACE_ENTER();
+  sse_free(self);
+  TRACE_LEAVE();
+}
@@ -0,0 +1,68 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#ifndef __RATE_LIMITER__
+#define __RATE_LIMITER__
+
+#include <sseutils.h>
+
+SSE_BEGIN_C_DECLS
+
+#define RATE_LIMITER_MAX_PROFILES  (8)
+#define RATE_LIMITER_PAUSED  (-1)
+
+typedef struct TRateLimiterProfile_ TRateLimiterProfile;
+typedef struct TRateLimiter_ TRateLimiter;
+
+typedef sse_bool (*RateLimiter_CongestionCallback)(TRateLimiter *in_limiter, sse_pointer in_user_data);
+
+struct TRateLimiterProfile_ {
+  sse_uint fStart;
+  sse_uint fEnd;
+  sse_int64 fRate;
+};
+
+/*
+ * Token bucket which shapes a transfer to a rate in bytes per second. The
+ * bucket holds one second worth of tokens. Time-of-day profiles override
+ * the default rate, a rate of 0 is unlimited and RATE_LIMITER_PAUSED stops
+ * the transfer. While the congestion callback reports a backed up uplink,
+ * the transfer is paused regardless of the tokens.
+ */
+struct TRateLimiter_ {
+  sse_int64 fDefaultRate;
+  TRateLimiterProfile fProfiles[RATE_LIMITER_MAX_PROFILES];
+  sse_uint fProfileCount;
+  sse_int64 fCurrentRate;
+  sse_int64 fTokens;
+  sse_uint64 fLastRefill;
+  sse_bool fCongested;
+  RateLimiter_CongestionCallback fCongestionCallback;
+  sse_pointer fCongestionUserData;
+};
+
+TRateLimiter * RateLimiter_New(void);
+void TRateLimiter_Delete(TRateLimiter *self);
+void TRateLimiter_SetRate(TRateLimiter *self, sse_int64 in_rate);
+sse_int TRateLimiter_SetProfiles(TRateLimiter *self, sse_char *in_spec, sse_uint in_len);
+void TRateLimiter_SetCongestionCallback(TRateLimiter *self, RateLimiter_CongestionCallback in_callback, sse_pointer in_user_data);
+sse_uint TRateLimiter_GetWait(TRateLimiter *self);
+sse_bool TRateLimiter_IsLimited(TRateLimiter *self);
+void TRateLimiter_Consume(TRateLimiter *self, sse_int64 in_bytes);
+
+SSE_END_C_DECLS
+
+#endif /* __RATE_LIMITER__ */
@@ -0,0 +1,437 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <servicesync/moat.h>
+#include "rsa_public_key.h"
+
+#define TAG "RsaPublicKey"
+
+#define TRACE_ENTER() MOAT_LOG_TRACE(TAG, "== enter =>");
+#define TRACE_LEAVE() MOAT_LOG_TRACE(TAG, "<= leave ==");
+#define LOG_ERROR(format, ...)  MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...)  MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+
+#define RSA_PUBLIC_KEY_PEM_BEGIN  "-----BEGIN "
+#define RSA_PUBLIC_KEY_PEM_END  "-----END "
+#define RSA_PUBLIC_KEY_LINE_SIZE  (256)
+#define RSA_PUBLIC_KEY_MAX_PEM_SIZE  (4096)
+
+#define DER_TAG_INTEGER  (0x02)
+#define DER_TAG_BIT_STRING  (0x03)
+#define DER_TAG_SEQUENCE  (0x30)
+
+/* 1.2.840.113549.1.1.1 */
+static const sse_byte RsaPublicKey_RsaEncryptionOid[] = {
+  0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x01
+};
+
+/* DigestInfo of SHA-256 which precedes the digest in the padded message */
+static const sse_byte RsaPublicKey_Sha256DigestInfo[] = {
+  0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20
+};
+
+/*
+ * Steps into the DER element at *io_p, which has to carry in_tag, and
+ * returns the length of its contents.
+ */
+static sse_int
+RsaPublicKey_ReadElement(const sse_byte **io_p, const sse_byte *in_end, sse_byte in_tag, sse_size *out_len)
+{
+  const sse_byte *p = *io_p;
+  sse_size len;
+  sse_uint n;
+
+  if (in_end - p < 2 || p[0] != in_tag) {
+    return SSE_E_INVAL;
+  }
+  len = p[1];
+  p += 2;
+  if (len & 0x80) {
+    n = len & 0x7f;
+    if (n == 0 || n > 2 || (sse_size)(in_end - p) < n) {
+      return SSE_E_INVAL;
+    }
+    for (len = 0; n > 0; n--) {
+      len = (len << 8) | *p++;
+    }
+  }
+  if ((sse_size)(in_end - p) < len) {
+    return SSE_E_INVAL;
+  }
+  *io_p = p;
+  *out_len = len;
+  return SSE_E_OK;
+}
+
+static sse_int
+RsaPublicKey_Compare(const sse_uint32 *in_a, const sse_uint32 *in_b, sse_uint in_words)
+{
+  while (in_words-- > 0) {
+    if (in_a[in_words] != in_b[in_words]) {
+      return (in_a[in_words] > in_b[in_words]) ? 1 : -1;
+    }
+  }
+  return 0;
+}
+
+static void
+RsaPublicKey_Subtract(sse_uint32 *io_a, const sse_uint32 *in_b, sse_uint in_words)
+{
+  sse_uint64 borrow = 0;
+  sse_uint64 d;
+  sse_uint i;
+
+  for (i = 0; i < in_words; i++) {
+    d = (sse_uint64)io_a[i] - in_b[i] - borrow;
+    io_a[i] = (sse_uint32)d;
+    borrow = (d >> 32) & 1;
+  }
+}
+
+/*
+ * out = a * b / 2^(32 * words) mod n, word by word (CIOS). out may be a or
+ * b.
+ */
+static void
+TRsaPublicKey_MontMul(TRsaPublicKey *self, sse_uint32 *out, const sse_uint32 *in_a, const sse_uint32 *in_b)
+{
+  sse_uint32 t[RSA_PUBLIC_KEY_MAX_WORDS + 2];
+  const sse_uint32 *n = self->fModulus;
+  sse_uint k = self->fWords;
+  sse_uint64 c;
+  sse_uint32 m;
+  sse_uint i;
+  sse_uint j;
+
+  sse_memset(t, 0, sizeof(sse_uint32) * (k + 2));
+  for (i = 0; i < k; i++) {
+    c = 0;
+    for (j = 0; j < k; j++) {
+      c += (sse_uint64)in_a[j] * in_b[i] + t[j];
+      t[j] = (sse_uint32)c;
+      c >>= 32;
+    }
+    c += t[k];
+    t[k] = (sse_uint32)c;
+    t[k + 1] = (sse_uint32)(c >> 32);
+    m = t[0] * self->fN0Inv;
+    c = ((sse_uint64)m * n[0] + t[0]) >> 32;
+    for (j = 1; j < k; j++) {
+      c += (sse_uint64)m * n[j] + t[j];
+      t[j - 1] = (sse_uint32)c;
+      c >>= 32;
+    }
+    c += t[k];
+    t[k - 1] = (sse_uint32)c;
+    t[k] = t[k + 1] + (sse_uint32)(c >> 32);
+  }
+  if (t[k] != 0 || RsaPublicKey_Compare(t, n, k) >= 0) {
+    RsaPublicKey_Subtract(t, n, k);
+  }
+  sse_memcpy(out, t, sizeof(sse_uint32) * k);
+}
+
+/*
+ * Takes the modulus and the exponent and derives -n^-1 mod 2^32 and
+ * 2^(64 * words) mod n for the Montgomery multiplication.
+ */
+static sse_int
+TRsaPublicKey_SetUp(TRsaPublicKey *self, const sse_byte *in_modulus, sse_size in_modulus_len, const sse_byte *in_exponent, sse_size in_exponent_len)
+{
+  sse_uint32 inv;
+  sse_uint32 carry;
+  sse_uint bits;
+  sse_uint i;
+
+  while (in_modulus_len > 0 && in_modulus[0] == 0) {
+    in_modulus++;
+    in_modulus_len--;
+  }
+  while (in_exponent_len > 0 && in_exponent[0] == 0) {
+    in_exponent++;
+    in_exponent_len--;
+  }
+  if (in_modulus_len == 0 || in_exponent_len == 0 || in_exponent_len > 4) {
+    return SSE_E_INVAL;
+  }
+  bits = (sse_uint)(in_modulus_len - 1) * 8;
+  for (i = in_modulus[0]; i != 0; i >>= 1) {
+    bits++;
+  }
+  if (bits < RSA_PUBLIC_KEY_MIN_BITS || bits > RSA_PUBLIC_KEY_MAX_BITS) {
+    LOG_ERROR("%u bit key is not supported.", bits);
+    return SSE_E_INVAL;
+  }
+  sse_memset(self->fModulus, 0, sizeof(self->fModulus));
+  for (i = 0; i < in_modulus_len; i++) {
+    self->fModulus[i / 4] |= (sse_uint32)in_modulus[in_modulus_len - 1 - i] << (8 * (i % 4));
+  }
+  self->fBytes = (sse_uint)in_modulus_len;
+  self->fWords = (self->fBytes + 3) / 4;
+  self->fExponent = 0;
+  for (i = 0; i < in_exponent_len; i++) {
+    self->fExponent = (self->fExponent << 8) | in_exponent[i];
+  }
+  if ((self->fModulus[0] & 1) == 0 || (self->fExponent & 1) == 0 || self->fExponent < 3) {
+    LOG_ERROR("key is malformed.");
+    return SSE_E_INVAL;
+  }
+  /* Newton's iteration doubles the correct low bits each round */
+  inv = 1;
+  for (i = 0; i < 5; i++) {
+    inv *= 2 - self->fModulus[0] * inv;
+  }
+  self->fN0Inv = (sse_uint32)0 - inv;
+  sse_memset(self->fR2, 0, sizeof(self->fR2));
+  self->fR2[0] = 1;
+  for (bits = 0; bits < 64 * self->fWords; bits++) {
+    carry = 0;
+    for (i = 0; i < self->fWords; i++) {
+      inv = self->fR2[i] >> 31;
+      self->fR2[i] = (self->fR2[i] << 1) | carry;
+      carry = inv;
+    }
+    if (carry != 0 || RsaPublicKey_Compare(self->fR2, self->fModulus, self->fWords) >= 0) {
+      RsaPublicKey_Subtract(self->fR2, self->fModulus, self->fWords);
+    }
+  }
+  return SSE_E_OK;
+}
+
+/*
+ * Reads the modulus and the exponent out of a SubjectPublicKeyInfo or an
+ * RSAPublicKey.
+ */
+static sse_int
+TRsaPublicKey_ParseDer(TRsaPublicKey *self, const sse_byte *in_der, sse_size in_len)
+{
+  const sse_byte *p = in_der;
+  const sse_byte *end = in_der + in_len;
+  const sse_byte *modulus;
+  sse_size modulus_len;
+  sse_size len;
+
+  if (RsaPublicKey_ReadElement(&p, end, DER_TAG_SEQUENCE, &len) != SSE_E_OK) {
+    return SSE_E_INVAL;
+  }
+  end = p + len;
+  if (p < end && *p == DER_TAG_SEQUENCE) {
+    if (RsaPublicKey_ReadElement(&p, end, DER_TAG_SEQUENCE, &len) != SSE_E_OK ||
+        len < sizeof(RsaPublicKey_RsaEncryptionOid) ||
+        sse_memcmp((sse_byte *)p, (sse_byte *)RsaPublicKey_RsaEncryptionOid, sizeof(RsaPublicKey_RsaEncryptionOid)) != 0) {
+      LOG_ERROR("key is not an RSA key.");
+      return SSE_E_INVAL;
+    }
+    p += len;
+    /* the bit string starts with the number of unused bits, which is 0 */
+    if (RsaPublicKey_ReadElement(&p, end, DER_TAG_BIT_STRING, &len) != SSE_E_OK || len < 1 || *p != 0) {
+      return SSE_E_INVAL;
+    }
+    end = p + len;
+    p++;
+    if (RsaPublicKey_ReadElement(&p, end, DER_TAG_SEQUENCE, &len) != SSE_E_OK) {
+      return SSE_E_INVAL;
+    }
+    end = p + len;
+  }
+  if (RsaPublicKey_ReadElement(&p, end, DER_TAG_INTEGER, &modulus_len) != SSE_E_OK) {
+    return SSE_E_INVAL;
+  }
+  modulus = p;
+  p += modulus_len;
+  if (RsaPublicKey_ReadElement(&p, end, DER_TAG_INTEGER, &len) != SSE_E_OK) {
+    return SSE_E_INVAL;
+  }
+  return TRsaPublicKey_SetUp(self, modulus, modulus_len, p, len);
+}
+
+/*
+ * Loads the first PEM block of in_pem_path.
+ */
+sse_int
+TRsaPublicKey_Load(TRsaPublicKey *self, sse_char *in_pem_path)
+{
+  FILE *fp;
+  sse_char line[RSA_PUBLIC_KEY_LINE_SIZE];
+  sse_char *base64 = NULL;
+  sse_byte *der = NULL;
+  sse_size base64_len = 0;
+  sse_size der_len = 0;
+  sse_bool in_block = sse_false;
+  sse_bool ended = sse_false;
+  sse_char *p;
+  sse_int err = SSE_E_INVAL;
+
+  TRACE_ENTER();
+  fp = fopen(in_pem_path, "r");
+  if (fp == NULL) {
+    LOG_ERROR("failed to fopen(%s). err=[%s]", in_pem_path, strerror(errno));
+    return SSE_E_NOENT;
+  }
+  base64 = sse_malloc(RSA_PUBLIC_KEY_MAX_PEM_SIZE);
+  der = sse_malloc(RSA_PUBLIC_KEY_MAX_PEM_SIZE);
+  if (base64 == NULL || der == NULL) {
+    LOG_ERROR("failed to sse_malloc().");
+    err = SSE_E_NOMEM;
+    goto exit;
+  }
+  while (!ended && fgets(line, sizeof(line), fp) != NULL) {
+    if (!in_block) {
+      in_block = (sse_strncmp(line, RSA_PUBLIC_KEY_PEM_BEGIN, sse_strlen(RSA_PUBLIC_KEY_PEM_BEGIN)) == 0);
+      continue;
+    }
+    if (sse_strncmp(line, RSA_PUBLIC_KEY_PEM_END, sse_strlen(RSA_PUBLIC_KEY_PEM_END)) == 0) {
+      ended = sse_true;
+      continue;
+    }
+    for (p = line; *p != '\0'; p++) {
+      if (*p == '\r' || *p == '\n' || *p == ' ' || *p == '\t') {
+        continue;
+      }
+      if (base64_len + 1 >= RSA_PUBLIC_KEY_MAX_PEM_SIZE) {
+        LOG_ERROR("[%s] is too large.", in_pem_path);
+        goto exit;
+      }
+      base64[base64_len++] = *p;
+    }
+  }
+  if (!ended || base64_len == 0) {
+    LOG_ERROR("[%s] has no PEM block.", in_pem_path);
+    goto exit;
+  }
+  base64[base64_len] = '\0';
+  sse_base64_decode(base64, base64_len, der, &der_len);
+  err = TRsaPublicKey_ParseDer(self, der, der_len);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("[%s] is not a valid RSA public key.", in_pem_path);
+    goto exit;
+  }
+  LOG_DEBUG("loaded %u bit RSA key [%s].", self->fBytes * 8, in_pem_path);
+
+exit:
+  if (der != NULL) {
+    sse_free(der);
+  }
+  if (base64 != NULL) {
+    sse_free(base64);
+  }
+  fclose(fp);
+  TRACE_LEAVE();
+  return err;
+}
+
+/*
+ * Returns the size of the modulus, which is the size of a signature, in
+ * bytes.
+ */
+sse_uint
+TRsaPublicKey_GetSize(TRsaPublicKey *self)
+{
+  return self->fBytes;
+}
+
+/*
+ * Checks that in_signature is the RSASSA-PKCS1-v1_5 signature of the
+ * SHA-256 digest in_digest. Returns SSE_E_INVAL when it is not.
+ */
+sse_int
+TRsaPublicKey_VerifySha256(TRsaPublicKey *self, const sse_byte *in_digest, const sse_byte *in_signature, sse_size in_signature_len)
+{
+  sse_uint32 s[RSA_PUBLIC_KEY_MAX_WORDS];
+  sse_uint32 acc[RSA_PUBLIC_KEY_MAX_WORDS];
+  sse_uint32 one[RSA_PUBLIC_KEY_MAX_WORDS];
+  sse_byte em[RSA_PUBLIC_KEY_MAX_BITS / 8];
+  sse_uint32 bit;
+  sse_uint pad_len;
+  sse_uint i;
+
+  if (self->fWords == 0) {
+    LOG_ERROR("key has not been loaded.");
+    return SSE_E_INVAL;
+  }
+  if (in_signature_len != self->fBytes) {
+    LOG_ERROR("signature size %u does not match the key.", (sse_uint)in_signature_len);
+    return SSE_E_INVAL;
+  }
+  sse_memset(s, 0, sizeof(s));
+  for (i = 0; i < self->fBytes; i++) {
+    s[i / 4] |= (sse_uint32)in_signature[self->fBytes - 1 - i] << (8 * (i % 4));
+  }
+  if (RsaPublicKey_Compare(s, self->fModulus, self->fWords) >= 0) {
+    LOG_ERROR("signature is out of range.");
+    return SSE_E_INVAL;
+  }
+  /* s^e mod n, in the Montgomery domain from the top bit of e down */
+  TRsaPublicKey_MontMul(self, s, s, self->fR2);
+  sse_memcpy(acc, s, sizeof(sse_uint32) * self->fWords);
+  for (bit = 0x80000000; (self->fExponent & bit) == 0; bit >>= 1) {
+  }
+  for (bit >>= 1; bit != 0; bit >>= 1) {
+    TRsaPublicKey_MontMul(self, acc, acc, acc);
+    if (self->fExponent & bit) {
+      TRsaPublicKey_MontMul(self, acc, acc, s);
+    }
+  }
+  sse_memset(one, 0, sizeof(one));
+  one[0] = 1;
+  TRsaPublicKey_MontMul(self, acc, acc, one);
+  for (i = 0; i < self->fBytes; i++) {
+    em[self->fBytes - 1 - i] = (sse_byte)(acc[i / 4] >> (8 * (i % 4)));
+  }
+  /* 00 01 FF .. FF 00 DigestInfo digest */
+  pad_len = self->fBytes - 3 - sizeof(RsaPublicKey_Sha256DigestInfo) - SHA256_MD_BYTES;
+  if (em[0] != 0x00 || em[1] != 0x01 || em[2 + pad_len] != 0x00) {
+    goto mismatch;
+  }
+  for (i = 0; i < pad_len; i++) {
+    if (em[2 + i] != 0xff) {
+      goto mismatch;
+    }
+  }
+  if (sse_memcmp(em + 3 + pad_len, (sse_byte *)RsaPublicKey_Sha256DigestInfo, sizeof(RsaPublicKey_Sha256DigestInfo)) != 0 ||
+      sse_memcmp(em + 3 + pad_len + sizeof(RsaPublicKey_Sha256DigestInfo), (sse_byte *)in_digest, SHA256_MD_BYTES) != 0) {
+    goto mismatch;
+  }
+  return SSE_E_OK;
+
+mismatch:
+  LOG_ERROR("signature does not match.");
+  return SSE_E_INVAL;
+}
+
+TRsaPublicKey *
+RsaPublicKey_New(void)
+{
+  TRsaPublicKey *key;
+
+  key = sse_zeroalloc(sizeof(TRsaPublicKey));
+  if (key == NULL) {
+    LOG_ERROR("failed to sse_zeroalloc().");
+    return NULL;
+  }
+  return key;
+}
+
+void
+TRsaPublicKey_Delete(TRsaPublicKey *self)
+{
+  sse_free(self);
+}
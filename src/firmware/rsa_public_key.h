@@ -0,0 +1,56 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#ifndef __RSA_PUBLIC_KEY__
+#define __RSA_PUBLIC_KEY__
+
+#include <sseutils.h>
+
+SSE_BEGIN_C_DECLS
+
+#define RSA_PUBLIC_KEY_MIN_BITS  (2048)
+#define RSA_PUBLIC_KEY_MAX_BITS  (4096)
+#define RSA_PUBLIC_KEY_MAX_WORDS  (RSA_PUBLIC_KEY_MAX_BITS / 32)
+
+typedef struct TRsaPublicKey_ TRsaPublicKey;
+
+/*
+ * RSA public key which verifies RSASSA-PKCS1-v1_5 signatures over SHA-256
+ * digests, as made by "openssl dgst -sha256 -sign". The key is loaded from
+ * a PEM file holding either a SubjectPublicKeyInfo ("openssl rsa -pubout")
+ * or a PKCS#1 RSAPublicKey. Only verification is done, so the arithmetic
+ * does not need to run in constant time. The modulus is kept as 32 bit
+ * words, least significant first, together with the constants of the
+ * Montgomery multiplication.
+ */
+struct TRsaPublicKey_ {
+  sse_uint32 fModulus[RSA_PUBLIC_KEY_MAX_WORDS];
+  sse_uint32 fR2[RSA_PUBLIC_KEY_MAX_WORDS];
+  sse_uint32 fN0Inv;
+  sse_uint fWords;
+  sse_uint fBytes;
+  sse_uint32 fExponent;
+};
+
+TRsaPublicKey * RsaPublicKey_New(void);
+void TRsaPublicKey_Delete(TRsaPublicKey *self);
+sse_int TRsaPublicKey_Load(TRsaPublicKey *self, sse_char *in_pem_path);
+sse_uint TRsaPublicKey_GetSize(TRsaPublicKey *self);
+sse_int TRsaPublicKey_VerifySha256(TRsaPublicKey *self, const sse_byte *in_digest, const sse_byte *in_signature, sse_size in_signature_len);
+
+SSE_END_C_DECLS
+
+#endif /* __RSA_PUBLIC_KEY__ */
@@ -0,0 +1,449 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <servicesync/moat.h>
+#include "signed_manifest.h"
+
+#define TAG "SignedManifest"
+
+#define TRACE_ENTER() MOAT_LOG_TRACE(TAG, "== enter =>");
+#define TRACE_LEAVE() MOAT_LOG_TRACE(TAG, "<= leave ==");
+#define LOG_ERROR(format, ...)  MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...)  MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+
+static sse_int
+SignedManifest_HexValue(sse_char in_c)
+{
+  if (in_c >= '0' && in_c <= '9') {
+    return in_c - '0';
+  }
+  if (in_c >= 'a' && in_c <= 'f') {
+    return in_c - 'a' + 10;
+  }
+  if (in_c >= 'A' && in_c <= 'F') {
+    return in_c - 'A' + 10;
+  }
+  return -1;
+}
+
+static sse_bool
+SignedManifest_NameEquals(const sse_char *in_name, const sse_char *in_other, sse_uint in_other_len)
+{
+  return (sse_strlen(in_name) == (sse_int)in_other_len && sse_strncmp(in_name, in_other, in_other_len) == 0);
+}
+
+static void
+TSignedManifest_ClearEntries(TSignedManifest *self)
+{
+  sse_uint i;
+
+  if (self->fEntries == NULL) {
+    return;
+  }
+  for (i = 0; i < self->fCount; i++) {
+    sse_free(self->fEntries[i].fName);
+  }
+  sse_free(self->fEntries);
+  self->fEntries = NULL;
+  self->fCount = 0;
+}
+
+/*
+ * Parses a line "<SHA-256 in hex> <size> <name>" of the manifest.
+ */
+static sse_int
+TSignedManifest_ParseLine(TSignedManifest *self, sse_char *in_line)
+{
+  TSignedManifestEntry *entry;
+  sse_char *p = in_line;
+  sse_char *end;
+  sse_int hi;
+  sse_int lo;
+  sse_uint i;
+
+  if (self->fCount >= SIGNED_MANIFEST_MAX_ENTRIES) {
+    LOG_ERROR("manifest has too many entries.");
+    return SSE_E_INVAL;
+  }
+  entry = &self->fEntries[self->fCount];
+  for (i = 0; i < SHA256_MD_BYTES; i++) {
+    hi = SignedManifest_HexValue(p[0]);
+    lo = (hi < 0) ? -1 : SignedManifest_HexValue(p[1]);
+    if (lo < 0) {
+      return SSE_E_INVAL;
+    }
+    entry->fDigest[i] = (sse_byte)((hi << 4) | lo);
+    p += 2;
+  }
+  if (*p != ' ' || p[1] < '0' || p[1] > '9') {
+    return SSE_E_INVAL;
+  }
+  entry->fSize = strtoull(p + 1, &end, 10);
+  if (*end != ' ' || end[1] == '\0') {
+    return SSE_E_INVAL;
+  }
+  p = end + 1;
+  if (sse_strcmp(p, SIGNED_MANIFEST_FILE_PATH) == 0 || sse_strcmp(p, SIGNED_MANIFEST_SIGNATURE_PATH) == 0) {
+    return SSE_E_INVAL;
+  }
+  for (i = 0; i < self->fCount; i++) {
+    if (sse_strcmp(self->fEntries[i].fName, p) == 0) {
+      LOG_ERROR("[%s] is listed twice.", p);
+      return SSE_E_INVAL;
+    }
+  }
+  entry->fName = sse_strdup(p);
+  if (entry->fName == NULL) {
+    return SSE_E_NOMEM;
+  }
+  entry->fSeen = sse_false;
+  self->fCount++;
+  return SSE_E_OK;
+}
+
+/*
+ * Checks the signature of the manifest which has been taken in and reads
+ * its entries.
+ */
+static sse_int
+TSignedManifest_Authenticate(TSignedManifest *self)
+{
+  sse_byte digest[SHA256_MD_BYTES];
+  sse_char *line;
+  sse_char *next;
+  sse_uint lines = 0;
+  sse_size i;
+  sse_int err;
+
+  FastHash_Sha256(self->fText, self->fTextLen, digest);
+  err = TRsaPublicKey_VerifySha256(self->fKey, digest, self->fSignature, self->fSignatureLen);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("manifest is not signed with the key of this device.");
+    return SSE_E_PERM;
+  }
+  /* the text is signed, but it is parsed as carefully as if it were not */
+  for (i = 0; i < self->fTextLen; i++) {
+    if (self->fText[i] == '\0') {
+      LOG_ERROR("manifest is malformed.");
+      return SSE_E_PERM;
+    }
+    if (self->fText[i] == '\n') {
+      lines++;
+    }
+  }
+  self->fText[self->fTextLen] = '\0';
+  TSignedManifest_ClearEntries(self);
+  self->fEntries = sse_zeroalloc(sizeof(TSignedManifestEntry) * SSE_MIN(lines + 1, SIGNED_MANIFEST_MAX_ENTRIES));
+  if (self->fEntries == NULL) {
+    LOG_ERROR("failed to sse_zeroalloc().");
+    return SSE_E_NOMEM;
+  }
+  line = (sse_char *)self->fText;
+  next = sse_strchr(line, '\n');
+  if (next == NULL || (sse_size)(next - line) != sse_strlen(SIGNED_MANIFEST_MAGIC) ||
+      sse_strncmp(line, SIGNED_MANIFEST_MAGIC, next - line) != 0) {
+    LOG_ERROR("manifest has an unknown format.");
+    return SSE_E_PERM;
+  }
+  for (line = next + 1; *line != '\0'; line = next + 1) {
+    next = sse_strchr(line, '\n');
+    if (next == NULL) {
+      LOG_ERROR("manifest is truncated.");
+      return SSE_E_PERM;
+    }
+    *next = '\0';
+    err = TSignedManifest_ParseLine(self, line);
+    *next = '\n';
+    if (err != SSE_E_OK) {
+      LOG_ERROR("manifest has a malformed entry.");
+      return (err == SSE_E_NOMEM) ? err : SSE_E_PERM;
+    }
+  }
+  LOG_INFO("package manifest has been authenticated, %u entries.", self->fCount);
+  return SSE_E_OK;
+}
+
+static TSignedManifestEntry *
+TSignedManifest_Find(TSignedManifest *self, sse_char *in_name, sse_uint in_name_len)
+{
+  sse_uint i;
+
+  for (i = 0; i < self->fCount; i++) {
+    if (SignedManifest_NameEquals(self->fEntries[i].fName, in_name, in_name_len)) {
+      return &self->fEntries[i];
+    }
+  }
+  return NULL;
+}
+
+static sse_int
+SignedManifest_OnEntryStart(TZipStream *in_stream, sse_char *in_name, sse_uint in_name_len, sse_int64 in_size, sse_pointer in_user_data)
+{
+  TSignedManifest *self = (TSignedManifest *)in_user_data;
+  TSignedManifestEntry *entry;
+
+  switch (self->fState) {
+  case SIGNED_MANIFEST_STATE_MANIFEST:
+    if (!SignedManifest_NameEquals(SIGNED_MANIFEST_FILE_PATH, in_name, in_name_len)) {
+      LOG_ERROR("package is not signed, [%.*s] comes before the manifest.", in_name_len, in_name);
+      break;
+    }
+    if (in_size > SIGNED_MANIFEST_MAX_SIZE) {
+      LOG_ERROR("manifest is too large. size=%lld", in_size);
+      break;
+    }
+    self->fTextLen = 0;
+    return SSE_E_OK;
+
+  case SIGNED_MANIFEST_STATE_SIGNATURE:
+    if (!SignedManifest_NameEquals(SIGNED_MANIFEST_SIGNATURE_PATH, in_name, in_name_len)) {
+      LOG_ERROR("package is not signed, [%.*s] follows the manifest.", in_name_len, in_name);
+      break;
+    }
+    self->fSignatureLen = 0;
+    return SSE_E_OK;
+
+  case SIGNED_MANIFEST_STATE_ENTRIES:
+    entry = TSignedManifest_Find(self, in_name, in_name_len);
+    if (entry == NULL) {
+      LOG_ERROR("[%.*s] is not in the manifest.", in_name_len, in_name);
+      break;
+    }
+    if (entry->fSeen) {
+      LOG_ERROR("[%s] appears twice.", entry->fName);
+      break;
+    }
+    if (in_size >= 0 && (sse_uint64)in_size != entry->fSize) {
+      LOG_ERROR("size of [%s] does not match the manifest. expected=%llu, actual=%lld", entry->fName, entry->fSize, in_size);
+      break;
+    }
+    self->fCurrent = entry;
+    FastHash_Sha256Init(&self->fContext);
+    return SSE_E_OK;
+
+  default:
+    break;
+  }
+  self->fState = SIGNED_MANIFEST_STATE_FAILED;
+  return SSE_E_PERM;
+}
+
+static sse_int
+SignedManifest_OnEntryData(TZipStream *in_stream, sse_byte *in_data, sse_size in_len, sse_pointer in_user_data)
+{
+  TSignedManifest *self = (TSignedManifest *)in_user_data;
+
+  switch (self->fState) {
+  case SIGNED_MANIFEST_STATE_MANIFEST:
+    if (self->fTextLen + in_len > SIGNED_MANIFEST_MAX_SIZE) {
+      LOG_ERROR("manifest is too large.");
+      break;
+    }
+    sse_memcpy(self->fText + self->fTextLen, in_data, in_len);
+    self->fTextLen += in_len;
+    return SSE_E_OK;
+
+  case SIGNED_MANIFEST_STATE_SIGNATURE:
+    if (self->fSignatureLen + in_len > sizeof(self->fSignature)) {
+      LOG_ERROR("signature is too large.");
+      break;
+    }
+    sse_memcpy(self->fSignature + self->fSignatureLen, in_data, in_len);
+    self->fSignatureLen += in_len;
+    return SSE_E_OK;
+
+  case SIGNED_MANIFEST_STATE_ENTRIES:
+    FastHash_Sha256Update(&self->fContext, in_data, in_len);
+    return SSE_E_OK;
+
+  default:
+    break;
+  }
+  self->fState = SIGNED_MANIFEST_STATE_FAILED;
+  return SSE_E_PERM;
+}
+
+static sse_int
+SignedManifest_OnEntryEnd(TZipStream *in_stream, sse_uint64 in_size, sse_pointer in_user_data)
+{
+  TSignedManifest *self = (TSignedManifest *)in_user_data;
+  sse_byte digest[SHA256_MD_BYTES];
+  sse_int err = SSE_E_PERM;
+
+  switch (self->fState) {
+  case SIGNED_MANIFEST_STATE_MANIFEST:
+    self->fState = SIGNED_MANIFEST_STATE_SIGNATURE;
+    return SSE_E_OK;
+
+  case SIGNED_MANIFEST_STATE_SIGNATURE:
+    err = TSignedManifest_Authenticate(self);
+    if (err != SSE_E_OK) {
+      break;
+    }
+    self->fState = SIGNED_MANIFEST_STATE_ENTRIES;
+    return SSE_E_OK;
+
+  case SIGNED_MANIFEST_STATE_ENTRIES:
+    FastHash_Sha256Final(&self->fContext, digest);
+    if (in_size != self->fCurrent->fSize || sse_memcmp(digest, self->fCurrent->fDigest, SHA256_MD_BYTES) != 0) {
+      LOG_ERROR("[%s] does not match the manifest.", self->fCurrent->fName);
+      break;
+    }
+    self->fCurrent->fSeen = sse_true;
+    self->fCurrent = NULL;
+    return SSE_E_OK;
+
+  default:
+    break;
+  }
+  self->fState = SIGNED_MANIFEST_STATE_FAILED;
+  return err;
+}
+
+/*
+ * Makes in_stream check its entries against the manifest.
+ */
+void
+TSignedManifest_Attach(TSignedManifest *self, TZipStream *in_stream)
+{
+  TZipStream_SetEntryCallbacks(in_stream, SignedManifest_OnEntryStart, SignedManifest_OnEntryData, SignedManifest_OnEntryEnd, self);
+}
+
+/*
+ * Returns true when the manifest has been authenticated and every entry it
+ * lists has been extracted intact.
+ */
+sse_bool
+TSignedManifest_IsComplete(TSignedManifest *self)
+{
+  sse_uint i;
+
+  if (self->fState != SIGNED_MANIFEST_STATE_ENTRIES) {
+    LOG_ERROR("package has not been authenticated.");
+    return sse_false;
+  }
+  for (i = 0; i < self->fCount; i++) {
+    if (!self->fEntries[i].fSeen) {
+      LOG_ERROR("[%s] is listed in the manifest but is missing.", self->fEntries[i].fName);
+      return sse_false;
+    }
+  }
+  return sse_true;
+}
+
+static sse_int
+SignedManifest_ReadFile(sse_char *in_dir_path, sse_char *in_name, sse_byte *out_data, sse_size in_capacity, sse_size *out_len)
+{
+  FILE *fp;
+  sse_char *path;
+  sse_size len;
+  sse_size n;
+
+  len = sse_strlen(in_dir_path) + 1 + sse_strlen(in_name);
+  path = sse_malloc(len + 1);
+  if (path == NULL) {
+    return SSE_E_NOMEM;
+  }
+  snprintf(path, len + 1, "%s/%s", in_dir_path, in_name);
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    LOG_ERROR("failed to fopen(%s). err=[%s]", path, strerror(errno));
+    sse_free(path);
+    return SSE_E_NOENT;
+  }
+  /* one byte more tells a file which is too large */
+  n = fread(out_data, 1, in_capacity + 1, fp);
+  fclose(fp);
+  if (n > in_capacity) {
+    LOG_ERROR("[%s] is too large.", path);
+    sse_free(path);
+    return SSE_E_INVAL;
+  }
+  sse_free(path);
+  *out_len = n;
+  return SSE_E_OK;
+}
+
+/*
+ * Authenticates the manifest of a package which has already been
+ * extracted into in_dir_path. The entries themselves have been checked
+ * when they were extracted.
+ */
+sse_int
+TSignedManifest_Load(TSignedManifest *self, sse_char *in_dir_path)
+{
+  sse_byte signature[sizeof(self->fSignature) + 1];
+  sse_int err;
+
+  TRACE_ENTER();
+  self->fState = SIGNED_MANIFEST_STATE_FAILED;
+  err = SignedManifest_ReadFile(in_dir_path, SIGNED_MANIFEST_FILE_PATH, self->fText, SIGNED_MANIFEST_MAX_SIZE, &self->fTextLen);
+  if (err != SSE_E_OK) {
+    return (err == SSE_E_NOMEM) ? err : SSE_E_PERM;
+  }
+  err = SignedManifest_ReadFile(in_dir_path, SIGNED_MANIFEST_SIGNATURE_PATH, signature, sizeof(self->fSignature), &self->fSignatureLen);
+  if (err != SSE_E_OK) {
+    return (err == SSE_E_NOMEM) ? err : SSE_E_PERM;
+  }
+  sse_memcpy(self->fSignature, signature, self->fSignatureLen);
+  err = TSignedManifest_Authenticate(self);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  self->fState = SIGNED_MANIFEST_STATE_ENTRIES;
+  TRACE_LEAVE();
+  return SSE_E_OK;
+}
+
+TSignedManifest *
+SignedManifest_New(TRsaPublicKey *in_key)
+{
+  TSignedManifest *manifest;
+
+  TRACE_ENTER();
+  manifest = sse_zeroalloc(sizeof(TSignedManifest));
+  if (manifest == NULL) {
+    LOG_ERROR("failed to sse_zeroalloc().");
+    return NULL;
+  }
+  /* one byte more for the terminator of the parsed text */
+  manifest->fText = sse_malloc(SIGNED_MANIFEST_MAX_SIZE + 1);
+  if (manifest->fText == NULL) {
+    LOG_ERROR("failed to sse_malloc().");
+    sse_free(manifest);
+    return NULL;
+  }
+  manifest->fKey = in_key;
+  manifest->fState = SIGNED_MANIFEST_STATE_MANIFEST;
+  TRACE_LEAVE();
+  return manifest;
+}
+
+void
+TSignedManifest_Delete(TSignedManifest *self)
+{
+  TRACE_ENTER();
+  TSignedManifest_ClearEntries(self);
+  sse_free(self->fText);
+  sse_free(self);
+  TRACE_LEAVE();
+}
@@ -0,0 +1,84 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#ifndef __SIGNED_MANIFEST__
+#define __SIGNED_MANIFEST__
+
+#include <sseutils.h>
+#include "fast_hash.h"
+#include "rsa_public_key.h"
+#include "zip_stream.h"
+
+SSE_BEGIN_C_DECLS
+
+#define SIGNED_MANIFEST_FILE_PATH  "fw/package.manifest"
+#define SIGNED_MANIFEST_SIGNATURE_PATH  "fw/package.manifest.sig"
+#define SIGNED_MANIFEST_MAGIC  "FWPKG-MANIFEST 1"
+#define SIGNED_MANIFEST_MAX_SIZE  (64 * 1024)
+#define SIGNED_MANIFEST_MAX_ENTRIES  (256)
+
+enum SignedManifestState_ {
+  SIGNED_MANIFEST_STATE_MANIFEST,
+  SIGNED_MANIFEST_STATE_SIGNATURE,
+  SIGNED_MANIFEST_STATE_ENTRIES,
+  SIGNED_MANIFEST_STATE_FAILED
+};
+
+typedef struct TSignedManifestEntry_ TSignedManifestEntry;
+typedef struct TSignedManifest_ TSignedManifest;
+
+struct TSignedManifestEntry_ {
+  sse_char *fName;
+  sse_uint64 fSize;
+  sse_byte fDigest[SHA256_MD_BYTES];
+  sse_bool fSeen;
+};
+
+/*
+ * Authenticates a package while it is extracted. The package starts with
+ * fw/package.manifest, which lists the size and the SHA-256 digest of
+ * every other entry, followed by fw/package.manifest.sig, the RSA
+ * signature of the manifest. Both are made by genfwpkg.py.
+ * Attached to a TZipStream, the manifest is taken in and authenticated as
+ * soon as its signature has passed by. Every following entry has to be
+ * listed and is hashed while it is inflated, so the check costs no extra
+ * pass over the data. An entry which is not listed or comes before the
+ * manifest is refused before anything of it is written, and one which
+ * does not match its size or digest fails the extraction when it ends.
+ * The archive is authentic once all listed entries have been seen.
+ */
+struct TSignedManifest_ {
+  TRsaPublicKey *fKey;
+  sse_int fState;
+  sse_byte *fText;
+  sse_size fTextLen;
+  sse_byte fSignature[RSA_PUBLIC_KEY_MAX_BITS / 8];
+  sse_size fSignatureLen;
+  TSignedManifestEntry *fEntries;
+  sse_uint fCount;
+  TSignedManifestEntry *fCurrent;
+  FastHashSha256Context fContext;
+};
+
+TSignedManifest * SignedManifest_New(TRsaPublicKey *in_key);
+void TSignedManifest_Delete(TSignedManifest *self);
+void TSignedManifest_Attach(TSignedManifest *self, TZipStream *in_stream);
+sse_bool TSignedManifest_IsComplete(TSignedManifest *self);
+sse_int TSignedManifest_Load(TSignedManifest *self, sse_char *in_dir_path);
+
+SSE_END_C_DECLS
+
+#endif /* __SIGNED_MANIFEST__ */
@@ -0,0 +1,738 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <servicesync/moat.h>
+#include "slot_installer.h"
+#include "kernel_hash.h"
+
+#define TAG "SlotInstaller"
+
+#define TRACE_ENTER() MOAT_LOG_TRACE(TAG, "== enter =>");
+#define TRACE_LEAVE() MOAT_LOG_TRACE(TAG, "<= leave ==");
+#define LOG_ERROR(format, ...)  MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...)  MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+
+#define SLOT_INSTALLER_BUFFER_SIZE  (64 * 1024)
+#define SLOT_INSTALLER_MAX_NAME_LEN  (64)
+#define SLOT_INSTALLER_DEFAULT_SLOT  'A'
+#define SLOT_INSTALLER_SLOT_FILE_KEY  "ACTIVE_SLOT_FILE"
+#define SLOT_INSTALLER_SWITCH_COMMAND_KEY  "SWITCH_COMMAND"
+#define SLOT_INSTALLER_BLOCK_SIZE_KEY  "BLOCK_SIZE"
+#define SLOT_INSTALLER_BLOCK_DIFF_KEY  "BLOCK_DIFF"
+#define SLOT_INSTALLER_MIN_BLOCK_SIZE  (512)
+#define SLOT_INSTALLER_MAX_BLOCK_SIZE  (4 * 1024 * 1024)
+#define SLOT_INSTALLER_DEFAULT_BLOCK_SIZE  (128 * 1024)
+
+static sse_char
+SlotInstaller_GetOtherSlot(sse_char in_slot)
+{
+  return (in_slot == 'A') ? 'B' : 'A';
+}
+
+static sse_char *
+TSlotInstaller_GetSlotFilePath(TSlotInstaller *self)
+{
+  sse_char *path;
+
+  path = TFirmwareConf_GetValue(self->fConf, SLOT_INSTALLER_SLOT_FILE_KEY);
+  return (path != NULL && *path != '\0') ? path : self->fSlotFilePath;
+}
+
+static sse_char
+SlotInstaller_ReadSlotFile(sse_char *in_path)
+{
+  FILE *fp;
+  int c;
+
+  fp = fopen(in_path, "r");
+  if (fp == NULL) {
+    LOG_INFO("no active slot has been recorded, slot %c is assumed.", SLOT_INSTALLER_DEFAULT_SLOT);
+    return SLOT_INSTALLER_DEFAULT_SLOT;
+  }
+  c = fgetc(fp);
+  fclose(fp);
+  if (c == 'A' || c == 'a') {
+    return 'A';
+  }
+  if (c == 'B' || c == 'b') {
+    return 'B';
+  }
+  LOG_ERROR("[%s] does not name a slot, slot %c is assumed.", in_path, SLOT_INSTALLER_DEFAULT_SLOT);
+  return SLOT_INSTALLER_DEFAULT_SLOT;
+}
+
+/*
+ * Replaces the active slot file atomically, so that a power loss leaves
+ * either slot recorded but never a broken file.
+ */
+static sse_int
+SlotInstaller_WriteSlotFile(sse_char *in_path, sse_char in_slot)
+{
+  sse_char *tmp_path;
+  sse_uint len;
+  FILE *fp;
+  sse_int err = SSE_E_OK;
+
+  len = sse_strlen(in_path) + 5;
+  tmp_path = sse_malloc(len);
+  if (tmp_path == NULL) {
+    LOG_ERROR("failed to sse_malloc().");
+    return SSE_E_NOMEM;
+  }
+  snprintf(tmp_path, len, "%s.tmp", in_path);
+  fp = fopen(tmp_path, "w");
+  if (fp == NULL) {
+    LOG_ERROR("failed to fopen(%s). err=[%s]", tmp_path, strerror(errno));
+    sse_free(tmp_path);
+    return SSE_E_ACCES;
+  }
+  if (fprintf(fp, "%c\n", in_slot) < 0 || fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+    LOG_ERROR("failed to write [%s]. err=[%s]", tmp_path, strerror(errno));
+    err = SSE_E_ACCES;
+  }
+  if (fclose(fp) != 0 && err == SSE_E_OK) {
+    err = SSE_E_ACCES;
+  }
+  if (err == SSE_E_OK && rename(tmp_path, in_path) != 0) {
+    LOG_ERROR("failed to rename(%s). err=[%s]", tmp_path, strerror(errno));
+    err = SSE_E_ACCES;
+  }
+  if (err != SSE_E_OK) {
+    unlink(tmp_path);
+  }
+  sse_free(tmp_path);
+  return err;
+}
+
+/*
+ * Reads the digest from the first field of a line written by md5sum.
+ */
+static sse_int
+SlotInstaller_ReadMd5File(sse_char *in_path, sse_byte *out_md5)
+{
+  FILE *fp;
+  sse_char hex[MD5_MD_BYTES * 2 + 1];
+  unsigned int byte;
+  sse_int i;
+
+  fp = fopen(in_path, "r");
+  if (fp == NULL) {
+    return SSE_E_NOENT;
+  }
+  if (fscanf(fp, "%32s", hex) != 1 || sse_strlen(hex) != MD5_MD_BYTES * 2) {
+    fclose(fp);
+    LOG_ERROR("[%s] has no MD5 digest.", in_path);
+    return SSE_E_INVAL;
+  }
+  fclose(fp);
+  for (i = 0; i < MD5_MD_BYTES; i++) {
+    if (sscanf(hex + i * 2, "%2x", &byte) != 1) {
+      LOG_ERROR("[%s] has no MD5 digest.", in_path);
+      return SSE_E_INVAL;
+    }
+    out_md5[i] = (sse_byte)byte;
+  }
+  return SSE_E_OK;
+}
+
+/*
+ * Reads the block of the target at in_offset and compares it with the
+ * pending block. A target shorter than that never matches.
+ */
+static sse_bool
+TSlotInstaller_IsBlockUnchanged(TSlotInstaller *self, off_t in_offset)
+{
+  sse_uint done = 0;
+  ssize_t n;
+
+  while (done < self->fBlockLen) {
+    n = pread(self->fTargetFd, self->fCompareBuffer + done, self->fBlockLen - done, in_offset + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return sse_false;
+    }
+    done += (sse_uint)n;
+  }
+  return (sse_memcmp(self->fCompareBuffer, self->fBlock, self->fBlockLen) == 0) ? sse_true : sse_false;
+}
+
+/*
+ * Writes the pending block at its aligned offset, unless the block diff
+ * finds it on the target already.
+ */
+static sse_int
+TSlotInstaller_FlushBlock(TSlotInstaller *self)
+{
+  off_t offset = (off_t)(self->fWritten - self->fBlockLen);
+  sse_uint done = 0;
+  ssize_t n;
+
+  if (self->fBlockLen == 0) {
+    return SSE_E_OK;
+  }
+  if (self->fBlockDiff && TSlotInstaller_IsBlockUnchanged(self, offset)) {
+    self->fBlocksSkipped++;
+    self->fBlockLen = 0;
+    return SSE_E_OK;
+  }
+  while (done < self->fBlockLen) {
+    n = pwrite(self->fTargetFd, self->fBlock + done, self->fBlockLen - done, offset + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      LOG_ERROR("failed to pwrite(%s). err=[%s]", self->fTargetPath, strerror(errno));
+      return SSE_E_ACCES;
+    }
+    done += (sse_uint)n;
+  }
+  self->fBlocksWritten++;
+  self->fBlockLen = 0;
+  return SSE_E_OK;
+}
+
+static sse_int
+TSlotInstaller_WriteTarget(TSlotInstaller *self, sse_byte *in_data, sse_size in_len)
+{
+  sse_uint len;
+  sse_int err;
+
+  if (self->fMaxSize > 0 && self->fWritten + in_len > self->fMaxSize) {
+    LOG_ERROR("image does not fit in [%s]. size=%llu", self->fTargetPath, self->fMaxSize);
+    return SSE_E_INVAL;
+  }
+  FastHash_Sha256Update(&self->fDigestContext, in_data, in_len);
+  while (in_len > 0) {
+    len = (sse_uint)SSE_MIN((sse_size)(self->fBlockSize - self->fBlockLen), in_len);
+    sse_memcpy(self->fBlock + self->fBlockLen, in_data, len);
+    self->fBlockLen += len;
+    self->fWritten += len;
+    in_data += len;
+    in_len -= len;
+    if (self->fBlockLen == self->fBlockSize) {
+      err = TSlotInstaller_FlushBlock(self);
+      if (err != SSE_E_OK) {
+        return err;
+      }
+    }
+  }
+  return SSE_E_OK;
+}
+
+/*
+ * Reads the image back from the target, past any cached pages, and
+ * compares it with the digest taken while it was written.
+ */
+static sse_int
+TSlotInstaller_ReadBack(TSlotInstaller *self, sse_byte *in_digest)
+{
+  sse_byte digest[SHA256_MD_BYTES];
+
+  posix_fadvise(self->fTargetFd, 0, 0, POSIX_FADV_DONTNEED);
+  if (KernelHash_HashFile(KERNEL_HASH_SHA256, self->fTargetFd, 0, (sse_int64)self->fWritten, digest) != SSE_E_OK) {
+    LOG_ERROR("failed to read back [%s].", self->fTargetPath);
+    return SSE_E_GENERIC;
+  }
+  if (sse_memcmp(digest, in_digest, SHA256_MD_BYTES) != 0) {
+    LOG_ERROR("[%s] does not read back as written.", self->fTargetPath);
+    return SSE_E_INVAL;
+  }
+  return SSE_E_OK;
+}
+
+static void
+TSlotInstaller_Close(TSlotInstaller *self)
+{
+  if (self->fInflateReady) {
+    inflateEnd(&self->fInflate);
+    self->fInflateReady = sse_false;
+  }
+  if (self->fTargetFd >= 0) {
+    close(self->fTargetFd);
+    self->fTargetFd = -1;
+  }
+  if (self->fTargetPath != NULL) {
+    sse_free(self->fTargetPath);
+    self->fTargetPath = NULL;
+  }
+}
+
+/*
+ * Loads the slot configuration and finds out the slot to install into.
+ */
+sse_int
+TSlotInstaller_Load(TSlotInstaller *self, sse_char *in_conf_path)
+{
+  sse_char *value;
+  sse_int err;
+
+  TRACE_ENTER();
+  err = TFirmwareConf_Load(self->fConf, in_conf_path);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to TFirmwareConf_Load(%s). err=%s", in_conf_path, sse_get_error_string(err));
+    return err;
+  }
+  value = TFirmwareConf_GetValue(self->fConf, SLOT_INSTALLER_BLOCK_SIZE_KEY);
+  if (value != NULL && *value != '\0') {
+    err = TSlotInstaller_SetBlockSize(self, (sse_uint)strtoul(value, NULL, 0));
+    if (err != SSE_E_OK) {
+      LOG_ERROR("invalid %s [%s].", SLOT_INSTALLER_BLOCK_SIZE_KEY, value);
+      return err;
+    }
+  }
+  value = TFirmwareConf_GetValue(self->fConf, SLOT_INSTALLER_BLOCK_DIFF_KEY);
+  if (value != NULL) {
+    TSlotInstaller_SetBlockDiff(self, (sse_strcmp(value, "1") == 0 || sse_strcmp(value, "yes") == 0) ? sse_true : sse_false);
+  }
+  self->fActiveSlot = SlotInstaller_ReadSlotFile(TSlotInstaller_GetSlotFilePath(self));
+  self->fTargetSlot = SlotInstaller_GetOtherSlot(self->fActiveSlot);
+  self->fVerifiedCount = 0;
+  self->fFailed = sse_false;
+  LOG_INFO("active slot is %c, images go to slot %c.", self->fActiveSlot, self->fTargetSlot);
+  TRACE_LEAVE();
+  return SSE_E_OK;
+}
+
+sse_char
+TSlotInstaller_GetTargetSlot(TSlotInstaller *self)
+{
+  return self->fTargetSlot;
+}
+
+/*
+ * Images are written in blocks of in_size bytes at offsets aligned to it,
+ * a multiple of 512 up to 4 MiB.
+ */
+sse_int
+TSlotInstaller_SetBlockSize(TSlotInstaller *self, sse_uint in_size)
+{
+  sse_byte *block;
+  sse_byte *compare;
+
+  if (in_size < SLOT_INSTALLER_MIN_BLOCK_SIZE || in_size > SLOT_INSTALLER_MAX_BLOCK_SIZE ||
+      in_size % SLOT_INSTALLER_MIN_BLOCK_SIZE != 0 || self->fTargetFd >= 0) {
+    return SSE_E_INVAL;
+  }
+  if (in_size == self->fBlockSize) {
+    return SSE_E_OK;
+  }
+  block = sse_malloc(in_size);
+  compare = sse_malloc(in_size);
+  if (block == NULL || compare == NULL) {
+    LOG_ERROR("failed to sse_malloc().");
+    if (block != NULL) {
+      sse_free(block);
+    }
+    if (compare != NULL) {
+      sse_free(compare);
+    }
+    return SSE_E_NOMEM;
+  }
+  if (self->fBlock != NULL) {
+    sse_free(self->fBlock);
+  }
+  if (self->fCompareBuffer != NULL) {
+    sse_free(self->fCompareBuffer);
+  }
+  self->fBlock = block;
+  self->fCompareBuffer = compare;
+  self->fBlockSize = in_size;
+  return SSE_E_OK;
+}
+
+/*
+ * In block diff mode each block is compared with the block on the target
+ * first and is written only when they differ.
+ */
+void
+TSlotInstaller_SetBlockDiff(TSlotInstaller *self, sse_bool in_enabled)
+{
+  self->fBlockDiff = in_enabled;
+}
+
+void
+TSlotInstaller_GetBlockCounts(TSlotInstaller *self, sse_uint *out_written, sse_uint *out_skipped)
+{
+  *out_written = self->fBlocksWritten;
+  *out_skipped = self->fBlocksSkipped;
+}
+
+/*
+ * Opens the target of in_name in the inactive slot. A plain file is
+ * truncated to the image when the image ends, a device is written over.
+ */
+sse_int
+TSlotInstaller_BeginImage(TSlotInstaller *self, sse_char *in_name, sse_bool in_gzip)
+{
+  sse_char key[SLOT_INSTALLER_MAX_NAME_LEN + 3];
+  sse_char *path;
+  struct stat st;
+  off_t size;
+
+  TRACE_ENTER();
+  TSlotInstaller_Close(self);
+  if (sse_strlen(in_name) > SLOT_INSTALLER_MAX_NAME_LEN) {
+    LOG_ERROR("image name is too long. name=%s", in_name);
+    self->fFailed = sse_true;
+    return SSE_E_INVAL;
+  }
+  snprintf(key, sizeof(key), "%s_%c", in_name, self->fTargetSlot);
+  path = TFirmwareConf_GetValue(self->fConf, key);
+  if (path == NULL || *path == '\0') {
+    LOG_ERROR("%s is not configured.", key);
+    self->fFailed = sse_true;
+    return SSE_E_NOENT;
+  }
+  self->fTargetPath = sse_strdup(path);
+  if (self->fTargetPath == NULL) {
+    LOG_ERROR("failed to sse_strdup().");
+    self->fFailed = sse_true;
+    return SSE_E_NOMEM;
+  }
+  self->fTargetFd = open(path, O_RDWR | O_CREAT, 0644);
+  if (self->fTargetFd < 0) {
+    LOG_ERROR("failed to open(%s). err=[%s]", path, strerror(errno));
+    goto error_exit;
+  }
+  self->fMaxSize = 0;
+  if (fstat(self->fTargetFd, &st) == 0 && S_ISBLK(st.st_mode)) {
+    size = lseek(self->fTargetFd, 0, SEEK_END);
+    if (size < 0 || lseek(self->fTargetFd, 0, SEEK_SET) != 0) {
+      LOG_ERROR("failed to lseek(%s). err=[%s]", path, strerror(errno));
+      goto error_exit;
+    }
+    self->fMaxSize = (sse_uint64)size;
+  }
+  if (in_gzip) {
+    sse_memset(&self->fInflate, 0, sizeof(self->fInflate));
+    /* gzip header and trailer */
+    if (inflateInit2(&self->fInflate, 16 + MAX_WBITS) != Z_OK) {
+      LOG_ERROR("failed to inflateInit2().");
+      TSlotInstaller_Close(self);
+      self->fFailed = sse_true;
+      return SSE_E_NOMEM;
+    }
+    self->fInflateReady = sse_true;
+    self->fInflateEnded = sse_false;
+  }
+  self->fWritten = 0;
+  self->fBlockLen = 0;
+  self->fBlocksWritten = 0;
+  self->fBlocksSkipped = 0;
+  sse_hashlib_md5_init(&self->fPayloadContext);
+  FastHash_Sha256Init(&self->fDigestContext);
+  LOG_INFO("installing %s into slot %c [%s].", in_name, self->fTargetSlot, path);
+  TRACE_LEAVE();
+  return SSE_E_OK;
+
+error_exit:
+  TSlotInstaller_Close(self);
+  self->fFailed = sse_true;
+  return SSE_E_ACCES;
+}
+
+sse_int
+TSlotInstaller_Write(TSlotInstaller *self, sse_byte *in_data, sse_size in_len)
+{
+  z_stream *z = &self->fInflate;
+  sse_uint produced;
+  int ret;
+  sse_int err = SSE_E_OK;
+
+  if (self->fTargetFd < 0) {
+    return SSE_E_INVAL;
+  }
+  sse_hashlib_md5_update(&self->fPayloadContext, in_data, in_len);
+  if (!self->fInflateReady) {
+    err = TSlotInstaller_WriteTarget(self, in_data, in_len);
+    goto exit;
+  }
+  z->next_in = in_data;
+  z->avail_in = (uInt)in_len;
+  do {
+    if (self->fInflateEnded && z->avail_in > 0) {
+      /* concatenated gzip members */
+      inflateReset(z);
+      self->fInflateEnded = sse_false;
+    }
+    z->next_out = self->fBuffer;
+    z->avail_out = SLOT_INSTALLER_BUFFER_SIZE;
+    ret = inflate(z, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      self->fInflateEnded = sse_true;
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      LOG_ERROR("failed to inflate(). ret=%d", ret);
+      err = SSE_E_INVAL;
+      break;
+    }
+    produced = SLOT_INSTALLER_BUFFER_SIZE - z->avail_out;
+    if (produced > 0) {
+      err = TSlotInstaller_WriteTarget(self, self->fBuffer, produced);
+    }
+  } while (err == SSE_E_OK && (z->avail_in > 0 || (z->avail_out == 0 && !self->fInflateEnded)));
+
+exit:
+  if (err != SSE_E_OK) {
+    TSlotInstaller_AbortImage(self);
+  }
+  return err;
+}
+
+/*
+ * Completes the image and verifies it. in_payload_md5 is the digest of the
+ * bytes pushed, NULL when there is none to check.
+ */
+sse_int
+TSlotInstaller_EndImage(TSlotInstaller *self, sse_byte *in_payload_md5)
+{
+  sse_byte md5[MD5_MD_BYTES];
+  sse_byte digest[SHA256_MD_BYTES];
+  struct stat st;
+  sse_int err;
+
+  TRACE_ENTER();
+  if (self->fTargetFd < 0) {
+    return SSE_E_INVAL;
+  }
+  if (self->fInflateReady && !self->fInflateEnded) {
+    LOG_ERROR("compressed image is truncated.");
+    err = SSE_E_INVAL;
+    goto error_exit;
+  }
+  err = TSlotInstaller_FlushBlock(self);
+  if (err != SSE_E_OK) {
+    goto error_exit;
+  }
+  sse_hashlib_md5_fini(&self->fPayloadContext, md5);
+  if (in_payload_md5 != NULL && sse_memcmp(md5, in_payload_md5, MD5_MD_BYTES) != 0) {
+    LOG_ERROR("MD5 digest of the image mismatched.");
+    err = SSE_E_INVAL;
+    goto error_exit;
+  }
+  if (fstat(self->fTargetFd, &st) == 0 && S_ISREG(st.st_mode) && ftruncate(self->fTargetFd, (off_t)self->fWritten) != 0) {
+    LOG_ERROR("failed to ftruncate(%s). err=[%s]", self->fTargetPath, strerror(errno));
+    err = SSE_E_ACCES;
+    goto error_exit;
+  }
+  if (fsync(self->fTargetFd) != 0) {
+    LOG_ERROR("failed to fsync(%s). err=[%s]", self->fTargetPath, strerror(errno));
+    err = SSE_E_ACCES;
+    goto error_exit;
+  }
+  FastHash_Sha256Final(&self->fDigestContext, digest);
+  err = TSlotInstaller_ReadBack(self, digest);
+  if (err != SSE_E_OK) {
+    goto error_exit;
+  }
+  LOG_INFO("[%s] has been verified. size=%llu, blocks written=%u, skipped=%u",
+      self->fTargetPath, self->fWritten, self->fBlocksWritten, self->fBlocksSkipped);
+  self->fVerifiedCount++;
+  TSlotInstaller_Close(self);
+  TRACE_LEAVE();
+  return SSE_E_OK;
+
+error_exit:
+  TSlotInstaller_AbortImage(self);
+  return err;
+}
+
+/*
+ * Drops the image being written. The slot can not be switched to after that.
+ */
+void
+TSlotInstaller_AbortImage(TSlotInstaller *self)
+{
+  TSlotInstaller_Close(self);
+  self->fFailed = sse_true;
+}
+
+sse_int
+TSlotInstaller_InstallFile(TSlotInstaller *self, sse_char *in_name, sse_char *in_image_path, sse_char *in_md5_path)
+{
+  sse_byte md5[MD5_MD_BYTES];
+  sse_byte *expected = NULL;
+  sse_byte *buffer = NULL;
+  sse_int len = sse_strlen(in_image_path);
+  sse_bool gzip;
+  ssize_t n;
+  sse_int err;
+  int fd;
+
+  TRACE_ENTER();
+  if (in_md5_path != NULL) {
+    err = SlotInstaller_ReadMd5File(in_md5_path, md5);
+    if (err == SSE_E_OK) {
+      expected = md5;
+    } else if (err != SSE_E_NOENT) {
+      self->fFailed = sse_true;
+      return err;
+    }
+  }
+  fd = open(in_image_path, O_RDONLY);
+  if (fd < 0) {
+    LOG_ERROR("failed to open(%s). err=[%s]", in_image_path, strerror(errno));
+    self->fFailed = sse_true;
+    return SSE_E_NOENT;
+  }
+  buffer = sse_malloc(SLOT_INSTALLER_BUFFER_SIZE);
+  if (buffer == NULL) {
+    LOG_ERROR("failed to sse_malloc().");
+    close(fd);
+    return SSE_E_NOMEM;
+  }
+  gzip = (len > 3 && sse_strcmp(in_image_path + len - 3, ".gz") == 0) ? sse_true : sse_false;
+  err = TSlotInstaller_BeginImage(self, in_name, gzip);
+  while (err == SSE_E_OK) {
+    n = read(fd, buffer, SLOT_INSTALLER_BUFFER_SIZE);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      LOG_ERROR("failed to read(%s). err=[%s]", in_image_path, strerror(errno));
+      TSlotInstaller_AbortImage(self);
+      err = SSE_E_GENERIC;
+      break;
+    }
+    if (n == 0) {
+      err = TSlotInstaller_EndImage(self, expected);
+      break;
+    }
+    err = TSlotInstaller_Write(self, buffer, (sse_size)n);
+  }
+  sse_free(buffer);
+  close(fd);
+  TRACE_LEAVE();
+  return err;
+}
+
+/*
+ * Makes the slot which has been installed the one to boot. The slot file is
+ * restored when SWITCH_COMMAND fails.
+ */
+sse_int
+TSlotInstaller_Switch(TSlotInstaller *self)
+{
+  sse_char *slot_file_path = TSlotInstaller_GetSlotFilePath(self);
+  sse_char *command;
+  sse_char *line = NULL;
+  sse_uint len;
+  sse_int err;
+  int status;
+
+  TRACE_ENTER();
+  if (self->fFailed || self->fVerifiedCount == 0 || self->fTargetFd >= 0) {
+    LOG_ERROR("slot %c has not been verified.", self->fTargetSlot);
+    return SSE_E_INVAL;
+  }
+  err = SlotInstaller_WriteSlotFile(slot_file_path, self->fTargetSlot);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  command = TFirmwareConf_GetValue(self->fConf, SLOT_INSTALLER_SWITCH_COMMAND_KEY);
+  if (command != NULL && *command != '\0') {
+    len = sse_strlen(command) + 3;
+    line = sse_malloc(len);
+    if (line == NULL) {
+      LOG_ERROR("failed to sse_malloc().");
+      err = SSE_E_NOMEM;
+      goto error_exit;
+    }
+    snprintf(line, len, "%s %c", command, self->fTargetSlot);
+    status = system(line);
+    if (status != 0) {
+      LOG_ERROR("[%s] failed. status=%d", line, status);
+      err = SSE_E_GENERIC;
+      goto error_exit;
+    }
+    sse_free(line);
+  }
+  LOG_INFO("switched from slot %c to slot %c.", self->fActiveSlot, self->fTargetSlot);
+  self->fActiveSlot = self->fTargetSlot;
+  self->fTargetSlot = SlotInstaller_GetOtherSlot(self->fActiveSlot);
+  self->fVerifiedCount = 0;
+  TRACE_LEAVE();
+  return SSE_E_OK;
+
+error_exit:
+  if (line != NULL) {
+    sse_free(line);
+  }
+  SlotInstaller_WriteSlotFile(slot_file_path, self->fActiveSlot);
+  return err;
+}
+
+TSlotInstaller *
+SlotInstaller_New(sse_char *in_slot_file_path)
+{
+  TSlotInstaller *installer = NULL;
+
+  TRACE_ENTER();
+  installer = sse_zeroalloc(sizeof(TSlotInstaller));
+  if (installer == NULL) {
+    LOG_ERROR("failed to sse_zeroalloc().");
+    return NULL;
+  }
+  installer->fTargetFd = -1;
+  installer->fActiveSlot = SLOT_INSTALLER_DEFAULT_SLOT;
+  installer->fTargetSlot = SlotInstaller_GetOtherSlot(SLOT_INSTALLER_DEFAULT_SLOT);
+  installer->fConf = FirmwareConf_New();
+  installer->fSlotFilePath = sse_strdup(in_slot_file_path);
+  installer->fBuffer = sse_malloc(SLOT_INSTALLER_BUFFER_SIZE);
+  if (installer->fConf == NULL || installer->fSlotFilePath == NULL || installer->fBuffer == NULL ||
+      TSlotInstaller_SetBlockSize(installer, SLOT_INSTALLER_DEFAULT_BLOCK_SIZE) != SSE_E_OK) {
+    LOG_ERROR("failed to allocate.");
+    TSlotInstaller_Delete(installer);
+    return NULL;
+  }
+  TRACE_LEAVE();
+  return installer;
+}
+
+void
+TSlotInstaller_Delete(TSlotInstaller *self)
+{
+  TRACE_ENTER();
+  TSlotInstaller_Close(self);
+  if (self->fCompareBuffer != NULL) {
+    sse_free(self->fCompareBuffer);
+  }
+  if (self->fBlock != NULL) {
+    sse_free(self->fBlock);
+  }
+  if (self->fBuffer != NULL) {
+    sse_free(self->fBuffer);
+  }
+  if (self->fSlotFilePath != NULL) {
+    sse_free(self->fSlotFilePath);
+  }
+  if (self->fConf != NULL) {
+    TFirmwareConf_Delete(self->fConf);
+  }
+  sse_free(self);
+  TRACE_LEAVE();
+}
@@ -0,0 +1,88 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#ifndef __SLOT_INSTALLER__
+#define __SLOT_INSTALLER__
+
+#include <zlib.h>
+#include <sseutils.h>
+#include "fast_hash.h"
+#include "firmware_conf.h"
+
+SSE_BEGIN_C_DECLS
+
+typedef struct TSlotInstaller_ TSlotInstaller;
+
+/*
+ * Installs images into the inactive one of two slots (A and B). The target
+ * of an image in a slot is given as <NAME>_A and <NAME>_B in the slot
+ * configuration and may be a block device, a loop device or a plain file.
+ * An image is pushed in order, inflated on the fly when it is gzip
+ * compressed and hashed while it is written with a fixed size buffer. When
+ * it has ended, the target is synced, the payload is checked against its
+ * MD5 digest and the written bytes are read back and checked against their
+ * SHA-256 digest.
+ * The target is written in aligned blocks (BLOCK_SIZE). In block diff mode
+ * (BLOCK_DIFF=yes) a block which the target already holds is skipped, which
+ * spares the flash when most of an image is unchanged. The number of blocks
+ * written and skipped is counted per image.
+ * The slot switch records the new slot in the active slot file (or
+ * ACTIVE_SLOT_FILE) and runs SWITCH_COMMAND with the slot as its argument.
+ * It is refused unless every image has been verified.
+ */
+struct TSlotInstaller_ {
+  TFirmwareConf *fConf;
+  sse_char *fSlotFilePath;
+  sse_char fActiveSlot;
+  sse_char fTargetSlot;
+  sse_char *fTargetPath;
+  int fTargetFd;
+  sse_uint64 fMaxSize;
+  sse_uint64 fWritten;
+  z_stream fInflate;
+  sse_bool fInflateReady;
+  sse_bool fInflateEnded;
+  sse_byte *fBuffer;
+  sse_byte *fBlock;
+  sse_byte *fCompareBuffer;
+  sse_uint fBlockSize;
+  sse_uint fBlockLen;
+  sse_bool fBlockDiff;
+  sse_uint fBlocksWritten;
+  sse_uint fBlocksSkipped;
+  SSEMd5Context fPayloadContext;
+  FastHashSha256Context fDigestContext;
+  sse_uint fVerifiedCount;
+  sse_bool fFailed;
+};
+
+TSlotInstaller * SlotInstaller_New(sse_char *in_slot_file_path);
+void TSlotInstaller_Delete(TSlotInstaller *self);
+sse_int TSlotInstaller_Load(TSlotInstaller *self, sse_char *in_conf_path);
+sse_char TSlotInstaller_GetTargetSlot(TSlotInstaller *self);
+sse_int TSlotInstaller_SetBlockSize(TSlotInstaller *self, sse_uint in_size);
+void TSlotInstaller_SetBlockDiff(TSlotInstaller *self, sse_bool in_enabled);
+void TSlotInstaller_GetBlockCounts(TSlotInstaller *self, sse_uint *out_written, sse_uint *out_skipped);
+sse_int TSlotInstaller_BeginImage(TSlotInstaller *self, sse_char *in_name, sse_bool in_gzip);
+sse_int TSlotInstaller_Write(TSlotInstaller *self, sse_byte *in_data, sse_size in_len);
+sse_int TSlotInstaller_EndImage(TSlotInstaller *self, sse_byte *in_payload_md5);
+void TSlotInstaller_AbortImage(TSlotInstaller *self);
+sse_int TSlotInstaller_InstallFile(TSlotInstaller *self, sse_char *in_name, sse_char *in_image_path, sse_char *in_md5_path);
+sse_int TSlotInstaller_Switch(TSlotInstaller *self);
+
+SSE_END_C_DECLS
+
+#endif /* __SLOT_INSTALLER__ */
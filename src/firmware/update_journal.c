@@ -0,0 +1,313 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#include <servicesync/moat.h>
+#include "update_journal.h"
+
+#define TAG "UpdateJournal"
+
+#define TRACE_ENTER() MOAT_LOG_TRACE(TAG, "== enter =>");
+#define TRACE_LEAVE() MOAT_LOG_TRACE(TAG, "<= leave ==");
+#define LOG_ERROR(format, ...)  MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...)  MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+
+#define UPDATE_JOURNAL_STORED_KEY  "FirmwareUpdateJournal"
+#define UPDATE_JOURNAL_FIELD_ASYNC_KEY  "@asyncKey"
+#define UPDATE_JOURNAL_FIELD_COMMAND  "@command"
+#define UPDATE_JOURNAL_FIELD_RUN_AT  "@runAt"
+#define UPDATE_JOURNAL_FIELD_STAGE  "@stage"
+#define UPDATE_JOURNAL_FIELD_OFFSET  "@offset"
+#define UPDATE_JOURNAL_FIELD_RESUMES  "@resumes"
+
+/* UpdateJournal private */
+
+static sse_int
+TUpdateJournal_Save(TUpdateJournal *self)
+{
+  sse_int err;
+
+  err = moat_datastore_save_object(self->fMoat, UPDATE_JOURNAL_STORED_KEY, self->fRecord);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to moat_datastore_save_object(). err=%s", sse_get_error_string(err));
+    return err;
+  }
+  self->fDirty = sse_false;
+  self->fSavedAt = moat_get_timestamp_msec();
+  return SSE_E_OK;
+}
+
+static sse_int32
+TUpdateJournal_GetInt32(TUpdateJournal *self, sse_char *in_field)
+{
+  sse_int32 value = 0;
+
+  if (self->fRecord != NULL) {
+    moat_object_get_int32_value(self->fRecord, in_field, &value);
+  }
+  return value;
+}
+
+static sse_int64
+TUpdateJournal_GetInt64(TUpdateJournal *self, sse_char *in_field)
+{
+  sse_int64 value = 0;
+
+  if (self->fRecord != NULL) {
+    moat_object_get_int64_value(self->fRecord, in_field, &value);
+  }
+  return value;
+}
+
+/* UpdateJournal public */
+
+/*
+ * Starts a record for a new job, which replaces whatever was recorded.
+ */
+sse_int
+TUpdateJournal_Begin(TUpdateJournal *self, MoatObject *in_info, sse_char *in_key, sse_int in_command, sse_int64 in_run_at)
+{
+  MoatObject *record;
+  sse_int err;
+
+  TRACE_ENTER();
+  record = moat_object_clone(in_info);
+  if (record == NULL) {
+    LOG_ERROR("failed to moat_object_clone().");
+    return SSE_E_NOMEM;
+  }
+  err = moat_object_add_string_value(record, UPDATE_JOURNAL_FIELD_ASYNC_KEY, in_key, 0, sse_true, sse_true);
+  if (err == SSE_E_OK) {
+    err = moat_object_add_int32_value(record, UPDATE_JOURNAL_FIELD_COMMAND, in_command, sse_true);
+  }
+  if (err == SSE_E_OK) {
+    err = moat_object_add_int64_value(record, UPDATE_JOURNAL_FIELD_RUN_AT, in_run_at, sse_true);
+  }
+  if (err == SSE_E_OK) {
+    err = moat_object_add_int32_value(record, UPDATE_JOURNAL_FIELD_STAGE, UPDATE_JOURNAL_STAGE_QUEUED, sse_true);
+  }
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to make record. err=%s", sse_get_error_string(err));
+    moat_object_free(record);
+    return err;
+  }
+  if (self->fRecord != NULL) {
+    moat_object_free(self->fRecord);
+  }
+  self->fRecord = record;
+  err = TUpdateJournal_Save(self);
+  TRACE_LEAVE();
+  return err;
+}
+
+sse_int
+TUpdateJournal_Load(TUpdateJournal *self)
+{
+  MoatObject *record = NULL;
+  sse_char *p;
+  sse_uint len;
+  sse_int err;
+
+  TRACE_ENTER();
+  err = moat_datastore_load_object(self->fMoat, UPDATE_JOURNAL_STORED_KEY, &record);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  if (moat_object_get_string_value(record, UPDATE_JOURNAL_FIELD_ASYNC_KEY, &p, &len) != SSE_E_OK) {
+    LOG_ERROR("invalid record.");
+    moat_object_free(record);
+    moat_datastore_remove_object(self->fMoat, UPDATE_JOURNAL_STORED_KEY);
+    return SSE_E_INVAL;
+  }
+  if (self->fRecord != NULL) {
+    moat_object_free(self->fRecord);
+  }
+  self->fRecord = record;
+  self->fDirty = sse_false;
+  self->fSavedAt = moat_get_timestamp_msec();
+  TRACE_LEAVE();
+  return SSE_E_OK;
+}
+
+/*
+ * The job is over, whether it has succeeded or not.
+ */
+void
+TUpdateJournal_End(TUpdateJournal *self)
+{
+  TRACE_ENTER();
+  if (self->fRecord != NULL) {
+    moat_object_free(self->fRecord);
+    self->fRecord = NULL;
+    moat_datastore_remove_object(self->fMoat, UPDATE_JOURNAL_STORED_KEY);
+  }
+  self->fDirty = sse_false;
+  TRACE_LEAVE();
+}
+
+sse_bool
+TUpdateJournal_IsActive(TUpdateJournal *self)
+{
+  return (self->fRecord != NULL) ? sse_true : sse_false;
+}
+
+sse_int
+TUpdateJournal_SetStage(TUpdateJournal *self, sse_int in_stage)
+{
+  sse_int err;
+
+  if (self->fRecord == NULL) {
+    return SSE_E_INVAL;
+  }
+  err = moat_object_add_int32_value(self->fRecord, UPDATE_JOURNAL_FIELD_STAGE, in_stage, sse_true);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  LOG_DEBUG("stage=%d", in_stage);
+  return TUpdateJournal_Save(self);
+}
+
+void
+TUpdateJournal_SetOffset(TUpdateJournal *self, sse_int64 in_offset)
+{
+  if (self->fRecord == NULL || TUpdateJournal_GetInt64(self, UPDATE_JOURNAL_FIELD_OFFSET) == in_offset) {
+    return;
+  }
+  if (moat_object_add_int64_value(self->fRecord, UPDATE_JOURNAL_FIELD_OFFSET, in_offset, sse_true) != SSE_E_OK) {
+    return;
+  }
+  self->fDirty = sse_true;
+  if (moat_get_timestamp_msec() - self->fSavedAt >= UPDATE_JOURNAL_FLUSH_INTERVAL_MSEC) {
+    TUpdateJournal_Save(self);
+  }
+}
+
+sse_int
+TUpdateJournal_Flush(TUpdateJournal *self)
+{
+  if (self->fRecord == NULL || !self->fDirty) {
+    return SSE_E_OK;
+  }
+  return TUpdateJournal_Save(self);
+}
+
+/*
+ * Counts one more resumption of the recorded job and tells how many there
+ * have been, so that a job which keeps crashing the process can be given up.
+ */
+sse_int
+TUpdateJournal_CountResume(TUpdateJournal *self)
+{
+  sse_int32 resumes;
+
+  if (self->fRecord == NULL) {
+    return 0;
+  }
+  resumes = TUpdateJournal_GetInt32(self, UPDATE_JOURNAL_FIELD_RESUMES) + 1;
+  moat_object_add_int32_value(self->fRecord, UPDATE_JOURNAL_FIELD_RESUMES, resumes, sse_true);
+  TUpdateJournal_Save(self);
+  return resumes;
+}
+
+sse_int
+TUpdateJournal_GetStage(TUpdateJournal *self)
+{
+  return TUpdateJournal_GetInt32(self, UPDATE_JOURNAL_FIELD_STAGE);
+}
+
+sse_int
+TUpdateJournal_GetCommand(TUpdateJournal *self)
+{
+  return TUpdateJournal_GetInt32(self, UPDATE_JOURNAL_FIELD_COMMAND);
+}
+
+sse_int64
+TUpdateJournal_GetRunAt(TUpdateJournal *self)
+{
+  return TUpdateJournal_GetInt64(self, UPDATE_JOURNAL_FIELD_RUN_AT);
+}
+
+sse_int64
+TUpdateJournal_GetOffset(TUpdateJournal *self)
+{
+  return TUpdateJournal_GetInt64(self, UPDATE_JOURNAL_FIELD_OFFSET);
+}
+
+sse_char *
+TUpdateJournal_CopyKey(TUpdateJournal *self)
+{
+  sse_char *p;
+  sse_uint len;
+
+  if (self->fRecord == NULL ||
+      moat_object_get_string_value(self->fRecord, UPDATE_JOURNAL_FIELD_ASYNC_KEY, &p, &len) != SSE_E_OK) {
+    return NULL;
+  }
+  return sse_strndup(p, len);
+}
+
+/*
+ * DownloadInfo of the recorded job, without the fields of the journal.
+ */
+MoatObject *
+TUpdateJournal_CopyInfo(TUpdateJournal *self)
+{
+  MoatObject *info;
+
+  if (self->fRecord == NULL) {
+    return NULL;
+  }
+  info = moat_object_clone(self->fRecord);
+  if (info == NULL) {
+    LOG_ERROR("failed to moat_object_clone().");
+    return NULL;
+  }
+  moat_object_remove_value(info, UPDATE_JOURNAL_FIELD_ASYNC_KEY);
+  moat_object_remove_value(info, UPDATE_JOURNAL_FIELD_COMMAND);
+  moat_object_remove_value(info, UPDATE_JOURNAL_FIELD_RUN_AT);
+  moat_object_remove_value(info, UPDATE_JOURNAL_FIELD_STAGE);
+  moat_object_remove_value(info, UPDATE_JOURNAL_FIELD_OFFSET);
+  moat_object_remove_value(info, UPDATE_JOURNAL_FIELD_RESUMES);
+  return info;
+}
+
+TUpdateJournal *
+UpdateJournal_New(Moat in_moat)
+{
+  TUpdateJournal *journal;
+
+  TRACE_ENTER();
+  journal = sse_zeroalloc(sizeof(TUpdateJournal));
+  if (journal == NULL) {
+    LOG_ERROR("failed to sse_zeroalloc().");
+    return NULL;
+  }
+  journal->fMoat = in_moat;
+  TRACE_LEAVE();
+  return journal;
+}
+
+void
+TUpdateJournal_Delete(TUpdateJournal *self)
+{
+  TRACE_ENTER();
+  TUpdateJournal_Flush(self);
+  if (self->fRecord != NULL) {
+    moat_object_free(self->fRecord);
+  }
+  sse_free(self);
+  TRACE_LEAVE();
+}
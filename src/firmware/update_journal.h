@@ -0,0 +1,71 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#ifndef __UPDATE_JOURNAL__
+#define __UPDATE_JOURNAL__
+
+#include <sseutils.h>
+
+SSE_BEGIN_C_DECLS
+
+#define UPDATE_JOURNAL_STAGE_QUEUED  (0)
+#define UPDATE_JOURNAL_STAGE_DOWNLOADING  (1)
+#define UPDATE_JOURNAL_STAGE_DOWNLOADED  (2)
+#define UPDATE_JOURNAL_STAGE_EXTRACTED  (3)
+#define UPDATE_JOURNAL_STAGE_VERIFIED  (4)
+#define UPDATE_JOURNAL_STAGE_APPLYING  (5)
+#define UPDATE_JOURNAL_STAGE_CHECKING  (6)
+
+#define UPDATE_JOURNAL_FLUSH_INTERVAL_MSEC  (10 * 1000)
+
+typedef struct TUpdateJournal_ TUpdateJournal;
+
+/*
+ * Durable record of the job in progress: the DownloadInfo it works on, its
+ * async key and command, the time it is due and the last stage it has
+ * reached. The record is a single datastore object which is replaced as a
+ * whole. A stage change is saved at once; the byte offset of a download is
+ * only saved along with the next stage change or once the flush interval
+ * has passed, so that a fast transfer does not rewrite the record for every
+ * chunk.
+ */
+struct TUpdateJournal_ {
+  Moat fMoat;
+  MoatObject *fRecord;
+  sse_bool fDirty;
+  sse_uint64 fSavedAt;
+};
+
+TUpdateJournal * UpdateJournal_New(Moat in_moat);
+void TUpdateJournal_Delete(TUpdateJournal *self);
+sse_int TUpdateJournal_Begin(TUpdateJournal *self, MoatObject *in_info, sse_char *in_key, sse_int in_command, sse_int64 in_run_at);
+sse_int TUpdateJournal_Load(TUpdateJournal *self);
+void TUpdateJournal_End(TUpdateJournal *self);
+sse_bool TUpdateJournal_IsActive(TUpdateJournal *self);
+sse_int TUpdateJournal_SetStage(TUpdateJournal *self, sse_int in_stage);
+void TUpdateJournal_SetOffset(TUpdateJournal *self, sse_int64 in_offset);
+sse_int TUpdateJournal_Flush(TUpdateJournal *self);
+sse_int TUpdateJournal_CountResume(TUpdateJournal *self);
+sse_int TUpdateJournal_GetStage(TUpdateJournal *self);
+sse_int TUpdateJournal_GetCommand(TUpdateJournal *self);
+sse_int64 TUpdateJournal_GetRunAt(TUpdateJournal *self);
+sse_int64 TUpdateJournal_GetOffset(TUpdateJournal *self);
+sse_char * TUpdateJournal_CopyKey(TUpdateJournal *self);
+MoatObject * TUpdateJournal_CopyInfo(TUpdateJournal *self);
+
+SSE_END_C_DECLS
+
+#endif /* __UPDATE_JOURNAL__ */
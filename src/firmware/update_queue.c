@@ -0,0 +1,316 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#include <servicesync/moat.h>
+#include "download_info_model.h"
+#include "update_queue.h"
+
+#define TAG "UpdateQueue"
+
+#define TRACE_ENTER() MOAT_LOG_TRACE(TAG, "== enter =>");
+#define TRACE_LEAVE() MOAT_LOG_TRACE(TAG, "<= leave ==");
+#define LOG_ERROR(format, ...)  MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...)  MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+
+#define UPDATE_QUEUE_STORED_KEY  "FirmwareUpdateQueue"
+#define UPDATE_QUEUE_FIELD_COMMAND  "@command"
+#define UPDATE_QUEUE_FIELD_PRIORITY  "@priority"
+#define UPDATE_QUEUE_FIELD_SEQUENCE  "@sequence"
+
+/* UpdateQueue private */
+
+static sse_bool
+UpdateQueue_IsSameValue(MoatObject *in_info1, MoatObject *in_info2, sse_char *in_field)
+{
+  sse_char *p1;
+  sse_char *p2;
+  sse_uint len1;
+  sse_uint len2;
+  sse_bool has1;
+  sse_bool has2;
+
+  has1 = (in_info1 != NULL && moat_object_get_string_value(in_info1, in_field, &p1, &len1) == SSE_E_OK) ? sse_true : sse_false;
+  has2 = (in_info2 != NULL && moat_object_get_string_value(in_info2, in_field, &p2, &len2) == SSE_E_OK) ? sse_true : sse_false;
+  if (!has1 || !has2) {
+    return (has1 == has2) ? sse_true : sse_false;
+  }
+  return (len1 == len2 && sse_strncmp(p1, p2, len1) == 0) ? sse_true : sse_false;
+}
+
+static void
+UpdateQueue_FreeJob(TUpdateJob *in_job)
+{
+  if (in_job->fInfo != NULL) {
+    moat_object_free(in_job->fInfo);
+  }
+  if (in_job->fKey != NULL) {
+    sse_free(in_job->fKey);
+  }
+  sse_memset(in_job, 0, sizeof(TUpdateJob));
+}
+
+/*
+ * Puts a job where it belongs by priority and sequence.
+ */
+static void
+TUpdateQueue_Sort(TUpdateQueue *self, sse_uint in_index)
+{
+  TUpdateJob job;
+  sse_uint i = in_index;
+
+  job = self->fJobs[i];
+  while (i > 0 && (self->fJobs[i - 1].fPriority < job.fPriority ||
+      (self->fJobs[i - 1].fPriority == job.fPriority && self->fJobs[i - 1].fSequence > job.fSequence))) {
+    self->fJobs[i] = self->fJobs[i - 1];
+    i--;
+  }
+  self->fJobs[i] = job;
+}
+
+static sse_int
+TUpdateQueue_Insert(TUpdateQueue *self, MoatObject *in_info, sse_char *in_key, sse_int in_command, sse_int32 in_priority, sse_int64 in_sequence)
+{
+  TUpdateJob *job;
+
+  if (self->fCount == UPDATE_QUEUE_MAX_JOBS) {
+    LOG_ERROR("queue is full.");
+    return SSE_E_AGAIN;
+  }
+  job = &self->fJobs[self->fCount];
+  job->fInfo = (in_info != NULL) ? moat_object_clone(in_info) : moat_object_new();
+  job->fKey = sse_strdup(in_key);
+  if (job->fInfo == NULL || job->fKey == NULL) {
+    LOG_ERROR("failed to allocate job.");
+    UpdateQueue_FreeJob(job);
+    return SSE_E_NOMEM;
+  }
+  moat_object_remove_value(job->fInfo, UPDATE_QUEUE_FIELD_COMMAND);
+  moat_object_remove_value(job->fInfo, UPDATE_QUEUE_FIELD_PRIORITY);
+  moat_object_remove_value(job->fInfo, UPDATE_QUEUE_FIELD_SEQUENCE);
+  job->fCommand = in_command;
+  job->fPriority = in_priority;
+  job->fSequence = in_sequence;
+  if (in_sequence >= self->fSequence) {
+    self->fSequence = in_sequence + 1;
+  }
+  self->fCount++;
+  TUpdateQueue_Sort(self, self->fCount - 1);
+  return SSE_E_OK;
+}
+
+static sse_int
+TUpdateQueue_Save(TUpdateQueue *self)
+{
+  MoatObject *queue = NULL;
+  MoatObject *entry = NULL;
+  sse_uint i;
+  sse_int err = SSE_E_NOMEM;
+
+  if (self->fCount == 0) {
+    moat_datastore_remove_object(self->fMoat, UPDATE_QUEUE_STORED_KEY);
+    return SSE_E_OK;
+  }
+  queue = moat_object_new();
+  if (queue == NULL) {
+    LOG_ERROR("failed to moat_object_new().");
+    return SSE_E_NOMEM;
+  }
+  for (i = 0; i < self->fCount; i++) {
+    entry = moat_object_clone(self->fJobs[i].fInfo);
+    if (entry == NULL) {
+      goto error_exit;
+    }
+    err = moat_object_add_int32_value(entry, UPDATE_QUEUE_FIELD_COMMAND, self->fJobs[i].fCommand, sse_true);
+    if (err == SSE_E_OK) {
+      err = moat_object_add_int32_value(entry, UPDATE_QUEUE_FIELD_PRIORITY, self->fJobs[i].fPriority, sse_true);
+    }
+    if (err == SSE_E_OK) {
+      err = moat_object_add_int64_value(entry, UPDATE_QUEUE_FIELD_SEQUENCE, self->fJobs[i].fSequence, sse_true);
+    }
+    if (err == SSE_E_OK) {
+      err = moat_object_add_object_value(queue, self->fJobs[i].fKey, entry, sse_true, sse_true);
+    }
+    if (err != SSE_E_OK) {
+      goto error_exit;
+    }
+    moat_object_free(entry);
+    entry = NULL;
+  }
+  err = moat_datastore_save_object(self->fMoat, UPDATE_QUEUE_STORED_KEY, queue);
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to moat_datastore_save_object(). err=%s", sse_get_error_string(err));
+  }
+  moat_object_free(queue);
+  return err;
+
+error_exit:
+  LOG_ERROR("failed to build queue. err=%s", sse_get_error_string(err));
+  if (entry != NULL) {
+    moat_object_free(entry);
+  }
+  moat_object_free(queue);
+  return err;
+}
+
+/* UpdateQueue public */
+
+/*
+ * Tells whether two DownloadInfo objects ask for the same package, i.e. the
+ * same URL and the same digest.
+ */
+sse_bool
+UpdateQueue_IsSamePackage(MoatObject *in_info1, MoatObject *in_info2)
+{
+  return (UpdateQueue_IsSameValue(in_info1, in_info2, DOWNLOAD_INFO_MODEL_FIELD_URL) &&
+      UpdateQueue_IsSameValue(in_info1, in_info2, DOWNLOAD_INFO_MODEL_FIELD_SHA256)) ? sse_true : sse_false;
+}
+
+void
+TUpdateQueue_Load(TUpdateQueue *self)
+{
+  MoatObject *queue = NULL;
+  MoatObject *entry;
+  MoatObjectIterator *it = NULL;
+  sse_char *key;
+  sse_int32 command;
+  sse_int32 priority;
+  sse_int64 sequence;
+
+  TRACE_ENTER();
+  if (moat_datastore_load_object(self->fMoat, UPDATE_QUEUE_STORED_KEY, &queue) != SSE_E_OK) {
+    return;
+  }
+  it = moat_object_create_iterator(queue);
+  while (it != NULL && moat_object_iterator_has_next(it)) {
+    key = moat_object_iterator_get_next_key(it);
+    if (key == NULL ||
+        moat_object_get_object_value(queue, key, &entry) != SSE_E_OK ||
+        moat_object_get_int32_value(entry, UPDATE_QUEUE_FIELD_COMMAND, &command) != SSE_E_OK ||
+        moat_object_get_int32_value(entry, UPDATE_QUEUE_FIELD_PRIORITY, &priority) != SSE_E_OK ||
+        moat_object_get_int64_value(entry, UPDATE_QUEUE_FIELD_SEQUENCE, &sequence) != SSE_E_OK) {
+      LOG_ERROR("invalid job is dropped.");
+      continue;
+    }
+    if (TUpdateQueue_Insert(self, entry, key, command, priority, sequence) != SSE_E_OK) {
+      break;
+    }
+  }
+  if (it != NULL) {
+    moat_object_iterator_free(it);
+  }
+  moat_object_free(queue);
+  LOG_DEBUG("%u jobs in queue.", self->fCount);
+  TRACE_LEAVE();
+}
+
+/*
+ * Queues a job. A job for the same package with the same command already
+ * in the queue makes this one SSE_E_ALREADY.
+ */
+sse_int
+TUpdateQueue_Push(TUpdateQueue *self, MoatObject *in_info, sse_char *in_key, sse_int in_command, sse_int32 in_priority)
+{
+  sse_uint i;
+  sse_int err;
+
+  TRACE_ENTER();
+  for (i = 0; i < self->fCount; i++) {
+    if (self->fJobs[i].fCommand == in_command && UpdateQueue_IsSamePackage(self->fJobs[i].fInfo, in_info)) {
+      LOG_INFO("same job is in queue. key=%s", self->fJobs[i].fKey);
+      if (self->fJobs[i].fPriority < in_priority) {
+        self->fJobs[i].fPriority = in_priority;
+        TUpdateQueue_Sort(self, i);
+        TUpdateQueue_Save(self);
+      }
+      return SSE_E_ALREADY;
+    }
+  }
+  err = TUpdateQueue_Insert(self, in_info, in_key, in_command, in_priority, self->fSequence);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  LOG_INFO("job is queued. key=%s, priority=%d, jobs=%u", in_key, in_priority, self->fCount);
+  TUpdateQueue_Save(self);
+  TRACE_LEAVE();
+  return SSE_E_OK;
+}
+
+TUpdateJob *
+TUpdateQueue_Peek(TUpdateQueue *self)
+{
+  return (self->fCount > 0) ? &self->fJobs[0] : NULL;
+}
+
+/*
+ * Takes the first job out of the queue. The caller owns its DownloadInfo
+ * and key afterwards.
+ */
+void
+TUpdateQueue_Pop(TUpdateQueue *self, MoatObject **out_info, sse_char **out_key, sse_int *out_command)
+{
+  sse_uint i;
+
+  if (self->fCount == 0) {
+    *out_info = NULL;
+    *out_key = NULL;
+    return;
+  }
+  *out_info = self->fJobs[0].fInfo;
+  *out_key = self->fJobs[0].fKey;
+  *out_command = self->fJobs[0].fCommand;
+  self->fCount--;
+  for (i = 0; i < self->fCount; i++) {
+    self->fJobs[i] = self->fJobs[i + 1];
+  }
+  sse_memset(&self->fJobs[self->fCount], 0, sizeof(TUpdateJob));
+  TUpdateQueue_Save(self);
+}
+
+sse_bool
+TUpdateQueue_IsEmpty(TUpdateQueue *self)
+{
+  return (self->fCount == 0) ? sse_true : sse_false;
+}
+
+TUpdateQueue *
+UpdateQueue_New(Moat in_moat)
+{
+  TUpdateQueue *queue;
+
+  TRACE_ENTER();
+  queue = sse_zeroalloc(sizeof(TUpdateQueue));
+  if (queue == NULL) {
+    LOG_ERROR("failed to sse_zeroalloc().");
+    return NULL;
+  }
+  queue->fMoat = in_moat;
+  TRACE_LEAVE();
+  return queue;
+}
+
+void
+TUpdateQueue_Delete(TUpdateQueue *self)
+{
+  sse_uint i;
+
+  TRACE_ENTER();
+  for (i = 0; i < self->fCount; i++) {
+    UpdateQueue_FreeJob(&self->fJobs[i]);
+  }
+  sse_free(self);
+  TRACE_LEAVE();
+}
@@ -0,0 +1,62 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#ifndef __UPDATE_QUEUE__
+#define __UPDATE_QUEUE__
+
+#include <sseutils.h>
+
+SSE_BEGIN_C_DECLS
+
+#define UPDATE_QUEUE_MAX_JOBS  (8)
+
+typedef struct TUpdateJob_ TUpdateJob;
+typedef struct TUpdateQueue_ TUpdateQueue;
+
+struct TUpdateJob_ {
+  MoatObject *fInfo;
+  sse_char *fKey;
+  sse_int fCommand;
+  sse_int32 fPriority;
+  sse_int64 fSequence;
+};
+
+/*
+ * Jobs which have been accepted while another job was running. A job with
+ * a higher priority goes first, jobs of the same priority in the order of
+ * arrival. A request for a package which already is waiting with the same
+ * command is refused and lends its priority to the waiting job instead.
+ * The queue is kept in the datastore.
+ */
+struct TUpdateQueue_ {
+  Moat fMoat;
+  TUpdateJob fJobs[UPDATE_QUEUE_MAX_JOBS];
+  sse_uint fCount;
+  sse_int64 fSequence;
+};
+
+TUpdateQueue * UpdateQueue_New(Moat in_moat);
+void TUpdateQueue_Delete(TUpdateQueue *self);
+void TUpdateQueue_Load(TUpdateQueue *self);
+sse_int TUpdateQueue_Push(TUpdateQueue *self, MoatObject *in_info, sse_char *in_key, sse_int in_command, sse_int32 in_priority);
+TUpdateJob * TUpdateQueue_Peek(TUpdateQueue *self);
+void TUpdateQueue_Pop(TUpdateQueue *self, MoatObject **out_info, sse_char **out_key, sse_int *out_command);
+sse_bool TUpdateQueue_IsEmpty(TUpdateQueue *self);
+sse_bool UpdateQueue_IsSamePackage(MoatObject *in_info1, MoatObject *in_info2);
+
+SSE_END_C_DECLS
+
+#endif /* __UPDATE_QUEUE__ */
@@ -0,0 +1,539 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <servicesync/moat.h>
+#include "worker_process.h"
+
+#define TAG "WorkerProcess"
+
+#define TRACE_ENTER() MOAT_LOG_TRACE(TAG, "== enter =>");
+#define TRACE_LEAVE() MOAT_LOG_TRACE(TAG, "<= leave ==");
+#define LOG_ERROR(format, ...)  MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...)  MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+
+#define WORKER_PROCESS_SHELL  "/bin/sh"
+#define WORKER_PROCESS_REAP_INTERVAL_SEC  (1)
+#define WORKER_PROCESS_READ_SIZE  (4096)
+
+/* WorkerProcess private */
+
+static void
+TWorkerProcess_Cleanup(TWorkerProcess *self)
+{
+  if (self->fWatcher != NULL) {
+    moat_io_watcher_stop(self->fWatcher);
+    moat_io_watcher_free(self->fWatcher);
+    self->fWatcher = NULL;
+  }
+  if (self->fPipeFd >= 0) {
+    close(self->fPipeFd);
+    self->fPipeFd = -1;
+  }
+  if (self->fReaper != NULL) {
+    moat_periodic_stop(self->fReaper);
+    moat_periodic_free(self->fReaper);
+    self->fReaper = NULL;
+  }
+}
+
+/*
+ * Reaps the child. Returns SSE_E_INTR when it has been killed by a signal and
+ * SSE_E_GENERIC when it could not be reaped.
+ */
+static sse_int
+WorkerProcess_Wait(pid_t in_pid)
+{
+  int status;
+
+  while (waitpid(in_pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      LOG_ERROR("failed to waitpid(%d). err=[%s]", (int)in_pid, strerror(errno));
+      return SSE_E_GENERIC;
+    }
+  }
+  if (WIFSIGNALED(status)) {
+    LOG_ERROR("worker %d was killed by signal %d.", (int)in_pid, WTERMSIG(status));
+    return SSE_E_INTR;
+  }
+  return SSE_E_OK;
+}
+
+static void
+WorkerProcess_OnResult(MoatIOWatcher *in_watcher, sse_pointer in_user_data, sse_int in_desc, sse_int in_event_flags)
+{
+  TWorkerProcess *self = (TWorkerProcess *)in_user_data;
+  sse_int result;
+  sse_int err;
+  ssize_t n;
+
+  TRACE_ENTER();
+  n = read(self->fPipeFd, self->fResult + self->fResultLen, sizeof(self->fResult) - self->fResultLen);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+    return;
+  }
+  if (n > 0) {
+    self->fResultLen += n;
+    if (self->fResultLen < sizeof(self->fResult)) {
+      return;
+    }
+  }
+  /* the result has been reported, or the child has gone without it */
+  TWorkerProcess_Cleanup(self);
+  err = WorkerProcess_Wait(self->fPid);
+  /* a child which could not be reaped has still reported its result */
+  if (self->fTimedOut) {
+    result = SSE_E_TIMEDOUT;
+  } else if (err != SSE_E_INTR && self->fResultLen == sizeof(self->fResult)) {
+    sse_memcpy(&result, self->fResult, sizeof(result));
+  } else {
+    LOG_ERROR("worker %d exited without result.", (int)self->fPid);
+    result = SSE_E_GENERIC;
+  }
+  LOG_DEBUG("worker %d completed. result=%s", (int)self->fPid, sse_get_error_string(result));
+  self->fPid = -1;
+  if (self->fCallback != NULL) {
+    (*self->fCallback)(self, result, self->fUserData);
+  }
+  TRACE_LEAVE();
+}
+
+static void
+WorkerProcess_RunChild(int in_fd, WorkerProcess_Proc in_proc, sse_pointer in_proc_data)
+{
+  sse_int result;
+  const sse_byte *p = (const sse_byte *)&result;
+  sse_size len = sizeof(result);
+  ssize_t n;
+
+  result = (*in_proc)(in_proc_data);
+  while (len > 0) {
+    n = write(in_fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    p += n;
+    len -= n;
+  }
+  /* never return into the event loop of the parent */
+  _exit(0);
+}
+
+static void
+TWorkerProcess_FlushLine(TWorkerProcess *self)
+{
+  if (self->fLineLen == 0) {
+    return;
+  }
+  self->fLine[self->fLineLen] = '\0';
+  if (self->fOutputCallback != NULL) {
+    (*self->fOutputCallback)(self, self->fLine, self->fLineLen, self->fOutputUserData);
+  } else {
+    LOG_INFO("[%d] %s", (int)self->fPid, self->fLine);
+  }
+  self->fLineLen = 0;
+}
+
+/*
+ * Reads what the command has written so far. Returns sse_false once the
+ * output has been closed.
+ */
+static sse_bool
+TWorkerProcess_ReadOutput(TWorkerProcess *self)
+{
+  sse_char buf[WORKER_PROCESS_READ_SIZE];
+  ssize_t n;
+  ssize_t i;
+
+  if (self->fPipeFd < 0) {
+    return sse_false;
+  }
+  for (;;) {
+    n = read(self->fPipeFd, buf, sizeof(buf));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return sse_true;
+      }
+      LOG_ERROR("failed to read(). err=[%s]", strerror(errno));
+      n = 0;
+    }
+    if (n == 0) {
+      TWorkerProcess_FlushLine(self);
+      return sse_false;
+    }
+    for (i = 0; i < n; i++) {
+      if (buf[i] == '\n') {
+        TWorkerProcess_FlushLine(self);
+        continue;
+      }
+      if (buf[i] == '\r') {
+        continue;
+      }
+      self->fLine[self->fLineLen++] = buf[i];
+      if (self->fLineLen == WORKER_PROCESS_LINE_SIZE) {
+        TWorkerProcess_FlushLine(self);
+      }
+    }
+  }
+}
+
+static void
+TWorkerProcess_CompleteCommand(TWorkerProcess *self, int in_status)
+{
+  sse_int result;
+
+  TWorkerProcess_ReadOutput(self);
+  TWorkerProcess_FlushLine(self);
+  TWorkerProcess_Cleanup(self);
+  if (self->fTimedOut) {
+    result = SSE_E_TIMEDOUT;
+  } else if (WIFEXITED(in_status) && WEXITSTATUS(in_status) == 0) {
+    result = SSE_E_OK;
+  } else {
+    if (WIFEXITED(in_status)) {
+      LOG_ERROR("command %d exited with %d.", (int)self->fPid, WEXITSTATUS(in_status));
+    } else if (WIFSIGNALED(in_status)) {
+      LOG_ERROR("command %d was killed by signal %d.", (int)self->fPid, WTERMSIG(in_status));
+    }
+    result = SSE_E_GENERIC;
+  }
+  LOG_DEBUG("command %d completed. result=%s", (int)self->fPid, sse_get_error_string(result));
+  self->fPid = -1;
+  if (self->fCallback != NULL) {
+    (*self->fCallback)(self, result, self->fUserData);
+  }
+}
+
+static sse_bool
+TWorkerProcess_Reap(TWorkerProcess *self)
+{
+  int status;
+  pid_t pid;
+
+  pid = waitpid(self->fPid, &status, WNOHANG);
+  if (pid == 0 || (pid < 0 && errno == EINTR)) {
+    return sse_false;
+  }
+  if (pid < 0) {
+    LOG_ERROR("failed to waitpid(%d). err=[%s]", (int)self->fPid, strerror(errno));
+    status = -1;
+  }
+  TWorkerProcess_CompleteCommand(self, status);
+  return sse_true;
+}
+
+static void
+WorkerProcess_OnOutput(MoatIOWatcher *in_watcher, sse_pointer in_user_data, sse_int in_desc, sse_int in_event_flags)
+{
+  TWorkerProcess *self = (TWorkerProcess *)in_user_data;
+
+  if (TWorkerProcess_ReadOutput(self)) {
+    return;
+  }
+  /* the command has closed its output, which usually means it has exited */
+  if (TWorkerProcess_Reap(self)) {
+    return;
+  }
+  moat_io_watcher_stop(self->fWatcher);
+  moat_io_watcher_free(self->fWatcher);
+  self->fWatcher = NULL;
+  close(self->fPipeFd);
+  self->fPipeFd = -1;
+}
+
+static void
+WorkerProcess_OnReap(MoatPeriodic *in_periodic, sse_pointer in_user_data)
+{
+  TWorkerProcess *self = (TWorkerProcess *)in_user_data;
+
+  if (TWorkerProcess_Reap(self)) {
+    return;
+  }
+  if (self->fDeadline > 0 && !self->fTimedOut && moat_get_timestamp_msec() >= self->fDeadline) {
+    LOG_ERROR("command %d has timed out.", (int)self->fPid);
+    self->fTimedOut = sse_true;
+    kill(-self->fPid, SIGKILL);
+  }
+}
+
+/*
+ * Kills a worker which has run out of time. The completion follows when the
+ * result pipe is closed.
+ */
+static void
+WorkerProcess_OnDeadline(MoatPeriodic *in_periodic, sse_pointer in_user_data)
+{
+  TWorkerProcess *self = (TWorkerProcess *)in_user_data;
+
+  if (!self->fTimedOut && moat_get_timestamp_msec() >= self->fDeadline) {
+    LOG_ERROR("worker %d has timed out.", (int)self->fPid);
+    self->fTimedOut = sse_true;
+    kill(-self->fPid, SIGKILL);
+  }
+}
+
+static void
+WorkerProcess_ExecChild(int in_fd, sse_char *in_command)
+{
+  int null_fd;
+
+  /* a process group of its own, so that a timeout kills the whole command */
+  setpgid(0, 0);
+  null_fd = open("/dev/null", O_RDONLY);
+  if (null_fd >= 0) {
+    dup2(null_fd, STDIN_FILENO);
+    close(null_fd);
+  }
+  dup2(in_fd, STDOUT_FILENO);
+  dup2(in_fd, STDERR_FILENO);
+  close(in_fd);
+  execl(WORKER_PROCESS_SHELL, "sh", "-c", in_command, (char *)NULL);
+  _exit(127);
+}
+
+/* WorkerProcess public */
+
+sse_bool
+TWorkerProcess_IsRunning(TWorkerProcess *self)
+{
+  return (self->fPid > 0) ? sse_true : sse_false;
+}
+
+/*
+ * Forks a child which runs in_proc(in_proc_data) and calls in_callback with
+ * the returned error code once the child has exited. A child still running
+ * after in_timeout_sec (0 for no limit) is killed together with the commands
+ * it has started, and completes with SSE_E_TIMEDOUT.
+ */
+sse_int
+TWorkerProcess_Start(TWorkerProcess *self, WorkerProcess_Proc in_proc, sse_pointer in_proc_data, sse_uint in_timeout_sec, WorkerProcess_CompletionCallback in_callback, sse_pointer in_user_data)
+{
+  int fds[2] = { -1, -1 };
+  pid_t pid;
+  sse_int err;
+
+  TRACE_ENTER();
+  if (TWorkerProcess_IsRunning(self)) {
+    LOG_ERROR("worker %d is running.", (int)self->fPid);
+    return SSE_E_ALREADY;
+  }
+  if (pipe(fds) != 0) {
+    LOG_ERROR("failed to pipe(). err=[%s]", strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  self->fWatcher = moat_io_watcher_new(fds[0], WorkerProcess_OnResult, self, MOAT_IO_FLAG_READ);
+  if (in_timeout_sec > 0) {
+    self->fReaper = moat_periodic_new(WorkerProcess_OnDeadline, self, WORKER_PROCESS_REAP_INTERVAL_SEC);
+  }
+  if (self->fWatcher == NULL || (in_timeout_sec > 0 && self->fReaper == NULL)) {
+    LOG_ERROR("failed to create watchers.");
+    err = SSE_E_NOMEM;
+    goto error_exit;
+  }
+  pid = fork();
+  if (pid < 0) {
+    LOG_ERROR("failed to fork(). err=[%s]", strerror(errno));
+    err = SSE_E_GENERIC;
+    goto error_exit;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    /* a process group of its own, so that a timeout kills what it has started too */
+    setpgid(0, 0);
+    WorkerProcess_RunChild(fds[1], in_proc, in_proc_data);
+  }
+  setpgid(pid, pid);
+  close(fds[1]);
+  fds[1] = -1;
+  self->fPid = pid;
+  self->fPipeFd = fds[0];
+  self->fResultLen = 0;
+  self->fTimedOut = sse_false;
+  self->fDeadline = (in_timeout_sec > 0) ? moat_get_timestamp_msec() + (sse_uint64)in_timeout_sec * 1000 : 0;
+  self->fCallback = in_callback;
+  self->fUserData = in_user_data;
+  err = moat_io_watcher_start(self->fWatcher);
+  if (err == SSE_E_OK && self->fReaper != NULL) {
+    err = moat_periodic_start(self->fReaper);
+  }
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to start watchers. err=%s", sse_get_error_string(err));
+    TWorkerProcess_Cancel(self);
+    return err;
+  }
+  LOG_DEBUG("worker %d has been started.", (int)pid);
+  TRACE_LEAVE();
+  return SSE_E_OK;
+
+error_exit:
+  if (self->fWatcher != NULL) {
+    moat_io_watcher_free(self->fWatcher);
+    self->fWatcher = NULL;
+  }
+  if (self->fReaper != NULL) {
+    moat_periodic_free(self->fReaper);
+    self->fReaper = NULL;
+  }
+  close(fds[0]);
+  if (fds[1] >= 0) {
+    close(fds[1]);
+  }
+  return err;
+}
+
+/*
+ * Executes in_command with the shell in a child process and calls
+ * in_callback once the command has exited. in_timeout_sec == 0 means that
+ * the command may run as long as it takes.
+ */
+sse_int
+TWorkerProcess_Execute(TWorkerProcess *self, sse_char *in_command, sse_uint in_timeout_sec, WorkerProcess_CompletionCallback in_callback, sse_pointer in_user_data)
+{
+  int fds[2] = { -1, -1 };
+  pid_t pid;
+  sse_int err;
+
+  TRACE_ENTER();
+  if (TWorkerProcess_IsRunning(self)) {
+    LOG_ERROR("worker %d is running.", (int)self->fPid);
+    return SSE_E_ALREADY;
+  }
+  if (pipe(fds) != 0) {
+    LOG_ERROR("failed to pipe(). err=[%s]", strerror(errno));
+    return SSE_E_GENERIC;
+  }
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  self->fWatcher = moat_io_watcher_new(fds[0], WorkerProcess_OnOutput, self, MOAT_IO_FLAG_READ);
+  self->fReaper = moat_periodic_new(WorkerProcess_OnReap, self, WORKER_PROCESS_REAP_INTERVAL_SEC);
+  if (self->fWatcher == NULL || self->fReaper == NULL) {
+    LOG_ERROR("failed to create watchers.");
+    err = SSE_E_NOMEM;
+    goto error_exit;
+  }
+  pid = fork();
+  if (pid < 0) {
+    LOG_ERROR("failed to fork(). err=[%s]", strerror(errno));
+    err = SSE_E_GENERIC;
+    goto error_exit;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    WorkerProcess_ExecChild(fds[1], in_command);
+  }
+  setpgid(pid, pid);
+  close(fds[1]);
+  self->fPid = pid;
+  self->fPipeFd = fds[0];
+  self->fLineLen = 0;
+  self->fTimedOut = sse_false;
+  self->fDeadline = (in_timeout_sec > 0) ? moat_get_timestamp_msec() + (sse_uint64)in_timeout_sec * 1000 : 0;
+  self->fCallback = in_callback;
+  self->fUserData = in_user_data;
+  err = moat_io_watcher_start(self->fWatcher);
+  if (err == SSE_E_OK) {
+    err = moat_periodic_start(self->fReaper);
+  }
+  if (err != SSE_E_OK) {
+    LOG_ERROR("failed to start watchers. err=%s", sse_get_error_string(err));
+    TWorkerProcess_Cancel(self);
+    return err;
+  }
+  LOG_DEBUG("command %d has been started. [%s]", (int)pid, in_command);
+  TRACE_LEAVE();
+  return SSE_E_OK;
+
+error_exit:
+  if (self->fWatcher != NULL) {
+    moat_io_watcher_free(self->fWatcher);
+    self->fWatcher = NULL;
+  }
+  if (self->fReaper != NULL) {
+    moat_periodic_free(self->fReaper);
+    self->fReaper = NULL;
+  }
+  close(fds[0]);
+  close(fds[1]);
+  return err;
+}
+
+void
+TWorkerProcess_SetOutputCallback(TWorkerProcess *self, WorkerProcess_OutputCallback in_callback, sse_pointer in_user_data)
+{
+  self->fOutputCallback = in_callback;
+  self->fOutputUserData = in_user_data;
+}
+
+/*
+ * Kills the running child and reaps it. The completion callback is not called.
+ */
+void
+TWorkerProcess_Cancel(TWorkerProcess *self)
+{
+  TRACE_ENTER();
+  TWorkerProcess_Cleanup(self);
+  if (self->fPid > 0) {
+    /* a command leads a process group of its own */
+    if (kill(-self->fPid, SIGKILL) != 0) {
+      kill(self->fPid, SIGKILL);
+    }
+    WorkerProcess_Wait(self->fPid);
+    self->fPid = -1;
+  }
+  TRACE_LEAVE();
+}
+
+TWorkerProcess *
+WorkerProcess_New(void)
+{
+  TWorkerProcess *worker;
+
+  TRACE_ENTER();
+  worker = sse_zeroalloc(sizeof(TWorkerProcess));
+  if (worker == NULL) {
+    LOG_ERROR("failed to sse_zeroalloc().");
+    return NULL;
+  }
+  worker->fPid = -1;
+  worker->fPipeFd = -1;
+  TRACE_LEAVE();
+  return worker;
+}
+
+void
+TWorkerProcess_Delete(TWorkerProcess *self)
+{
+  TRACE_ENTER();
+  TWorkerProcess_Cancel(self);
+  sse_free(self);
+  TRACE_LEAVE();
+}
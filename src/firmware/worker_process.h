@@ -0,0 +1,71 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#ifndef __WORKER_PROCESS__
+#define __WORKER_PROCESS__
+
+#include <sys/types.h>
+#include <sseutils.h>
+
+SSE_BEGIN_C_DECLS
+
+typedef struct TWorkerProcess_ TWorkerProcess;
+
+typedef sse_int (*WorkerProcess_Proc)(sse_pointer in_proc_data);
+typedef void (*WorkerProcess_CompletionCallback)(TWorkerProcess *in_worker, sse_int in_result, sse_pointer in_user_data);
+typedef void (*WorkerProcess_OutputCallback)(TWorkerProcess *in_worker, sse_char *in_line, sse_uint in_len, sse_pointer in_user_data);
+
+#define WORKER_PROCESS_LINE_SIZE  (512)
+
+/*
+ * Runs a blocking job in a forked child process. The child reports the
+ * result of the job through a pipe, which is watched by the event loop, so
+ * that the completion callback is called from the event loop without ever
+ * blocking it. A child which dies without reporting completes the job with
+ * SSE_E_GENERIC, one killed for running out of time with SSE_E_TIMEDOUT.
+ * A shell command can be executed the same way. Its stdout and stderr are
+ * passed to the output callback line by line through a fixed size buffer,
+ * longer lines are split. The command completes with its exit status, or
+ * with SSE_E_TIMEDOUT when it is killed for running out of time.
+ */
+struct TWorkerProcess_ {
+  pid_t fPid;
+  int fPipeFd;
+  MoatIOWatcher *fWatcher;
+  sse_byte fResult[sizeof(sse_int)];
+  sse_uint fResultLen;
+  MoatPeriodic *fReaper;
+  sse_uint64 fDeadline;
+  sse_bool fTimedOut;
+  sse_char fLine[WORKER_PROCESS_LINE_SIZE + 1];
+  sse_uint fLineLen;
+  WorkerProcess_OutputCallback fOutputCallback;
+  sse_pointer fOutputUserData;
+  WorkerProcess_CompletionCallback fCallback;
+  sse_pointer fUserData;
+};
+
+TWorkerProcess * WorkerProcess_New(void);
+void TWorkerProcess_Delete(TWorkerProcess *self);
+sse_int TWorkerProcess_Start(TWorkerProcess *self, WorkerProcess_Proc in_proc, sse_pointer in_proc_data, sse_uint in_timeout_sec, WorkerProcess_CompletionCallback in_callback, sse_pointer in_user_data);
+sse_int TWorkerProcess_Execute(TWorkerProcess *self, sse_char *in_command, sse_uint in_timeout_sec, WorkerProcess_CompletionCallback in_callback, sse_pointer in_user_data);
+void TWorkerProcess_SetOutputCallback(TWorkerProcess *self, WorkerProcess_OutputCallback in_callback, sse_pointer in_user_data);
+void TWorkerProcess_Cancel(TWorkerProcess *self);
+sse_bool TWorkerProcess_IsRunning(TWorkerProcess *self);
+
+SSE_END_C_DECLS
+
+#endif /* __WORKER_PROCESS__ */
@@ -0,0 +1,965 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include <servicesync/moat.h>
+#include "zip_stream.h"
+
+#define TAG "ZipStream"
+
+#define TRACE_ENTER() MOAT_LOG_TRACE(TAG, "== enter =>");
+#define TRACE_LEAVE() MOAT_LOG_TRACE(TAG, "<= leave ==");
+#define LOG_ERROR(format, ...)  MOAT_LOG_ERROR(TAG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) MOAT_LOG_INFO(TAG, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...)  MOAT_LOG_DEBUG(TAG, format, ##__VA_ARGS__)
+
+#define ZIP_SIG_LOCAL_HEADER  (0x04034b50)
+#define ZIP_SIG_DATA_DESCRIPTOR  (0x08074b50)
+#define ZIP_SIG_CENTRAL_HEADER  (0x02014b50)
+#define ZIP_SIG_ZIP64_END_OF_CENTRAL_DIR  (0x06064b50)
+#define ZIP_SIG_END_OF_CENTRAL_DIR  (0x06054b50)
+
+#define ZIP_SIG_ZIP64_END_OF_CENTRAL_DIR_LOCATOR  (0x07064b50)
+
+#define ZIP_LOCAL_HEADER_SIZE  (26)
+#define ZIP_CENTRAL_HEADER_SIZE  (42)
+#define ZIP_END_OF_CENTRAL_DIR_SIZE  (22)
+#define ZIP_ZIP64_END_OF_CENTRAL_DIR_SIZE  (56)
+#define ZIP_ZIP64_LOCATOR_SIZE  (20)
+#define ZIP_MAX_COMMENT_SIZE  (0xFFFF)
+#define ZIP_MAX_CENTRAL_DIR_SIZE  (16 * 1024 * 1024)
+
+#define ZIP_FLAG_ENCRYPTED  (1 << 0)
+#define ZIP_FLAG_DATA_DESCRIPTOR  (1 << 3)
+
+#define ZIP_METHOD_STORED  (0)
+#define ZIP_METHOD_DEFLATED  (8)
+
+#define ZIP_EXTRA_ZIP64  (0x0001)
+#define ZIP_MADE_BY_UNIX  (3)
+
+#define ZIP_STREAM_OUT_BUFFER_SIZE  (32 * 1024)
+#define ZIP_STREAM_READ_BUFFER_SIZE  (64 * 1024)
+
+enum ZipStreamState_ {
+  ZIP_STREAM_STATE_SIGNATURE,
+  ZIP_STREAM_STATE_LOCAL_HEADER,
+  ZIP_STREAM_STATE_LOCAL_NAME,
+  ZIP_STREAM_STATE_DATA,
+  ZIP_STREAM_STATE_DESCRIPTOR,
+  ZIP_STREAM_STATE_CENTRAL_HEADER,
+  ZIP_STREAM_STATE_CENTRAL_NAME,
+  ZIP_STREAM_STATE_TRAILER,
+  ZIP_STREAM_STATE_ERROR,
+  ZIP_STREAM_STATEs
+};
+
+/* ZipStream private */
+
+static sse_uint16
+ZipStream_Get16(const sse_byte *p)
+{
+  return (sse_uint16)(p[0] | (p[1] << 8));
+}
+
+static sse_uint32
+ZipStream_Get32(const sse_byte *p)
+{
+  return (sse_uint32)p[0] | ((sse_uint32)p[1] << 8) | ((sse_uint32)p[2] << 16) | ((sse_uint32)p[3] << 24);
+}
+
+static sse_uint64
+ZipStream_Get64(const sse_byte *p)
+{
+  return (sse_uint64)ZipStream_Get32(p) | ((sse_uint64)ZipStream_Get32(p + 4) << 32);
+}
+
+/*
+ * Rejects absolute names and names which escape the output directory.
+ */
+static sse_bool
+ZipStream_IsSafeName(const sse_char *in_name, sse_uint in_len)
+{
+  sse_uint i;
+  sse_uint start = 0;
+
+  if (in_len == 0 || in_name[0] == '/') {
+    return sse_false;
+  }
+  for (i = 0; i <= in_len; i++) {
+    if (i == in_len || in_name[i] == '/') {
+      if (i - start == 2 && in_name[start] == '.' && in_name[start + 1] == '.') {
+        return sse_false;
+      }
+      start = i + 1;
+    } else if (in_name[i] == '\\' || in_name[i] == '\0') {
+      return sse_false;
+    }
+  }
+  return sse_true;
+}
+
+static sse_char *
+TZipStream_MakeEntryPath(TZipStream *self, const sse_char *in_name, sse_uint in_len)
+{
+  sse_char *path;
+  sse_int len;
+
+  if (!ZipStream_IsSafeName(in_name, in_len)) {
+    LOG_ERROR("unsafe entry name [%.*s].", (int)in_len, in_name);
+    return NULL;
+  }
+  len = sse_strlen(self->fDirPath) + 1 + in_len;
+  path = sse_malloc(len + 1);
+  if (path == NULL) {
+    LOG_ERROR("failed to sse_malloc().");
+    return NULL;
+  }
+  snprintf(path, len + 1, "%s/%.*s", self->fDirPath, (int)in_len, in_name);
+  return path;
+}
+
+static sse_int
+ZipStream_MakeParentDirs(sse_char *in_path, sse_uint in_base_len)
+{
+  sse_char *p;
+
+  for (p = in_path + in_base_len + 1; *p != '\0'; p++) {
+    if (*p != '/') {
+      continue;
+    }
+    *p = '\0';
+    if (mkdir(in_path, 0755) != 0 && errno != EEXIST) {
+      LOG_ERROR("failed to mkdir(%s). err=[%s]", in_path, strerror(errno));
+      *p = '/';
+      return SSE_E_ACCES;
+    }
+    *p = '/';
+  }
+  return SSE_E_OK;
+}
+
+static sse_int
+TZipStream_Expect(TZipStream *self, sse_int in_state, sse_uint in_need)
+{
+  if (in_need > self->fHeaderCapacity) {
+    if (self->fHeader != NULL) {
+      sse_free(self->fHeader);
+    }
+    self->fHeader = sse_malloc(in_need);
+    if (self->fHeader == NULL) {
+      LOG_ERROR("failed to sse_malloc().");
+      self->fHeaderCapacity = 0;
+      return SSE_E_NOMEM;
+    }
+    self->fHeaderCapacity = in_need;
+  }
+  self->fState = in_state;
+  self->fHeaderLen = 0;
+  self->fHeaderNeed = in_need;
+  return SSE_E_OK;
+}
+
+static void
+TZipStream_CloseEntry(TZipStream *self)
+{
+  if (self->fFd >= 0) {
+    close(self->fFd);
+    self->fFd = -1;
+  }
+  if (self->fEntryPath != NULL) {
+    sse_free(self->fEntryPath);
+    self->fEntryPath = NULL;
+  }
+}
+
+static sse_int
+TZipStream_VerifyEntry(TZipStream *self)
+{
+  if (self->fActualCrc32 != self->fCrc32) {
+    LOG_ERROR("CRC-32 mismatch. expected=%08x, actual=%08x", self->fCrc32, self->fActualCrc32);
+    return SSE_E_INVAL;
+  }
+  if (self->fWritten != self->fUncompressedSize) {
+    LOG_ERROR("size mismatch. expected=%llu, actual=%llu", self->fUncompressedSize, self->fWritten);
+    return SSE_E_INVAL;
+  }
+  return SSE_E_OK;
+}
+
+static sse_int
+TZipStream_FinishEntry(TZipStream *self)
+{
+  sse_int err;
+
+  TZipStream_CloseEntry(self);
+  if (self->fEntryEndCallback != NULL) {
+    err = (*self->fEntryEndCallback)(self, self->fWritten, self->fEntryUserData);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+  }
+  if (self->fInflateReady) {
+    inflateReset(&self->fInflate);
+  }
+  self->fEntryCount++;
+  if (self->fFlags & ZIP_FLAG_DATA_DESCRIPTOR) {
+    self->fDescriptorSigSkipped = sse_false;
+    return TZipStream_Expect(self, ZIP_STREAM_STATE_DESCRIPTOR, 4);
+  }
+  err = TZipStream_VerifyEntry(self);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  return TZipStream_Expect(self, ZIP_STREAM_STATE_SIGNATURE, 4);
+}
+
+/*
+ * Reads the zip64 extended information field. Only the values whose 32 bit
+ * counterpart is saturated are present, in this order.
+ */
+static sse_bool
+ZipStream_ParseZip64Extra(sse_byte *in_extra, sse_uint in_len, sse_uint64 *io_usize, sse_uint64 *io_csize, sse_uint64 *io_offset)
+{
+  sse_uint16 tag;
+  sse_uint16 size;
+  sse_byte *p;
+  sse_byte *end;
+
+  while (in_len >= 4) {
+    tag = ZipStream_Get16(in_extra);
+    size = ZipStream_Get16(in_extra + 2);
+    if (size > in_len - 4) {
+      break;
+    }
+    if (tag == ZIP_EXTRA_ZIP64) {
+      p = in_extra + 4;
+      end = p + size;
+      if (*io_usize == SSE_UINT32_MAX && p + 8 <= end) {
+        *io_usize = ZipStream_Get64(p);
+        p += 8;
+      }
+      if (*io_csize == SSE_UINT32_MAX && p + 8 <= end) {
+        *io_csize = ZipStream_Get64(p);
+        p += 8;
+      }
+      if (io_offset != NULL && *io_offset == SSE_UINT32_MAX && p + 8 <= end) {
+        *io_offset = ZipStream_Get64(p);
+      }
+      return sse_true;
+    }
+    in_extra += 4 + size;
+    in_len -= 4 + size;
+  }
+  return sse_false;
+}
+
+static sse_int
+TZipStream_StartEntry(TZipStream *self, sse_char *in_name, sse_uint in_name_len)
+{
+  sse_int err;
+
+  if (self->fFlags & ZIP_FLAG_ENCRYPTED) {
+    LOG_ERROR("encrypted entry is not supported.");
+    return SSE_E_INVAL;
+  }
+  if (self->fMethod != ZIP_METHOD_STORED && self->fMethod != ZIP_METHOD_DEFLATED) {
+    LOG_ERROR("compression method %u is not supported.", self->fMethod);
+    return SSE_E_INVAL;
+  }
+  if (self->fMethod == ZIP_METHOD_STORED && (self->fFlags & ZIP_FLAG_DATA_DESCRIPTOR)) {
+    /* the end of such an entry can not be found without the central directory */
+    LOG_ERROR("stored entry with data descriptor can not be streamed.");
+    return SSE_E_INVAL;
+  }
+  if (!(self->fFlags & ZIP_FLAG_DATA_DESCRIPTOR) && self->fUncompressedSize > self->fMaxEntrySize) {
+    LOG_ERROR("entry exceeds the size limit. size=%llu", self->fUncompressedSize);
+    return SSE_E_INVAL;
+  }
+  self->fEntryPath = TZipStream_MakeEntryPath(self, in_name, in_name_len);
+  if (self->fEntryPath == NULL) {
+    return SSE_E_INVAL;
+  }
+  if (self->fEntryStartCallback != NULL) {
+    err = (*self->fEntryStartCallback)(self, in_name, in_name_len,
+        (self->fFlags & ZIP_FLAG_DATA_DESCRIPTOR) ? -1 : (sse_int64)self->fUncompressedSize, self->fEntryUserData);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+  }
+  err = ZipStream_MakeParentDirs(self->fEntryPath, sse_strlen(self->fDirPath));
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  if (in_name[in_name_len - 1] != '/') {
+    self->fFd = open(self->fEntryPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (self->fFd < 0) {
+      LOG_ERROR("failed to open(%s). err=[%s]", self->fEntryPath, strerror(errno));
+      return SSE_E_ACCES;
+    }
+  }
+  LOG_DEBUG("entry [%s] method=%u, size=%llu", self->fEntryPath, self->fMethod, self->fUncompressedSize);
+  self->fConsumed = 0;
+  self->fWritten = 0;
+  self->fActualCrc32 = crc32(0L, Z_NULL, 0);
+  if (self->fMethod == ZIP_METHOD_DEFLATED && !self->fInflateReady) {
+    sse_memset(&self->fInflate, 0, sizeof(z_stream));
+    if (inflateInit2(&self->fInflate, -MAX_WBITS) != Z_OK) {
+      LOG_ERROR("failed to inflateInit2().");
+      return SSE_E_NOMEM;
+    }
+    self->fInflateReady = sse_true;
+  }
+  self->fState = ZIP_STREAM_STATE_DATA;
+  if (self->fMethod == ZIP_METHOD_STORED && self->fCompressedSize == 0) {
+    return TZipStream_FinishEntry(self);
+  }
+  return SSE_E_OK;
+}
+
+static sse_int
+TZipStream_OpenEntry(TZipStream *self)
+{
+  /* zip64 extended information carries the sizes that overflow 32 bits */
+  self->fZip64 = ZipStream_ParseZip64Extra(self->fHeader + self->fNameLen, self->fHeaderNeed - self->fNameLen,
+      &self->fUncompressedSize, &self->fCompressedSize, NULL);
+  return TZipStream_StartEntry(self, (sse_char *)self->fHeader, self->fNameLen);
+}
+
+static void
+TZipStream_ApplyMode(TZipStream *self, sse_char *in_name, sse_uint in_name_len)
+{
+  sse_uint mode = (self->fExternalAttr >> 16) & 0777;
+  sse_char *path;
+
+  if ((self->fMadeBy >> 8) != ZIP_MADE_BY_UNIX || mode == 0 || !S_ISREG(self->fExternalAttr >> 16)) {
+    return;
+  }
+  path = TZipStream_MakeEntryPath(self, in_name, in_name_len);
+  if (path == NULL) {
+    return;
+  }
+  if (chmod(path, mode) != 0) {
+    LOG_ERROR("failed to chmod(%s). err=[%s]", path, strerror(errno));
+  }
+  sse_free(path);
+}
+
+static sse_int
+TZipStream_Output(TZipStream *self, sse_byte *in_data, sse_size in_len)
+{
+  ssize_t n;
+  sse_int err;
+
+  if (self->fWritten + in_len > self->fMaxEntrySize || self->fTotalWritten + in_len > self->fMaxTotalSize) {
+    LOG_ERROR("extracted data exceeds the size limit. entry=%llu, total=%llu", self->fWritten, self->fTotalWritten);
+    return SSE_E_INVAL;
+  }
+  if (self->fEntryDataCallback != NULL && in_len > 0) {
+    err = (*self->fEntryDataCallback)(self, in_data, in_len, self->fEntryUserData);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+  }
+  self->fActualCrc32 = crc32(self->fActualCrc32, in_data, in_len);
+  self->fWritten += in_len;
+  self->fTotalWritten += in_len;
+  while (in_len > 0 && self->fFd >= 0) {
+    n = write(self->fFd, in_data, in_len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_ERROR("failed to write(%s). err=[%s]", self->fEntryPath, strerror(errno));
+      return SSE_E_GENERIC;
+    }
+    in_data += n;
+    in_len -= n;
+  }
+  return SSE_E_OK;
+}
+
+static sse_int
+TZipStream_WriteData(TZipStream *self, sse_byte *in_data, sse_size in_len, sse_size *out_consumed)
+{
+  sse_size n;
+  sse_int ret;
+  sse_int err;
+
+  *out_consumed = 0;
+  if (self->fMethod == ZIP_METHOD_STORED) {
+    n = (sse_size)SSE_MIN((sse_uint64)in_len, self->fCompressedSize - self->fConsumed);
+    err = TZipStream_Output(self, in_data, n);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+    self->fConsumed += n;
+    *out_consumed = n;
+    if (self->fConsumed == self->fCompressedSize) {
+      return TZipStream_FinishEntry(self);
+    }
+    return SSE_E_OK;
+  }
+  self->fInflate.next_in = in_data;
+  self->fInflate.avail_in = (uInt)in_len;
+  do {
+    self->fInflate.next_out = self->fOutBuffer;
+    self->fInflate.avail_out = ZIP_STREAM_OUT_BUFFER_SIZE;
+    ret = inflate(&self->fInflate, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+      LOG_ERROR("failed to inflate(). ret=%d", ret);
+      return SSE_E_INVAL;
+    }
+    err = TZipStream_Output(self, self->fOutBuffer, ZIP_STREAM_OUT_BUFFER_SIZE - self->fInflate.avail_out);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+  } while (ret == Z_OK && (self->fInflate.avail_in > 0 || self->fInflate.avail_out == 0));
+  n = in_len - self->fInflate.avail_in;
+  self->fConsumed += n;
+  *out_consumed = n;
+  if (!(self->fFlags & ZIP_FLAG_DATA_DESCRIPTOR) && self->fConsumed > self->fCompressedSize) {
+    LOG_ERROR("compressed data exceeds its size.");
+    return SSE_E_INVAL;
+  }
+  if (ret == Z_STREAM_END) {
+    return TZipStream_FinishEntry(self);
+  }
+  return SSE_E_OK;
+}
+
+static sse_int
+TZipStream_HandleHeader(TZipStream *self)
+{
+  sse_byte *h = self->fHeader;
+  sse_uint32 sig;
+  sse_uint need;
+
+  switch (self->fState) {
+  case ZIP_STREAM_STATE_SIGNATURE:
+    sig = ZipStream_Get32(h);
+    if (sig == ZIP_SIG_LOCAL_HEADER) {
+      return TZipStream_Expect(self, ZIP_STREAM_STATE_LOCAL_HEADER, ZIP_LOCAL_HEADER_SIZE);
+    }
+    if (sig == ZIP_SIG_CENTRAL_HEADER) {
+      return TZipStream_Expect(self, ZIP_STREAM_STATE_CENTRAL_HEADER, ZIP_CENTRAL_HEADER_SIZE);
+    }
+    if (sig == ZIP_SIG_ZIP64_END_OF_CENTRAL_DIR || sig == ZIP_SIG_END_OF_CENTRAL_DIR) {
+      LOG_DEBUG("%u entries have been extracted.", self->fEntryCount);
+      self->fState = ZIP_STREAM_STATE_TRAILER;
+      return SSE_E_OK;
+    }
+    LOG_ERROR("unknown signature %08x.", sig);
+    return SSE_E_INVAL;
+
+  case ZIP_STREAM_STATE_LOCAL_HEADER:
+    self->fFlags = ZipStream_Get16(h + 2);
+    self->fMethod = ZipStream_Get16(h + 4);
+    self->fCrc32 = ZipStream_Get32(h + 10);
+    self->fCompressedSize = ZipStream_Get32(h + 14);
+    self->fUncompressedSize = ZipStream_Get32(h + 18);
+    self->fNameLen = ZipStream_Get16(h + 22);
+    self->fZip64 = sse_false;
+    need = self->fNameLen + ZipStream_Get16(h + 24);
+    if (self->fNameLen == 0) {
+      LOG_ERROR("entry without name.");
+      return SSE_E_INVAL;
+    }
+    return TZipStream_Expect(self, ZIP_STREAM_STATE_LOCAL_NAME, need);
+
+  case ZIP_STREAM_STATE_LOCAL_NAME:
+    return TZipStream_OpenEntry(self);
+
+  case ZIP_STREAM_STATE_DESCRIPTOR:
+    if (!self->fDescriptorSigSkipped) {
+      self->fDescriptorSigSkipped = sse_true;
+      need = self->fZip64 ? 16 : 8;
+      if (ZipStream_Get32(h) == ZIP_SIG_DATA_DESCRIPTOR) {
+        need += 4;
+      } else {
+        self->fCrc32 = ZipStream_Get32(h);
+      }
+      return TZipStream_Expect(self, ZIP_STREAM_STATE_DESCRIPTOR, need);
+    }
+    if (self->fHeaderNeed == 12 || self->fHeaderNeed == 20) {
+      self->fCrc32 = ZipStream_Get32(h);
+      h += 4;
+    }
+    self->fUncompressedSize = self->fZip64 ? ZipStream_Get64(h + 8) : ZipStream_Get32(h + 4);
+    if (TZipStream_VerifyEntry(self) != SSE_E_OK) {
+      return SSE_E_INVAL;
+    }
+    return TZipStream_Expect(self, ZIP_STREAM_STATE_SIGNATURE, 4);
+
+  case ZIP_STREAM_STATE_CENTRAL_HEADER:
+    self->fMadeBy = ZipStream_Get16(h);
+    self->fNameLen = ZipStream_Get16(h + 24);
+    self->fExternalAttr = ZipStream_Get32(h + 34);
+    need = self->fNameLen + ZipStream_Get16(h + 26) + ZipStream_Get16(h + 28);
+    return TZipStream_Expect(self, ZIP_STREAM_STATE_CENTRAL_NAME, need);
+
+  case ZIP_STREAM_STATE_CENTRAL_NAME:
+    TZipStream_ApplyMode(self, (sse_char *)h, self->fNameLen);
+    return TZipStream_Expect(self, ZIP_STREAM_STATE_SIGNATURE, 4);
+
+  default:
+    break;
+  }
+  return SSE_E_INVAL;
+}
+
+static sse_int
+ZipStream_ReadAt(int in_fd, sse_byte *out_buf, sse_size in_len, sse_uint64 in_offset)
+{
+  ssize_t n;
+
+  while (in_len > 0) {
+    n = pread(in_fd, out_buf, in_len, (off_t)in_offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_ERROR("failed to pread(). err=[%s]", strerror(errno));
+      return SSE_E_GENERIC;
+    }
+    if (n == 0) {
+      LOG_ERROR("archive is truncated.");
+      return SSE_E_INVAL;
+    }
+    out_buf += n;
+    in_len -= n;
+    in_offset += n;
+  }
+  return SSE_E_OK;
+}
+
+/*
+ * Locates the central directory from the (zip64) end of central directory
+ * record at the tail of the archive.
+ */
+static sse_int
+ZipStream_FindCentralDir(int in_fd, sse_uint64 in_file_size, sse_uint64 *out_offset, sse_uint64 *out_size, sse_uint64 *out_count)
+{
+  sse_byte *tail = NULL;
+  sse_byte *eocd = NULL;
+  sse_byte rec[ZIP_ZIP64_END_OF_CENTRAL_DIR_SIZE];
+  sse_size tail_len;
+  sse_size i;
+  sse_uint64 pos;
+  sse_int err;
+
+  if (in_file_size < ZIP_END_OF_CENTRAL_DIR_SIZE) {
+    LOG_ERROR("archive is too short.");
+    return SSE_E_INVAL;
+  }
+  tail_len = (sse_size)SSE_MIN(in_file_size, (sse_uint64)(ZIP_END_OF_CENTRAL_DIR_SIZE + ZIP_MAX_COMMENT_SIZE));
+  tail = sse_malloc(tail_len);
+  if (tail == NULL) {
+    LOG_ERROR("failed to sse_malloc().");
+    return SSE_E_NOMEM;
+  }
+  err = ZipStream_ReadAt(in_fd, tail, tail_len, in_file_size - tail_len);
+  if (err != SSE_E_OK) {
+    goto error_exit;
+  }
+  /* the comment is the only variable part, so the record must end the file */
+  for (i = tail_len - ZIP_END_OF_CENTRAL_DIR_SIZE + 1; i > 0; i--) {
+    if (ZipStream_Get32(tail + i - 1) == ZIP_SIG_END_OF_CENTRAL_DIR &&
+        i - 1 + ZIP_END_OF_CENTRAL_DIR_SIZE + ZipStream_Get16(tail + i - 1 + 20) == tail_len) {
+      eocd = tail + i - 1;
+      break;
+    }
+  }
+  if (eocd == NULL) {
+    LOG_ERROR("end of central directory is not found.");
+    err = SSE_E_INVAL;
+    goto error_exit;
+  }
+  if (ZipStream_Get16(eocd + 4) != 0 || ZipStream_Get16(eocd + 6) != 0) {
+    LOG_ERROR("multi-disk archive is not supported.");
+    err = SSE_E_INVAL;
+    goto error_exit;
+  }
+  *out_count = ZipStream_Get16(eocd + 10);
+  *out_size = ZipStream_Get32(eocd + 12);
+  *out_offset = ZipStream_Get32(eocd + 16);
+  pos = in_file_size - tail_len + (eocd - tail);
+  if (pos >= ZIP_ZIP64_LOCATOR_SIZE &&
+      (*out_count == 0xFFFF || *out_size == SSE_UINT32_MAX || *out_offset == SSE_UINT32_MAX)) {
+    err = ZipStream_ReadAt(in_fd, rec, ZIP_ZIP64_LOCATOR_SIZE, pos - ZIP_ZIP64_LOCATOR_SIZE);
+    if (err != SSE_E_OK) {
+      goto error_exit;
+    }
+    if (ZipStream_Get32(rec) == ZIP_SIG_ZIP64_END_OF_CENTRAL_DIR_LOCATOR) {
+      err = ZipStream_ReadAt(in_fd, rec, ZIP_ZIP64_END_OF_CENTRAL_DIR_SIZE, ZipStream_Get64(rec + 8));
+      if (err != SSE_E_OK) {
+        goto error_exit;
+      }
+      if (ZipStream_Get32(rec) != ZIP_SIG_ZIP64_END_OF_CENTRAL_DIR) {
+        LOG_ERROR("zip64 end of central directory is broken.");
+        err = SSE_E_INVAL;
+        goto error_exit;
+      }
+      *out_count = ZipStream_Get64(rec + 32);
+      *out_size = ZipStream_Get64(rec + 40);
+      *out_offset = ZipStream_Get64(rec + 48);
+    }
+  }
+  if (*out_offset > in_file_size || *out_size > in_file_size - *out_offset) {
+    LOG_ERROR("central directory is out of the archive.");
+    err = SSE_E_INVAL;
+    goto error_exit;
+  }
+  if (*out_size > ZIP_MAX_CENTRAL_DIR_SIZE) {
+    LOG_ERROR("central directory is too large. size=%llu", *out_size);
+    err = SSE_E_INVAL;
+    goto error_exit;
+  }
+  sse_free(tail);
+  return SSE_E_OK;
+
+error_exit:
+  sse_free(tail);
+  return err;
+}
+
+/*
+ * Loads the fields of the central directory entry at in_entry. Returns the
+ * length of the entry, or 0 when it is broken.
+ */
+static sse_size
+TZipStream_LoadCentralEntry(TZipStream *self, sse_byte *in_entry, sse_size in_len, sse_uint64 *out_offset)
+{
+  sse_uint extra_len;
+  sse_size len;
+
+  if (in_len < 4 + ZIP_CENTRAL_HEADER_SIZE || ZipStream_Get32(in_entry) != ZIP_SIG_CENTRAL_HEADER) {
+    LOG_ERROR("central directory is broken.");
+    return 0;
+  }
+  self->fMadeBy = ZipStream_Get16(in_entry + 4);
+  self->fFlags = ZipStream_Get16(in_entry + 8);
+  self->fMethod = ZipStream_Get16(in_entry + 10);
+  self->fCrc32 = ZipStream_Get32(in_entry + 16);
+  self->fCompressedSize = ZipStream_Get32(in_entry + 20);
+  self->fUncompressedSize = ZipStream_Get32(in_entry + 24);
+  self->fNameLen = ZipStream_Get16(in_entry + 28);
+  extra_len = ZipStream_Get16(in_entry + 30);
+  self->fExternalAttr = ZipStream_Get32(in_entry + 38);
+  *out_offset = ZipStream_Get32(in_entry + 42);
+  len = 4 + ZIP_CENTRAL_HEADER_SIZE + self->fNameLen + extra_len + ZipStream_Get16(in_entry + 32);
+  if (len > in_len || self->fNameLen == 0) {
+    LOG_ERROR("central directory is broken.");
+    return 0;
+  }
+  self->fZip64 = ZipStream_ParseZip64Extra(in_entry + 4 + ZIP_CENTRAL_HEADER_SIZE + self->fNameLen, extra_len,
+      &self->fUncompressedSize, &self->fCompressedSize, out_offset);
+  return len;
+}
+
+/*
+ * Checks every entry before anything is written, so that an archive which
+ * can not be extracted as a whole leaves nothing behind.
+ */
+static sse_int
+TZipStream_CheckCentralDir(TZipStream *self, sse_byte *in_dir, sse_size in_size, sse_uint64 in_count, sse_uint64 in_file_size)
+{
+  struct statvfs fs;
+  sse_uint64 total = 0;
+  sse_uint64 offset;
+  sse_uint64 i;
+  sse_size len;
+
+  for (i = 0; i < in_count; i++) {
+    len = TZipStream_LoadCentralEntry(self, in_dir, in_size, &offset);
+    if (len == 0) {
+      return SSE_E_INVAL;
+    }
+    if (!ZipStream_IsSafeName((sse_char *)in_dir + 4 + ZIP_CENTRAL_HEADER_SIZE, self->fNameLen)) {
+      LOG_ERROR("unsafe entry name [%.*s].", (int)self->fNameLen, in_dir + 4 + ZIP_CENTRAL_HEADER_SIZE);
+      return SSE_E_INVAL;
+    }
+    if (offset > in_file_size || self->fCompressedSize > in_file_size - offset) {
+      LOG_ERROR("entry is out of the archive.");
+      return SSE_E_INVAL;
+    }
+    if (self->fUncompressedSize > self->fMaxEntrySize) {
+      LOG_ERROR("entry exceeds the size limit. size=%llu", self->fUncompressedSize);
+      return SSE_E_INVAL;
+    }
+    total += self->fUncompressedSize;
+    if (total > self->fMaxTotalSize - self->fTotalWritten) {
+      LOG_ERROR("archive exceeds the size limit.");
+      return SSE_E_INVAL;
+    }
+    in_dir += len;
+    in_size -= len;
+  }
+  if (statvfs(self->fDirPath, &fs) == 0 && total > (sse_uint64)fs.f_bavail * fs.f_frsize) {
+    LOG_ERROR("not enough space to extract. required=%llu", total);
+    return SSE_E_NOMEM;
+  }
+  return SSE_E_OK;
+}
+
+static sse_int
+TZipStream_ExtractEntry(TZipStream *self, int in_fd, sse_byte *in_entry, sse_uint64 in_offset, sse_byte *in_buffer)
+{
+  sse_byte header[4 + ZIP_LOCAL_HEADER_SIZE];
+  sse_uint64 pos;
+  sse_uint64 remaining;
+  sse_size len;
+  sse_size n;
+  sse_int err;
+
+  err = ZipStream_ReadAt(in_fd, header, sizeof(header), in_offset);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  if (ZipStream_Get32(header) != ZIP_SIG_LOCAL_HEADER) {
+    LOG_ERROR("local header is not found at %llu.", in_offset);
+    return SSE_E_INVAL;
+  }
+  pos = in_offset + sizeof(header) + ZipStream_Get16(header + 26) + ZipStream_Get16(header + 28);
+  /* the central directory already tells the sizes a data descriptor would carry */
+  self->fFlags &= ~ZIP_FLAG_DATA_DESCRIPTOR;
+  err = TZipStream_StartEntry(self, (sse_char *)in_entry + 4 + ZIP_CENTRAL_HEADER_SIZE, self->fNameLen);
+  if (err != SSE_E_OK) {
+    return err;
+  }
+  remaining = self->fCompressedSize;
+  while (self->fState == ZIP_STREAM_STATE_DATA) {
+    if (remaining == 0) {
+      LOG_ERROR("compressed data is truncated.");
+      return SSE_E_INVAL;
+    }
+    len = (sse_size)SSE_MIN(remaining, (sse_uint64)ZIP_STREAM_READ_BUFFER_SIZE);
+    err = ZipStream_ReadAt(in_fd, in_buffer, len, pos);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+    err = TZipStream_WriteData(self, in_buffer, len, &n);
+    if (err != SSE_E_OK) {
+      return err;
+    }
+    pos += len;
+    remaining -= len;
+  }
+  TZipStream_ApplyMode(self, (sse_char *)in_entry + 4 + ZIP_CENTRAL_HEADER_SIZE, self->fNameLen);
+  return SSE_E_OK;
+}
+
+/* ZipStream public */
+
+sse_int
+TZipStream_Write(TZipStream *self, sse_byte *in_data, sse_size in_len)
+{
+  sse_size n;
+  sse_int err = SSE_E_OK;
+
+  while (in_len > 0) {
+    switch (self->fState) {
+    case ZIP_STREAM_STATE_ERROR:
+      return SSE_E_INVAL;
+    case ZIP_STREAM_STATE_TRAILER:
+      /* end of central directory and comment */
+      return SSE_E_OK;
+    case ZIP_STREAM_STATE_DATA:
+      err = TZipStream_WriteData(self, in_data, in_len, &n);
+      break;
+    default:
+      n = SSE_MIN(in_len, (sse_size)(self->fHeaderNeed - self->fHeaderLen));
+      sse_memcpy(self->fHeader + self->fHeaderLen, in_data, n);
+      self->fHeaderLen += n;
+      if (self->fHeaderLen == self->fHeaderNeed) {
+        err = TZipStream_HandleHeader(self);
+      }
+      break;
+    }
+    if (err != SSE_E_OK) {
+      LOG_ERROR("failed to decode archive. err=%s", sse_get_error_string(err));
+      TZipStream_CloseEntry(self);
+      self->fState = ZIP_STREAM_STATE_ERROR;
+      return err;
+    }
+    in_data += n;
+    in_len -= n;
+  }
+  return SSE_E_OK;
+}
+
+sse_bool
+TZipStream_IsCompleted(TZipStream *self)
+{
+  return (self->fState == ZIP_STREAM_STATE_TRAILER) ? sse_true : sse_false;
+}
+
+void
+TZipStream_SetLimits(TZipStream *self, sse_uint64 in_max_entry_size, sse_uint64 in_max_total_size)
+{
+  self->fMaxEntrySize = in_max_entry_size;
+  self->fMaxTotalSize = in_max_total_size;
+}
+
+void
+TZipStream_SetEntryCallbacks(TZipStream *self, ZipStream_EntryStartCallback in_start, ZipStream_EntryDataCallback in_data, ZipStream_EntryEndCallback in_end, sse_pointer in_user_data)
+{
+  self->fEntryStartCallback = in_start;
+  self->fEntryDataCallback = in_data;
+  self->fEntryEndCallback = in_end;
+  self->fEntryUserData = in_user_data;
+}
+
+/*
+ * Extracts the archive file through its central directory. Every entry is
+ * read from the offset the central directory tells and is verified against
+ * the CRC-32 and the sizes recorded there.
+ */
+sse_int
+TZipStream_ExtractFile(TZipStream *self, sse_char *in_file_path)
+{
+  struct stat st;
+  sse_byte *dir = NULL;
+  sse_byte *buffer = NULL;
+  sse_byte *entry;
+  sse_uint64 dir_offset;
+  sse_uint64 dir_size;
+  sse_uint64 count;
+  sse_uint64 offset;
+  sse_uint64 i;
+  sse_size len;
+  sse_int err;
+  int fd;
+
+  TRACE_ENTER();
+  if (self->fState != ZIP_STREAM_STATE_SIGNATURE || self->fEntryCount > 0) {
+    LOG_ERROR("stream has already been used.");
+    return SSE_E_INVAL;
+  }
+  fd = open(in_file_path, O_RDONLY);
+  if (fd < 0) {
+    LOG_ERROR("failed to open(%s). err=[%s]", in_file_path, strerror(errno));
+    return SSE_E_NOENT;
+  }
+  if (fstat(fd, &st) != 0) {
+    LOG_ERROR("failed to fstat(%s). err=[%s]", in_file_path, strerror(errno));
+    err = SSE_E_GENERIC;
+    goto error_exit;
+  }
+  err = ZipStream_FindCentralDir(fd, (sse_uint64)st.st_size, &dir_offset, &dir_size, &count);
+  if (err != SSE_E_OK) {
+    goto error_exit;
+  }
+  dir = sse_malloc((sse_size)dir_size + 1);
+  buffer = sse_malloc(ZIP_STREAM_READ_BUFFER_SIZE);
+  if (dir == NULL || buffer == NULL) {
+    LOG_ERROR("failed to sse_malloc().");
+    err = SSE_E_NOMEM;
+    goto error_exit;
+  }
+  err = ZipStream_ReadAt(fd, dir, (sse_size)dir_size, dir_offset);
+  if (err != SSE_E_OK) {
+    goto error_exit;
+  }
+  err = TZipStream_CheckCentralDir(self, dir, (sse_size)dir_size, count, (sse_uint64)st.st_size);
+  if (err != SSE_E_OK) {
+    goto error_exit;
+  }
+  entry = dir;
+  for (i = 0; i < count; i++) {
+    len = TZipStream_LoadCentralEntry(self, entry, dir_size - (entry - dir), &offset);
+    err = TZipStream_ExtractEntry(self, fd, entry, offset, buffer);
+    if (err != SSE_E_OK) {
+      goto error_exit;
+    }
+    entry += len;
+  }
+  LOG_DEBUG("%u entries have been extracted.", self->fEntryCount);
+  self->fState = ZIP_STREAM_STATE_TRAILER;
+  sse_free(buffer);
+  sse_free(dir);
+  close(fd);
+  TRACE_LEAVE();
+  return SSE_E_OK;
+
+error_exit:
+  LOG_ERROR("failed to extract [%s]. err=%s", in_file_path, sse_get_error_string(err));
+  TZipStream_CloseEntry(self);
+  self->fState = ZIP_STREAM_STATE_ERROR;
+  if (buffer != NULL) {
+    sse_free(buffer);
+  }
+  if (dir != NULL) {
+    sse_free(dir);
+  }
+  close(fd);
+  return err;
+}
+
+TZipStream *
+ZipStream_New(sse_char *in_dir_path)
+{
+  TZipStream *stream;
+
+  TRACE_ENTER();
+  stream = sse_zeroalloc(sizeof(TZipStream));
+  if (stream == NULL) {
+    LOG_ERROR("failed to sse_zeroalloc().");
+    return NULL;
+  }
+  stream->fFd = -1;
+  stream->fMaxEntrySize = (sse_uint64)-1;
+  stream->fMaxTotalSize = (sse_uint64)-1;
+  stream->fDirPath = sse_strdup(in_dir_path);
+  stream->fOutBuffer = sse_malloc(ZIP_STREAM_OUT_BUFFER_SIZE);
+  if (stream->fDirPath == NULL || stream->fOutBuffer == NULL ||
+      TZipStream_Expect(stream, ZIP_STREAM_STATE_SIGNATURE, 4) != SSE_E_OK) {
+    LOG_ERROR("failed to allocate stream.");
+    TZipStream_Delete(stream);
+    return NULL;
+  }
+  TRACE_LEAVE();
+  return stream;
+}
+
+void
+TZipStream_Delete(TZipStream *self)
+{
+  TRACE_ENTER();
+  TZipStream_CloseEntry(self);
+  if (self->fInflateReady) {
+    inflateEnd(&self->fInflate);
+  }
+  if (self->fHeader != NULL) {
+    sse_free(self->fHeader);
+  }
+  if (self->fOutBuffer != NULL) {
+    sse_free(self->fOutBuffer);
+  }
+  if (self->fDirPath != NULL) {
+    sse_free(self->fDirPath);
+  }
+  sse_free(self);
+  TRACE_LEAVE();
+}
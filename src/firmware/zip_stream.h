@@ -0,0 +1,88 @@
+/*
+ * LEGAL NOTICE
+ *
+ * Copyright (C) 2016 InventIt Inc. All rights reserved.
+ *
+ * This source code, product and/or document is protected under licenses
+ * restricting its use, copying, distribution, and decompilation.
+ * No part of this source code, product or document may be reproduced in
+ * any form by any means without prior written authorization of InventIt Inc.
+ * and its licensors, if any.
+ *
+ * InventIt Inc.
+ * 9F, Kojimachi 4-4-7, Chiyoda-ku, Tokyo 102-0083
+ * JAPAN
+ * http://www.yourinventit.com/
+ */
+#ifndef __ZIP_STREAM__
+#define __ZIP_STREAM__
+
+#include <zlib.h>
+#include <sseutils.h>
+
+SSE_BEGIN_C_DECLS
+
+typedef struct TZipStream_ TZipStream;
+
+typedef sse_int (*ZipStream_EntryStartCallback)(TZipStream *in_stream, sse_char *in_name, sse_uint in_name_len, sse_int64 in_size, sse_pointer in_user_data);
+typedef sse_int (*ZipStream_EntryDataCallback)(TZipStream *in_stream, sse_byte *in_data, sse_size in_len, sse_pointer in_user_data);
+typedef sse_int (*ZipStream_EntryEndCallback)(TZipStream *in_stream, sse_uint64 in_size, sse_pointer in_user_data);
+
+/*
+ * Push decoder for ZIP archives. Bytes of the archive are written in order
+ * as they become available and every entry is inflated into the output
+ * directory on the fly with a fixed size output buffer. File modes are
+ * applied when the central directory passes by at the end of the archive.
+ * An archive which already is in a file can be extracted through its
+ * central directory instead, which also covers entries that can not be
+ * streamed. Extracted sizes are bounded per entry and in total.
+ * Entry callbacks see every entry before anything of it is written (with
+ * its size, or -1 when a data descriptor follows), then its extracted data
+ * and its end. An error returned by any of them stops the extraction.
+ */
+struct TZipStream_ {
+  sse_char *fDirPath;
+  sse_int fState;
+  sse_byte *fHeader;
+  sse_uint fHeaderCapacity;
+  sse_uint fHeaderLen;
+  sse_uint fHeaderNeed;
+  sse_uint16 fFlags;
+  sse_uint16 fMethod;
+  sse_uint16 fMadeBy;
+  sse_uint32 fExternalAttr;
+  sse_uint32 fCrc32;
+  sse_uint64 fCompressedSize;
+  sse_uint64 fUncompressedSize;
+  sse_uint fNameLen;
+  sse_bool fZip64;
+  sse_bool fDescriptorSigSkipped;
+  sse_char *fEntryPath;
+  int fFd;
+  sse_uint64 fConsumed;
+  sse_uint64 fWritten;
+  sse_uint32 fActualCrc32;
+  z_stream fInflate;
+  sse_bool fInflateReady;
+  sse_byte *fOutBuffer;
+  sse_uint fEntryCount;
+  sse_uint64 fMaxEntrySize;
+  sse_uint64 fMaxTotalSize;
+  sse_uint64 fTotalWritten;
+  ZipStream_EntryStartCallback fEntryStartCallback;
+  ZipStream_EntryDataCallback fEntryDataCallback;
+  ZipStream_EntryEndCallback fEntryEndCallback;
+  sse_pointer fEntryUserData;
+};
+
+TZipStream * ZipStream_New(sse_char *in_dir_path);
+void TZipStream_Delete(TZipStream *self);
+sse_int TZipStream_Write(TZipStream *self, sse_byte *in_data, sse_size in_len);
+sse_bool TZipStream_IsCompleted(TZipStream *self);
+void TZipStream_SetLimits(TZipStream *self, sse_uint64 in_max_entry_size, sse_uint64 in_max_total_size);
+void TZipStream_SetEntryCallbacks(TZipStream *self, ZipStream_EntryStartCallback in_start, ZipStream_EntryDataCallback in_data, ZipStream_EntryEndCallback in_end, sse_pointer in_user_data);
+sse_int TZipStream_ExtractFile(TZipStream *self, sse_char *in_file_path);
+
+SSE_END_C_DECLS
+
+#endif /* __ZIP_STREAM__ */
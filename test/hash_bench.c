@@ -0,0 +1,506 @@
+/*
+ * Hash throughput benchmark.
+ *
+ * Measures MB/s (10^6 bytes per second) and cycles/byte of MD5, SHA-1 and
+ * SHA-256 as implemented by ssehashlib, by every fast_hash back end the CPU
+ * supports, by the kernel through AF_ALG when it is available and, when
+ * built with HASH_BENCH_WITH_OPENSSL, by OpenSSL.
+ * Each implementation is timed for buffer sizes from 64 B to 4 MB in three
+ * modes:
+ *   oneshot  a whole digest (init, update, final) per buffer
+ *   stream   one digest over at least 1 MiB fed in buffer sized updates
+ *   file     a whole digest of the head of a file, spliced into the kernel
+ *            or read in 64 KiB chunks by the others
+ * Cycles are counted with perf events. Where those are not available the
+ * clock given with -c is used, otherwise cycles/byte is left empty.
+ * Results are written as CSV or JSON to stdout.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <linux/perf_event.h>
+#include <servicesync/moat.h>
+#include "firmware/fast_hash.h"
+#include "firmware/kernel_hash.h"
+
+#if defined(HASH_BENCH_WITH_OPENSSL)
+#include <openssl/evp.h>
+#endif
+
+#define HASH_BENCH_MIN_SIZE		(64)
+#define HASH_BENCH_MAX_SIZE		(4 * 1024 * 1024)
+#define HASH_BENCH_STREAM_BYTES	(1024 * 1024)
+#define HASH_BENCH_MAX_ALGORITHMS	(32)
+#define HASH_BENCH_CHECK_BYTES	(1000)
+#define HASH_BENCH_READ_SIZE	(64 * 1024)
+
+typedef union HashBenchContext_ HashBenchContext;
+union HashBenchContext_ {
+	SSEMd5Context fMd5;
+	SSESha1Context fSha1;
+	SSESha256Context fSha256;
+	FastHashSha1Context fFastSha1;
+	FastHashSha256Context fFastSha256;
+	TKernelHash *fKernel;
+};
+
+typedef struct HashBenchAlgorithm_ HashBenchAlgorithm;
+struct HashBenchAlgorithm_ {
+	const char *fName;
+	char fImpl[32];
+	int fBackend;
+	int fMdLen;
+	void (*fInit)(HashBenchContext *ctx);
+	void (*fUpdate)(HashBenchContext *ctx, sse_byte *data, sse_size len);
+	void (*fFinal)(HashBenchContext *ctx, sse_byte *md);
+	void (*fUpdateFile)(HashBenchContext *ctx, int fd, sse_size len);
+};
+
+enum HashBenchMode_ {
+	HASH_BENCH_ONESHOT,
+	HASH_BENCH_STREAM,
+	HASH_BENCH_FILE,
+	HASH_BENCH_MODEs
+};
+
+static const char *HashBench_ModeNames[HASH_BENCH_MODEs] = { "oneshot", "stream", "file" };
+
+static HashBenchAlgorithm HashBench_Algorithms[HASH_BENCH_MAX_ALGORITHMS];
+static int HashBench_AlgorithmCount = 0;
+static int HashBench_CycleFd = -1;
+static double HashBench_Mhz = 0;
+static TKernelHash *HashBench_Kernels[KERNEL_HASH_ALGORITHMs];
+static sse_byte HashBench_ReadBuffer[HASH_BENCH_READ_SIZE];
+
+/* fast_hash logs through the app log of the runtime */
+void
+ssep_app_log_print(sse_int level, const sse_char *format, ...)
+{
+	va_list ap;
+
+	if (level > SSE_LOG_LEVEL_WARN) {
+		return;
+	}
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	fputc('\n', stderr);
+	va_end(ap);
+}
+
+static void md5_init(HashBenchContext *ctx) { sse_hashlib_md5_init(&ctx->fMd5); }
+static void md5_update(HashBenchContext *ctx, sse_byte *data, sse_size len) { sse_hashlib_md5_update(&ctx->fMd5, data, len); }
+static void md5_final(HashBenchContext *ctx, sse_byte *md) { sse_hashlib_md5_fini(&ctx->fMd5, md); }
+static void sha1_init(HashBenchContext *ctx) { sse_hashlib_sha1_init(&ctx->fSha1); }
+static void sha1_update(HashBenchContext *ctx, sse_byte *data, sse_size len) { sse_hashlib_sha1_update(&ctx->fSha1, data, len); }
+static void sha1_final(HashBenchContext *ctx, sse_byte *md) { sse_hashlib_sha1_fini(&ctx->fSha1, md); }
+static void sha256_init(HashBenchContext *ctx) { sse_hashlib_sha256_init(&ctx->fSha256); }
+static void sha256_update(HashBenchContext *ctx, sse_byte *data, sse_size len) { sse_hashlib_sha256_update(&ctx->fSha256, data, len); }
+static void sha256_final(HashBenchContext *ctx, sse_byte *md) { sse_hashlib_sha256_fini(&ctx->fSha256, md); }
+static void fast_sha1_init(HashBenchContext *ctx) { FastHash_Sha1Init(&ctx->fFastSha1); }
+static void fast_sha1_update(HashBenchContext *ctx, sse_byte *data, sse_size len) { FastHash_Sha1Update(&ctx->fFastSha1, data, len); }
+static void fast_sha1_final(HashBenchContext *ctx, sse_byte *md) { FastHash_Sha1Final(&ctx->fFastSha1, md); }
+static void fast_sha256_init(HashBenchContext *ctx) { FastHash_Sha256Init(&ctx->fFastSha256); }
+static void fast_sha256_update(HashBenchContext *ctx, sse_byte *data, sse_size len) { FastHash_Sha256Update(&ctx->fFastSha256, data, len); }
+static void fast_sha256_final(HashBenchContext *ctx, sse_byte *md) { FastHash_Sha256Final(&ctx->fFastSha256, md); }
+static void kernel_md5_init(HashBenchContext *ctx) { ctx->fKernel = HashBench_Kernels[KERNEL_HASH_MD5]; }
+static void kernel_sha1_init(HashBenchContext *ctx) { ctx->fKernel = HashBench_Kernels[KERNEL_HASH_SHA1]; }
+static void kernel_sha256_init(HashBenchContext *ctx) { ctx->fKernel = HashBench_Kernels[KERNEL_HASH_SHA256]; }
+static void kernel_update(HashBenchContext *ctx, sse_byte *data, sse_size len) { TKernelHash_Update(ctx->fKernel, data, len); }
+static void kernel_final(HashBenchContext *ctx, sse_byte *md) { TKernelHash_Final(ctx->fKernel, md); }
+static void kernel_update_file(HashBenchContext *ctx, int fd, sse_size len) { TKernelHash_UpdateFile(ctx->fKernel, fd, 0, len); }
+
+#if defined(HASH_BENCH_WITH_OPENSSL)
+/* a single EVP context is reused, so that allocating it is not timed */
+static EVP_MD_CTX *HashBench_Evp = NULL;
+
+static void evp_update(HashBenchContext *ctx, sse_byte *data, sse_size len) { EVP_DigestUpdate(HashBench_Evp, data, len); }
+static void evp_final(HashBenchContext *ctx, sse_byte *md) { EVP_DigestFinal_ex(HashBench_Evp, md, NULL); }
+static void evp_md5_init(HashBenchContext *ctx) { EVP_DigestInit_ex(HashBench_Evp, EVP_md5(), NULL); }
+static void evp_sha1_init(HashBenchContext *ctx) { EVP_DigestInit_ex(HashBench_Evp, EVP_sha1(), NULL); }
+static void evp_sha256_init(HashBenchContext *ctx) { EVP_DigestInit_ex(HashBench_Evp, EVP_sha256(), NULL); }
+#endif
+
+static void
+add_algorithm(const char *name, const char *impl, int backend, int md_len,
+		void (*init)(HashBenchContext *), void (*update)(HashBenchContext *, sse_byte *, sse_size), void (*final)(HashBenchContext *, sse_byte *))
+{
+	HashBenchAlgorithm *a;
+
+	if (HashBench_AlgorithmCount >= HASH_BENCH_MAX_ALGORITHMS) {
+		return;
+	}
+	a = &HashBench_Algorithms[HashBench_AlgorithmCount++];
+	a->fName = name;
+	snprintf(a->fImpl, sizeof(a->fImpl), "%s", impl);
+	a->fBackend = backend;
+	a->fMdLen = md_len;
+	a->fInit = init;
+	a->fUpdate = update;
+	a->fFinal = final;
+	a->fUpdateFile = NULL;
+}
+
+static void
+add_kernel_algorithm(const char *name, int algorithm, void (*init)(HashBenchContext *))
+{
+	HashBench_Kernels[algorithm] = KernelHash_New(algorithm);
+	if (HashBench_Kernels[algorithm] == NULL) {
+		fprintf(stderr, "%s is not available through AF_ALG, skipping the kernel.\n", name);
+		return;
+	}
+	add_algorithm(name, "kernel", -1, KernelHash_GetDigestSize(algorithm), init, kernel_update, kernel_final);
+	HashBench_Algorithms[HashBench_AlgorithmCount - 1].fUpdateFile = kernel_update_file;
+}
+
+static void
+add_algorithms(void)
+{
+	char impl[32];
+	int i;
+
+	add_algorithm("md5", "ssehashlib", -1, MD5_MD_BYTES, md5_init, md5_update, md5_final);
+	add_algorithm("sha1", "ssehashlib", -1, SHA1_MD_BYTES, sha1_init, sha1_update, sha1_final);
+	add_algorithm("sha256", "ssehashlib", -1, SHA256_MD_BYTES, sha256_init, sha256_update, sha256_final);
+	for (i = 0; i < FastHash_GetBackendCount(); i++) {
+		if (!FastHash_IsBackendAvailable(i)) {
+			continue;
+		}
+		snprintf(impl, sizeof(impl), "fast_hash/%s", FastHash_GetBackendName(i));
+		add_algorithm("sha1", impl, i, SHA1_MD_BYTES, fast_sha1_init, fast_sha1_update, fast_sha1_final);
+		add_algorithm("sha256", impl, i, SHA256_MD_BYTES, fast_sha256_init, fast_sha256_update, fast_sha256_final);
+	}
+	add_kernel_algorithm("md5", KERNEL_HASH_MD5, kernel_md5_init);
+	add_kernel_algorithm("sha1", KERNEL_HASH_SHA1, kernel_sha1_init);
+	add_kernel_algorithm("sha256", KERNEL_HASH_SHA256, kernel_sha256_init);
+#if defined(HASH_BENCH_WITH_OPENSSL)
+	add_algorithm("md5", "openssl", -1, MD5_MD_BYTES, evp_md5_init, evp_update, evp_final);
+	add_algorithm("sha1", "openssl", -1, SHA1_MD_BYTES, evp_sha1_init, evp_update, evp_final);
+	add_algorithm("sha256", "openssl", -1, SHA256_MD_BYTES, evp_sha256_init, evp_update, evp_final);
+#endif
+}
+
+static void
+prepare(HashBenchAlgorithm *a)
+{
+	if (a->fBackend >= 0) {
+		FastHash_SelectBackend(a->fBackend);
+	}
+}
+
+/*
+ * All implementations of an algorithm have to agree before any of them is
+ * timed.
+ */
+static int
+check_algorithms(sse_byte *buf)
+{
+	HashBenchContext ctx;
+	sse_byte md[SHA256_MD_BYTES];
+	sse_byte ref[SHA256_MD_BYTES];
+	int i, j;
+
+	for (i = 0; i < HashBench_AlgorithmCount; i++) {
+		for (j = 0; j < i; j++) {
+			if (strcmp(HashBench_Algorithms[i].fName, HashBench_Algorithms[j].fName) == 0) {
+				break;
+			}
+		}
+		prepare(&HashBench_Algorithms[j]);
+		HashBench_Algorithms[j].fInit(&ctx);
+		HashBench_Algorithms[j].fUpdate(&ctx, buf, HASH_BENCH_CHECK_BYTES);
+		HashBench_Algorithms[j].fFinal(&ctx, ref);
+		prepare(&HashBench_Algorithms[i]);
+		HashBench_Algorithms[i].fInit(&ctx);
+		HashBench_Algorithms[i].fUpdate(&ctx, buf, HASH_BENCH_CHECK_BYTES);
+		HashBench_Algorithms[i].fFinal(&ctx, md);
+		if (memcmp(md, ref, HashBench_Algorithms[i].fMdLen) != 0) {
+			fprintf(stderr, "%s of %s differs from %s.\n", HashBench_Algorithms[i].fName,
+					HashBench_Algorithms[i].fImpl, HashBench_Algorithms[j].fImpl);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+open_cycle_counter(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	HashBench_CycleFd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long long
+read_cycles(void)
+{
+	long long count;
+
+	if (HashBench_CycleFd < 0 || read(HashBench_CycleFd, &count, sizeof(count)) != sizeof(count)) {
+		return -1;
+	}
+	return count;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * In the file mode the first size bytes of fd are hashed, spliced into the
+ * kernel or read into a buffer the way the software path reads a package.
+ */
+static void
+run_once(HashBenchAlgorithm *a, int mode, sse_byte *buf, int fd, size_t size)
+{
+	HashBenchContext ctx;
+	sse_byte md[SHA256_MD_BYTES];
+	size_t total;
+	size_t off;
+	ssize_t n;
+
+	a->fInit(&ctx);
+	if (mode == HASH_BENCH_FILE && a->fUpdateFile != NULL) {
+		a->fUpdateFile(&ctx, fd, size);
+	} else if (mode == HASH_BENCH_FILE) {
+		for (off = 0; off < size; off += n) {
+			n = pread(fd, HashBench_ReadBuffer, (size - off < HASH_BENCH_READ_SIZE) ? size - off : HASH_BENCH_READ_SIZE, off);
+			if (n <= 0) {
+				break;
+			}
+			a->fUpdate(&ctx, HashBench_ReadBuffer, n);
+		}
+	} else if (mode == HASH_BENCH_STREAM) {
+		total = (size < HASH_BENCH_STREAM_BYTES) ? HASH_BENCH_STREAM_BYTES : size;
+		for (off = 0; off < total; off += size) {
+			a->fUpdate(&ctx, buf, size);
+		}
+	} else {
+		a->fUpdate(&ctx, buf, size);
+	}
+	a->fFinal(&ctx, md);
+}
+
+static void
+print_result(int json, int first, HashBenchAlgorithm *a, int mode, size_t size,
+		long long iterations, long long bytes, double seconds, double cpb)
+{
+	double mbps = bytes / seconds / 1e6;
+
+	if (json) {
+		printf("%s\n    { \"algorithm\": \"%s\", \"implementation\": \"%s\", \"mode\": \"%s\", "
+				"\"buffer_bytes\": %lu, \"iterations\": %lld, \"bytes\": %lld, \"seconds\": %.6f, "
+				"\"mb_per_s\": %.2f, ", first ? "" : ",", a->fName, a->fImpl, HashBench_ModeNames[mode],
+				(unsigned long)size, iterations, bytes, seconds, mbps);
+		if (cpb >= 0) {
+			printf("\"cycles_per_byte\": %.3f }", cpb);
+		} else {
+			printf("\"cycles_per_byte\": null }");
+		}
+	} else {
+		printf("%s,%s,%s,%lu,%lld,%lld,%.6f,%.2f,", a->fName, a->fImpl, HashBench_ModeNames[mode],
+				(unsigned long)size, iterations, bytes, seconds, mbps);
+		if (cpb >= 0) {
+			printf("%.3f", cpb);
+		}
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+			"usage: %s [-k] [-f csv|json] [-t seconds] [-a algorithm] [-i implementation]\n"
+			"          [-s min_bytes] [-S max_bytes] [-c cpu_mhz] [-d directory]\n"
+			"  -k  only run the known-answer tests of every back end, exits 1 on failure\n"
+			"  -f  output format, csv by default\n"
+			"  -t  minimum time per measurement, 0.2 seconds by default\n"
+			"  -a  only the given algorithm (md5, sha1, sha256)\n"
+			"  -i  only implementations starting with the given name\n"
+			"  -s  smallest buffer size, %d by default\n"
+			"  -S  largest buffer size, %d by default, sizes grow by 4x\n"
+			"  -c  CPU clock in MHz for cycles/byte when perf events are not available\n"
+			"  -d  directory of the file hashed in the file mode, $TMPDIR or /tmp by default\n",
+			prog, HASH_BENCH_MIN_SIZE, HASH_BENCH_MAX_SIZE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *only_algorithm = NULL;
+	const char *only_impl = NULL;
+	const char *cycle_source;
+	const char *auto_backend;
+	const char *dir = getenv("TMPDIR");
+	char path[256];
+	struct utsname uts;
+	HashBenchAlgorithm *a;
+	sse_byte *buf;
+	size_t min_size = HASH_BENCH_MIN_SIZE;
+	size_t max_size = HASH_BENCH_MAX_SIZE;
+	size_t size;
+	double min_time = 0.2;
+	double start, seconds, cpb;
+	long long iterations, bytes, c0, c1;
+	int json = 0;
+	int self_test_only = 0;
+	int first = 1;
+	int mode;
+	int opt;
+	int fd;
+	int i;
+
+	while ((opt = getopt(argc, argv, "kf:t:a:i:s:S:c:d:h")) != -1) {
+		switch (opt) {
+		case 'k':
+			self_test_only = 1;
+			break;
+		case 'f':
+			json = (strcmp(optarg, "json") == 0);
+			break;
+		case 't':
+			min_time = atof(optarg);
+			break;
+		case 'a':
+			only_algorithm = optarg;
+			break;
+		case 'i':
+			only_impl = optarg;
+			break;
+		case 's':
+			min_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			max_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			HashBench_Mhz = atof(optarg);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (min_size == 0 || max_size < min_size) {
+		usage(argv[0]);
+		return 1;
+	}
+	/* a back end which fails its vectors must not be measured */
+	if (FastHash_SelfTest() != SSE_E_OK) {
+		fprintf(stderr, "known-answer tests have failed.\n");
+		return 1;
+	}
+	if (self_test_only) {
+		printf("known-answer tests have passed.\n");
+		return 0;
+	}
+	buf = malloc(max_size > HASH_BENCH_CHECK_BYTES ? max_size : HASH_BENCH_CHECK_BYTES);
+	if (buf == NULL) {
+		fprintf(stderr, "failed to allocate %lu bytes.\n", (unsigned long)max_size);
+		return 1;
+	}
+	for (i = 0; i < (int)(max_size > HASH_BENCH_CHECK_BYTES ? max_size : HASH_BENCH_CHECK_BYTES); i++) {
+		buf[i] = (sse_byte)(i * 131 + 7);
+	}
+	snprintf(path, sizeof(path), "%s/hash_bench.XXXXXX", (dir != NULL) ? dir : "/tmp");
+	fd = mkstemp(path);
+	if (fd < 0 || write(fd, buf, max_size) != (ssize_t)max_size) {
+		fprintf(stderr, "failed to write %s.\n", path);
+		return 1;
+	}
+	unlink(path);
+#if defined(HASH_BENCH_WITH_OPENSSL)
+	HashBench_Evp = EVP_MD_CTX_new();
+#endif
+	auto_backend = FastHash_GetBackendName(FastHash_GetSelectedBackend());
+	add_algorithms();
+	if (check_algorithms(buf) != 0) {
+		return 1;
+	}
+	open_cycle_counter();
+	if (read_cycles() >= 0) {
+		cycle_source = "perf";
+	} else if (HashBench_Mhz > 0) {
+		cycle_source = "clock";
+	} else {
+		cycle_source = "none";
+	}
+
+	if (json) {
+		uname(&uts);
+		printf("{\n  \"machine\": \"%s\",\n  \"kernel\": \"%s\",\n  \"cycle_source\": \"%s\",\n  \"fast_hash_backend\": \"%s\",\n  \"results\": [",
+				uts.machine, uts.release, cycle_source, auto_backend);
+	} else {
+		printf("algorithm,implementation,mode,buffer_bytes,iterations,bytes,seconds,mb_per_s,cycles_per_byte\n");
+	}
+	for (i = 0; i < HashBench_AlgorithmCount; i++) {
+		a = &HashBench_Algorithms[i];
+		if (only_algorithm != NULL && strcmp(a->fName, only_algorithm) != 0) {
+			continue;
+		}
+		if (only_impl != NULL && strncmp(a->fImpl, only_impl, strlen(only_impl)) != 0) {
+			continue;
+		}
+		prepare(a);
+		for (mode = 0; mode < HASH_BENCH_MODEs; mode++) {
+			for (size = min_size; size <= max_size; size *= 4) {
+				/* warm up caches and branch predictors */
+				run_once(a, mode, buf, fd, size);
+				iterations = 0;
+				c0 = read_cycles();
+				start = now();
+				do {
+					run_once(a, mode, buf, fd, size);
+					iterations++;
+					seconds = now() - start;
+				} while (seconds < min_time);
+				c1 = read_cycles();
+				bytes = iterations * (long long)((mode == HASH_BENCH_STREAM && size < HASH_BENCH_STREAM_BYTES) ? HASH_BENCH_STREAM_BYTES : size);
+				if (c0 >= 0 && c1 >= c0) {
+					cpb = (double)(c1 - c0) / bytes;
+				} else if (HashBench_Mhz > 0) {
+					cpb = HashBench_Mhz * 1e6 * seconds / bytes;
+				} else {
+					cpb = -1;
+				}
+				print_result(json, first, a, mode, size, iterations, bytes, seconds, cpb);
+				first = 0;
+			}
+		}
+	}
+	if (json) {
+		printf("\n  ]\n}\n");
+	}
+#if defined(HASH_BENCH_WITH_OPENSSL)
+	EVP_MD_CTX_free(HashBench_Evp);
+#endif
+	for (i = 0; i < KERNEL_HASH_ALGORITHMs; i++) {
+		if (HashBench_Kernels[i] != NULL) {
+			TKernelHash_Delete(HashBench_Kernels[i]);
+		}
+	}
+	close(fd);
+	free(buf);
+	return 0;
+}